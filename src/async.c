@@ -0,0 +1,381 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file async.c
+ *
+ * @brief Calls that complete through an eventfd, for event loops.
+ *
+ * A submitted call is queued for a small pool of library threads, which
+ * make the ordinary blocking call and move it to the completed list,
+ * bumping the context's eventfd. The caller's event loop polls the
+ * eventfd and calls igvt_async_dispatch, which runs the callbacks of
+ * the completed calls on the loop's own thread; nothing of the caller's
+ * ever runs on a library thread.
+ *
+ * The pool is started on first use. Calls are started in the order they
+ * were submitted, but with more than one thread may finish in any order;
+ * a caller that needs one call to follow another submits the second
+ * from the first's callback.
+ */
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+struct async_op {
+    struct async_op *next;
+    igvt_op op;
+    unsigned int domid;
+    gt_port vgt_port;
+    gt_port pgt_port;
+    unsigned int args[3];
+    size_t edid_size;
+    unsigned char edid[EDID_MAX_SIZE];
+    igvt_async_cb cb;
+    void *arg;
+    int result;
+};
+
+void _async_init(igvt_ctx *ctx)
+{
+    pthread_mutex_init(&ctx->async_lock, NULL);
+    pthread_cond_init(&ctx->async_cond, NULL);
+    ctx->async_queue = NULL;
+    ctx->async_queue_tail = &ctx->async_queue;
+    ctx->async_done = NULL;
+    ctx->async_done_tail = &ctx->async_done;
+    ctx->async_fd = -1;
+    ctx->async_n_threads = 0;
+    ctx->async_stopping = 0;
+}
+
+static void async_list_free(struct async_op *op)
+{
+    struct async_op *next;
+
+    for (; op; op = next) {
+        next = op->next;
+        free(op);
+    }
+}
+
+void _async_free(igvt_ctx *ctx)
+{
+    unsigned int i;
+
+    /* The threads finish what was submitted before they stop */
+    pthread_mutex_lock(&ctx->async_lock);
+    ctx->async_stopping = 1;
+    pthread_cond_broadcast(&ctx->async_cond);
+    pthread_mutex_unlock(&ctx->async_lock);
+
+    for (i = 0; i < ctx->async_n_threads; i++)
+        pthread_join(ctx->async_threads[i], NULL);
+
+    async_list_free(ctx->async_done);
+
+    if (ctx->async_fd >= 0)
+        close(ctx->async_fd);
+
+    pthread_cond_destroy(&ctx->async_cond);
+    pthread_mutex_destroy(&ctx->async_lock);
+}
+
+static int async_call(igvt_ctx *ctx, const struct async_op *op)
+{
+    switch (op->op) {
+    case IGVT_OP_CREATE_INSTANCE:
+        return igvt_ctx_create_instance(ctx, op->domid, op->args[0],
+                                        op->args[1], op->args[2]);
+
+    case IGVT_OP_PLUG_DISPLAY:
+        return igvt_ctx_plug_display(ctx, op->domid, op->vgt_port,
+                                     op->edid, op->edid_size, op->pgt_port);
+
+    case IGVT_OP_SET_FOREGROUND_VM:
+        return igvt_ctx_set_foreground_vm(ctx, op->domid);
+
+    default:
+        return -EINVAL;
+    }
+}
+
+static void *async_thread(void *arg)
+{
+    igvt_ctx *ctx = arg;
+    struct async_op *op;
+
+    pthread_mutex_lock(&ctx->async_lock);
+
+    for (;;) {
+        while (!ctx->async_queue && !ctx->async_stopping)
+            pthread_cond_wait(&ctx->async_cond, &ctx->async_lock);
+
+        op = ctx->async_queue;
+
+        if (!op)
+            break;
+
+        ctx->async_queue = op->next;
+
+        if (!ctx->async_queue)
+            ctx->async_queue_tail = &ctx->async_queue;
+
+        pthread_mutex_unlock(&ctx->async_lock);
+
+        op->result = async_call(ctx, op);
+
+        pthread_mutex_lock(&ctx->async_lock);
+
+        op->next = NULL;
+        *ctx->async_done_tail = op;
+        ctx->async_done_tail = &op->next;
+
+        eventfd_write(ctx->async_fd, 1);
+    }
+
+    pthread_mutex_unlock(&ctx->async_lock);
+
+    return NULL;
+}
+
+/*
+ * Make the eventfd, and start the threads if asked to. Called with
+ * async_lock held.
+ */
+static int async_start(igvt_ctx *ctx, int threads)
+{
+    int fd, status;
+
+    if (ctx->async_fd < 0) {
+        fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if (fd < 0)
+            return -errno;
+
+        /* dispatch looks without the lock */
+        __atomic_store_n(&ctx->async_fd, fd, __ATOMIC_RELEASE);
+    }
+
+    while (threads && ctx->async_n_threads < IGVT_ASYNC_THREADS) {
+        status = pthread_create(&ctx->async_threads[ctx->async_n_threads],
+                                NULL, async_thread, ctx);
+
+        if (status != 0) {
+            /* Fewer threads are only slower; none is a failure */
+            if (ctx->async_n_threads)
+                break;
+
+            igvt_printf(ctx, IGVT_ERROR, "%s::cannot start async thread: "
+                        "%s\n", __func__, igvt_strerror(status));
+            return -status;
+        }
+
+        ctx->async_n_threads++;
+    }
+
+    return 0;
+}
+
+static int async_submit(igvt_ctx *ctx, struct async_op *op)
+{
+    int status;
+
+    if (!op->cb) {
+        free(op);
+        return -EINVAL;
+    }
+
+    op->next = NULL;
+
+    pthread_mutex_lock(&ctx->async_lock);
+
+    status = async_start(ctx, 1);
+
+    if (status == 0) {
+        *ctx->async_queue_tail = op;
+        ctx->async_queue_tail = &op->next;
+        pthread_cond_signal(&ctx->async_cond);
+    }
+
+    pthread_mutex_unlock(&ctx->async_lock);
+
+    if (status < 0)
+        free(op);
+
+    return status;
+}
+
+int igvt_ctx_async_create_instance(igvt_ctx *ctx, unsigned int domid,
+                                   unsigned int aperture_size,
+                                   unsigned int gm_size,
+                                   unsigned int fence_count,
+                                   igvt_async_cb cb, void *arg)
+{
+    struct async_op *op = malloc(sizeof(*op));
+
+    if (!op)
+        return -ENOMEM;
+
+    op->op = IGVT_OP_CREATE_INSTANCE;
+    op->domid = domid;
+    op->args[0] = aperture_size;
+    op->args[1] = gm_size;
+    op->args[2] = fence_count;
+    op->cb = cb;
+    op->arg = arg;
+
+    return async_submit(_igvt_ctx(ctx), op);
+}
+
+int igvt_async_create_instance(unsigned int domid, unsigned int aperture_size,
+                               unsigned int gm_size, unsigned int fence_count,
+                               igvt_async_cb cb, void *arg)
+{
+    return igvt_ctx_async_create_instance(NULL, domid, aperture_size, gm_size,
+                                          fence_count, cb, arg);
+}
+
+int igvt_ctx_async_plug_display(igvt_ctx *ctx, unsigned int domid,
+                                gt_port vgt_port, const unsigned char *edid,
+                                size_t edid_size, gt_port pgt_port,
+                                igvt_async_cb cb, void *arg)
+{
+    struct async_op *op;
+
+    /* As much as igvt_plug_display would ever write */
+    if (edid_size > EDID_MAX_SIZE)
+        edid_size = EDID_MAX_SIZE;
+
+    op = malloc(sizeof(*op));
+
+    if (!op)
+        return -ENOMEM;
+
+    op->op = IGVT_OP_PLUG_DISPLAY;
+    op->domid = domid;
+    op->vgt_port = vgt_port;
+    op->pgt_port = pgt_port;
+    op->edid_size = edid ? edid_size : 0;
+    memcpy(op->edid, edid, op->edid_size);
+    op->cb = cb;
+    op->arg = arg;
+
+    return async_submit(_igvt_ctx(ctx), op);
+}
+
+int igvt_async_plug_display(unsigned int domid, gt_port vgt_port,
+                            const unsigned char *edid, size_t edid_size,
+                            gt_port pgt_port, igvt_async_cb cb, void *arg)
+{
+    return igvt_ctx_async_plug_display(NULL, domid, vgt_port, edid,
+                                       edid_size, pgt_port, cb, arg);
+}
+
+int igvt_ctx_async_set_foreground_vm(igvt_ctx *ctx, unsigned int domid,
+                                     igvt_async_cb cb, void *arg)
+{
+    struct async_op *op = malloc(sizeof(*op));
+
+    if (!op)
+        return -ENOMEM;
+
+    op->op = IGVT_OP_SET_FOREGROUND_VM;
+    op->domid = domid;
+    op->cb = cb;
+    op->arg = arg;
+
+    return async_submit(_igvt_ctx(ctx), op);
+}
+
+int igvt_async_set_foreground_vm(unsigned int domid, igvt_async_cb cb,
+                                 void *arg)
+{
+    return igvt_ctx_async_set_foreground_vm(NULL, domid, cb, arg);
+}
+
+/**
+ * @brief The eventfd that is readable while calls wait to be dispatched
+ *
+ * @param ctx The context, or NULL for the default context
+ * @return the descriptor, owned by the context, or -errno
+ */
+int igvt_ctx_async_fd(igvt_ctx *ctx)
+{
+    int status;
+
+    ctx = _igvt_ctx(ctx);
+
+    pthread_mutex_lock(&ctx->async_lock);
+    status = async_start(ctx, 0);
+    pthread_mutex_unlock(&ctx->async_lock);
+
+    return status < 0 ? status : ctx->async_fd;
+}
+
+int igvt_async_fd(void)
+{
+    return igvt_ctx_async_fd(NULL);
+}
+
+/**
+ * @brief Run the callbacks of the calls that have completed
+ *
+ * @param ctx The context, or NULL for the default context
+ * @return the number of callbacks run
+ */
+int igvt_ctx_async_dispatch(igvt_ctx *ctx)
+{
+    struct async_op *done, *next;
+    eventfd_t count;
+    int fd, n = 0;
+
+    ctx = _igvt_ctx(ctx);
+    fd = __atomic_load_n(&ctx->async_fd, __ATOMIC_ACQUIRE);
+
+    if (fd < 0)
+        return 0;
+
+    /*
+     * Clear the eventfd before taking the list, so that a call that
+     * completes in between leaves it readable rather than forgotten.
+     */
+    eventfd_read(fd, &count);
+
+    pthread_mutex_lock(&ctx->async_lock);
+    done = ctx->async_done;
+    ctx->async_done = NULL;
+    ctx->async_done_tail = &ctx->async_done;
+    pthread_mutex_unlock(&ctx->async_lock);
+
+    /* Callbacks may submit, or dispatch, again */
+    for (; done; done = next) {
+        next = done->next;
+        done->cb(done->result, done->arg);
+        free(done);
+        n++;
+    }
+
+    return n;
+}
+
+int igvt_async_dispatch(void)
+{
+    return igvt_ctx_async_dispatch(NULL);
+}
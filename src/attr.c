@@ -0,0 +1,609 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file attr.c
+ *
+ * @brief Access to the vgt sysfs attributes.
+ *
+ * Attributes are opened once per context and the handles are kept, so
+ * that the hot paths are a single read or write through the context's
+ * I/O backend (see io.c) rather than an open, an I/O and a close. sysfs
+ * regenerates an attribute on every read from offset zero, so a cached
+ * descriptor never goes stale while the attribute exists. When a VM is
+ * destroyed its descriptors start failing with ENODEV; they are then
+ * reopened once before giving up.
+ *
+ * Reads and writes of an open attribute take no lock, only an fd_rcu
+ * read section. fd_lock is held just to look up or publish a handle,
+ * never across I/O, so a write that stalls (an extended EDID may take
+ * EDID_WRITE_TIMEOUT_MS) holds up no other VM. A handle that has gone
+ * stale is unpublished by whichever thread finds it first, and closed
+ * once an rcu grace period has passed, as is a forgotten VM's node.
+ */
+
+#include <sys/vfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+#ifndef SYSFS_MAGIC
+#define SYSFS_MAGIC 0x62656572
+#endif
+
+static const char *attr_names[IGVT_NUM_ATTRS] = {
+    [IGVT_ATTR_CONNECTION] = "connection",
+    [IGVT_ATTR_PORT_OVERRIDE] = "port_override",
+    [IGVT_ATTR_EDID] = "edid",
+    [IGVT_ATTR_PRESENCE] = "presence",
+    [IGVT_ATTR_FOREGROUND_VM] = "foreground_vm",
+    [IGVT_ATTR_CREATE_INSTANCE] = "create_vgt_instance",
+};
+
+static void attr_fds_init(struct attr_fds *fds, unsigned int domid)
+{
+    int port, attr;
+
+    fds->next = NULL;
+    fds->domid = domid;
+
+    for (port = 0; port < GVT_MAX_PORTS; port++)
+        for (attr = 0; attr < IGVT_NUM_ATTRS; attr++)
+            fds->fds[port][attr] = -1;
+}
+
+static void attr_fds_close(const struct igvt_io *io, igvt_ctx *ctx,
+                           struct attr_fds *fds)
+{
+    int port, attr;
+
+    for (port = 0; port < GVT_MAX_PORTS; port++) {
+        for (attr = 0; attr < IGVT_NUM_ATTRS; attr++) {
+            if (fds->fds[port][attr] >= 0)
+                io->close_attr(ctx, fds->fds[port][attr]);
+
+            fds->fds[port][attr] = -1;
+        }
+    }
+}
+
+const char *_attr_name(igvt_attr attr)
+{
+    return attr_names[attr];
+}
+
+void _attr_init(igvt_ctx *ctx)
+{
+    struct statfs sfs;
+
+    pthread_mutex_init(&ctx->fd_lock, NULL);
+    pthread_mutex_init(&ctx->uring_lock, NULL);
+    _rcu_init(&ctx->fd_rcu);
+    attr_fds_init(&ctx->control_fds, 0);
+    memset(ctx->vm_fds, 0, sizeof(ctx->vm_fds));
+    ctx->io = ctx->io_base = &_io_sysfs;
+    ctx->uring = NULL;
+    ctx->uring_state = 0;
+
+    ctx->vgt_is_sysfs = statfs(ctx->vgt_root, &sfs) == 0 &&
+                        sfs.f_type == SYSFS_MAGIC;
+}
+
+void _attr_free(igvt_ctx *ctx)
+{
+    struct attr_fds *fds, *next;
+    int i;
+
+    attr_fds_close(ctx->io_base, ctx, &ctx->control_fds);
+
+    for (i = 0; i < IGVT_VM_FD_BUCKETS; i++) {
+        for (fds = ctx->vm_fds[i]; fds; fds = next) {
+            next = fds->next;
+            attr_fds_close(ctx->io_base, ctx, fds);
+            free(fds);
+        }
+
+        ctx->vm_fds[i] = NULL;
+    }
+
+    _rcu_free(&ctx->fd_rcu);
+    pthread_mutex_destroy(&ctx->uring_lock);
+    pthread_mutex_destroy(&ctx->fd_lock);
+}
+
+void _attr_path(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                gt_port port, char *path, size_t size)
+{
+    switch (attr) {
+    case IGVT_ATTR_CONNECTION:
+    case IGVT_ATTR_PORT_OVERRIDE:
+    case IGVT_ATTR_EDID:
+        snprintf(path, size, "%s/vm%d/%s/%s", ctx->vgt_root, domid,
+                 port_strings[port], attr_names[attr]);
+        break;
+
+    case IGVT_ATTR_PRESENCE:
+        snprintf(path, size, "%s/control/%s/%s", ctx->vgt_root,
+                 port_strings[port], attr_names[attr]);
+        break;
+
+    default:
+        snprintf(path, size, "%s/control/%s", ctx->vgt_root,
+                 attr_names[attr]);
+        break;
+    }
+}
+
+/* Called with fd_lock held, or inside an fd_rcu read section */
+static struct attr_fds *attr_fds_lookup(igvt_ctx *ctx, igvt_attr attr,
+                                        unsigned int domid)
+{
+    struct attr_fds *fds;
+
+    if (!IGVT_ATTR_VM_P(attr))
+        return &ctx->control_fds;
+
+    fds = __atomic_load_n(&ctx->vm_fds[domid % IGVT_VM_FD_BUCKETS],
+                          __ATOMIC_ACQUIRE);
+
+    while (fds && fds->domid != domid)
+        fds = __atomic_load_n(&fds->next, __ATOMIC_ACQUIRE);
+
+    return fds;
+}
+
+/* Called with fd_lock held */
+static int *attr_fd_slot(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                         gt_port port)
+{
+    struct attr_fds *fds;
+    unsigned int bucket;
+
+    if (!igvt_is_valid_port_p(port))
+        port = 0;
+
+    fds = attr_fds_lookup(ctx, attr, domid);
+
+    if (fds)
+        return &fds->fds[port][attr];
+
+    fds = malloc(sizeof(*fds));
+
+    if (!fds)
+        return NULL;
+
+    bucket = domid % IGVT_VM_FD_BUCKETS;
+
+    attr_fds_init(fds, domid);
+    fds->next = ctx->vm_fds[bucket];
+    __atomic_store_n(&ctx->vm_fds[bucket], fds, __ATOMIC_RELEASE);
+
+    return &fds->fds[port][attr];
+}
+
+/* The descriptor was cached before the attribute went away */
+static int attr_stale_p(int err)
+{
+    return err == ENODEV || err == ENOENT || err == EBADF;
+}
+
+/* Inside an fd_rcu read section */
+static int attr_fd_published(igvt_ctx *ctx, igvt_attr attr,
+                             unsigned int domid, gt_port port)
+{
+    const struct attr_fds *fds = attr_fds_lookup(ctx, attr, domid);
+
+    return fds ? __atomic_load_n(&fds->fds[port][attr], __ATOMIC_ACQUIRE) : -1;
+}
+
+static ssize_t attr_io_fd(igvt_ctx *ctx, const struct igvt_io *io, int fd,
+                          igvt_attr attr, unsigned int domid, gt_port port,
+                          void *rbuf, const void *wbuf, size_t size)
+{
+    ssize_t n;
+
+    if (rbuf)
+        return io->read_attr(ctx, fd, attr, domid, port, rbuf, size);
+
+    IGVT_PROBE(attr_write__entry, attr_names[attr], domid, port, size);
+    n = io->write_attr(ctx, fd, attr, domid, port, wbuf, size);
+    IGVT_PROBE(attr_write__return, attr_names[attr], domid, port, n);
+
+    return n;
+}
+
+/*
+ * I/O through the published handle, if there is one; *fd is set to the
+ * handle used, or -1. The read section keeps the handle open however
+ * long the I/O takes.
+ */
+static ssize_t attr_io_published(igvt_ctx *ctx, igvt_attr attr,
+                                 unsigned int domid, gt_port port,
+                                 void *rbuf, const void *wbuf, size_t size,
+                                 int *fd)
+{
+    const struct igvt_io *io;
+    ssize_t n = -ENODEV;
+    int token;
+
+    token = _rcu_read_lock(&ctx->fd_rcu);
+
+    /* The backend first: handles are unpublished before it changes */
+    io = _attr_io(ctx);
+    *fd = attr_fd_published(ctx, attr, domid, port);
+
+    if (*fd >= 0)
+        n = attr_io_fd(ctx, io, *fd, attr, domid, port, rbuf, wbuf, size);
+
+    _rcu_read_unlock(&ctx->fd_rcu, token);
+
+    return n;
+}
+
+/* Unpublish a stale handle, and close it when nobody can be using it */
+static void attr_drop(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                      gt_port port, int fd)
+{
+    const struct igvt_io *io;
+    struct attr_fds *fds;
+    int dropped = 0;
+
+    pthread_mutex_lock(&ctx->fd_lock);
+
+    io = ctx->io_base;
+    fds = attr_fds_lookup(ctx, attr, domid);
+
+    /* Another thread may have dropped it, and reopened it, already */
+    if (fds && fds->fds[port][attr] == fd) {
+        __atomic_store_n(&fds->fds[port][attr], -1, __ATOMIC_RELEASE);
+        dropped = 1;
+    }
+
+    pthread_mutex_unlock(&ctx->fd_lock);
+
+    if (dropped) {
+        _rcu_synchronize(&ctx->fd_rcu);
+        io->close_attr(ctx, fd);
+    }
+}
+
+/*
+ * Read or write an attribute, opening it on first use and reopening it
+ * once if its handle has gone stale. No lock is held across the I/O.
+ */
+static ssize_t attr_io(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                       gt_port port, void *rbuf, const void *wbuf,
+                       size_t size)
+{
+    const struct igvt_io *io;
+    ssize_t n = -ENODEV;
+    int fd, retry, status;
+
+    if (!igvt_is_valid_port_p(port))
+        port = 0;
+
+    for (retry = 0; retry < 2; retry++) {
+        n = attr_io_published(ctx, attr, domid, port, rbuf, wbuf, size, &fd);
+
+        if (fd < 0) {
+            status = _attr_open(ctx, attr, domid, port);
+
+            if (status == -ENOMEM)
+                break;
+
+            if (status < 0)
+                return status;
+
+            n = attr_io_published(ctx, attr, domid, port, rbuf, wbuf, size,
+                                  &fd);
+
+            /* The VM was forgotten as soon as it was opened */
+            if (fd < 0)
+                continue;
+        }
+
+        if (n >= 0 || !attr_stale_p(-n))
+            return n;
+
+        attr_drop(ctx, attr, domid, port, fd);
+    }
+
+    if (retry == 2)
+        return n;
+
+    /* Nowhere to keep the handle, so it is only used the once */
+    io = _attr_io(ctx);
+    fd = io->open_attr(ctx, attr, domid, port);
+
+    if (fd < 0)
+        return -ENODEV;
+
+    n = attr_io_fd(ctx, io, fd, attr, domid, port, rbuf, wbuf, size);
+    io->close_attr(ctx, fd);
+
+    return n;
+}
+
+/**
+ * @brief Read an attribute from the start
+ *
+ * @return the number of bytes read, -ENODEV if the attribute can't be
+ *         opened, or -errno
+ */
+ssize_t _attr_read(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                   gt_port port, void *buf, size_t size)
+{
+    return attr_io(ctx, attr, domid, port, buf, NULL, size);
+}
+
+/**
+ * @brief Open an attribute ahead of its first read
+ *
+ * The open happens outside fd_lock, so threads opening many attributes
+ * at once don't queue behind one another; only publishing the handle
+ * takes the lock. Later reads of the attribute are lock-free.
+ *
+ * @return 0 if the attribute is open, -ENODEV if it can't be opened,
+ *         or -errno
+ */
+int _attr_open(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+               gt_port port)
+{
+    const struct igvt_io *io;
+    int *slot;
+    int fd;
+
+    if (!igvt_is_valid_port_p(port))
+        port = 0;
+
+    pthread_mutex_lock(&ctx->fd_lock);
+    io = ctx->io;
+    slot = attr_fd_slot(ctx, attr, domid, port);
+    fd = slot ? *slot : -1;
+    pthread_mutex_unlock(&ctx->fd_lock);
+
+    if (!slot)
+        return -ENOMEM;
+
+    if (fd >= 0)
+        return 0;
+
+    fd = io->open_attr(ctx, attr, domid, port);
+
+    if (fd < 0)
+        return -ENODEV;
+
+    /* The VM may have been forgotten, and the slot freed, meanwhile */
+    pthread_mutex_lock(&ctx->fd_lock);
+    slot = ctx->io == io ? attr_fd_slot(ctx, attr, domid, port) : NULL;
+
+    if (slot && *slot < 0) {
+        __atomic_store_n(slot, fd, __ATOMIC_RELEASE);
+        fd = -1;
+    }
+
+    pthread_mutex_unlock(&ctx->fd_lock);
+
+    /* Someone else opened it first, or the VM has gone */
+    if (fd >= 0)
+        io->close_attr(ctx, fd);
+
+    return 0;
+}
+
+/**
+ * @brief Replace the value of an attribute
+ *
+ * @return the number of bytes written, -ENODEV if the attribute can't
+ *         be opened, or -errno
+ */
+ssize_t _attr_write(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                    gt_port port, const void *buf, size_t size)
+{
+    ssize_t n = attr_io(ctx, attr, domid, port, NULL, buf, size);
+
+    if (n > 0)
+        _stats_bytes_written(ctx, n);
+
+    return n;
+}
+
+/*
+ * Open what a batch writes to, leaving the rest of a chain unopened
+ * once an attribute can't be opened.
+ */
+static void attr_write_batch_open(igvt_ctx *ctx, struct attr_write *writes,
+                                  size_t n)
+{
+    struct attr_write *w;
+    int status, broken = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        w = &writes[i];
+        status = broken ? -ENODEV : _attr_open(ctx, w->attr, w->domid,
+                                               w->port);
+        broken = w->link && (broken || status < 0);
+    }
+}
+
+/**
+ * @brief Write a batch of attributes
+ *
+ * The batch is made of chains: a write with link set is followed by the
+ * next one only if it succeeds, and otherwise the rest of its chain
+ * fails with -ECANCELED. Backends that can issue a whole batch at once
+ * do so; everything else, including a chain that hit a stale handle, is
+ * written one at a time. Each write's result is what _attr_write would
+ * have returned. As with _attr_write, no lock is held while writing.
+ */
+void _attr_write_batch(igvt_ctx *ctx, struct attr_write *writes, size_t n)
+{
+    const struct igvt_io *io;
+    struct attr_write *w;
+    size_t i, written = 0;
+    int issued = 0, redo = 0, broken = 0, token;
+
+    if (_attr_io(ctx)->write_batch) {
+        attr_write_batch_open(ctx, writes, n);
+
+        token = _rcu_read_lock(&ctx->fd_rcu);
+
+        io = _attr_io(ctx);
+
+        for (i = 0; i < n; i++) {
+            w = &writes[i];
+            w->handle = broken ? -1 : attr_fd_published(ctx, w->attr,
+                                                        w->domid, w->port);
+            broken = w->link && (broken || w->handle < 0);
+        }
+
+        if (io->write_batch) {
+            for (i = 0; i < n; i++)
+                IGVT_PROBE(attr_write__entry, attr_names[writes[i].attr],
+                           writes[i].domid, writes[i].port, writes[i].size);
+
+            issued = io->write_batch(ctx, writes, n) == 0;
+
+            for (i = 0; issued && i < n; i++)
+                IGVT_PROBE(attr_write__return, attr_names[writes[i].attr],
+                           writes[i].domid, writes[i].port,
+                           writes[i].result);
+        }
+
+        _rcu_read_unlock(&ctx->fd_rcu, token);
+    }
+
+    for (i = 0; i < n; i++) {
+        w = &writes[i];
+
+        /* Once a write is redone, so is the rest of its chain */
+        if (!issued || w->handle < 0 || redo || attr_stale_p(-w->result)) {
+            w->result = attr_io(ctx, w->attr, w->domid, w->port, NULL,
+                                w->buf, w->size);
+            redo = 1;
+        }
+
+        if (w->result > 0)
+            written += w->result;
+
+        while (w->result < 0 && w->link && i + 1 < n) {
+            w = &writes[++i];
+            w->result = -ECANCELED;
+        }
+
+        if (!w->link)
+            redo = 0;
+    }
+
+    if (written)
+        _stats_bytes_written(ctx, written);
+}
+
+/**
+ * @brief Drop the cached descriptors of a VM that is going away
+ */
+void _attr_forget_vm(igvt_ctx *ctx, unsigned int domid)
+{
+    const struct igvt_io *io;
+    struct attr_fds **p, *fds = NULL;
+
+    pthread_mutex_lock(&ctx->fd_lock);
+
+    io = ctx->io_base;
+
+    for (p = &ctx->vm_fds[domid % IGVT_VM_FD_BUCKETS]; *p; p = &(*p)->next) {
+        if ((*p)->domid == domid) {
+            fds = *p;
+            __atomic_store_n(p, fds->next, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->fd_lock);
+
+    /* Outside fd_lock: a write to the VM may take a while to finish */
+    if (fds) {
+        _rcu_synchronize(&ctx->fd_rcu);
+        attr_fds_close(io, ctx, fds);
+        free(fds);
+    }
+}
+
+/**
+ * @brief Switch a context to another I/O backend
+ *
+ * Handles belong to the backend that opened them, so they are all
+ * closed, and reopened through the new backend as they are used. A
+ * tee recording I/O stays on top of the new backend.
+ */
+void _attr_set_io(igvt_ctx *ctx, const struct igvt_io *io)
+{
+    const struct igvt_io *old;
+    struct attr_fds control, *vm_fds[IGVT_VM_FD_BUCKETS], *fds, *next;
+    int i, port, attr;
+
+    pthread_mutex_lock(&ctx->fd_lock);
+
+    old = ctx->io_base;
+    control = ctx->control_fds;
+
+    for (port = 0; port < GVT_MAX_PORTS; port++)
+        for (attr = 0; attr < IGVT_NUM_ATTRS; attr++)
+            __atomic_store_n(&ctx->control_fds.fds[port][attr], -1,
+                             __ATOMIC_RELEASE);
+
+    for (i = 0; i < IGVT_VM_FD_BUCKETS; i++) {
+        vm_fds[i] = ctx->vm_fds[i];
+        __atomic_store_n(&ctx->vm_fds[i], NULL, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&ctx->io_base, io, __ATOMIC_RELEASE);
+
+    if (ctx->io != &_io_tee)
+        __atomic_store_n(&ctx->io, io, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&ctx->fd_lock);
+
+    /* Outside fd_lock, as in _attr_forget_vm */
+    _rcu_synchronize(&ctx->fd_rcu);
+
+    attr_fds_close(old, ctx, &control);
+
+    for (i = 0; i < IGVT_VM_FD_BUCKETS; i++) {
+        for (fds = vm_fds[i]; fds; fds = next) {
+            next = fds->next;
+            attr_fds_close(old, ctx, fds);
+            free(fds);
+        }
+    }
+}
+
+/**
+ * @brief Put the I/O trace tee on top of a context's backend, or take
+ * it off
+ *
+ * The tee hands the backend's own handles through, so nothing is
+ * reopened.
+ */
+void _attr_set_tee(igvt_ctx *ctx, int on)
+{
+    pthread_mutex_lock(&ctx->fd_lock);
+    __atomic_store_n(&ctx->io, on ? &_io_tee : ctx->io_base,
+                     __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->fd_lock);
+}
@@ -0,0 +1,188 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file attr_stress.c
+ *
+ * @brief Concurrent attribute access on the simulator, run by make check
+ *
+ * Query threads read every port of a set of VMs while other threads
+ * plug and unplug displays, switch the foreground VM and create and
+ * destroy VMs under the readers, so cached handles go stale and are
+ * reopened as they would on a real vgt. The results are checked, but
+ * the test earns its keep built with ThreadSanitizer:
+ *
+ *   ./configure CFLAGS="-g -O1 -fsanitize=thread -Wno-tsan" \
+ *               LDFLAGS=-fsanitize=thread && make check
+ *
+ * (-Wno-tsan because gcc warns about the recorder's fence under -Werror.)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "igvt.h"
+
+#define STABLE_VMS 4            /* domids 1..4, never destroyed */
+#define CHURN_VM 10             /* created and destroyed over and over */
+#define QUERY_THREADS 4
+#define ITERATIONS 2000
+
+static igvt_ctx *ctx;
+static unsigned char edid[128];
+static int failures;
+
+static void fail(const char *what, unsigned int domid, int result)
+{
+    fprintf(stderr, "attr_stress: %s vm%u: %d\n", what, domid, result);
+    __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+}
+
+static void *query_thread(void *arg)
+{
+    unsigned int domid;
+    int i, port;
+
+    (void) arg;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        for (domid = 1; domid <= STABLE_VMS; domid++) {
+            if (!igvt_ctx_enabled_p(ctx, domid))
+                fail("enabled_p", domid, 0);
+
+            for (port = PORT_A; port <= PORT_E; port++)
+                igvt_ctx_port_plugged_p(ctx, domid, port);
+        }
+
+        /* Goes away and comes back under the reader */
+        igvt_ctx_port_plugged_p(ctx, CHURN_VM, PORT_B);
+        igvt_ctx_port_present_p(ctx, i % (PORT_E + 1));
+    }
+
+    return NULL;
+}
+
+/* Each plugger owns one VM, so what it plugged must read back */
+static void *plug_thread(void *arg)
+{
+    unsigned int domid = (unsigned int) (size_t) arg;
+    int i, result;
+
+    for (i = 0; i < ITERATIONS / 4; i++) {
+        result = igvt_ctx_plug_display(ctx, domid, PORT_B, edid, sizeof(edid),
+                                       PORT_B);
+
+        if (result < 0 || !igvt_ctx_port_plugged_p(ctx, domid, PORT_B))
+            fail("plug", domid, result);
+
+        result = igvt_ctx_unplug_display(ctx, domid, PORT_B);
+
+        if (result < 0 || igvt_ctx_port_plugged_p(ctx, domid, PORT_B))
+            fail("unplug", domid, result);
+    }
+
+    return NULL;
+}
+
+static void *foreground_thread(void *arg)
+{
+    unsigned int domid;
+    int i, result;
+
+    (void) arg;
+
+    for (i = 0; i < ITERATIONS / 4; i++) {
+        domid = i % (STABLE_VMS + 1);
+        result = igvt_ctx_set_foreground_vm(ctx, domid);
+
+        if (result < 0)
+            fail("set_foreground_vm", domid, result);
+    }
+
+    return NULL;
+}
+
+static void *churn_thread(void *arg)
+{
+    int i, result;
+
+    (void) arg;
+
+    for (i = 0; i < ITERATIONS / 8; i++) {
+        result = igvt_ctx_create_instance(ctx, CHURN_VM, 64, 512, 4);
+
+        if (result < 0)
+            fail("create_instance", CHURN_VM, result);
+
+        igvt_ctx_plug_display(ctx, CHURN_VM, PORT_B, edid, sizeof(edid),
+                              PORT_B);
+
+        result = igvt_ctx_destroy_instance(ctx, CHURN_VM);
+
+        if (result < 0)
+            fail("destroy_instance", CHURN_VM, result);
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    static const unsigned char header[8] = {
+        0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+    };
+    pthread_t threads[QUERY_THREADS + STABLE_VMS + 2];
+    unsigned int domid, n = 0, i;
+
+    ctx = igvt_ctx_new(NULL, NULL);
+
+    if (!ctx || igvt_ctx_set_backend(ctx, IGVT_BACKEND_SIMULATOR) < 0) {
+        fprintf(stderr, "attr_stress: no simulator\n");
+        return 1;
+    }
+
+    /* Reading ports of the churned VM while it is gone is expected */
+    igvt_ctx_set_log_level(ctx, IGVT_LOG_NONE);
+
+    for (i = 0; i < sizeof(header); i++)
+        edid[i] = header[i];
+
+    for (domid = 1; domid <= STABLE_VMS; domid++) {
+        if (igvt_ctx_create_instance(ctx, domid, 64, 512, 4) < 0) {
+            fprintf(stderr, "attr_stress: can't create vm%u\n", domid);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < QUERY_THREADS; i++)
+        pthread_create(&threads[n++], NULL, query_thread, NULL);
+
+    for (domid = 1; domid <= STABLE_VMS; domid++)
+        pthread_create(&threads[n++], NULL, plug_thread,
+                       (void *) (size_t) domid);
+
+    pthread_create(&threads[n++], NULL, foreground_thread, NULL);
+    pthread_create(&threads[n++], NULL, churn_thread, NULL);
+
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    igvt_ctx_free(ctx);
+
+    if (failures) {
+        fprintf(stderr, "attr_stress: %d failures\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
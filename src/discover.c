@@ -0,0 +1,295 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file discover.c
+ *
+ * @brief Learning the state of every vgt instance at once, at startup.
+ *
+ * The VMs are listed in one pass over the vgt root, and then a pool of
+ * threads takes them one at a time off a shared counter and reads each
+ * port's connection and port_override. A VM's attributes are opened
+ * outside fd_lock (see _attr_open), so on a cold context the threads'
+ * opens overlap instead of queueing, and the reads after them take no
+ * lock at all. The calling thread reads the host-wide attributes and
+ * then joins in as one of the workers.
+ *
+ * The handles stay cached in the context, so the calls the manager
+ * makes once discovery is done find their attributes already open.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+/* More than this many threads only fight over the directory locks */
+#define DISCOVER_MAX_THREADS 32
+
+struct discover {
+    igvt_ctx *ctx;
+    struct igvt_vm_state *vms;
+    size_t n_vms;
+    size_t next;                /* the next VM for a worker to take */
+};
+
+static int compare_domids(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Read a VM's ports, leaving the first failure in its result */
+static void discover_vm(igvt_ctx *ctx, struct igvt_vm_state *vm)
+{
+    char word[16];
+    int port, len, status;
+
+    vm->result = 0;
+
+    for (port = 0; port < GVT_MAX_PORTS; port++) {
+        vm->ports[port].connected = 0;
+        vm->ports[port].pgt_port = PORT_ILLEGAL;
+
+        if (!igvt_is_valid_port_p(port))
+            continue;
+
+        status = _attr_open(ctx, IGVT_ATTR_CONNECTION, vm->domid, port);
+
+        if (status == 0)
+            status = _attr_open(ctx, IGVT_ATTR_PORT_OVERRIDE, vm->domid,
+                                port);
+
+        if (status == 0) {
+            len = _read_attr_word(ctx, IGVT_ATTR_CONNECTION, vm->domid, port,
+                                  word, sizeof(word));
+
+            if (len < 0)
+                status = len;
+            else
+                vm->ports[port].connected = strcmp("connected", word) == 0;
+        }
+
+        if (status == 0) {
+            len = _read_attr_word(ctx, IGVT_ATTR_PORT_OVERRIDE, vm->domid,
+                                  port, word, sizeof(word));
+
+            if (len < 0)
+                status = len;
+            else if (len > 0)
+                vm->ports[port].pgt_port = _translate_vgt_port(word, len);
+        }
+
+        if (status < 0 && vm->result == 0) {
+            igvt_printf(ctx, IGVT_WARNING, "%s::cannot read vm%u %s: %s\n",
+                        __func__, vm->domid, port_strings[port],
+                        igvt_strerror(-status));
+            vm->result = status;
+        }
+    }
+}
+
+static void *discover_thread(void *arg)
+{
+    struct discover *d = arg;
+    uint64_t span = _trace_begin(d->ctx);
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED)) <
+           d->n_vms)
+        discover_vm(d->ctx, &d->vms[i]);
+
+    _trace_end(d->ctx, "discover_worker", span, 0, PORT_ILLEGAL, 0);
+
+    return NULL;
+}
+
+/* The domain IDs of the VMs, sorted, in an array for the caller to free */
+static ssize_t list_vms(igvt_ctx *ctx, unsigned int **domids)
+{
+    const struct igvt_io *io = _attr_io(ctx);
+    unsigned int *grown;
+    size_t size = 64;
+    ssize_t n;
+
+    *domids = NULL;
+
+    if (!io->list_vms)
+        return -EOPNOTSUPP;
+
+    /* VMs can be created between sizing the array and filling it */
+    for (;;) {
+        grown = realloc(*domids, size * sizeof(**domids));
+
+        if (!grown) {
+            free(*domids);
+            *domids = NULL;
+            return -ENOMEM;
+        }
+
+        *domids = grown;
+        n = io->list_vms(ctx, *domids, size);
+
+        if (n < 0) {
+            free(*domids);
+            *domids = NULL;
+            return n;
+        }
+
+        if ((size_t) n <= size)
+            break;
+
+        size = n + n / 4;
+    }
+
+    qsort(*domids, n, sizeof(**domids), compare_domids);
+
+    return n;
+}
+
+/**
+ * @brief Learn the state of the host and every VM on it
+ *
+ * @param ctx The context
+ * @param threads How many threads to read with, the caller's included;
+ *        0 for one per CPU
+ * @param statep Set to the state, for igvt_host_state_free
+ * @return 0 on success, -EOPNOTSUPP if the backend can't list its VMs,
+ *         or -errno
+ */
+static int discover(igvt_ctx *ctx, unsigned int threads,
+                    struct igvt_host_state **statep)
+{
+    struct igvt_host_state *state;
+    struct discover d;
+    unsigned int *domids, started = 0, i;
+    pthread_t *workers = NULL;
+    uint64_t start = _recorder_now(), span;
+    char word[16];
+    ssize_t n;
+    long cpus;
+    int port;
+
+    *statep = NULL;
+
+    span = _trace_begin(ctx);
+    n = list_vms(ctx, &domids);
+    _trace_end(ctx, "list_vms", span, 0, PORT_ILLEGAL, n < 0 ? n : 0);
+
+    if (n < 0) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::cannot list the VMs: %s\n",
+                    __func__, igvt_strerror(-n));
+        return n;
+    }
+
+    state = calloc(1, sizeof(*state) + n * sizeof(state->vms[0]));
+
+    if (!state) {
+        free(domids);
+        return -ENOMEM;
+    }
+
+    state->vms = (struct igvt_vm_state *) (state + 1);
+    state->n_vms = n;
+
+    for (i = 0; i < (size_t) n; i++)
+        state->vms[i].domid = domids[i];
+
+    free(domids);
+
+    if (threads == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    if (threads > DISCOVER_MAX_THREADS)
+        threads = DISCOVER_MAX_THREADS;
+
+    if (threads > (size_t) n)
+        threads = n;
+
+    d.ctx = ctx;
+    d.vms = state->vms;
+    d.n_vms = n;
+    d.next = 0;
+
+    /* Fewer workers than asked for is only slower */
+    if (threads > 1)
+        workers = calloc(threads - 1, sizeof(*workers));
+
+    while (workers && started < threads - 1 &&
+           pthread_create(&workers[started], NULL, discover_thread, &d) == 0)
+        started++;
+
+    /* The host's own attributes, while the workers get going */
+    for (port = 0; port < GVT_MAX_PORTS; port++) {
+        if (igvt_is_valid_port_p(port) &&
+            _read_attr_word(ctx, IGVT_ATTR_PRESENCE, 0, port,
+                            word, sizeof(word)) > 0 &&
+            strcmp("present", word) == 0)
+            state->present |= 1u << port;
+    }
+
+    if (_read_attr_word(ctx, IGVT_ATTR_FOREGROUND_VM, 0, PORT_ILLEGAL,
+                        word, sizeof(word)) > 0)
+        state->foreground_vm = strtoul(word, NULL, 10);
+
+    discover_thread(&d);
+
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+
+    state->threads = started + 1;
+    state->ready_ns = _recorder_now() - start;
+
+    igvt_printf(ctx, IGVT_DEBUG, "%s::%zu VMs ready in %llu us on %u "
+                "threads\n", __func__, state->n_vms,
+                (unsigned long long) state->ready_ns / 1000, state->threads);
+
+    *statep = state;
+
+    return 0;
+}
+
+int igvt_ctx_discover(igvt_ctx *ctx, unsigned int threads,
+                      struct igvt_host_state **state)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(discover__entry, threads);
+    result = discover(ctx, threads, state);
+    IGVT_PROBE(discover__return, result);
+    _recorder_record(ctx, IGVT_OP_DISCOVER, 0, PORT_ILLEGAL, result, start);
+
+    return result;
+}
+
+int igvt_discover(unsigned int threads, struct igvt_host_state **state)
+{
+    return igvt_ctx_discover(NULL, threads, state);
+}
+
+void igvt_host_state_free(struct igvt_host_state *state)
+{
+    free(state);
+}
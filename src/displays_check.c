@@ -0,0 +1,249 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file displays_check.c
+ *
+ * @brief Saving and restoring a VM's displays on the simulator, run by
+ * make check
+ *
+ * A VM's displays are saved and restored to another VM, whose displays
+ * must then save to the same blob and read back the same. Blobs that
+ * are cut short, name a port twice, count EDID blocks they don't have
+ * or come from a newer libigvt must be turned down without anything
+ * being written, and a buffer that is too small must get the size it
+ * needs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "igvt.h"
+
+/* As igvt.c lays out the blob */
+#define HEADER_SIZE 8
+#define RECORD_SIZE 4
+
+static igvt_ctx *ctx;
+static int failures;
+
+static void expect(int ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "displays_check: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t save(unsigned int domid, unsigned char *blob)
+{
+    size_t size = IGVT_DISPLAYS_BLOB_MAX;
+
+    if (igvt_ctx_vm_save_displays(ctx, domid, blob, &size) < 0) {
+        expect(0, "can't save");
+        return 0;
+    }
+
+    return size;
+}
+
+static void expect_port(unsigned int domid, gt_port port, int connected,
+                        gt_port pgt_port)
+{
+    struct igvt_host_state *state;
+    char what[64];
+    size_t i;
+
+    snprintf(what, sizeof(what), "vm%u port %d not as restored", domid,
+             port);
+
+    if (igvt_ctx_discover(ctx, 1, &state) < 0) {
+        expect(0, "can't discover");
+        return;
+    }
+
+    for (i = 0; i < state->n_vms && state->vms[i].domid != domid; i++)
+        ;
+
+    expect(i < state->n_vms &&
+           state->vms[i].ports[port].connected == connected &&
+           state->vms[i].ports[port].pgt_port == pgt_port, what);
+
+    igvt_host_state_free(state);
+}
+
+/* Save vm1, restore it to vm2 over what vm2 had, and compare */
+static size_t check_round_trip(unsigned char *blob)
+{
+    unsigned char edid[256], again[IGVT_DISPLAYS_BLOB_MAX];
+    size_t size, size_again;
+
+    memcpy(edid, igvt_edid_synthesize(1920, 1080, 60, 0), 128);
+    memcpy(edid + 128, edid, 128);
+    edid[126] = 1;
+    edid[127] -= 1;
+
+    expect(igvt_ctx_plug_display(ctx, 1, PORT_B, edid, 256, PORT_C) == 0,
+           "can't plug vm1 port B");
+    expect(igvt_ctx_plug_display(ctx, 1, PORT_D, edid, 128, PORT_B) == 0 &&
+           igvt_ctx_unplug_display(ctx, 1, PORT_D) == 0,
+           "can't plug and unplug vm1 port D");
+
+    /* Disconnected first, then given vm1's display */
+    expect(igvt_ctx_plug_display(ctx, 2, PORT_B, edid, 128, PORT_D) == 0,
+           "can't plug vm2 port B");
+
+    size = save(1, blob);
+
+    /* Port B with both blocks, and port D, which kept its EDID */
+    expect(size == HEADER_SIZE + 2 * RECORD_SIZE + 3 * 128 && blob[5] == 2 &&
+           blob[HEADER_SIZE] == PORT_B && blob[HEADER_SIZE + 3] == 2 &&
+           blob[HEADER_SIZE + RECORD_SIZE + 256] == PORT_D,
+           "vm1 blob isn't ports B and D");
+
+    expect(igvt_ctx_vm_restore_displays(ctx, 2, blob, size) == 0,
+           "can't restore to vm2");
+
+    size_again = save(2, again);
+
+    expect(size_again == size && memcmp(again, blob, size) == 0,
+           "vm2 doesn't save as vm1 did");
+
+    expect_port(2, PORT_B, 1, PORT_C);
+    expect_port(2, PORT_D, 0, PORT_B);
+    expect(igvt_ctx_port_plugged_p(ctx, 2, PORT_B) &&
+           !igvt_ctx_port_plugged_p(ctx, 2, PORT_D),
+           "vm2 plugged ports aren't vm1's");
+
+    return size;
+}
+
+/* vm3 has nothing on it, and must still have nothing after each */
+static void expect_rejected(const unsigned char *blob, size_t size,
+                            int error, const char *what)
+{
+    unsigned char empty[IGVT_DISPLAYS_BLOB_MAX];
+    char message[96];
+
+    snprintf(message, sizeof(message), "%s not turned down", what);
+    expect(igvt_ctx_vm_restore_displays(ctx, 3, blob, size) == error,
+           message);
+
+    snprintf(message, sizeof(message), "%s wrote to vm3", what);
+    expect(save(3, empty) == HEADER_SIZE && empty[5] == 0, message);
+}
+
+static void check_rejected(const unsigned char *blob, size_t size)
+{
+    unsigned char bad[IGVT_DISPLAYS_BLOB_MAX + RECORD_SIZE + 128];
+    size_t first = RECORD_SIZE + 2 * 128;
+
+    expect_rejected(blob, HEADER_SIZE - 1, -EINVAL, "short header");
+    expect_rejected(blob, size - 1, -EINVAL, "blob cut short");
+    expect_rejected(blob, HEADER_SIZE + first + 2, -EINVAL,
+                    "blob cut in a record");
+
+    memcpy(bad, blob, size);
+    bad[size] = 0;
+    expect_rejected(bad, size + 1, -EINVAL, "trailing byte");
+
+    memcpy(bad, blob, size);
+    bad[0] = 'X';
+    expect_rejected(bad, size, -EINVAL, "bad magic");
+
+    /* Port B's record again on the end */
+    memcpy(bad, blob, size);
+    memcpy(bad + size, blob + HEADER_SIZE, first);
+    bad[5]++;
+    expect_rejected(bad, size + first, -EINVAL, "port named twice");
+
+    memcpy(bad, blob, size);
+    bad[HEADER_SIZE + 3] = 3;
+    expect_rejected(bad, size, -EINVAL, "three EDID blocks");
+
+    /* Port D's one block counted as two */
+    memcpy(bad, blob, size);
+    bad[HEADER_SIZE + first + 3] = 2;
+    expect_rejected(bad, size, -EINVAL, "block count past the end");
+
+    memcpy(bad, blob, size);
+    bad[HEADER_SIZE + 2] = GVT_MAX_PORTS;
+    expect_rejected(bad, size, -EINVAL, "bad port_override");
+
+    memcpy(bad, blob, size);
+    bad[4]++;
+    expect_rejected(bad, size, -ENOTSUP, "newer version");
+}
+
+/* A buffer too small gets the size it needs, and nothing else */
+static void check_size_query(size_t needed)
+{
+    unsigned char buf[IGVT_DISPLAYS_BLOB_MAX];
+    size_t size = 0;
+
+    expect(igvt_ctx_vm_save_displays(ctx, 1, NULL, &size) == -ENOSPC &&
+           size == needed, "size query");
+
+    memset(buf, 0xa5, sizeof(buf));
+    size = needed - 1;
+
+    expect(igvt_ctx_vm_save_displays(ctx, 1, buf, &size) == -ENOSPC &&
+           size == needed && buf[0] == 0xa5, "buffer a byte short");
+
+    expect(igvt_ctx_vm_save_displays(ctx, 1, buf, &size) == 0 &&
+           size == needed, "buffer of the size asked for");
+
+    expect(igvt_ctx_vm_save_displays(ctx, 9, buf, &size) == -EINVAL,
+           "saved a VM that doesn't exist");
+}
+
+int main(void)
+{
+    unsigned char blob[IGVT_DISPLAYS_BLOB_MAX];
+    unsigned int domid;
+    size_t size;
+
+    ctx = igvt_ctx_new(NULL, NULL);
+
+    if (!ctx || igvt_ctx_set_backend(ctx, IGVT_BACKEND_SIMULATOR) < 0) {
+        fprintf(stderr, "displays_check: no simulator\n");
+        return 1;
+    }
+
+    /* Every blob turned down is logged */
+    igvt_ctx_set_log_level(ctx, IGVT_LOG_NONE);
+
+    for (domid = 1; domid <= 3; domid++) {
+        if (igvt_ctx_create_instance(ctx, domid, 64, 512, 4) < 0) {
+            fprintf(stderr, "displays_check: can't create vm%u\n", domid);
+            return 1;
+        }
+    }
+
+    size = check_round_trip(blob);
+
+    if (size > HEADER_SIZE) {
+        check_rejected(blob, size);
+        check_size_query(size);
+    }
+
+    igvt_ctx_free(ctx);
+
+    if (failures) {
+        fprintf(stderr, "displays_check: %d failures\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1292 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file drm.c
+ *
+ * @brief DRM connector discovery, and mirroring of physical monitors
+ * into virtual ports, with optional hotplug debouncing.
+ *
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+#include "port_hash.h"
+#include "port_hash_table.h"
+
+/*
+ * Connector discovery.
+ *
+ * /sys/class/drm is read once to learn which connectors each card has
+ * and which card vGT drives. Translating a name to a gt_port needs none
+ * of that: the connector part of the name goes through the perfect hash
+ * built by gen_port_hash. The names are interned and never freed, so
+ * pointers handed out by _translate_pgt_port stay good across rescans.
+ */
+
+struct connector {
+    const char *name;
+    unsigned int card;
+    gt_port port;
+};
+
+struct connector_table {
+    struct connector *connectors;
+    size_t n_connectors;
+    unsigned int primary_card;
+    const char *port_names[GVT_MAX_PORTS];
+};
+
+/* Used when there is no DRM to discover, e.g. on a simulated vgt */
+static const char *default_connectors[] = {
+    "card0-eDP-1",
+    "card0-DP-1",
+    "card0-HDMI-A-1",
+    "card0-DP-2",
+    "card0-HDMI-A-2",
+    "card0-DP-3",
+    "card0-HDMI-A-3",
+    "card0-VGA-1",
+};
+
+struct interned {
+    struct interned *next;
+    char name[];
+};
+
+/* Shared by all contexts */
+static struct interned *interned_names;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *intern_name(const char *name)
+{
+    struct interned *i;
+    size_t len = strlen(name);
+
+    pthread_mutex_lock(&intern_lock);
+
+    for (i = interned_names; i; i = i->next) {
+        if (strcmp(i->name, name) == 0)
+            goto out;
+    }
+
+    i = malloc(sizeof(*i) + len + 1);
+
+    if (!i)
+        goto out;
+
+    memcpy(i->name, name, len + 1);
+    i->next = interned_names;
+    interned_names = i;
+
+out:
+    pthread_mutex_unlock(&intern_lock);
+
+    return i ? i->name : NULL;
+}
+
+/*
+ * Split "card<N>-<connector>" and work out which gt_port it is.
+ * Returns -1 if the name isn't a connector at all.
+ */
+static int parse_connector(const char *name, unsigned int *card, gt_port *port,
+                           int *rank)
+{
+    const struct port_hash_entry *e;
+    const char *end = name + 4;
+
+    if (strncmp(name, "card", 4) != 0)
+        return -1;
+
+    /* By hand: strtoul's locale handling costs more than the lookup */
+    for (*card = 0; *end >= '0' && *end <= '9' && end - name < 12; end++)
+        *card = *card * 10 + (*end - '0');
+
+    if (end == name + 4 || *end != '-')
+        return -1;
+
+    e = port_hash_lookup(&connector_hash, end + 1, strlen(end + 1));
+
+    *port = e ? e->port : PORT_ILLEGAL;
+    *rank = e ? e->rank : INT_MAX;
+
+    return 0;
+}
+
+/* Is cardN driven by i915? */
+static int i915_card_p(igvt_ctx *ctx, const char *card)
+{
+    char path[256], driver[256];
+    ssize_t n;
+    const char *base;
+
+    snprintf(path, sizeof(path), "%s/%s/device/driver", ctx->drm_root, card);
+
+    n = readlink(path, driver, sizeof(driver) - 1);
+
+    if (n < 0)
+        return 0;
+
+    driver[n] = '\0';
+    base = strrchr(driver, '/');
+
+    return strcmp(base ? base + 1 : driver, "i915") == 0;
+}
+
+static void free_connector_table(struct connector_table *table)
+{
+    if (!table)
+        return;
+
+    free(table->connectors);
+    free(table);
+}
+
+static struct connector_table *build_connector_table(const char **names,
+                                                     size_t n_names,
+                                                     unsigned int primary_card)
+{
+    struct connector_table *table;
+    int ranks[GVT_MAX_PORTS];
+    size_t i;
+
+    table = calloc(1, sizeof(*table));
+
+    if (!table)
+        return NULL;
+
+    table->connectors = calloc(n_names ? n_names : 1, sizeof(*table->connectors));
+
+    if (!table->connectors) {
+        free_connector_table(table);
+        return NULL;
+    }
+
+    for (i = 0; i < GVT_MAX_PORTS; i++)
+        ranks[i] = INT_MAX;
+
+    table->primary_card = primary_card;
+
+    for (i = 0; i < n_names; i++) {
+        struct connector *c = &table->connectors[table->n_connectors];
+        int rank;
+
+        if (parse_connector(names[i], &c->card, &c->port, &rank) < 0)
+            continue;
+
+        c->name = intern_name(names[i]);
+
+        if (!c->name)
+            continue;
+
+        table->n_connectors++;
+
+        if (c->card == primary_card && c->port != PORT_ILLEGAL &&
+            rank < ranks[c->port]) {
+            ranks[c->port] = rank;
+            table->port_names[c->port] = c->name;
+        }
+    }
+
+    return table;
+}
+
+static struct connector_table *discover_connectors(igvt_ctx *ctx)
+{
+    struct connector_table *table;
+    struct dirent *entry;
+    const char **names = NULL;
+    size_t n_names = 0, names_size = 0, i;
+    unsigned int primary_card = UINT_MAX, any_card = UINT_MAX, card;
+    char *end;
+    DIR *dir;
+
+    dir = opendir(ctx->drm_root);
+
+    if (dir) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "card", 4) != 0)
+                continue;
+
+            card = strtoul(entry->d_name + 4, &end, 10);
+
+            if (end == entry->d_name + 4)
+                continue;
+
+            /* A bare cardN is the GPU itself */
+            if (*end == '\0') {
+                if (card < any_card)
+                    any_card = card;
+                if (card < primary_card && i915_card_p(ctx, entry->d_name))
+                    primary_card = card;
+                continue;
+            }
+
+            if (n_names == names_size) {
+                size_t size = names_size ? names_size * 2 : 32;
+                const char **grown = realloc(names, size * sizeof(*grown));
+
+                if (!grown)
+                    break;
+
+                names = grown;
+                names_size = size;
+            }
+
+            names[n_names] = strdup(entry->d_name);
+
+            if (names[n_names])
+                n_names++;
+        }
+
+        closedir(dir);
+    }
+
+    if (n_names == 0) {
+        table = build_connector_table(default_connectors,
+                                      sizeof(default_connectors) /
+                                      sizeof(default_connectors[0]), 0);
+    } else {
+        if (primary_card == UINT_MAX)
+            primary_card = any_card == UINT_MAX ? 0 : any_card;
+
+        table = build_connector_table(names, n_names, primary_card);
+    }
+
+    for (i = 0; i < n_names; i++)
+        free((char *) names[i]);
+
+    free(names);
+
+    return table;
+}
+
+/*
+ * Get the connector table, discovering the connectors first if that
+ * hasn't been done yet. Must be called inside a drm rcu read section,
+ * and the table is only valid until it ends. The table may still be
+ * NULL if discovery ran out of memory.
+ */
+static const struct connector_table *connectors_get(igvt_ctx *ctx)
+{
+    struct igvt_drm *drm = &ctx->drm;
+    struct connector_table *table;
+
+    table = __atomic_load_n(&drm->connectors, __ATOMIC_ACQUIRE);
+
+    if (table)
+        return table;
+
+    /* Nothing is freed when the table is first published */
+    pthread_mutex_lock(&drm->connector_lock);
+
+    table = drm->connectors;
+
+    if (!table) {
+        table = discover_connectors(ctx);
+        __atomic_store_n(&drm->connectors, table, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&drm->connector_lock);
+
+    return table;
+}
+
+/**
+ * @brief Re-read the DRM connectors
+ *
+ * @param ctx The context
+ * @return 0 on success
+ */
+static int drm_rescan(igvt_ctx *ctx)
+{
+    struct connector_table *table, *old;
+    struct igvt_drm *drm;
+
+    drm = &ctx->drm;
+
+    table = discover_connectors(ctx);
+
+    if (!table)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&drm->connector_lock);
+    old = drm->connectors;
+    __atomic_store_n(&drm->connectors, table, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&drm->connector_lock);
+
+    /* Readers may be waiting on connector_lock inside a read section */
+    _rcu_synchronize(&drm->rcu);
+    free_connector_table(old);
+
+    return 0;
+}
+
+int igvt_ctx_drm_rescan(igvt_ctx *ctx)
+{
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(drm_rescan__entry);
+    result = drm_rescan(ctx);
+    IGVT_PROBE(drm_rescan__return, result);
+
+    return result;
+}
+
+int igvt_drm_rescan(void)
+{
+    return igvt_ctx_drm_rescan(NULL);
+}
+
+gt_port _translate_i915_port(const char *i915_port_name)
+{
+    unsigned int card;
+    gt_port port;
+    int rank;
+
+    if (parse_connector(i915_port_name, &card, &port, &rank) < 0)
+        return PORT_ILLEGAL;
+
+    return port;
+}
+
+const char *_translate_pgt_port(igvt_ctx *ctx, gt_port pgt_port)
+{
+    const struct connector_table *table;
+    const char *name = NULL;
+    int token;
+
+    if (!igvt_is_valid_port_p(pgt_port))
+        return NULL;
+
+    token = _rcu_read_lock(&ctx->drm.rcu);
+
+    table = connectors_get(ctx);
+
+    /* The names are interned, so they outlive the table */
+    if (table)
+        name = table->port_names[pgt_port];
+
+    _rcu_read_unlock(&ctx->drm.rcu, token);
+
+    return name;
+}
+
+/*
+ * A mirror keeps what it last pushed to its virtual port. A change to
+ * the physical port makes it pending until settle_at; by then the port
+ * may have changed again, or gone back to what was pushed.
+ */
+struct mirror {
+    unsigned int domid;
+    gt_port vgt_port;
+    gt_port pgt_port;
+    int pending;
+    int due;
+    uint64_t settle_at;
+    struct physical_port applied;
+    struct igvt_hotplug_stats stats;
+};
+
+void _drm_init(igvt_ctx *ctx)
+{
+    struct igvt_drm *drm = &ctx->drm;
+
+    pthread_mutex_init(&drm->connector_lock, NULL);
+    _rcu_init(&drm->rcu);
+    pthread_mutex_init(&drm->mirror_lock, NULL);
+    drm->uevent_fd = -1;
+}
+
+void _drm_free(igvt_ctx *ctx)
+{
+    struct igvt_drm *drm = &ctx->drm;
+
+    if (drm->uevent_fd >= 0)
+        close(drm->uevent_fd);
+
+    free_connector_table(drm->connectors);
+    free(drm->mirrors);
+    pthread_mutex_destroy(&drm->mirror_lock);
+    _rcu_free(&drm->rcu);
+    pthread_mutex_destroy(&drm->connector_lock);
+}
+
+static ssize_t read_attribute(igvt_ctx *ctx, const char *connector,
+                              const char *attribute, void *buf, size_t size)
+{
+    char path[256];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", ctx->drm_root,
+             connector, attribute);
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -errno;
+
+    n = read(fd, buf, size);
+
+    if (n < 0)
+        n = -errno;
+
+    close(fd);
+
+    return n;
+}
+
+static void read_connector(igvt_ctx *ctx, const char *connector,
+                           struct physical_port *port)
+{
+    char status[16];
+    ssize_t n;
+
+    memset(port, 0, sizeof(*port));
+
+    n = read_attribute(ctx, connector, "status", status, sizeof(status) - 1);
+
+    if (n <= 0)
+        return;
+
+    status[n] = '\0';
+
+    if (strncmp(status, "connected", 9) != 0)
+        return;
+
+    n = read_attribute(ctx, connector, "edid", port->edid, sizeof(port->edid));
+
+    /* A monitor that won't tell us what it is can't be mirrored */
+    if (n < EDID_BLOCK_SIZE)
+        return;
+
+    port->connected = 1;
+    port->edid_size = n - (n % EDID_BLOCK_SIZE);
+}
+
+/*
+ * Several connectors share a physical port (DP-1 and HDMI-A-1 are both
+ * PORT_B); whichever of them has a monitor on it wins. Only the GPU
+ * that vGT drives is looked at.
+ */
+static void scan_physical_ports(igvt_ctx *ctx, struct physical_port *ports)
+{
+    const struct connector_table *table;
+    const struct connector *c;
+    struct physical_port port;
+    size_t i;
+    int token;
+
+    memset(ports, 0, sizeof(*ports) * GVT_MAX_PORTS);
+
+    token = _rcu_read_lock(&ctx->drm.rcu);
+
+    table = connectors_get(ctx);
+
+    for (i = 0; table && i < table->n_connectors; i++) {
+        c = &table->connectors[i];
+
+        if (c->card != table->primary_card || c->port == PORT_ILLEGAL ||
+            ports[c->port].connected)
+            continue;
+
+        read_connector(ctx, c->name, &port);
+
+        if (port.connected)
+            ports[c->port] = port;
+    }
+
+    _rcu_read_unlock(&ctx->drm.rcu, token);
+}
+
+/* scan_physical_ports for just the one port, straight from sysfs */
+static void scan_physical_port(igvt_ctx *ctx, gt_port pgt_port,
+                               struct physical_port *port)
+{
+    const struct connector_table *table;
+    const struct connector *c;
+    size_t i;
+    int token;
+
+    memset(port, 0, sizeof(*port));
+
+    token = _rcu_read_lock(&ctx->drm.rcu);
+
+    table = connectors_get(ctx);
+
+    for (i = 0; table && i < table->n_connectors && !port->connected; i++) {
+        c = &table->connectors[i];
+
+        if (c->card == table->primary_card && c->port == pgt_port)
+            read_connector(ctx, c->name, port);
+    }
+
+    _rcu_read_unlock(&ctx->drm.rcu, token);
+}
+
+static int physical_port_changed(const struct physical_port *a,
+                                 const struct physical_port *b)
+{
+    if (a->connected != b->connected)
+        return 1;
+
+    if (!a->connected)
+        return 0;
+
+    return a->edid_size != b->edid_size ||
+           memcmp(a->edid, b->edid, a->edid_size) != 0;
+}
+
+/* Disconnect, EDID and connect: the most writes one mirror takes */
+#define MIRROR_WRITES 3
+
+static void mirror_write(struct attr_write *w, igvt_attr attr,
+                         const struct mirror *m, const void *buf,
+                         size_t size)
+{
+    w->attr = attr;
+    w->domid = m->domid;
+    w->port = m->vgt_port;
+    w->buf = buf;
+    w->size = size;
+    w->link = 1;
+}
+
+/*
+ * Push the current state of the physical ports to the mirrors that are
+ * due. Each mirror gets a disconnect, EDID, connect chain, which takes
+ * its guest through a single disconnect/connect and skips the
+ * port_override write entirely, and the chains of all the mirrors go
+ * out as one batch.
+ *
+ * Called with mirror_lock held. Returns the number of virtual ports
+ * that were updated.
+ */
+static int push_physical_ports(igvt_ctx *ctx)
+{
+    struct igvt_drm *drm = &ctx->drm;
+    const struct physical_port *port;
+    struct attr_write *writes;
+    unsigned char (*edids)[EDID_MAX_SIZE];
+    struct mirror *m;
+    size_t *ends, i, j, n_writes = 0, edid_size;
+    uint64_t span = _trace_begin(ctx);
+    int updated = 0, ok;
+
+    writes = calloc(drm->n_mirrors * MIRROR_WRITES, sizeof(*writes));
+    edids = calloc(drm->n_mirrors, sizeof(*edids));
+    ends = calloc(drm->n_mirrors, sizeof(*ends));
+
+    /* The mirrors stay due, for the next settle to push */
+    if (!writes || !edids || !ends) {
+        free(writes);
+        free(edids);
+        free(ends);
+        return 0;
+    }
+
+    for (i = 0; i < drm->n_mirrors; i++) {
+        m = &drm->mirrors[i];
+        port = &drm->physical_ports[m->pgt_port];
+
+        if (m->due) {
+            mirror_write(&writes[n_writes++], IGVT_ATTR_CONNECTION, m,
+                         "disconnect\n", strlen("disconnect\n"));
+
+            if (port->connected) {
+                edid_size = _prepare_edid(ctx, m->domid, m->vgt_port,
+                                          port->edid, port->edid_size,
+                                          edids[i]);
+                mirror_write(&writes[n_writes++], IGVT_ATTR_EDID, m,
+                             edids[i], edid_size);
+                mirror_write(&writes[n_writes++], IGVT_ATTR_CONNECTION, m,
+                             "connect\n", strlen("connect\n"));
+            }
+
+            writes[n_writes - 1].link = 0;
+        }
+
+        ends[i] = n_writes;
+    }
+
+    _trace_end(ctx, "prepare", span, 0, PORT_ILLEGAL, 0);
+    span = _trace_begin(ctx);
+
+    _attr_write_batch(ctx, writes, n_writes);
+
+    _trace_end(ctx, "write_batch", span, 0, PORT_ILLEGAL, 0);
+
+    for (i = 0, j = 0; i < drm->n_mirrors; j = ends[i++]) {
+        m = &drm->mirrors[i];
+
+        if (!m->due)
+            continue;
+
+        /* The first failure; what it cancelled follows it */
+        for (ok = 1; j < ends[i] && ok; j++) {
+            if (writes[j].result < 0) {
+                ok = 0;
+
+                igvt_printf(ctx, IGVT_ERROR, "%s::failed to write %s of "
+                            "vm%u %s: %s\n", __func__,
+                            _attr_name(writes[j].attr), m->domid,
+                            port_strings[m->vgt_port],
+                            igvt_strerror(-writes[j].result));
+            }
+        }
+
+        updated += ok;
+        m->due = 0;
+        m->applied = drm->physical_ports[m->pgt_port];
+    }
+
+    free(writes);
+    free(edids);
+    free(ends);
+
+    return updated;
+}
+
+/*
+ * Push the pending mirrors whose settle window has passed. One that
+ * settled back on what it already shows is left alone.
+ *
+ * Called with mirror_lock held. Returns the number of virtual ports
+ * that were updated.
+ */
+static int settle_mirrors(igvt_ctx *ctx, uint64_t now)
+{
+    struct igvt_drm *drm = &ctx->drm;
+    struct igvt_hotplug_stats delta = { 0 };
+    struct mirror *m;
+    size_t i;
+    int any = 0, updated = 0;
+
+    for (i = 0; i < drm->n_mirrors; i++) {
+        m = &drm->mirrors[i];
+
+        if (!m->pending || m->settle_at > now)
+            continue;
+
+        m->pending = 0;
+
+        if (!physical_port_changed(&drm->physical_ports[m->pgt_port],
+                                   &m->applied)) {
+            m->stats.suppressed++;
+            delta.suppressed++;
+            continue;
+        }
+
+        m->due = 1;
+        m->stats.pushed++;
+        delta.pushed++;
+        any = 1;
+    }
+
+    if (any)
+        updated = push_physical_ports(ctx);
+
+    if (delta.suppressed || delta.pushed)
+        _stats_hotplug(ctx, &delta);
+
+    return updated;
+}
+
+/* Called with mirror_lock held */
+static void ensure_physical_ports(igvt_ctx *ctx)
+{
+    if (!ctx->drm.physical_ports_valid) {
+        scan_physical_ports(ctx, ctx->drm.physical_ports);
+        ctx->drm.physical_ports_valid = 1;
+    }
+}
+
+/*
+ * (Re)start the settle window of every mirror of a changed port. A
+ * mirror that was already settling never shows the state it was
+ * waiting on.
+ *
+ * Called with mirror_lock held.
+ */
+static void debounce_mirrors(igvt_ctx *ctx, const int *changed, uint64_t now)
+{
+    struct igvt_drm *drm = &ctx->drm;
+    struct igvt_hotplug_stats delta = { 0 };
+    struct mirror *m;
+    size_t i;
+
+    for (i = 0; i < drm->n_mirrors; i++) {
+        m = &drm->mirrors[i];
+
+        if (!changed[m->pgt_port])
+            continue;
+
+        m->stats.changes++;
+        delta.changes++;
+
+        if (m->pending) {
+            m->stats.suppressed++;
+            delta.suppressed++;
+        }
+
+        m->pending = 1;
+        m->settle_at = now + drm->settle_ns;
+    }
+
+    if (delta.changes)
+        _stats_hotplug(ctx, &delta);
+}
+
+/* Called with mirror_lock held */
+static int refresh_physical_ports(igvt_ctx *ctx)
+{
+    struct igvt_drm *drm = &ctx->drm;
+    struct physical_port ports[GVT_MAX_PORTS];
+    int changed[GVT_MAX_PORTS];
+    uint64_t now;
+    int i, any = 0;
+
+    scan_physical_ports(ctx, ports);
+
+    for (i = 0; i < GVT_MAX_PORTS; i++) {
+        changed[i] = !drm->physical_ports_valid ||
+                     physical_port_changed(&ports[i], &drm->physical_ports[i]);
+        any |= changed[i];
+    }
+
+    memcpy(drm->physical_ports, ports, sizeof(ports));
+    drm->physical_ports_valid = 1;
+
+    now = _recorder_now();
+
+    if (any)
+        debounce_mirrors(ctx, changed, now);
+
+    return settle_mirrors(ctx, now);
+}
+
+/**
+ * @brief Mirror the monitor on a physical port into a virtual port
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param pgt_port
+ * @return 0 on success
+ */
+static int mirror_add(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                      gt_port pgt_port)
+{
+    const struct physical_port *port;
+    struct igvt_drm *drm;
+    struct mirror *m = NULL;
+    size_t i;
+    int status;
+
+    drm = &ctx->drm;
+
+    if (!_enabled_p(ctx, domid)) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d\n",
+		    __func__, domid);
+	return -EINVAL;
+    }
+
+    if (!igvt_is_valid_port_p(vgt_port) || !igvt_is_valid_port_p(pgt_port)) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid port %d -> %d\n",
+		    __func__, vgt_port, pgt_port);
+
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&drm->mirror_lock);
+
+    for (i = 0; i < drm->n_mirrors; i++) {
+        if (drm->mirrors[i].domid == domid &&
+            drm->mirrors[i].vgt_port == vgt_port) {
+            m = &drm->mirrors[i];
+            break;
+        }
+    }
+
+    if (!m) {
+        if (drm->n_mirrors == drm->mirrors_size) {
+            size_t size = drm->mirrors_size ? drm->mirrors_size * 2 : 16;
+            struct mirror *grown = realloc(drm->mirrors,
+                                           size * sizeof(*grown));
+
+            if (!grown) {
+                pthread_mutex_unlock(&drm->mirror_lock);
+                return -ENOMEM;
+            }
+
+            drm->mirrors = grown;
+            drm->mirrors_size = size;
+        }
+
+        m = &drm->mirrors[drm->n_mirrors++];
+        memset(m, 0, sizeof(*m));
+        m->domid = domid;
+        m->vgt_port = vgt_port;
+    }
+
+    m->pgt_port = pgt_port;
+
+    ensure_physical_ports(ctx);
+
+    port = &drm->physical_ports[pgt_port];
+
+    /* Whatever was settling is overtaken by the state written here */
+    if (m->pending) {
+        struct igvt_hotplug_stats delta = { .suppressed = 1 };
+
+        m->pending = 0;
+        m->stats.suppressed++;
+        _stats_hotplug(ctx, &delta);
+    }
+
+    m->applied = *port;
+
+    status = _write_connection(ctx, domid, vgt_port, 0);
+
+    if (status == 0)
+        status = _write_port_override(ctx, domid, vgt_port, pgt_port);
+
+    if (status == 0 && port->connected) {
+        status = _write_edid(ctx, domid, vgt_port,
+                             port->edid, port->edid_size);
+
+        if (status == 0)
+            status = _write_connection(ctx, domid, vgt_port, 1);
+    }
+
+    pthread_mutex_unlock(&drm->mirror_lock);
+
+    return status;
+}
+
+int igvt_ctx_mirror_add(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                        gt_port pgt_port)
+{
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(mirror_add__entry, domid, vgt_port, pgt_port);
+    result = mirror_add(ctx, domid, vgt_port, pgt_port);
+    IGVT_PROBE(mirror_add__return, domid, vgt_port, result);
+
+    return result;
+}
+
+int igvt_mirror_add(unsigned int domid, gt_port vgt_port, gt_port pgt_port)
+{
+    return igvt_ctx_mirror_add(NULL, domid, vgt_port, pgt_port);
+}
+
+/**
+ * @brief Stop mirroring into a virtual port
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @return 0 on success, -ENOENT if the port wasn't a mirror
+ */
+int igvt_ctx_mirror_remove(igvt_ctx *ctx, unsigned int domid,
+                           gt_port vgt_port)
+{
+    struct igvt_drm *drm;
+    size_t i;
+    int status = -ENOENT;
+
+    ctx = _igvt_ctx(ctx);
+    drm = &ctx->drm;
+
+    pthread_mutex_lock(&drm->mirror_lock);
+
+    for (i = 0; i < drm->n_mirrors; i++) {
+        if (drm->mirrors[i].domid == domid &&
+            drm->mirrors[i].vgt_port == vgt_port) {
+            if (drm->mirrors[i].pending) {
+                struct igvt_hotplug_stats delta = { .suppressed = 1 };
+
+                _stats_hotplug(ctx, &delta);
+            }
+
+            drm->mirrors[i] = drm->mirrors[--drm->n_mirrors];
+            status = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&drm->mirror_lock);
+
+    return status;
+}
+
+int igvt_mirror_remove(unsigned int domid, gt_port vgt_port)
+{
+    return igvt_ctx_mirror_remove(NULL, domid, vgt_port);
+}
+
+/**
+ * @brief Re-read the physical ports and push any changes to the mirrors
+ *
+ * @param ctx The context
+ * @return the number of virtual ports updated
+ */
+static int mirror_refresh(igvt_ctx *ctx)
+{
+    int updated;
+
+    pthread_mutex_lock(&ctx->drm.mirror_lock);
+    updated = refresh_physical_ports(ctx);
+    pthread_mutex_unlock(&ctx->drm.mirror_lock);
+
+    return updated;
+}
+
+int igvt_ctx_mirror_refresh(igvt_ctx *ctx)
+{
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(mirror_refresh__entry);
+    result = mirror_refresh(ctx);
+    IGVT_PROBE(mirror_refresh__return, result);
+
+    return result;
+}
+
+int igvt_mirror_refresh(void)
+{
+    return igvt_ctx_mirror_refresh(NULL);
+}
+
+/**
+ * @brief Get the file descriptor that signals DRM hotplug events
+ *
+ * @param ctx The context, or NULL for the default context
+ * @return a file descriptor to poll for input, or -errno
+ */
+int igvt_ctx_mirror_fd(igvt_ctx *ctx)
+{
+    struct sockaddr_nl addr;
+    struct igvt_drm *drm;
+    int fd;
+
+    ctx = _igvt_ctx(ctx);
+    drm = &ctx->drm;
+
+    pthread_mutex_lock(&drm->mirror_lock);
+
+    if (drm->uevent_fd < 0) {
+        fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT);
+
+        if (fd < 0) {
+            fd = -errno;
+            goto out;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1;
+
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            int err = -errno;
+
+            igvt_printf(ctx, IGVT_ERROR, "%s::cannot bind uevent socket: %s\n",
+                        __func__, igvt_strerror(errno));
+            close(fd);
+            fd = err;
+            goto out;
+        }
+
+        drm->uevent_fd = fd;
+    }
+
+    fd = drm->uevent_fd;
+
+out:
+    pthread_mutex_unlock(&drm->mirror_lock);
+
+    return fd;
+}
+
+int igvt_mirror_fd(void)
+{
+    return igvt_ctx_mirror_fd(NULL);
+}
+
+/* Is this uevent a hotplug on a DRM device? */
+static int drm_hotplug_uevent_p(const char *msg, size_t len)
+{
+    const char *p = msg, *end = msg + len;
+    int drm = 0, hotplug = 0;
+
+    while (p < end) {
+        if (strcmp(p, "SUBSYSTEM=drm") == 0)
+            drm = 1;
+        else if (strcmp(p, "HOTPLUG=1") == 0)
+            hotplug = 1;
+
+        p += strlen(p) + 1;
+    }
+
+    return drm && hotplug;
+}
+
+/**
+ * @brief Handle pending DRM hotplug events, and mirrors that have settled
+ *
+ * @param ctx The context
+ * @return the number of virtual ports updated, or -errno
+ */
+static int mirror_dispatch(igvt_ctx *ctx)
+{
+    char msg[4096];
+    ssize_t n;
+    int fd, hotplug = 0, updated;
+
+    fd = igvt_ctx_mirror_fd(ctx);
+
+    if (fd < 0)
+        return fd;
+
+    while ((n = recv(fd, msg, sizeof(msg) - 1, MSG_DONTWAIT)) > 0) {
+        msg[n] = '\0';
+        hotplug |= drm_hotplug_uevent_p(msg, n);
+    }
+
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -errno;
+
+    if (hotplug)
+        return mirror_refresh(ctx);
+
+    pthread_mutex_lock(&ctx->drm.mirror_lock);
+    updated = settle_mirrors(ctx, _recorder_now());
+    pthread_mutex_unlock(&ctx->drm.mirror_lock);
+
+    return updated;
+}
+
+int igvt_ctx_mirror_dispatch(igvt_ctx *ctx)
+{
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(mirror_dispatch__entry);
+    result = mirror_dispatch(ctx);
+    IGVT_PROBE(mirror_dispatch__return, result);
+
+    return result;
+}
+
+int igvt_mirror_dispatch(void)
+{
+    return igvt_ctx_mirror_dispatch(NULL);
+}
+
+/**
+ * @brief Set the hotplug settle window of the mirrors
+ *
+ * Mirrors already settling keep the deadline they have.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param settle_ms The window in ms, 0 to push changes straight away
+ * @return the previous window
+ */
+unsigned int igvt_ctx_mirror_set_settle(igvt_ctx *ctx, unsigned int settle_ms)
+{
+    unsigned int old;
+
+    ctx = _igvt_ctx(ctx);
+
+    pthread_mutex_lock(&ctx->drm.mirror_lock);
+    old = ctx->drm.settle_ns / 1000000;
+    ctx->drm.settle_ns = (uint64_t) settle_ms * 1000000;
+    pthread_mutex_unlock(&ctx->drm.mirror_lock);
+
+    return old;
+}
+
+unsigned int igvt_mirror_set_settle(unsigned int settle_ms)
+{
+    return igvt_ctx_mirror_set_settle(NULL, settle_ms);
+}
+
+/**
+ * @brief How long until the next mirror settles
+ *
+ * @param ctx The context, or NULL for the default context
+ * @return the time in ms, rounded up, or -1 if no mirror is settling
+ */
+int igvt_ctx_mirror_timeout(igvt_ctx *ctx)
+{
+    const struct mirror *m;
+    struct igvt_drm *drm;
+    uint64_t next = UINT64_MAX, now;
+    size_t i;
+
+    ctx = _igvt_ctx(ctx);
+    drm = &ctx->drm;
+
+    pthread_mutex_lock(&drm->mirror_lock);
+
+    for (i = 0; i < drm->n_mirrors; i++) {
+        m = &drm->mirrors[i];
+
+        if (m->pending && m->settle_at < next)
+            next = m->settle_at;
+    }
+
+    pthread_mutex_unlock(&drm->mirror_lock);
+
+    if (next == UINT64_MAX)
+        return -1;
+
+    now = _recorder_now();
+
+    if (next <= now)
+        return 0;
+
+    next = (next - now + 999999) / 1000000;
+
+    return next < INT_MAX ? (int) next : INT_MAX;
+}
+
+int igvt_mirror_timeout(void)
+{
+    return igvt_ctx_mirror_timeout(NULL);
+}
+
+/**
+ * @brief Read the hotplug counters of a mirror
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param stats Filled in with the counters
+ * @return 0 on success, -ENOENT if the port isn't a mirror
+ */
+int igvt_ctx_mirror_get_stats(igvt_ctx *ctx, unsigned int domid,
+                              gt_port vgt_port,
+                              struct igvt_hotplug_stats *stats)
+{
+    struct igvt_drm *drm;
+    size_t i;
+    int status = -ENOENT;
+
+    ctx = _igvt_ctx(ctx);
+    drm = &ctx->drm;
+
+    pthread_mutex_lock(&drm->mirror_lock);
+
+    for (i = 0; i < drm->n_mirrors; i++) {
+        if (drm->mirrors[i].domid == domid &&
+            drm->mirrors[i].vgt_port == vgt_port) {
+            *stats = drm->mirrors[i].stats;
+            status = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&drm->mirror_lock);
+
+    return status;
+}
+
+int igvt_mirror_get_stats(unsigned int domid, gt_port vgt_port,
+                          struct igvt_hotplug_stats *stats)
+{
+    return igvt_ctx_mirror_get_stats(NULL, domid, vgt_port, stats);
+}
+
+/**
+ * @brief Get the EDID of the monitor on a physical port
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param pgt_port
+ * @param edid Buffer to copy the EDID to
+ * @param edid_size Size of the buffer
+ * @return the size of the EDID, 0 if no monitor is connected
+ */
+size_t igvt_ctx_physical_edid(igvt_ctx *ctx, gt_port pgt_port,
+                              unsigned char *edid, size_t edid_size)
+{
+    const struct physical_port *port;
+    size_t size = 0;
+
+    ctx = _igvt_ctx(ctx);
+
+    if (!igvt_is_valid_port_p(pgt_port))
+        return 0;
+
+    pthread_mutex_lock(&ctx->drm.mirror_lock);
+
+    ensure_physical_ports(ctx);
+
+    port = &ctx->drm.physical_ports[pgt_port];
+
+    if (port->connected) {
+        size = port->edid_size < edid_size ? port->edid_size : edid_size;
+        memcpy(edid, port->edid, size);
+        size = port->edid_size;
+    }
+
+    pthread_mutex_unlock(&ctx->drm.mirror_lock);
+
+    return size;
+}
+
+/*
+ * The EDID of the monitor on a physical port as it is now, rather than
+ * as the hotplug cache last saw it. The cache is left alone, so that
+ * the mirrors still see the change when it is refreshed.
+ */
+size_t _physical_edid(igvt_ctx *ctx, gt_port pgt_port, unsigned char *edid,
+                      size_t edid_size)
+{
+    struct physical_port port;
+    size_t size;
+
+    scan_physical_port(ctx, pgt_port, &port);
+
+    if (!port.connected)
+        return 0;
+
+    size = port.edid_size < edid_size ? port.edid_size : edid_size;
+    memcpy(edid, port.edid, size);
+
+    return port.edid_size;
+}
+
+size_t igvt_physical_edid(gt_port pgt_port, unsigned char *edid,
+                          size_t edid_size)
+{
+    return igvt_ctx_physical_edid(NULL, pgt_port, edid, edid_size);
+}
@@ -0,0 +1,506 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file edid.c
+ *
+ * @brief EDID filtering and synthesis.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+static void write_edid_byte(unsigned char *edid, size_t byte, const unsigned char value)
+{
+	/* Add the old value back to the checksum */
+	edid[0x7f] += edid[byte];
+
+	edid[byte] = value;
+
+	/* Subtract the new value from the checksum */
+	edid[0x7f] -= edid[byte];
+}
+
+void _filter_edid(unsigned char *edid, size_t edid_size, int analog_port)
+{
+    int i;
+
+    /*
+     * The virtual port is unaware of the dongle status,
+     * so we must make certain that the digital/analog input
+     * bit matches the port.
+     *
+     * The digital/analog bit is in the Video Input Parameters
+     * bitmap. EDID byte 20, bit 7.
+     * 
+     * Toggling this bit changes the definition of the 
+     * Supported Features Bitmap (byte 24) bits 3:4. When digital,
+     * 0x0 == RGB 4:4:4 color support. When analog, 0x1 == RGB color.
+     */
+    if (analog_port && (edid[20] & 0x80) ) {
+
+        write_edid_byte(edid, 20, 0x00);
+        write_edid_byte(edid, 24, (edid[24] & 0xE7) | 0x08);
+
+    } else if (!analog_port && !(edid[20] & 0x80)) {
+
+        write_edid_byte(edid, 20, 0x80);
+        write_edid_byte(edid, 24, (edid[24] & 0xE7));
+
+    } 
+
+    /*
+     * Funny things happen when the Windows graphics driver
+     * invokes DPMS. (Stale images, off-screen buffers visible).
+     *
+     * Clear the DPMS bits so Windows doesn't use it.
+     * 
+     * DPMS support bits are in the Supported Features Bitmap.
+     * Byte 24, bits 5:7
+     */
+    write_edid_byte(edid, 24, edid[24] & 0x1F);
+
+    /*
+     * There are limits to the pixelClock EDID field
+     * that the Windows GT driver will support. 
+     *
+     * The limits are meaningless, since the port is
+     * virtual, and no clocks are actually configured.
+     *
+     * Override the pixelClock fields here to fit into
+     * the limits.
+     */
+
+    /*
+     * There are four timing descriptors. 18 bytes long,
+     * starting at byte 54. The first two bytes is the
+     * pixelClock.
+     */
+    for (i = 0; i < 4; i++) {
+        unsigned char *timingDescriptor = (unsigned char *) &edid[54 + (18 * i)];
+        unsigned short clock = timingDescriptor[0] + (timingDescriptor[1] << 8);
+
+        /* Cap the pixel clock (bytes 0-1) at 160mhz */
+        if (clock > 16000) {
+
+            write_edid_byte(edid, (&timingDescriptor[0] - edid), 16000 & 0xff);
+            write_edid_byte(edid, (&timingDescriptor[1] - edid), 16000 >> 8);
+        }
+    }
+}
+
+/**
+ * @brief Make the extension blocks of an EDID consistent with its size
+ *
+ * Trims edid_size to whole blocks, rewrites the extension count in the
+ * base block to match the number of blocks actually being written and
+ * recomputes the checksum of every extension block.
+ *
+ * @return the number of bytes that should be written
+ */
+size_t _fixup_edid_extensions(unsigned char *edid, size_t edid_size)
+{
+    size_t blocks, block, i;
+
+    if (edid_size < EDID_BLOCK_SIZE)
+        return edid_size;
+
+    blocks = edid_size / EDID_BLOCK_SIZE;
+
+    /* Don't write blocks that the base block doesn't announce */
+    if (blocks - 1 > edid[EDID_EXTENSION_COUNT])
+        blocks = edid[EDID_EXTENSION_COUNT] + 1;
+
+    /* Don't announce blocks that aren't going to be written */
+    if (edid[EDID_EXTENSION_COUNT] != blocks - 1)
+        write_edid_byte(edid, EDID_EXTENSION_COUNT, blocks - 1);
+
+    for (block = 1; block < blocks; block++) {
+        unsigned char *ext = &edid[block * EDID_BLOCK_SIZE];
+        unsigned char sum = 0;
+
+        for (i = 0; i < EDID_BLOCK_SIZE - 1; i++)
+            sum += ext[i];
+
+        ext[EDID_BLOCK_SIZE - 1] = -sum;
+    }
+
+    return blocks * EDID_BLOCK_SIZE;
+}
+
+/*
+ * Synthesized EDIDs.
+ *
+ * Virtual monitors are described by a single CVT reduced blanking
+ * detailed timing, which is what most VDI guests expect from a flat
+ * panel. Every EDID handed out has already been through _filter_edid,
+ * so plugging it changes nothing, and is kept in a cache for the life
+ * of the process so that asking for the same mode again is a lookup.
+ */
+
+/* Modes that are built the first time anything is synthesized */
+static const struct {
+    unsigned short width;
+    unsigned short height;
+} edid_template_modes[] = {
+    { 1024,  768 },
+    { 1280,  720 },
+    { 1280,  800 },
+    { 1280, 1024 },
+    { 1366,  768 },
+    { 1440,  900 },
+    { 1600,  900 },
+    { 1680, 1050 },
+    { 1920, 1080 },
+    { 1920, 1200 },
+    { 2560, 1440 },
+};
+
+#define EDID_TEMPLATE_REFRESH 60
+#define EDID_CACHE_BUCKETS 64
+
+/* The range limits descriptor holds rates in one byte */
+#define EDID_MAX_REFRESH 255
+
+/*
+ * Modes cached past the templates, which aren't counted. Templates are
+ * never freed, so any more than this are built in a buffer of the
+ * calling thread's instead.
+ */
+#define EDID_CACHE_MAX 256
+
+struct edid_template {
+    struct edid_template *next;
+    unsigned int width;
+    unsigned int height;
+    unsigned int refresh;
+    int analog;
+    unsigned char edid[EDID_BLOCK_SIZE];
+};
+
+static struct edid_template *edid_cache[EDID_CACHE_BUCKETS];
+static unsigned int edid_cache_count;
+static __thread unsigned char edid_uncached[EDID_BLOCK_SIZE];
+static pthread_mutex_t edid_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t edid_cache_once = PTHREAD_ONCE_INIT;
+
+static const unsigned char edid_header[8] = {
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+};
+
+/* sRGB primaries and D65 white point */
+static const unsigned char edid_chromaticity[10] = {
+    0xee, 0x91, 0xa3, 0x54, 0x4c, 0x99, 0x26, 0x0f, 0x50, 0x54
+};
+
+static unsigned int edid_cache_hash(unsigned int width, unsigned int height,
+                                    unsigned int refresh, int analog)
+{
+    unsigned int h = width * 2654435761u;
+
+    h ^= height * 40503u;
+    h ^= refresh << 16;
+    h ^= analog ? 0x80000000u : 0;
+
+    return (h ^ (h >> 13)) % EDID_CACHE_BUCKETS;
+}
+
+/* CVT v1.1 vertical sync width, picked by aspect ratio */
+static unsigned int cvt_vsync(unsigned int width, unsigned int height)
+{
+    if (width * 3 == height * 4)
+        return 4;
+    if (width * 9 == height * 16)
+        return 5;
+    if (width * 10 == height * 16)
+        return 6;
+    if (width * 4 == height * 5 || width * 9 == height * 15)
+        return 7;
+
+    return 10;
+}
+
+static void edid_put_descriptor_string(unsigned char *d, unsigned char tag,
+                                       const char *text)
+{
+    size_t i, len = strlen(text);
+
+    memset(d, 0, 18);
+    d[3] = tag;
+
+    for (i = 0; i < 13; i++) {
+        if (i < len)
+            d[5 + i] = text[i];
+        else
+            d[5 + i] = (i == len) ? 0x0a : 0x20;
+    }
+}
+
+/**
+ * @brief Build an EDID for a CVT reduced blanking mode
+ *
+ * @return 0 on success, -1 if the mode can't be described by an EDID
+ */
+static int _build_edid(unsigned char *edid, unsigned int width,
+                       unsigned int height, unsigned int refresh, int analog)
+{
+    /* CVT reduced blanking constants */
+    const unsigned int h_blank = 160, h_front = 48, h_sync = 32;
+    const unsigned int v_front = 3, v_back_min = 6, v_blank_min_us = 460;
+    unsigned int v_sync = cvt_vsync(width, height);
+    unsigned int v_blank, h_total, v_total, h_freq_khz;
+    unsigned long long clock;
+    unsigned int h_mm, v_mm;
+    unsigned char *dtd = &edid[54];
+    unsigned char sum = 0;
+    double h_period_us;
+    int i;
+
+    if (width == 0 || height == 0 || width > 4095 || height > 4095 ||
+        refresh > EDID_MAX_REFRESH)
+        return -1;
+
+    h_period_us = (1000000.0 / refresh - v_blank_min_us) / height;
+
+    if (h_period_us <= 0)
+        return -1;
+
+    v_blank = (unsigned int) (v_blank_min_us / h_period_us) + 1;
+
+    if (v_blank < v_front + v_sync + v_back_min)
+        v_blank = v_front + v_sync + v_back_min;
+
+    h_total = width + h_blank;
+    v_total = height + v_blank;
+
+    /* Pixel clock in 10kHz units, rounded down to the CVT 0.25MHz step */
+    clock = (unsigned long long) h_total * v_total * refresh / 10000;
+    clock -= clock % 25;
+
+    if (clock == 0 || v_blank > 4095)
+        return -1;
+
+    /* _filter_edid caps the clock, but it has to fit the field first */
+    if (clock > 0xffff)
+        clock = 0xffff;
+
+    h_freq_khz = (clock * 10) / h_total;
+
+    /* Claim a 96dpi panel */
+    h_mm = width * 254 / 960;
+    v_mm = height * 254 / 960;
+
+    memset(edid, 0, EDID_BLOCK_SIZE);
+    memcpy(edid, edid_header, sizeof(edid_header));
+
+    /* Manufacturer "IGV", product code is the mode */
+    edid[8] = (('I' - '@') << 2) | (('G' - '@') >> 3);
+    edid[9] = (('G' - '@') << 5) | ('V' - '@');
+    edid[10] = width & 0xff;
+    edid[11] = height & 0xff;
+    edid[17] = 2015 - 1990;
+
+    /* EDID 1.3 */
+    edid[18] = 1;
+    edid[19] = 3;
+
+    edid[20] = analog ? 0x00 : 0x80;
+    edid[21] = h_mm / 10 > 255 ? 255 : h_mm / 10;
+    edid[22] = v_mm / 10 > 255 ? 255 : v_mm / 10;
+    edid[23] = 120;             /* gamma 2.2 */
+    edid[24] = (analog ? 0x08 : 0x00) | 0x02;  /* preferred timing */
+    memcpy(&edid[25], edid_chromaticity, sizeof(edid_chromaticity));
+
+    /* 640x480@60, 800x600@60, 1024x768@60 */
+    edid[35] = 0x21;
+    edid[36] = 0x08;
+
+    /* No standard timings */
+    for (i = 38; i < 54; i++)
+        edid[i] = 0x01;
+
+    dtd[0] = clock & 0xff;
+    dtd[1] = clock >> 8;
+    dtd[2] = width & 0xff;
+    dtd[3] = h_blank & 0xff;
+    dtd[4] = ((width >> 8) << 4) | (h_blank >> 8);
+    dtd[5] = height & 0xff;
+    dtd[6] = v_blank & 0xff;
+    dtd[7] = ((height >> 8) << 4) | (v_blank >> 8);
+    dtd[8] = h_front & 0xff;
+    dtd[9] = h_sync & 0xff;
+    dtd[10] = ((v_front & 0xf) << 4) | (v_sync & 0xf);
+    dtd[11] = ((h_front >> 8) << 6) | ((h_sync >> 8) << 4) |
+              ((v_front >> 4) << 2) | (v_sync >> 4);
+    dtd[12] = h_mm & 0xff;
+    dtd[13] = v_mm & 0xff;
+    dtd[14] = ((h_mm >> 8) << 4) | (v_mm >> 8);
+    /* Digital separate sync, +hsync -vsync as CVT-RB requires */
+    dtd[17] = 0x1a;
+
+    /* Display range limits, capped at the 160MHz the guest driver takes */
+    dtd = &edid[72];
+    dtd[3] = 0xfd;
+    dtd[5] = 23;
+    dtd[6] = refresh > 75 ? refresh : 75;
+    dtd[7] = 15;
+    dtd[8] = h_freq_khz + 1 > 255 ? 255 : h_freq_khz + 1;
+    dtd[9] = 16;
+    dtd[11] = 0x0a;
+    memset(&dtd[12], 0x20, 6);
+
+    edid_put_descriptor_string(&edid[90], 0xfc, "IGVT Virtual");
+
+    /* Dummy descriptor */
+    edid[108 + 3] = 0x10;
+
+    for (i = 0; i < EDID_BLOCK_SIZE - 1; i++)
+        sum += edid[i];
+
+    edid[EDID_BLOCK_SIZE - 1] = -sum;
+
+    _filter_edid(edid, EDID_BLOCK_SIZE, analog);
+
+    return 0;
+}
+
+/*
+ * Templates are never freed and are published complete, so finding one
+ * needs no lock.
+ */
+static struct edid_template *
+edid_cache_find(unsigned int bucket, unsigned int width, unsigned int height,
+                unsigned int refresh, int analog)
+{
+    struct edid_template *t;
+
+    t = __atomic_load_n(&edid_cache[bucket], __ATOMIC_ACQUIRE);
+
+    for (; t; t = t->next) {
+        if (t->width == width && t->height == height &&
+            t->refresh == refresh && t->analog == analog)
+            return t;
+    }
+
+    return NULL;
+}
+
+/*
+ * Find a mode, building it if need be. A counted mode is only built
+ * while fewer than EDID_CACHE_MAX are cached. Called with
+ * edid_cache_lock held.
+ */
+static struct edid_template *
+edid_cache_lookup(unsigned int width, unsigned int height,
+                  unsigned int refresh, int analog, int counted)
+{
+    unsigned int bucket = edid_cache_hash(width, height, refresh, analog);
+    struct edid_template *t;
+
+    t = edid_cache_find(bucket, width, height, refresh, analog);
+
+    if (t || (counted && edid_cache_count >= EDID_CACHE_MAX))
+        return t;
+
+    t = calloc(1, sizeof(*t));
+
+    if (!t)
+        return NULL;
+
+    if (_build_edid(t->edid, width, height, refresh, analog) < 0) {
+        free(t);
+        return NULL;
+    }
+
+    t->width = width;
+    t->height = height;
+    t->refresh = refresh;
+    t->analog = analog;
+    t->next = edid_cache[bucket];
+    __atomic_store_n(&edid_cache[bucket], t, __ATOMIC_RELEASE);
+
+    if (counted)
+        edid_cache_count++;
+
+    return t;
+}
+
+static void edid_cache_prebuild(void)
+{
+    size_t i;
+
+    pthread_mutex_lock(&edid_cache_lock);
+
+    for (i = 0; i < sizeof(edid_template_modes) / sizeof(edid_template_modes[0]); i++) {
+        edid_cache_lookup(edid_template_modes[i].width,
+                          edid_template_modes[i].height,
+                          EDID_TEMPLATE_REFRESH, 0, 0);
+        edid_cache_lookup(edid_template_modes[i].width,
+                          edid_template_modes[i].height,
+                          EDID_TEMPLATE_REFRESH, 1, 0);
+    }
+
+    pthread_mutex_unlock(&edid_cache_lock);
+}
+
+/**
+ * @brief Synthesize the EDID of a virtual monitor
+ *
+ * @param width Horizontal resolution in pixels
+ * @param height Vertical resolution in lines
+ * @param refresh Refresh rate in Hz, or 0 for 60
+ * @param analog Non-zero for a monitor on the analog (VGA) port
+ * @return a 128 byte EDID owned by the library, or NULL; valid for the
+ *         life of the process if cached, else until the thread's next call
+ */
+const unsigned char *igvt_edid_synthesize(unsigned int width,
+                                          unsigned int height,
+                                          unsigned int refresh,
+                                          int analog)
+{
+    struct edid_template *t;
+    int full = 0;
+
+    if (refresh == 0)
+        refresh = EDID_TEMPLATE_REFRESH;
+
+    analog = !!analog;
+
+    pthread_once(&edid_cache_once, edid_cache_prebuild);
+
+    t = edid_cache_find(edid_cache_hash(width, height, refresh, analog),
+                        width, height, refresh, analog);
+
+    if (!t) {
+        pthread_mutex_lock(&edid_cache_lock);
+        t = edid_cache_lookup(width, height, refresh, analog, 1);
+        full = !t && edid_cache_count >= EDID_CACHE_MAX;
+        pthread_mutex_unlock(&edid_cache_lock);
+    }
+
+    if (t)
+        return t->edid;
+
+    if (full && _build_edid(edid_uncached, width, height, refresh,
+                            analog) == 0)
+        return edid_uncached;
+
+    igvt_printf(NULL, IGVT_ERROR, "%s::Can't describe %ux%u@%u\n",
+                __func__, width, height, refresh);
+
+    return NULL;
+}
@@ -0,0 +1,199 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file edid_filter_check.cpp
+ *
+ * @brief igvt.hpp's EDID filter against the library's, run by make check
+ *
+ * Including igvt.hpp compiles its static_asserts, which hold the C++
+ * filter to four reference EDIDs. This goes further, over random EDIDs
+ * of one and two blocks, announcing from none to three extensions, with
+ * either kind of input and pixel clocks either side of the cap. The C
+ * filter (_fixup_edid_extensions and _filter_edid) is reached through
+ * an EDID store, which keeps every EDID added filtered for both kinds
+ * of port.
+ *
+ * filter_edid is consteval, so COMPILED EDIDs go through it when this
+ * is compiled; the many more checked at run time go through the
+ * constexpr steps it is made of.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include "igvt.hpp"
+
+namespace {
+
+constexpr unsigned int COMPILED = 16;   /* through filter_edid */
+constexpr unsigned int RANDOM = 4096;   /* through its steps at run time */
+
+struct RandomEdid {
+    std::array<unsigned char, igvt::edid_max_size> bytes;
+    std::size_t size;
+};
+
+/* Valid base block, anything goes after it */
+constexpr RandomEdid random_edid(std::uint64_t seed)
+{
+    RandomEdid edid{};
+    unsigned char sum = 0;
+
+    for (auto &byte : edid.bytes) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        byte = seed >> 32;
+    }
+
+    edid.size = seed & 1 ? igvt::edid_max_size : igvt::edid_block_size;
+
+    edid.bytes[0] = edid.bytes[7] = 0x00;
+    for (std::size_t i = 1; i < 7; i++)
+        edid.bytes[i] = 0xff;
+
+    edid.bytes[126] &= 3;
+
+    for (std::size_t i = 0; i < igvt::edid_block_size - 1; i++)
+        sum += edid.bytes[i];
+
+    edid.bytes[127] = -sum;
+
+    return edid;
+}
+
+constexpr std::uint64_t seed(unsigned int i)
+{
+    return 0x9e3779b97f4a7c15ull * (i + 1);
+}
+
+template <std::size_t... I>
+consteval auto compile_filtered(std::index_sequence<I...>)
+{
+    return std::array{igvt::filter_edid(random_edid(seed(I)).bytes, false)...,
+                      igvt::filter_edid(random_edid(seed(I)).bytes, true)...};
+}
+
+constexpr auto compiled = compile_filtered(
+    std::make_index_sequence<COMPILED>());
+
+int failures;
+
+/* What the store made of an EDID, against what the C++ filter made */
+void compare(igvt_ctx *ctx, std::uint64_t id, igvt_edid_variant variant,
+             const unsigned char *expected, std::size_t size, unsigned int i)
+{
+    unsigned char edid[igvt::edid_max_size];
+    int n = igvt_ctx_edid_store_get(ctx, id, variant, edid, sizeof(edid));
+
+    if (n != (int) size || std::memcmp(edid, expected, size) != 0) {
+        std::fprintf(stderr, "edid_filter_check: EDID %u %s: %d bytes, "
+                     "%zu expected%s\n", i,
+                     variant == IGVT_EDID_FILTERED ? "digital" : "analog",
+                     n, size, n == (int) size ? ", contents differ" : "");
+        failures++;
+    }
+}
+
+int check(igvt_ctx *ctx)
+{
+    unsigned int i;
+
+    for (i = 0; i < COMPILED; i++) {
+        RandomEdid raw = random_edid(seed(i));
+        const auto &digital = compiled[i];
+        const auto &analog = compiled[COMPILED + i];
+        std::uint64_t id;
+
+        if (igvt_ctx_edid_store_add(ctx, raw.bytes.data(), raw.bytes.size(),
+                                    &id) < 0)
+            return -1;
+
+        compare(ctx, id, IGVT_EDID_FILTERED, digital.bytes.data(),
+                digital.size, i);
+        compare(ctx, id, IGVT_EDID_FILTERED_ANALOG, analog.bytes.data(),
+                analog.size, i);
+    }
+
+    for (i = 0; i < RANDOM; i++) {
+        RandomEdid raw = random_edid(seed(COMPILED + i));
+        RandomEdid digital = raw, analog;
+        std::uint64_t id;
+
+        if (igvt_ctx_edid_store_add(ctx, raw.bytes.data(), raw.size,
+                                    &id) < 0)
+            return -1;
+
+        digital.size = igvt::detail::edid_fixup_extensions(
+            digital.bytes.data(), digital.size);
+        analog = digital;
+        igvt::detail::edid_filter(digital.bytes.data(), false);
+        igvt::detail::edid_filter(analog.bytes.data(), true);
+
+        if (!igvt::edid_valid(digital.bytes.data(), digital.size) ||
+            !igvt::edid_valid(analog.bytes.data(), analog.size)) {
+            std::fprintf(stderr, "edid_filter_check: EDID %u filtered "
+                         "invalid\n", COMPILED + i);
+            failures++;
+        }
+
+        compare(ctx, id, IGVT_EDID_FILTERED, digital.bytes.data(),
+                digital.size, COMPILED + i);
+        compare(ctx, id, IGVT_EDID_FILTERED_ANALOG, analog.bytes.data(),
+                analog.size, COMPILED + i);
+    }
+
+    return 0;
+}
+
+} // namespace
+
+int main()
+{
+    char dir[] = "/tmp/igvt-edid-check.XXXXXX";
+    char path[64];
+    int status;
+
+    auto ctx = igvt::Context::create();
+
+    if (!ctx || !mkdtemp(dir)) {
+        std::fprintf(stderr, "edid_filter_check: no context or no %s\n",
+                     dir);
+        return 1;
+    }
+
+    std::snprintf(path, sizeof(path), "%s/store", dir);
+
+    status = igvt_ctx_edid_store_open(ctx->get(), path,
+                                      COMPILED + RANDOM);
+
+    if (status == 0)
+        status = check(ctx->get());
+
+    igvt_ctx_edid_store_open(ctx->get(), nullptr, 0);
+    unlink(path);
+    rmdir(dir);
+
+    if (status < 0) {
+        std::fprintf(stderr, "edid_filter_check: store failed\n");
+        return 1;
+    }
+
+    if (failures) {
+        std::fprintf(stderr, "edid_filter_check: %d failures\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
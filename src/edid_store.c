@@ -0,0 +1,535 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file edid_store.c
+ *
+ * @brief EDIDs shared between processes through a mapped file, by id.
+ *
+ * The file is a header, an open-addressing index and an array of
+ * entries, sized for its capacity when it is created. An entry holds an
+ * EDID as it was added and filtered for digital and analog ports, and
+ * is keyed by a 64-bit hash of the EDID.
+ *
+ * Entries are only ever appended. A writer takes an flock on the file,
+ * fills in the next entry and then publishes it by storing its number
+ * into a free index slot. Readers, in any process, never lock: they
+ * probe the index, and an entry they find is complete and never
+ * changes again, so they can use it in place for as long as they stay
+ * in an edid_store_rcu read section. Past that the context's store may
+ * be replaced and unmapped, so nothing in the mapping is handed out.
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+#define EDID_STORE_MAGIC 0x53444749 /* "IGDS" */
+#define EDID_STORE_VERSION 1
+#define EDID_STORE_DEFAULT_EDIDS 1024
+#define EDID_STORE_MAX_EDIDS (1 << 20)
+
+struct edid_store_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_entries;
+    uint32_t index_size;        /* a power of two */
+    uint32_t n_entries;
+    uint32_t entry_size;
+    uint8_t reserved[40];
+};
+
+struct edid_store_entry {
+    uint64_t id;
+    uint16_t size;              /* of the EDID as added */
+    uint16_t filtered_size;     /* of both filtered variants */
+    uint8_t reserved[4];
+    unsigned char edid[IGVT_EDID_VARIANTS][EDID_MAX_SIZE];
+};
+
+struct edid_store {
+    int fd;
+    size_t map_size;
+    struct edid_store_header *header;
+    uint32_t *index;            /* entry number + 1, 0 if free */
+    struct edid_store_entry *entries;
+};
+
+void _edid_store_init(igvt_ctx *ctx)
+{
+    pthread_mutex_init(&ctx->edid_store_lock, NULL);
+    _rcu_init(&ctx->edid_store_rcu);
+    ctx->edid_store = NULL;
+}
+
+static void store_free(struct edid_store *store)
+{
+    if (!store)
+        return;
+
+    munmap(store->header, store->map_size);
+    close(store->fd);
+    free(store);
+}
+
+void _edid_store_free(igvt_ctx *ctx)
+{
+    store_free(ctx->edid_store);
+    _rcu_free(&ctx->edid_store_rcu);
+    pthread_mutex_destroy(&ctx->edid_store_lock);
+}
+
+static size_t store_map_size(uint32_t max_entries, uint32_t index_size)
+{
+    return sizeof(struct edid_store_header) +
+           index_size * sizeof(uint32_t) +
+           max_entries * sizeof(struct edid_store_entry);
+}
+
+/* FNV-1a; 0 is kept for "no EDID" */
+static uint64_t edid_hash(const unsigned char *edid, size_t edid_size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < edid_size; i++)
+        hash = (hash ^ edid[i]) * 0x100000001b3ULL;
+
+    return hash ? hash : 1;
+}
+
+/* Lock-free, from any process */
+static const struct edid_store_entry *store_lookup(
+    const struct edid_store *store, uint64_t id)
+{
+    uint32_t mask = store->header->index_size - 1;
+    uint32_t i, slot, e;
+
+    for (i = 0; i <= mask; i++) {
+        slot = (id + i) & mask;
+        e = __atomic_load_n(&store->index[slot], __ATOMIC_ACQUIRE);
+
+        if (e == 0 || e > store->header->max_entries)
+            return NULL;
+
+        if (store->entries[e - 1].id == id)
+            return &store->entries[e - 1];
+    }
+
+    return NULL;
+}
+
+/*
+ * Map a store, creating it if the file is empty. The caller holds the
+ * file lock, so a file another process is still creating isn't seen
+ * half done.
+ */
+static int store_map(struct edid_store *store, size_t max_edids)
+{
+    struct edid_store_header *header;
+    uint32_t max_entries, index_size;
+    struct stat st;
+    void *map;
+    int create;
+
+    if (fstat(store->fd, &st) < 0)
+        return -errno;
+
+    create = st.st_size == 0;
+
+    if (create) {
+        max_entries = max_edids;
+
+        for (index_size = 1; index_size < max_entries * 2; index_size <<= 1)
+            ;
+
+        if (ftruncate(store->fd, store_map_size(max_entries, index_size)) < 0)
+            return -errno;
+    } else {
+        if ((size_t) st.st_size < sizeof(*header))
+            return -EINVAL;
+
+        header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED,
+                      store->fd, 0);
+
+        if (header == MAP_FAILED)
+            return -errno;
+
+        max_entries = header->max_entries;
+        index_size = header->index_size;
+
+        if (header->magic != EDID_STORE_MAGIC ||
+            header->version != EDID_STORE_VERSION ||
+            header->entry_size != sizeof(struct edid_store_entry) ||
+            max_entries == 0 || max_entries > EDID_STORE_MAX_EDIDS ||
+            index_size < max_entries || (index_size & (index_size - 1)) ||
+            (size_t) st.st_size < store_map_size(max_entries, index_size)) {
+            munmap(header, sizeof(*header));
+            return -EINVAL;
+        }
+
+        munmap(header, sizeof(*header));
+    }
+
+    store->map_size = store_map_size(max_entries, index_size);
+
+    map = mmap(NULL, store->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               store->fd, 0);
+
+    if (map == MAP_FAILED)
+        return -errno;
+
+    store->header = map;
+    store->index = (uint32_t *) (store->header + 1);
+    store->entries = (struct edid_store_entry *) (store->index + index_size);
+
+    if (create) {
+        store->header->version = EDID_STORE_VERSION;
+        store->header->max_entries = max_entries;
+        store->header->index_size = index_size;
+        store->header->entry_size = sizeof(struct edid_store_entry);
+
+        __atomic_store_n(&store->header->magic, EDID_STORE_MAGIC,
+                         __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Open an EDID store, replacing the context's
+ *
+ * @param ctx The context
+ * @param path The store's file, or NULL to close the context's store
+ * @param max_edids The capacity if the file is created, 0 for a default
+ * @return 0 on success, -EINVAL if the file isn't an EDID store, or
+ *         -errno
+ */
+static int edid_store_open(igvt_ctx *ctx, const char *path, size_t max_edids)
+{
+    struct edid_store *store = NULL, *old;
+    int status;
+
+    if (max_edids == 0)
+        max_edids = EDID_STORE_DEFAULT_EDIDS;
+
+    if (max_edids > EDID_STORE_MAX_EDIDS)
+        return -EINVAL;
+
+    if (path) {
+        store = calloc(1, sizeof(*store));
+
+        if (!store)
+            return -ENOMEM;
+
+        store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (store->fd < 0) {
+            status = -errno;
+            free(store);
+            return status;
+        }
+
+        flock(store->fd, LOCK_EX);
+        status = store_map(store, max_edids);
+        flock(store->fd, LOCK_UN);
+
+        if (status < 0) {
+            igvt_printf(ctx, IGVT_ERROR, "%s::cannot map EDID store %s: %s\n",
+                        __func__, path, igvt_strerror(-status));
+            close(store->fd);
+            free(store);
+            return status;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->edid_store_lock);
+    old = ctx->edid_store;
+    __atomic_store_n(&ctx->edid_store, store, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->edid_store_lock);
+
+    _rcu_synchronize(&ctx->edid_store_rcu);
+    store_free(old);
+
+    return 0;
+}
+
+int igvt_ctx_edid_store_open(igvt_ctx *ctx, const char *path,
+                             size_t max_edids)
+{
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(edid_store_open__entry, path, max_edids);
+    result = edid_store_open(ctx, path, max_edids);
+    IGVT_PROBE(edid_store_open__return, result);
+
+    return result;
+}
+
+int igvt_edid_store_open(const char *path, size_t max_edids)
+{
+    return igvt_ctx_edid_store_open(NULL, path, max_edids);
+}
+
+/* Fill in a new entry. Called with the file lock held. */
+static void entry_fill(struct edid_store_entry *e, uint64_t id,
+                       const unsigned char *edid, size_t edid_size)
+{
+    size_t size;
+
+    e->id = id;
+    e->size = edid_size;
+    memcpy(e->edid[IGVT_EDID_RAW], edid, edid_size);
+
+    memcpy(e->edid[IGVT_EDID_FILTERED], edid, edid_size);
+    size = _fixup_edid_extensions(e->edid[IGVT_EDID_FILTERED], edid_size);
+    memcpy(e->edid[IGVT_EDID_FILTERED_ANALOG], e->edid[IGVT_EDID_FILTERED],
+           size);
+
+    _filter_edid(e->edid[IGVT_EDID_FILTERED], size, 0);
+    _filter_edid(e->edid[IGVT_EDID_FILTERED_ANALOG], size, 1);
+    e->filtered_size = size;
+}
+
+/**
+ * @brief Add an EDID to the store, unless it is already there
+ *
+ * @param ctx The context
+ * @param edid
+ * @param edid_size Whole blocks only; anything past EDID_MAX_SIZE is
+ *        dropped
+ * @param id Set to the EDID's id
+ * @return 0 on success, -ENOENT if no store is open, -ENOSPC if it is
+ *         full, or -EINVAL
+ */
+static int edid_store_add(igvt_ctx *ctx, const unsigned char *edid,
+                          size_t edid_size, uint64_t *id)
+{
+    struct edid_store *store;
+    uint32_t n, mask, slot;
+    int token, status = 0;
+
+    if (edid_size > EDID_MAX_SIZE)
+        edid_size = EDID_MAX_SIZE;
+
+    edid_size -= edid_size % EDID_BLOCK_SIZE;
+
+    if (edid_size == 0)
+        return -EINVAL;
+
+    *id = edid_hash(edid, edid_size);
+
+    token = _rcu_read_lock(&ctx->edid_store_rcu);
+
+    store = __atomic_load_n(&ctx->edid_store, __ATOMIC_ACQUIRE);
+
+    if (!store) {
+        _rcu_read_unlock(&ctx->edid_store_rcu, token);
+        return -ENOENT;
+    }
+
+    /* Adding what is already there needn't lock anything */
+    if (store_lookup(store, *id))
+        goto out;
+
+    flock(store->fd, LOCK_EX);
+
+    n = store->header->n_entries;
+
+    if (store_lookup(store, *id)) {
+        /* Another process added it first */
+    } else if (n >= store->header->max_entries) {
+        status = -ENOSPC;
+    } else {
+        entry_fill(&store->entries[n], *id, edid, edid_size);
+
+        mask = store->header->index_size - 1;
+
+        for (slot = *id & mask; store->index[slot]; slot = (slot + 1) & mask)
+            ;
+
+        /* Publishes the entry */
+        __atomic_store_n(&store->index[slot], n + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&store->header->n_entries, n + 1, __ATOMIC_RELEASE);
+    }
+
+    flock(store->fd, LOCK_UN);
+
+out:
+    _rcu_read_unlock(&ctx->edid_store_rcu, token);
+
+    if (status == -ENOSPC)
+        igvt_printf(ctx, IGVT_ERROR, "%s::EDID store is full\n", __func__);
+
+    return status;
+}
+
+int igvt_ctx_edid_store_add(igvt_ctx *ctx, const unsigned char *edid,
+                            size_t edid_size, uint64_t *id)
+{
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(edid_store_add__entry, edid_size);
+    result = edid_store_add(ctx, edid, edid_size, id);
+    IGVT_PROBE(edid_store_add__return, result);
+
+    return result;
+}
+
+int igvt_edid_store_add(const unsigned char *edid, size_t edid_size,
+                        uint64_t *id)
+{
+    return igvt_ctx_edid_store_add(NULL, edid, edid_size, id);
+}
+
+/**
+ * @brief Copy an EDID out of the store
+ *
+ * The copy is made in the read section; once it ends the mapping may
+ * be gone.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param id
+ * @param variant
+ * @param edid Buffer to copy the EDID to
+ * @param edid_size Size of the buffer
+ * @return the size of the EDID, -ENOENT if it isn't there, or -EINVAL
+ */
+int igvt_ctx_edid_store_get(igvt_ctx *ctx, uint64_t id,
+                            igvt_edid_variant variant,
+                            unsigned char *edid, size_t edid_size)
+{
+    const struct edid_store_entry *e = NULL;
+    const struct edid_store *store;
+    int size = -ENOENT;
+    int token;
+
+    ctx = _igvt_ctx(ctx);
+
+    if (variant >= IGVT_EDID_VARIANTS)
+        return -EINVAL;
+
+    token = _rcu_read_lock(&ctx->edid_store_rcu);
+
+    store = __atomic_load_n(&ctx->edid_store, __ATOMIC_ACQUIRE);
+
+    if (store)
+        e = store_lookup(store, id);
+
+    if (e) {
+        size = variant == IGVT_EDID_RAW ? e->size : e->filtered_size;
+        memcpy(edid, e->edid[variant],
+               (size_t) size < edid_size ? (size_t) size : edid_size);
+    }
+
+    _rcu_read_unlock(&ctx->edid_store_rcu, token);
+
+    return size;
+}
+
+int igvt_edid_store_get(uint64_t id, igvt_edid_variant variant,
+                        unsigned char *edid, size_t edid_size)
+{
+    return igvt_ctx_edid_store_get(NULL, id, variant, edid, edid_size);
+}
+
+/**
+ * @brief Plug in a display with an EDID from the store
+ *
+ * The variant filtered for vgt_port is written straight from the
+ * mapping.
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param edid_id
+ * @param pgt_port
+ * @return 0 on success, -ENOENT if the EDID isn't in the store
+ */
+static int plug_display_id(igvt_ctx *ctx, unsigned int domid,
+                           gt_port vgt_port, uint64_t edid_id,
+                           gt_port pgt_port)
+{
+    const struct edid_store_entry *e = NULL;
+    const struct edid_store *store;
+    struct journal_op jop;
+    igvt_edid_variant variant;
+    int token, status;
+
+    variant = vgt_port == PORT_VGA ? IGVT_EDID_FILTERED_ANALOG :
+                                     IGVT_EDID_FILTERED;
+
+    /* The store can't be unmapped under the writes */
+    token = _rcu_read_lock(&ctx->edid_store_rcu);
+
+    store = __atomic_load_n(&ctx->edid_store, __ATOMIC_ACQUIRE);
+
+    if (store)
+        e = store_lookup(store, edid_id);
+
+    if (e) {
+        /* Journaled as a plain plug, so replay needn't open the store */
+        status = _journal_begin(ctx, &jop, IGVT_OP_PLUG_DISPLAY, domid,
+                                vgt_port, pgt_port, NULL,
+                                e->edid[IGVT_EDID_RAW], e->size, 1);
+
+        if (status == 0)
+            status = _plug_display(ctx, domid, vgt_port, e->edid[variant],
+                                   e->filtered_size, pgt_port, 1);
+
+        _journal_end(ctx, &jop);
+    } else {
+        igvt_printf(ctx, IGVT_ERROR, "%s::EDID %016llx isn't in the store\n",
+                    __func__, (unsigned long long) edid_id);
+        status = -ENOENT;
+    }
+
+    _rcu_read_unlock(&ctx->edid_store_rcu, token);
+
+    return status;
+}
+
+int igvt_ctx_plug_display_id(igvt_ctx *ctx, unsigned int domid,
+                             gt_port vgt_port, uint64_t edid_id,
+                             gt_port pgt_port)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(plug_display_id__entry, domid, vgt_port, edid_id, pgt_port);
+    result = plug_display_id(ctx, domid, vgt_port, edid_id, pgt_port);
+    IGVT_PROBE(plug_display_id__return, domid, vgt_port, result);
+    _recorder_record(ctx, IGVT_OP_PLUG_DISPLAY_ID, domid, vgt_port,
+                     result, start);
+
+    return result;
+}
+
+int igvt_plug_display_id(unsigned int domid, gt_port vgt_port,
+                         uint64_t edid_id, gt_port pgt_port)
+{
+    return igvt_ctx_plug_display_id(NULL, domid, vgt_port, edid_id,
+                                    pgt_port);
+}
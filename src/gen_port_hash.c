@@ -0,0 +1,144 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file gen_port_hash.c
+ *
+ * @brief Generator for port_hash_table.h, run by make regen-port-hash
+ *
+ * Searches for a seed and table size that give each port name a slot of
+ * its own, and writes the tables out as C.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "igvt.h"
+#include "port_hash.h"
+
+struct key {
+    const char *name;
+    const char *port;
+    int rank;
+};
+
+/* The names vGT gives its ports */
+static const struct key vgt_port_keys[] = {
+    { "PORT_A", "PORT_A", 0 },
+    { "PORT_B", "PORT_B", 0 },
+    { "PORT_C", "PORT_C", 0 },
+    { "PORT_D", "PORT_D", 0 },
+    { "PORT_E", "PORT_E", 0 },
+};
+
+/*
+ * i915 connector names, less the "cardN-" prefix. Where several
+ * connectors share a port, the lowest rank is the preferred name.
+ */
+static const struct key connector_keys[] = {
+    { "eDP-1",    "PORT_EDP", 0 },
+    { "HDMI-A-1", "PORT_B",   0 },
+    { "HDMI-A-2", "PORT_C",   0 },
+    { "HDMI-A-3", "PORT_D",   0 },
+    { "DP-1",     "PORT_B",   1 },
+    { "DP-2",     "PORT_C",   1 },
+    { "DP-3",     "PORT_D",   1 },
+    { "DVI-D-1",  "PORT_B",   2 },
+    { "DVI-D-2",  "PORT_C",   2 },
+    { "DVI-D-3",  "PORT_D",   2 },
+    { "VGA-1",    "PORT_VGA", 0 },
+};
+
+#define MAX_SEEDS 1000000u
+
+static int generate(const char *table, const struct key *keys, size_t n_keys)
+{
+    unsigned int seed, size, lengths = 0;
+    int *slots;
+    size_t i;
+
+    for (i = 0; i < n_keys; i++)
+        lengths |= 1u << strlen(keys[i].name);
+
+    for (size = n_keys; size <= n_keys * 4; size++) {
+        slots = malloc(size * sizeof(*slots));
+
+        if (!slots)
+            return -1;
+
+        for (seed = 0; seed < MAX_SEEDS; seed++) {
+            for (i = 0; i < size; i++)
+                slots[i] = -1;
+
+            for (i = 0; i < n_keys; i++) {
+                const char *name = keys[i].name;
+                unsigned int slot = port_hash(seed, name, strlen(name)) % size;
+
+                if (slots[slot] >= 0)
+                    break;
+
+                slots[slot] = i;
+            }
+
+            if (i == n_keys)
+                goto found;
+        }
+
+        free(slots);
+    }
+
+    fprintf(stderr, "gen_port_hash: no perfect hash for %s\n", table);
+
+    return -1;
+
+found:
+    printf("static const struct port_hash_entry %s_entries[%u] = {\n",
+           table, size);
+
+    for (i = 0; i < size; i++) {
+        const struct key *k;
+
+        if (slots[i] < 0) {
+            printf("    { 0, NULL, PORT_ILLEGAL, 0 },\n");
+            continue;
+        }
+
+        k = &keys[slots[i]];
+        printf("    { %zu, \"%s\", %s, %d },\n",
+               strlen(k->name), k->name, k->port, k->rank);
+    }
+
+    printf("};\n\n");
+    printf("static const struct port_hash_table %s = {\n", table);
+    printf("    0x%08xu, %u, 0x%08xu, %s_entries\n", seed, size, lengths, table);
+    printf("};\n\n");
+
+    free(slots);
+
+    return 0;
+}
+
+int main(void)
+{
+    printf("/* Generated by gen_port_hash. Do not edit. */\n\n");
+
+    if (generate("vgt_port_hash", vgt_port_keys,
+                 sizeof(vgt_port_keys) / sizeof(vgt_port_keys[0])) < 0)
+        return 1;
+
+    if (generate("connector_hash", connector_keys,
+                 sizeof(connector_keys) / sizeof(connector_keys[0])) < 0)
+        return 1;
+
+    return 0;
+}
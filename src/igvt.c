@@ -19,25 +19,18 @@
 
 #include <unistd.h>
 #include <stdarg.h>
-#include <sys/stat.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "igvt.h"
+#include "igvt_private.h"
+#include "port_hash.h"
+#include "port_hash_table.h"
 
-typedef enum {
-    IGVT_ERROR = 0,
-    IGVT_WARNING = 1,
-    IGVT_NUM_LOGGERS
-} igvt_log_type;
-
-static int igvt_printf(igvt_log_type log_type, const char *format, ...);
-
-#define VGT_KERNEL_PATH "/sys/kernel/vgt"
-#define VGT_VM_ATTRIBUTE_FORMAT VGT_KERNEL_PATH "/vm%d/%s/%s"
-
-static const char *port_strings[] = {
+const char *const port_strings[GVT_MAX_PORTS] = {
     "PORT_A",
     "PORT_B",
     "PORT_C",
@@ -45,650 +38,1669 @@ static const char *port_strings[] = {
     "PORT_E",
 };
 
-static inline int
-igvt_is_valid_port_p(gt_port port)
+/* The context used by the functions that don't take one */
+static igvt_ctx default_ctx;
+static pthread_once_t default_ctx_once = PTHREAD_ONCE_INIT;
+
+static void ctx_init(igvt_ctx *ctx, const char *vgt_root,
+                     const char *drm_root)
 {
-    switch (port) {
-        case PORT_EDP:
-        case PORT_B:
-        case PORT_C:
-        case PORT_D:
-        case PORT_VGA:
-            return 1;
-        break;
+    snprintf(ctx->vgt_root, sizeof(ctx->vgt_root), "%s", vgt_root);
+    snprintf(ctx->drm_root, sizeof(ctx->drm_root), "%s", drm_root);
+
+    ctx->edid_ext = EDID_EXT_UNKNOWN;
+    ctx->log_level = IGVT_LOG_UNSET;
+
+    _attr_init(ctx);
+    _drm_init(ctx);
+    _recorder_init(ctx);
+    _trace_init(ctx);
+    _iotrace_init(ctx);
+    _stage_init(ctx);
+    _edid_store_init(ctx);
+    _journal_init(ctx);
+    _async_init(ctx);
+}
 
-        default:
-            return 0;
-        break;
-    }
+static void default_ctx_init(void)
+{
+    ctx_init(&default_ctx, VGT_KERNEL_PATH, DRM_CLASS_PATH);
+    default_ctx.log_level = IGVT_LOG_WARNING;
+}
 
-    return 0;
+/**
+ * @brief Resolve a context argument, NULL meaning the default context
+ */
+igvt_ctx *_igvt_ctx(igvt_ctx *ctx)
+{
+    if (ctx)
+        return ctx;
+
+    pthread_once(&default_ctx_once, default_ctx_init);
+
+    return &default_ctx;
 }
 
-int igvt_available_p(void)
+/**
+ * @brief Create a context
+ *
+ * @param vgt_root The vgt sysfs directory, or NULL for /sys/kernel/vgt
+ * @param drm_root The DRM class directory, or NULL for /sys/class/drm
+ * @return the new context, or NULL with errno set
+ */
+igvt_ctx *igvt_ctx_new(const char *vgt_root, const char *drm_root)
 {
-    struct stat st;
+    igvt_ctx *ctx;
 
-    /*
-     * If the top level path to the igvt info is missing
-     * then igvt isn't supported on this machine.
-     */
-    if (stat(VGT_KERNEL_PATH, &st) != 0) {
-        return 0;
+    if (!vgt_root)
+        vgt_root = VGT_KERNEL_PATH;
+
+    if (!drm_root)
+        drm_root = DRM_CLASS_PATH;
+
+    if (strlen(vgt_root) >= IGVT_ROOT_MAX ||
+        strlen(drm_root) >= IGVT_ROOT_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
     }
 
-    return 1;
+    ctx = calloc(1, sizeof(*ctx));
+
+    if (!ctx)
+        return NULL;
+
+    ctx_init(ctx, vgt_root, drm_root);
+
+    return ctx;
 }
 
-int igvt_enabled_p(unsigned int domid)
+/**
+ * @brief Free a context
+ *
+ * @param ctx The context, which must not be in use by any other thread
+ */
+void igvt_ctx_free(igvt_ctx *ctx)
+{
+    if (!ctx || ctx == &default_ctx)
+        return;
+
+    /* Staging and async threads are still using the context */
+    _async_free(ctx);
+    _stage_free(ctx);
+    _journal_free(ctx);
+    _edid_store_free(ctx);
+    _iotrace_free(ctx);
+    _trace_free(ctx);
+    _recorder_free(ctx);
+    _stats_free(ctx);
+    _drm_free(ctx);
+    _uring_free(ctx);
+    _attr_free(ctx);
+    _sim_free(ctx);
+    free(ctx);
+}
+
+/**
+ * @brief Translate a vgt port name, as found in port_override, to a gt_port
+ *
+ * @param name The name, which need not be NUL terminated
+ * @param len Length of the name
+ * @return the gt_port, or PORT_ILLEGAL
+ */
+gt_port _translate_vgt_port(const char *name, size_t len)
 {
-    char path[128];
-    struct stat st;
+    const struct port_hash_entry *e = port_hash_lookup(&vgt_port_hash,
+                                                       name, len);
+
+    return e ? e->port : PORT_ILLEGAL;
+}
+
+/*
+ * Read the first word of an attribute, the way fscanf("%s") would.
+ * Returns the length of the word, or -errno.
+ */
+int _read_attr_word(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                    gt_port port, char *word, size_t size)
+{
+    ssize_t n;
+    size_t start = 0, end;
+
+    n = _attr_read(ctx, attr, domid, port, word, size - 1);
 
+    if (n < 0)
+        return n;
+
+    word[n] = '\0';
+
+    while (start < (size_t) n && (word[start] == ' ' || word[start] == '\n'))
+        start++;
+
+    end = start;
+
+    while (end < (size_t) n && word[end] != ' ' && word[end] != '\n')
+        end++;
+
+    memmove(word, word + start, end - start);
+    word[end - start] = '\0';
+
+    return end - start;
+}
+
+static int write_attr_string(igvt_ctx *ctx, igvt_attr attr,
+                             unsigned int domid, gt_port port,
+                             const char *value)
+{
+    ssize_t n = _attr_write(ctx, attr, domid, port, value, strlen(value));
+
+    return n < 0 ? n : 0;
+}
+
+static int available_p(igvt_ctx *ctx)
+{
+    return _attr_io(ctx)->available(ctx);
+}
+
+int igvt_ctx_available_p(igvt_ctx *ctx)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(available_p__entry);
+    result = available_p(ctx);
+    IGVT_PROBE(available_p__return, result);
+    _recorder_record(ctx, IGVT_OP_AVAILABLE_P, 0, PORT_ILLEGAL, result, start);
+
+    return result;
+}
+
+int igvt_available_p(void)
+{
+    return igvt_ctx_available_p(NULL);
+}
+
+int _enabled_p(igvt_ctx *ctx, unsigned int domid)
+{
     /* Dom0 is never a valid igvt domain */
     if (domid == 0)
 	return 0;
 
-    snprintf(path, sizeof(path), VGT_KERNEL_PATH "/vm%d", domid);
+    /* Asking about a domain that isn't a vgt VM is not an error */
+    return _attr_io(ctx)->vm_exists(ctx, domid);
+}
+
+int igvt_ctx_enabled_p(igvt_ctx *ctx, unsigned int domid)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(enabled_p__entry, domid);
+    result = _enabled_p(ctx, domid);
+    IGVT_PROBE(enabled_p__return, domid, result);
+    _recorder_record(ctx, IGVT_OP_ENABLED_P, domid, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
+
+int igvt_enabled_p(unsigned int domid)
+{
+    return igvt_ctx_enabled_p(NULL, domid);
+}
+
+
+/**
+ * @brief Set the foreground VM
+ *
+ * @param ctx The context
+ * @param domid The domain ID of the port to put in the foreground
+ * @return 0 on success
+ */
+int _set_foreground_vm(igvt_ctx *ctx, unsigned int domid)
+{
+    char value[16];
+    int retval = 0;
+    int n, r = -1;
+    int status;
+
+    if (domid != 0 && !_attr_io(ctx)->vm_exists(ctx, domid)) {
+	igvt_printf(ctx, IGVT_WARNING, "%s::VM %d in %s doesn't exist\n",
+		    __func__, domid, ctx->vgt_root);
+
+        return -EINVAL;
+    }
 
-    if (stat(path, &st) != 0) {
-	igvt_printf(IGVT_ERROR, "%s::cannot stat %s: %s\n",
-		    __func__, path, strerror(errno));
+    /* Check to see if the fg vm needs to change */
+    status = _read_attr_word(ctx, IGVT_ATTR_FOREGROUND_VM, 0, PORT_ILLEGAL,
+                             value, sizeof(value));
 
+    if (status < 0) {
+	igvt_printf(ctx, IGVT_WARNING, "::%s Foreground VM file %s"
+		    "/control/foreground_vm can't be open for read\n",
+		    __func__, ctx->vgt_root);
+
+        return -ENODEV;
+    }
+
+    n = sscanf(value, "%d", &r);
+
+    if (n == 1 && r == domid) {
+	/* No change required. */
         return 0;
     }
 
-    return 1;
+    /* We need to change the fg vm. */
+    snprintf(value, sizeof(value), "%d", domid);
+
+    status = write_attr_string(ctx, IGVT_ATTR_FOREGROUND_VM, 0, PORT_ILLEGAL,
+                               value);
+
+    if (status == -ENODEV) {
+	igvt_printf(ctx, IGVT_WARNING, "::%s Foreground VM file %s"
+		    "/control/foreground_vm can't be open for write\n",
+		    __func__, ctx->vgt_root);
+
+        return -ENODEV;
+    }
+
+    if (status < 0) {
+	igvt_printf(ctx, IGVT_WARNING, "%s::write returned %d, error: %s\n",
+		    __func__, status, igvt_strerror(-status));
+    }
+
+    /* check that it was actually set. */
+    status = _read_attr_word(ctx, IGVT_ATTR_FOREGROUND_VM, 0, PORT_ILLEGAL,
+                             value, sizeof(value));
+
+    if (status < 0) {
+	igvt_printf(ctx, IGVT_WARNING, "%s::Foreground VM file %s"
+		    "/control/foreground_vm can't be open for re-read\n",
+		    __func__, ctx->vgt_root);
+
+        return -ENODEV;
+    }
+
+    r = -1;
+    n = sscanf(value, "%d", &r);
+
+    if (n != 1 || r != domid) {
+        igvt_printf(ctx, IGVT_WARNING,
+		    "%s:: set DomID %d does not match "
+		    "returned DomID: %d nRead: %d\n",
+	             __func__, domid, r, n);
+
+        retval = -EAGAIN;
+    }
+
+    return retval;
 }
 
+int igvt_ctx_set_foreground_vm(igvt_ctx *ctx, unsigned int domid)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(set_foreground_vm__entry, domid);
+    result = _set_foreground_vm(ctx, domid);
+    IGVT_PROBE(set_foreground_vm__return, domid, result);
+    _recorder_record(ctx, IGVT_OP_SET_FOREGROUND_VM, domid, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
+
+int igvt_set_foreground_vm(unsigned int domid)
+{
+    return igvt_ctx_set_foreground_vm(NULL, domid);
+}
 
 /**
- * @brief Set the foreground VM
+ * @brief Given a port name return the associated gt_port ID
+ *
+ * @param ctx The context
+ * @param i915_port_name
+ * @return the gt_port on success or PORT_ILLEGAL on failure
+ * Note that the same port ID is returned for DP and HDMI-A
+ * devices. Connectors on any card are understood.
+ */
+static gt_port translate_i915_port(igvt_ctx *ctx, const char *i915_port_name)
+{
+    gt_port port = _translate_i915_port(i915_port_name);
+
+    if (port == PORT_ILLEGAL) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid vgt_port %s\n",
+		    __func__, i915_port_name);
+    }
+
+    return port;
+}
+
+gt_port igvt_ctx_translate_i915_port(igvt_ctx *ctx, const char *i915_port_name)
+{
+    gt_port result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(translate_i915_port__entry, i915_port_name);
+    result = translate_i915_port(ctx, i915_port_name);
+    IGVT_PROBE(translate_i915_port__return, result);
+
+    return result;
+}
+
+gt_port igvt_translate_i915_port(const char *i915_port_name)
+{
+    return igvt_ctx_translate_i915_port(NULL, i915_port_name);
+}
+
+/**
+ * @brief Given a gt_port ID return the associated port name
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param pgt_port_num
+ * @return the port name on success, or "INVALID" on failure.
+ * The name is the connector on the GPU that vGT drives. Where
+ * a port has both, the HDMI-A name is returned rather than the DP one.
+ */
+const char *igvt_ctx_translate_pgt_port(igvt_ctx *ctx, gt_port pgt_port_num)
+{
+    const char *result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(translate_pgt_port__entry, pgt_port_num);
+    result = _translate_pgt_port(ctx, pgt_port_num);
+    IGVT_PROBE(translate_pgt_port__return, pgt_port_num, result);
+
+    return result ? result : "INVALID";
+}
+
+const char *igvt_translate_pgt_port(gt_port pgt_port_num)
+{
+    return igvt_ctx_translate_pgt_port(NULL, pgt_port_num);
+}
+
+/**
+ * @brief Create an igvt instance
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param aperture_size
+ * @param gm_size
+ * @param fence_count
+ * @return 0 on success
+ */
+static int create_instance(igvt_ctx *ctx, unsigned int domid,
+                           unsigned int aperture_size,
+                           unsigned int gm_size, unsigned int fence_count)
+{
+    char value[64];
+
+    /* Anything cached for an earlier VM with this ID is stale */
+    _attr_forget_vm(ctx, domid);
+
+    snprintf(value, sizeof(value), "%d,%u,%u,%u,%d\n", domid, aperture_size,
+                                   gm_size, fence_count, 1);
+
+    return write_attr_string(ctx, IGVT_ATTR_CREATE_INSTANCE, 0, PORT_ILLEGAL,
+                             value);
+}
+
+int igvt_ctx_create_instance(igvt_ctx *ctx, unsigned int domid,
+                             unsigned int aperture_size, unsigned int gm_size,
+                             unsigned int fence_count)
+{
+    uint32_t args[3] = { aperture_size, gm_size, fence_count };
+    uint64_t start;
+    struct journal_op jop;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(create_instance__entry, domid, aperture_size, gm_size,
+               fence_count);
+    result = _journal_begin(ctx, &jop, IGVT_OP_CREATE_INSTANCE, domid,
+                            PORT_ILLEGAL, PORT_ILLEGAL, args, NULL, 0, 1);
+
+    if (result == 0)
+        result = create_instance(ctx, domid, aperture_size, gm_size,
+                                 fence_count);
+
+    _journal_end(ctx, &jop);
+    IGVT_PROBE(create_instance__return, domid, result);
+    _recorder_record(ctx, IGVT_OP_CREATE_INSTANCE, domid, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
+
+int igvt_create_instance(unsigned int domid, unsigned int aperture_size,
+			 unsigned int gm_size, unsigned int fence_count)
+{
+    return igvt_ctx_create_instance(NULL, domid, aperture_size, gm_size,
+                                    fence_count);
+}
+
+/**
+ * @brief Destroy an igvt instance
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @return 0 on success
+ */
+static int destroy_instance(igvt_ctx *ctx, unsigned int domid)
+{
+    char value[16];
+
+    _attr_forget_vm(ctx, domid);
+
+    snprintf(value, sizeof(value), "%d\n", -domid);
+
+    return write_attr_string(ctx, IGVT_ATTR_CREATE_INSTANCE, 0, PORT_ILLEGAL,
+                             value);
+}
+
+int igvt_ctx_destroy_instance(igvt_ctx *ctx, unsigned int domid)
+{
+    uint64_t start;
+    struct journal_op jop;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(destroy_instance__entry, domid);
+    result = _journal_begin(ctx, &jop, IGVT_OP_DESTROY_INSTANCE, domid,
+                            PORT_ILLEGAL, PORT_ILLEGAL, NULL, NULL, 0, 1);
+
+    if (result == 0)
+        result = destroy_instance(ctx, domid);
+
+    _journal_end(ctx, &jop);
+    IGVT_PROBE(destroy_instance__return, domid, result);
+    _recorder_record(ctx, IGVT_OP_DESTROY_INSTANCE, domid, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
+
+int igvt_destroy_instance(unsigned int domid)
+{
+    return igvt_ctx_destroy_instance(NULL, domid);
+}
+
+/**
+ * @brief Probe the largest EDID the kernel will accept
+ *
+ * The vgt edid attribute is a binary attribute, and its size is the
+ * largest EDID the kernel will take. Kernels that only declare 128
+ * bytes hang when they are given more, so we only write extension
+ * blocks when the attribute is big enough to hold them. Text attributes
+ * always report a page, which tells us nothing.
+ *
+ * The result is cached for the life of the context.
+ *
+ * @param domid The domain ID of an edid attribute
+ * @param vgt_port The port of the edid attribute
+ * @return the maximum number of EDID bytes to write
+ */
+static size_t igvt_edid_max_size(igvt_ctx *ctx, unsigned int domid,
+                                 gt_port vgt_port)
+{
+    edid_ext_state state, unknown = EDID_EXT_UNKNOWN;
+    ssize_t size = -1;
+
+    state = __atomic_load_n(&ctx->edid_ext, __ATOMIC_RELAXED);
+
+    if (state == EDID_EXT_UNKNOWN)
+        size = _attr_io(ctx)->attr_size(ctx, IGVT_ATTR_EDID, domid, vgt_port);
+
+    if (size >= 0) {
+        if (size >= EDID_MAX_SIZE && size != sysconf(_SC_PAGESIZE)) {
+            state = EDID_EXT_SUPPORTED;
+        } else {
+            state = EDID_EXT_UNSUPPORTED;
+        }
+
+        /* Don't undo a timeout latched by another thread */
+        if (!__atomic_compare_exchange_n(&ctx->edid_ext, &unknown, state, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            state = unknown;
+    }
+
+    return state == EDID_EXT_SUPPORTED ? EDID_MAX_SIZE : EDID_BLOCK_SIZE;
+}
+
+static int is_port_analog(gt_port port) {
+
+    return port == PORT_E;
+
+}
+
+/**
+ * @brief Write the physical port a virtual port maps to
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param pgt_port
+ * @return 0 on success
+ */
+int _write_port_override(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                         gt_port pgt_port)
+{
+    char value[16];
+    uint64_t span = _trace_begin(ctx);
+    int status;
+
+    snprintf(value, sizeof(value), "%s\n", port_strings[pgt_port]);
+
+    status = write_attr_string(ctx, IGVT_ATTR_PORT_OVERRIDE, domid, vgt_port,
+                               value);
+    _trace_end(ctx, "port_override", span, domid, vgt_port, status);
+
+    return status;
+}
+
+/**
+ * @brief Filter a copy of an EDID for a virtual port
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param edid Not modified
+ * @param edid_size
+ * @param filtered Set to the EDID, cut down to what the kernel can take
+ * @return the size of the filtered EDID
+ */
+size_t _prepare_edid(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                     const unsigned char *edid, size_t edid_size,
+                     unsigned char *filtered)
+{
+    size_t max_size;
+
+    /* Only write extension blocks if the kernel can take them */
+    max_size = igvt_edid_max_size(ctx, domid, vgt_port);
+
+    if (edid_size > max_size) {
+        edid_size = max_size;
+    }
+
+    /* Filter a copy; the caller's EDID may be a shared template */
+    memcpy(filtered, edid, edid_size);
+
+    edid_size = _fixup_edid_extensions(filtered, edid_size);
+
+    _filter_edid(filtered, edid_size, is_port_analog(vgt_port));
+
+    return edid_size;
+}
+
+/**
+ * @brief Filter an EDID and write it to a virtual port
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param edid Not modified; a copy is filtered
+ * @param edid_size
+ * @return 0 on success
+ */
+int _write_edid(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                const unsigned char *edid, size_t edid_size)
+{
+    unsigned char filtered[EDID_MAX_SIZE] = { 0 };
+    uint64_t span = _trace_begin(ctx);
+    ssize_t n;
+    int status = 0;
+
+    edid_size = _prepare_edid(ctx, domid, vgt_port, edid, edid_size, filtered);
+    edid = filtered;
+
+    _trace_end(ctx, "edid_filter", span, domid, vgt_port, 0);
+    span = _trace_begin(ctx);
+
+    n = _attr_write(ctx, IGVT_ATTR_EDID, domid, vgt_port, edid, edid_size);
+
+    if (n == -ENODEV) {
+        status = -ENODEV;
+    } else if (n != edid_size) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::failed to write EDID: %s\n",
+                    __func__, n < 0 ? igvt_strerror(-n) : "short write");
+
+        /* e.g. -ETIMEDOUT from a kernel that can't take extensions,
+         * which the caller can retry with one block */
+        if (n < 0 && edid_size > EDID_BLOCK_SIZE)
+            status = n;
+    }
+
+    _trace_end(ctx, "edid_write", span, domid, vgt_port, status);
+
+    return status;
+}
+
+/**
+ * @brief Write an EDID that was filtered for its port beforehand
+ *
+ * The EDID is written as it is, unless the kernel can't take all of
+ * it, in which case it goes through _write_edid to be cut down;
+ * filtering it a second time changes nothing.
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param edid Filtered for vgt_port
+ * @param edid_size
+ * @return 0 on success
+ */
+static int write_filtered_edid(igvt_ctx *ctx, unsigned int domid,
+                               gt_port vgt_port, const unsigned char *edid,
+                               size_t edid_size)
+{
+    uint64_t span;
+    ssize_t n;
+    int status = 0;
+
+    if (edid_size > igvt_edid_max_size(ctx, domid, vgt_port))
+        return _write_edid(ctx, domid, vgt_port, edid, edid_size);
+
+    span = _trace_begin(ctx);
+
+    n = _attr_write(ctx, IGVT_ATTR_EDID, domid, vgt_port, edid, edid_size);
+
+    if (n == -ENODEV) {
+        status = -ENODEV;
+    } else if (n != edid_size) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::failed to write EDID: %s\n",
+                    __func__, n < 0 ? igvt_strerror(-n) : "short write");
+
+        if (n < 0 && edid_size > EDID_BLOCK_SIZE)
+            status = n;
+    }
+
+    _trace_end(ctx, "edid_write", span, domid, vgt_port, status);
+
+    return status;
+}
+
+/**
+ * @brief Connect or disconnect a virtual port
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param connect non-zero to connect, zero to disconnect
+ * @return 0 on success
+ */
+int _write_connection(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                      int connect)
+{
+    uint64_t span = _trace_begin(ctx);
+    int status;
+
+    status = write_attr_string(ctx, IGVT_ATTR_CONNECTION, domid, vgt_port,
+                               connect ? "connect\n" : "disconnect\n");
+    _trace_end(ctx, connect ? "connect" : "disconnect", span, domid, vgt_port,
+               status);
+
+    return status;
+}
+
+static int unplug_display(igvt_ctx *ctx, unsigned int domid,
+                          gt_port vgt_port);
+static int port_plugged_p(igvt_ctx *ctx, unsigned int domid,
+                          gt_port vgt_port);
+
+/**
+ * @brief Plug in a display
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param edid
+ * @param edid_size
+ * @param pgt_port
+ * @param filtered Non-zero if the EDID is already filtered for vgt_port
+ * @return 0 on success
+ */
+int _plug_display(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                  const unsigned char *edid, size_t edid_size,
+                  gt_port pgt_port, int filtered)
+{
+    uint64_t span = _trace_begin(ctx);
+    int status = 0;
+
+    if (!_enabled_p(ctx, domid)) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d\n",
+		    __func__, domid);
+	status = -EINVAL;
+    } else if (!igvt_is_valid_port_p(vgt_port)) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid vgt_port %d\n",
+		    __func__, vgt_port);
+        status = -EINVAL;
+    } else if (!igvt_is_valid_port_p(pgt_port)) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid pgt_port %d\n",
+		    __func__, pgt_port);
+        status = -EINVAL;
+    }
+
+    _trace_end(ctx, "validate", span, domid, vgt_port, status);
+
+    if (status < 0)
+        return status;
+
+    span = _trace_begin(ctx);
+
+    if (port_plugged_p(ctx, domid, vgt_port)) {
+        unplug_display(ctx, domid, vgt_port);
+    }
+
+    _trace_end(ctx, "unplug", span, domid, vgt_port, 0);
+
+    status = _write_port_override(ctx, domid, vgt_port, pgt_port);
+
+    if (status < 0)
+        return status;
+
+    if (filtered)
+        status = write_filtered_edid(ctx, domid, vgt_port, edid, edid_size);
+    else
+        status = _write_edid(ctx, domid, vgt_port, edid, edid_size);
+
+    if (status < 0)
+        return status;
+
+    return _write_connection(ctx, domid, vgt_port, 1);
+}
+
+int igvt_ctx_plug_display(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                          const unsigned char *edid, size_t edid_size,
+                          gt_port pgt_port)
+{
+    uint64_t start;
+    struct journal_op jop;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(plug_display__entry, domid, vgt_port, edid_size, pgt_port);
+    result = _journal_begin(ctx, &jop, IGVT_OP_PLUG_DISPLAY, domid, vgt_port,
+                            pgt_port, NULL, edid, edid_size, 1);
+
+    if (result == 0)
+        result = _plug_display(ctx, domid, vgt_port, edid, edid_size,
+                               pgt_port, 0);
+
+    _journal_end(ctx, &jop);
+    IGVT_PROBE(plug_display__return, domid, vgt_port, result);
+    _recorder_record(ctx, IGVT_OP_PLUG_DISPLAY, domid, vgt_port,
+                     result, start);
+
+    return result;
+}
+
+int igvt_plug_display(unsigned int domid, gt_port vgt_port,
+		      const unsigned char *edid, size_t edid_size,
+		      gt_port pgt_port)
+{
+    return igvt_ctx_plug_display(NULL, domid, vgt_port, edid, edid_size,
+                                 pgt_port);
+}
+
+/**
+ * @brief Plug in a display whose EDID was filtered for its port already
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @param edid Filtered for vgt_port
+ * @param edid_size
+ * @param pgt_port
+ * @return 0 on success, -EINVAL if the EDID is for the other kind of port
+ */
+static int plug_display_filtered(igvt_ctx *ctx, unsigned int domid,
+                                 gt_port vgt_port, const unsigned char *edid,
+                                 size_t edid_size, gt_port pgt_port)
+{
+    struct journal_op jop;
+    int status;
+
+    /* Only the input bit is checked; the rest is the caller's word */
+    if (!edid || edid_size < EDID_BLOCK_SIZE ||
+        is_port_analog(vgt_port) == ((edid[20] & 0x80) != 0)) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::EDID isn't filtered for %s\n",
+                    __func__, igvt_is_valid_port_p(vgt_port) ?
+                    port_strings[vgt_port] : "the port");
+        return -EINVAL;
+    }
+
+    /* Journaled as a plain plug; filtering it again on replay is a no-op */
+    status = _journal_begin(ctx, &jop, IGVT_OP_PLUG_DISPLAY, domid, vgt_port,
+                            pgt_port, NULL, edid, edid_size, 1);
+
+    if (status == 0)
+        status = _plug_display(ctx, domid, vgt_port, edid, edid_size,
+                               pgt_port, 1);
+
+    _journal_end(ctx, &jop);
+
+    return status;
+}
+
+int igvt_ctx_plug_display_filtered(igvt_ctx *ctx, unsigned int domid,
+                                   gt_port vgt_port,
+                                   const unsigned char *edid,
+                                   size_t edid_size, gt_port pgt_port)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(plug_display_filtered__entry, domid, vgt_port, edid_size,
+               pgt_port);
+    result = plug_display_filtered(ctx, domid, vgt_port, edid, edid_size,
+                                   pgt_port);
+    IGVT_PROBE(plug_display_filtered__return, domid, vgt_port, result);
+    _recorder_record(ctx, IGVT_OP_PLUG_DISPLAY_FILTERED, domid, vgt_port,
+                     result, start);
+
+    return result;
+}
+
+int igvt_plug_display_filtered(unsigned int domid, gt_port vgt_port,
+                               const unsigned char *edid, size_t edid_size,
+                               gt_port pgt_port)
+{
+    return igvt_ctx_plug_display_filtered(NULL, domid, vgt_port, edid,
+                                          edid_size, pgt_port);
+}
+
+/* The most writes plugging in one display takes */
+#define PLUG_WRITES 4
+
+static void plug_write(struct attr_write *w, igvt_attr attr,
+                       const struct igvt_display *d, const void *buf,
+                       size_t size)
+{
+    w->attr = attr;
+    w->domid = d->domid;
+    w->port = d->vgt_port;
+    w->buf = buf;
+    w->size = size;
+    w->link = 1;
+}
+
+/**
+ * @brief Plug in many displays, with one batch of writes
+ *
+ * Each display's unplug, port_override, EDID and connect writes are a
+ * chain, so they happen in order and stop at the first failure.
+ *
+ * @param ctx The context
+ * @param displays
+ * @param n
+ * @return 0 if they were all plugged in, else the first failure
+ */
+int _plug_displays(igvt_ctx *ctx, struct igvt_display *displays, size_t n)
+{
+    struct igvt_display *d;
+    struct attr_write *writes;
+    unsigned char (*edids)[EDID_MAX_SIZE];
+    char (*overrides)[16];
+    struct journal_op *jops, *last = NULL;
+    size_t *ends, i, j, n_writes = 0, edid_size;
+    uint64_t span = _trace_begin(ctx);
+    int status = 0;
+
+    writes = calloc(n * PLUG_WRITES, sizeof(*writes));
+    edids = calloc(n, sizeof(*edids));
+    overrides = calloc(n, sizeof(*overrides));
+    ends = calloc(n, sizeof(*ends));
+    jops = calloc(n, sizeof(*jops));
+
+    if (!writes || !edids || !overrides || !ends || !jops) {
+        free(writes);
+        free(edids);
+        free(overrides);
+        free(ends);
+        free(jops);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < n; i++) {
+        d = &displays[i];
+        d->result = 0;
+
+        if (!_enabled_p(ctx, d->domid)) {
+            igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d\n",
+                        __func__, d->domid);
+            d->result = -EINVAL;
+        } else if (!igvt_is_valid_port_p(d->vgt_port)) {
+            igvt_printf(ctx, IGVT_ERROR, "%s::Invalid vgt_port %d\n",
+                        __func__, d->vgt_port);
+            d->result = -EINVAL;
+        } else if (!igvt_is_valid_port_p(d->pgt_port)) {
+            igvt_printf(ctx, IGVT_ERROR, "%s::Invalid pgt_port %d\n",
+                        __func__, d->pgt_port);
+            d->result = -EINVAL;
+        } else {
+            /* Journaled one by one, synced together below */
+            d->result = _journal_begin(ctx, &jops[i], IGVT_OP_PLUG_DISPLAY,
+                                       d->domid, d->vgt_port, d->pgt_port,
+                                       NULL, d->edid, d->edid_size, 0);
+
+            if (d->result == 0)
+                last = &jops[i];
+        }
+
+        if (d->result < 0) {
+            ends[i] = n_writes;
+            continue;
+        }
+
+        if (port_plugged_p(ctx, d->domid, d->vgt_port))
+            plug_write(&writes[n_writes++], IGVT_ATTR_CONNECTION, d,
+                       "disconnect\n", strlen("disconnect\n"));
+
+        snprintf(overrides[i], sizeof(overrides[i]), "%s\n",
+                 port_strings[d->pgt_port]);
+        plug_write(&writes[n_writes++], IGVT_ATTR_PORT_OVERRIDE, d,
+                   overrides[i], strlen(overrides[i]));
+
+        edid_size = _prepare_edid(ctx, d->domid, d->vgt_port, d->edid,
+                                  d->edid_size, edids[i]);
+        plug_write(&writes[n_writes++], IGVT_ATTR_EDID, d, edids[i],
+                   edid_size);
+
+        plug_write(&writes[n_writes++], IGVT_ATTR_CONNECTION, d,
+                   "connect\n", strlen("connect\n"));
+        writes[n_writes - 1].link = 0;
+
+        ends[i] = n_writes;
+    }
+
+    _trace_end(ctx, "prepare", span, 0, PORT_ILLEGAL, 0);
+
+    /* Nothing is written unless every intent is on disk */
+    if (last && (status = _journal_sync(ctx, last)) < 0) {
+        for (i = 0; i < n; i++) {
+            if (displays[i].result == 0)
+                displays[i].result = status;
+        }
+
+        n_writes = 0;
+    }
+
+    span = _trace_begin(ctx);
+
+    _attr_write_batch(ctx, writes, n_writes);
+
+    _trace_end(ctx, "write_batch", span, 0, PORT_ILLEGAL, 0);
+
+    for (i = 0, j = 0; i < n; j = ends[i++]) {
+        d = &displays[i];
+
+        /* The first failure; what it cancelled follows it */
+        for (; j < ends[i] && d->result == 0; j++) {
+            if (writes[j].result < 0) {
+                d->result = writes[j].result;
+
+                igvt_printf(ctx, IGVT_ERROR, "%s::failed to write %s of "
+                            "vm%u %s: %s\n", __func__,
+                            _attr_name(writes[j].attr), d->domid,
+                            port_strings[d->vgt_port],
+                            igvt_strerror(-d->result));
+            }
+        }
+
+        if (d->result < 0 && status == 0)
+            status = d->result;
+    }
+
+    for (i = 0; i < n; i++)
+        _journal_end(ctx, &jops[i]);
+
+    free(writes);
+    free(edids);
+    free(overrides);
+    free(ends);
+    free(jops);
+
+    return status;
+}
+
+int igvt_ctx_plug_displays(igvt_ctx *ctx, struct igvt_display *displays,
+                           size_t n)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(plug_displays__entry, n);
+    result = _plug_displays(ctx, displays, n);
+    IGVT_PROBE(plug_displays__return, n, result);
+    _recorder_record(ctx, IGVT_OP_PLUG_DISPLAYS, 0, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
+
+int igvt_plug_displays(struct igvt_display *displays, size_t n)
+{
+    return igvt_ctx_plug_displays(NULL, displays, n);
+}
+
+/* Is a port connected? Its domain and port have been validated already */
+static int connected_p(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port)
+{
+    char c[12];
+
+    if (_read_attr_word(ctx, IGVT_ATTR_CONNECTION, domid, vgt_port,
+                        c, sizeof(c)) <= 0)
+        return 0;
+
+    return strcmp("connected", c) == 0;
+}
+
+/**
+ * @brief Move the monitor on a physical port from one virtual port to another
  *
- * @param domid The domain ID of the port to put in the foreground
+ * Everything but the hand over itself happens first: validation, EDID
+ * filtering, unplugging whatever the new port showed, and its
+ * port_override and EDID writes, which also opens the attributes. Only
+ * the old port's disconnect and the new port's connect are left, back
+ * to back; that is the gap in which neither VM owns the monitor.
+ *
+ * @param ctx The context
+ * @param from_dom
+ * @param from_port
+ * @param to_dom
+ * @param to_port
+ * @param pgt_port
+ * @param gap_ns Set to the length of the gap, if not NULL
  * @return 0 on success
  */
-int igvt_set_foreground_vm(unsigned int domid)
+static int handoff_display(igvt_ctx *ctx, unsigned int from_dom,
+                           gt_port from_port, unsigned int to_dom,
+                           gt_port to_port, gt_port pgt_port,
+                           uint64_t *gap_ns)
 {
-    FILE *fd;
-    char path[128];
-    struct stat st;
-    int retval = 0;
-    int n, r = -1;
-    int status;
+    unsigned char edid[EDID_MAX_SIZE], filtered[EDID_MAX_SIZE];
+    uint64_t span = _trace_begin(ctx), start;
+    size_t edid_size, size;
+    ssize_t n;
+    int from_plugged, status = 0;
+
+    if (gap_ns)
+        *gap_ns = 0;
+
+    if (!_enabled_p(ctx, from_dom) || !_enabled_p(ctx, to_dom)) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d -> %d\n",
+                    __func__, from_dom, to_dom);
+        status = -EINVAL;
+    } else if (!igvt_is_valid_port_p(from_port) ||
+               !igvt_is_valid_port_p(to_port)) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::Invalid vgt_port %d -> %d\n",
+                    __func__, from_port, to_port);
+        status = -EINVAL;
+    } else if (!igvt_is_valid_port_p(pgt_port)) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::Invalid pgt_port %d\n",
+                    __func__, pgt_port);
+        status = -EINVAL;
+    } else if (from_dom == to_dom && from_port == to_port) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::vm%u %s handed off to itself\n",
+                    __func__, to_dom, port_strings[to_port]);
+        status = -EINVAL;
+    }
 
-    if (domid != 0) {
-        snprintf(path, sizeof(path), VGT_KERNEL_PATH "/vm%d", domid);
+    _trace_end(ctx, "validate", span, to_dom, to_port, status);
 
-        if (stat(path, &st) != 0) {
-	    igvt_printf(IGVT_WARNING, "%s::VM %d at %s doesn't exist\n",
-			__func__, domid, path);
+    if (status < 0)
+        return status;
 
-            return -EINVAL;
-        }
+    span = _trace_begin(ctx);
+
+    /*
+     * The monitor's own EDID, else whatever the old port was given. The
+     * connector is read afresh: the monitor may have been swapped since
+     * the hotplug cache was filled.
+     */
+    edid_size = _physical_edid(ctx, pgt_port, edid, sizeof(edid));
+
+    if (edid_size < EDID_BLOCK_SIZE) {
+        n = _attr_read(ctx, IGVT_ATTR_EDID, from_dom, from_port,
+                       edid, sizeof(edid));
+        edid_size = n < 0 ? 0 : n;
     }
 
-    /* Check to see if the fg vm needs to change */
-    fd = fopen(VGT_KERNEL_PATH "/control/foreground_vm", "r");
+    if (edid_size > sizeof(edid))
+        edid_size = sizeof(edid);
 
-    if (!fd) {
-	igvt_printf(IGVT_WARNING, "::%s Foreground VM file " 
-		    VGT_KERNEL_PATH
-		    "/control/foreground_vm can't be open for read\n",
-		    __func__);
+    edid_size -= edid_size % EDID_BLOCK_SIZE;
 
+    if (edid_size == 0) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::no EDID for %s\n",
+                    __func__, port_strings[pgt_port]);
+        _trace_end(ctx, "prepare", span, to_dom, to_port, -ENODEV);
         return -ENODEV;
     }
 
-    n = fscanf(fd, "%d", &r);
-
-    fclose(fd);
+    size = _prepare_edid(ctx, to_dom, to_port, edid, edid_size, filtered);
 
-    if (n == 1 && r == domid) {
-	/* No change required. */
-        return 0;
-    }
+    /* Reading the connections opens them, ready for the hand over */
+    from_plugged = connected_p(ctx, from_dom, from_port);
 
-    /* We need to change the fg vm. */
-    fd = fopen(VGT_KERNEL_PATH "/control/foreground_vm", "w");
+    if (connected_p(ctx, to_dom, to_port))
+        status = _write_connection(ctx, to_dom, to_port, 0);
 
-    if (!fd) {
-	igvt_printf(IGVT_WARNING, "::%s Foreground VM file "
-		    VGT_KERNEL_PATH
-		    "/control/foreground_vm can't be open for write\n",
-		    __func__);
+    _trace_end(ctx, "prepare", span, to_dom, to_port, status);
 
-        return -ENODEV;
-    }
+    if (status == 0)
+        status = _write_port_override(ctx, to_dom, to_port, pgt_port);
 
-    status = fprintf(fd, "%d", domid);
+    if (status < 0)
+        return status;
 
-    if (status <= 0) {
-	igvt_printf(IGVT_WARNING, "%s::fprintf returned %d, error: %s\n",
-		    __func__, status, strerror(errno));
-    }
+    span = _trace_begin(ctx);
 
-    status = fclose(fd);
+    n = _attr_write(ctx, IGVT_ATTR_EDID, to_dom, to_port, filtered, size);
 
-    if (status < 0) {
-	igvt_printf(IGVT_WARNING, "%s::fclose returned %d, error: %s\n",
-		    __func__, status, strerror(errno));
+    /* A kernel that can't take extensions has latched that by now */
+    if (n == -ETIMEDOUT && size > EDID_BLOCK_SIZE) {
+        size = _prepare_edid(ctx, to_dom, to_port, edid, edid_size, filtered);
+        n = _attr_write(ctx, IGVT_ATTR_EDID, to_dom, to_port, filtered, size);
     }
 
-    /* check that it was actually set. */
-    fd = fopen(VGT_KERNEL_PATH "/control/foreground_vm", "r");
+    status = n < 0 ? n : n != size ? -EIO : 0;
 
-    if (!fd) {
-	igvt_printf(IGVT_WARNING, "%s::Foreground VM file "
-		    VGT_KERNEL_PATH 
-		    "/control/foreground_vm can't be open for re-read\n",
-		    __func__);
+    _trace_end(ctx, "edid_write", span, to_dom, to_port, status);
 
-        return -ENODEV;
+    if (status < 0) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::failed to write EDID: %s\n",
+                    __func__, igvt_strerror(-status));
+        return status;
     }
 
-    n = fscanf(fd, "%d", &r);
+    start = _recorder_now();
+    span = _trace_begin(ctx);
 
-    if (n != 1 || r != domid) {
-        igvt_printf(IGVT_WARNING,
-		    "%s:: set DomID %d does not match "
-		    "returned DomID: %d nRead: %d\n",
-	             __func__, domid, r, n);
+    if (from_plugged)
+        status = _write_connection(ctx, from_dom, from_port, 0);
 
-        retval = -EAGAIN;
+    if (status == 0) {
+        status = _write_connection(ctx, to_dom, to_port, 1);
+
+        /* Give the monitor back rather than leave it with no one */
+        if (status < 0 && from_plugged)
+            _write_connection(ctx, from_dom, from_port, 1);
     }
 
-    fclose(fd);
+    if (gap_ns && from_plugged)
+        *gap_ns = _recorder_now() - start;
 
-    return retval;
+    _trace_end(ctx, "handoff", span, to_dom, to_port, status);
+
+    return status;
 }
 
-/**
- * @brief Given a port name return the associated gt_port ID
- *
- * @param domid The domain ID
- * @param i915_port_name
- * @return the gt_port on success or PORT_ILLEGAL on failure
- * Note that the same port ID is returned for DP and HDMI-A
- * devices.
- */
-gt_port igvt_translate_i915_port(const char *i915_port_name)
+int igvt_ctx_handoff_display(igvt_ctx *ctx, unsigned int from_dom,
+                             gt_port from_port, unsigned int to_dom,
+                             gt_port to_port, gt_port pgt_port,
+                             uint64_t *gap_ns)
 {
-    gt_port port = PORT_ILLEGAL;
-
-    /* Ugliness - logic from intel's vgt_mgr script */
-    if (strcmp(i915_port_name, "card0-eDP-1") == 0) {
-        port = PORT_EDP;
-    } else if (strcmp(i915_port_name, "card0-DP-1") == 0) {
-        port = PORT_B;
-    } else if (strcmp(i915_port_name, "card0-HDMI-A-1") == 0) {
-        port = PORT_B;
-    } else if (strcmp(i915_port_name, "card0-DP-2") == 0) {
-        port = PORT_C;
-    } else if (strcmp(i915_port_name, "card0-HDMI-A-2") == 0) {
-        port = PORT_C;
-    } else if (strcmp(i915_port_name, "card0-DP-3") == 0) {
-        port = PORT_D;
-    } else if (strcmp(i915_port_name, "card0-HDMI-A-3") == 0) {
-        port = PORT_D;
-    } else if (strcmp(i915_port_name, "card0-VGA-1") == 0) {
-        port = PORT_VGA;
-    } else {
-	igvt_printf(IGVT_ERROR, "%s::Invalid vgt_port %s\n",
-		    __func__, i915_port_name);
-    }
-
-    return port;
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(handoff_display__entry, from_dom, from_port, to_dom, to_port,
+               pgt_port);
+    result = handoff_display(ctx, from_dom, from_port, to_dom, to_port,
+                             pgt_port, gap_ns);
+    IGVT_PROBE(handoff_display__return, to_dom, to_port, result);
+    _recorder_record(ctx, IGVT_OP_HANDOFF_DISPLAY, to_dom, to_port,
+                     result, start);
+
+    return result;
 }
 
-/**
- * @brief Given a gt_port ID return the associated port name
- *
- * @param pgt_port_num
- * @return the port name on success, or "INVALID" on failure.
- * Note that only the HDMI-A name is returned for ports that
- * might actually be DP ports.
- */
-const char *igvt_translate_pgt_port(gt_port pgt_port_num)
+int igvt_handoff_display(unsigned int from_dom, gt_port from_port,
+                         unsigned int to_dom, gt_port to_port,
+                         gt_port pgt_port, uint64_t *gap_ns)
 {
-    switch (pgt_port_num) {
-    case PORT_EDP:
-        return "card0-eDP-1";
-    case PORT_B:
-        return "card-HDMI-A-1";
-    case PORT_C:
-        return "card0-HDMI-A-2";
-    case PORT_D:
-        return "card0-HDMI-A-3";
-    case PORT_VGA:
-        return "card0-VGA-1";
-    default:
-        /* Should there be an error here? */
-        break;
-    }
-
-    return "INVALID";
+    return igvt_ctx_handoff_display(NULL, from_dom, from_port, to_dom,
+                                    to_port, pgt_port, gap_ns);
 }
 
-/**
- * @brief Create an igvt instance
+/*
+ * A displays blob is a header and then one record per port that has
+ * anything set, each followed by its EDID:
  *
- * @param domid The domain ID
- * @param aperture_size
- * @param gm_size
- * @param fence_count
- * @return 0 on success
+ *   header: 'I' 'G' 'V' 'D', version, number of records, 0, 0
+ *   record: vgt_port, flags, pgt_port or 0xff, number of EDID blocks
+ *
+ * Every field is a byte, so the blob reads the same on any host.
  */
-int igvt_create_instance(unsigned int domid, unsigned int aperture_size,
-			 unsigned int gm_size, unsigned int fence_count)
-{
-    FILE *fd;
-    char *path = VGT_KERNEL_PATH "/control/create_vgt_instance";
-    int retval = 0;
-
-    fd = fopen(path, "w");
-
-    if (!fd)
-        return -ENODEV;
-
-    if (fprintf(fd, "%d,%u,%u,%u,%d\n", domid, aperture_size,
-				        gm_size, fence_count, 1) < 0) {
-        retval = -errno;
-    }
-
-    fclose(fd);
-
-    return retval;
-}
+#define DISPLAYS_MAGIC "IGVD"
+#define DISPLAYS_VERSION 1
+#define DISPLAYS_HEADER_SIZE 8
+#define DISPLAYS_RECORD_SIZE 4
+#define DISPLAYS_CONNECTED 0x01
+#define DISPLAYS_NO_OVERRIDE 0xff
 
 /**
- * @brief Destroy an igvt instance
+ * @brief Serialise the displays of a VM
  *
+ * @param ctx The context
  * @param domid The domain ID
- * @return 0 on success
+ * @param buf Where to put the blob
+ * @param size The size of buf on entry, the size of the blob on return
+ * @return 0 on success, -ENOSPC if buf is too small
  */
-int igvt_destroy_instance(unsigned int domid)
+static int vm_save_displays(igvt_ctx *ctx, unsigned int domid, void *buf,
+                            size_t *size)
 {
-    FILE *fd;
-    char *path = VGT_KERNEL_PATH "/control/create_vgt_instance";
-    int retval = 0;
-
-    fd = fopen(path, "w");
-
-    if (!fd)
-        return -ENODEV;
-
-    if (fprintf(fd, "%d\n", -domid) < 0) {
-        retval = -errno;
+    unsigned char blob[IGVT_DISPLAYS_BLOB_MAX], *p, *edid;
+    unsigned int port, n_records = 0;
+    char word[16];
+    ssize_t n;
+    size_t blocks, blob_size;
+    gt_port pgt_port;
+    int len;
+
+    if (!_enabled_p(ctx, domid)) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d\n",
+                    __func__, domid);
+        return -EINVAL;
     }
 
-    fclose(fd);
-
-    return retval;
-}
-
-static void write_edid_byte(unsigned char *edid, size_t byte, const unsigned char value)
-{
-	/* Add the old value back to the checksum */
-	edid[0x7f] += edid[byte];
+    p = blob + DISPLAYS_HEADER_SIZE;
 
-	edid[byte] = value;
+    for (port = 0; port < GVT_MAX_PORTS; port++) {
+        if (!igvt_is_valid_port_p(port))
+            continue;
 
-	/* Subtract the new value from the checksum */
-	edid[0x7f] -= edid[byte];
-}
+        p[0] = port;
+        p[1] = connected_p(ctx, domid, port) ? DISPLAYS_CONNECTED : 0;
 
-static void _filter_edid(unsigned char *edid, size_t edid_size, int analog_port)
-{
-    int i;
+        len = _read_attr_word(ctx, IGVT_ATTR_PORT_OVERRIDE, domid, port,
+                              word, sizeof(word));
+        pgt_port = len > 0 ? _translate_vgt_port(word, len) : PORT_ILLEGAL;
+        p[2] = pgt_port == PORT_ILLEGAL ? DISPLAYS_NO_OVERRIDE : pgt_port;
 
-    /*
-     * The virtual port is unaware of the dongle status,
-     * so we must make certain that the digital/analog input
-     * bit matches the port.
-     *
-     * The digital/analog bit is in the Video Input Parameters
-     * bitmap. EDID byte 20, bit 7.
-     * 
-     * Toggling this bit changes the definition of the 
-     * Supported Features Bitmap (byte 24) bits 3:4. When digital,
-     * 0x0 == RGB 4:4:4 color support. When analog, 0x1 == RGB color.
-     */
-    if (analog_port && (edid[20] & 0x80) ) {
+        /* Only as much of the attribute as the EDID in it announces */
+        edid = p + DISPLAYS_RECORD_SIZE;
+        n = _attr_read(ctx, IGVT_ATTR_EDID, domid, port, edid, EDID_MAX_SIZE);
+        blocks = n < EDID_BLOCK_SIZE ? 0 : n / EDID_BLOCK_SIZE;
 
-        write_edid_byte(edid, 20, 0x00);
-        write_edid_byte(edid, 24, (edid[24] & 0xE7) | 0x08);
+        if (blocks && memcmp(edid, "\0\xff\xff\xff\xff\xff\xff\0", 8) != 0)
+            blocks = 0;
 
-    } else if (!analog_port && !(edid[20] & 0x80)) {
+        if (blocks && blocks > edid[EDID_EXTENSION_COUNT] + 1u)
+            blocks = edid[EDID_EXTENSION_COUNT] + 1u;
 
-        write_edid_byte(edid, 20, 0x80);
-        write_edid_byte(edid, 24, (edid[24] & 0xE7));
+        p[3] = blocks;
 
-    } 
+        if (p[1] || p[2] != DISPLAYS_NO_OVERRIDE || p[3]) {
+            p = edid + blocks * EDID_BLOCK_SIZE;
+            n_records++;
+        }
+    }
 
-    /*
-     * Funny things happen when the Windows graphics driver
-     * invokes DPMS. (Stale images, off-screen buffers visible).
-     *
-     * Clear the DPMS bits so Windows doesn't use it.
-     * 
-     * DPMS support bits are in the Supported Features Bitmap.
-     * Byte 24, bits 5:7
-     */
-    write_edid_byte(edid, 24, edid[24] & 0x1F);
+    memcpy(blob, DISPLAYS_MAGIC, 4);
+    blob[4] = DISPLAYS_VERSION;
+    blob[5] = n_records;
+    blob[6] = blob[7] = 0;
 
-    /*
-     * There are limits to the pixelClock EDID field
-     * that the Windows GT driver will support. 
-     *
-     * The limits are meaningless, since the port is
-     * virtual, and no clocks are actually configured.
-     *
-     * Override the pixelClock fields here to fit into
-     * the limits.
-     */
+    blob_size = p - blob;
 
-    /*
-     * There are four timing descriptors. 18 bytes long,
-     * starting at byte 54. The first two bytes is the
-     * pixelClock.
-     */
-    for (i = 0; i < 4; i++) {
-        unsigned char *timingDescriptor = (unsigned char *) &edid[54 + (18 * i)];
-        unsigned short clock = timingDescriptor[0] + (timingDescriptor[1] << 8);
+    if (*size < blob_size) {
+        *size = blob_size;
+        return -ENOSPC;
+    }
 
-        /* Cap the pixel clock (bytes 0-1) at 160mhz */
-        if (clock > 16000) {
+    memcpy(buf, blob, blob_size);
+    *size = blob_size;
 
-            write_edid_byte(edid, (&timingDescriptor[0] - edid), 16000 & 0xff);
-            write_edid_byte(edid, (&timingDescriptor[1] - edid), 16000 >> 8);
-        }
-    }
+    return 0;
 }
 
-static int is_port_analog(gt_port port) {
-
-    return port == PORT_E;
+int igvt_ctx_vm_save_displays(igvt_ctx *ctx, unsigned int domid, void *buf,
+                              size_t *size)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(vm_save_displays__entry, domid);
+    result = vm_save_displays(ctx, domid, buf, size);
+    IGVT_PROBE(vm_save_displays__return, domid, result);
+    _recorder_record(ctx, IGVT_OP_VM_SAVE_DISPLAYS, domid, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
 
+int igvt_vm_save_displays(unsigned int domid, void *buf, size_t *size)
+{
+    return igvt_ctx_vm_save_displays(NULL, domid, buf, size);
 }
 
 /**
- * @brief Plug in a display
+ * @brief Restore the displays of a VM from a blob, in one batch
  *
- * @param domid The domain ID
- * @param vgt_port
- * @param edid
- * @param edid_size
- * @param pgt_port
- * @return 0 on success
+ * Each port's writes are a chain, as for igvt_plug_displays. A port
+ * that is connected now is disconnected first, and connected again
+ * only if it was when the blob was saved.
+ *
+ * @param ctx The context
+ * @param domid The domain ID, which needn't be the one that was saved
+ * @param blob
+ * @param size
+ * @return 0 on success, -EINVAL if the blob is malformed, -ENOTSUP if
+ *         it is from a newer version, or the first failed write
  */
-int igvt_plug_display(unsigned int domid, gt_port vgt_port,
-		      unsigned char *edid, size_t edid_size,
-		      gt_port pgt_port)
+static int vm_restore_displays(igvt_ctx *ctx, unsigned int domid,
+                               const void *blob, size_t size)
 {
-    char filename[256];
-    FILE *fd;
-
-    if (!igvt_enabled_p(domid)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid domain %d\n",
-		    __func__, domid);
-	return -EINVAL;
-    }
-
-    if (!igvt_is_valid_port_p(vgt_port)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid vgt_port %s\n",
-		    __func__, vgt_port);
-
+    struct attr_write writes[GVT_MAX_PORTS * PLUG_WRITES];
+    unsigned char edids[GVT_MAX_PORTS][EDID_MAX_SIZE];
+    char overrides[GVT_MAX_PORTS][16];
+    const unsigned char *p = blob, *end = p + size, *r;
+    struct igvt_display d = { .domid = domid };
+    unsigned int i, n_records, blocks, first;
+    size_t n_writes = 0, j, edid_size;
+    uint64_t span = _trace_begin(ctx);
+    int seen = 0, status = 0;
+
+    if (!_enabled_p(ctx, domid)) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d\n",
+                    __func__, domid);
         return -EINVAL;
     }
 
-    if (!igvt_is_valid_port_p(pgt_port)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid pgt_port %s\n",
-		    __func__, pgt_port);
-
-        return -EINVAL;
-    }
+    if (size < DISPLAYS_HEADER_SIZE || memcmp(p, DISPLAYS_MAGIC, 4) != 0)
+        status = -EINVAL;
+    else if (p[4] > DISPLAYS_VERSION)
+        status = -ENOTSUP;
+
+    n_records = status == 0 ? p[5] : 0;
+    p += DISPLAYS_HEADER_SIZE;
+
+    /* Check the whole blob before writing anything */
+    for (r = p, i = 0; status == 0 && i < n_records; i++) {
+        if (end - r < DISPLAYS_RECORD_SIZE ||
+            !igvt_is_valid_port_p(r[0]) || (seen & (1 << r[0])) ||
+            (r[2] != DISPLAYS_NO_OVERRIDE && !igvt_is_valid_port_p(r[2])) ||
+            r[3] > EDID_MAX_SIZE / EDID_BLOCK_SIZE ||
+            end - r - DISPLAYS_RECORD_SIZE < r[3] * EDID_BLOCK_SIZE) {
+            status = -EINVAL;
+            break;
+        }
 
-    if (igvt_port_plugged_p(domid, vgt_port)) {
-        igvt_unplug_display(domid, vgt_port);
+        seen |= 1 << r[0];
+        r += DISPLAYS_RECORD_SIZE + r[3] * EDID_BLOCK_SIZE;
     }
 
-    snprintf(filename, sizeof(filename),
-	     VGT_VM_ATTRIBUTE_FORMAT, domid,
-	     port_strings[vgt_port], "port_override");
-
-    fd = fopen(filename, "w");
+    if (status == 0 && r != end)
+        status = -EINVAL;
 
-    if (!fd) {
-	igvt_printf(IGVT_ERROR, "%s::error opening %s: %s\n",
-		    __func__, filename, strerror(errno));
-
-        return -ENODEV;
+    if (status < 0) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::bad displays blob: %s\n",
+                    __func__, igvt_strerror(-status));
+        _trace_end(ctx, "prepare", span, domid, PORT_ILLEGAL, status);
+        return status;
     }
 
-    fprintf(fd, "%s\n", port_strings[pgt_port]);
-    fclose (fd);
-
-    _filter_edid(edid, edid_size, is_port_analog(vgt_port));
+    for (i = 0; i < n_records; i++) {
+        d.vgt_port = p[0];
+        blocks = p[3];
+        first = n_writes;
 
-    snprintf(filename, sizeof(filename),
-	     VGT_VM_ATTRIBUTE_FORMAT, domid,
-	     port_strings[vgt_port], "edid");
+        if (connected_p(ctx, domid, d.vgt_port))
+            plug_write(&writes[n_writes++], IGVT_ATTR_CONNECTION, &d,
+                       "disconnect\n", strlen("disconnect\n"));
 
-    fd = fopen(filename, "w");
+        if (p[2] != DISPLAYS_NO_OVERRIDE) {
+            snprintf(overrides[i], sizeof(overrides[i]), "%s\n",
+                     port_strings[p[2]]);
+            plug_write(&writes[n_writes++], IGVT_ATTR_PORT_OVERRIDE, &d,
+                       overrides[i], strlen(overrides[i]));
+        }
 
-    if (!fd) {
-	igvt_printf(IGVT_ERROR, "%s::error opening %s: %s\n",
-		    __func__, filename, strerror(errno));
+        /* Already filtered, but the kernel may take fewer blocks now */
+        if (blocks) {
+            edid_size = _prepare_edid(ctx, domid, d.vgt_port,
+                                      p + DISPLAYS_RECORD_SIZE,
+                                      blocks * EDID_BLOCK_SIZE, edids[i]);
+            plug_write(&writes[n_writes++], IGVT_ATTR_EDID, &d, edids[i],
+                       edid_size);
+        }
 
-        return -ENODEV;
-    }
+        if (p[1] & DISPLAYS_CONNECTED)
+            plug_write(&writes[n_writes++], IGVT_ATTR_CONNECTION, &d,
+                       "connect\n", strlen("connect\n"));
 
-    /* Writing more than 128 EDID bytes currently hangs the system */
-    if (edid_size > 128) {
-        edid_size = 128;
-    }
+        if (n_writes > first)
+            writes[n_writes - 1].link = 0;
 
-    if (fwrite(edid, 1, edid_size, fd) != edid_size) {
-        fprintf(stderr, "%s::failed to write EDID: %s\n",
-                __func__, strerror(errno));
+        p += DISPLAYS_RECORD_SIZE + blocks * EDID_BLOCK_SIZE;
     }
 
-    fclose (fd);
+    _trace_end(ctx, "prepare", span, domid, PORT_ILLEGAL, 0);
+    span = _trace_begin(ctx);
 
-    snprintf(filename, sizeof(filename),
-	     VGT_VM_ATTRIBUTE_FORMAT, domid, 
-	     port_strings[vgt_port], "connection");
+    _attr_write_batch(ctx, writes, n_writes);
 
-    fd = fopen(filename, "w");
+    _trace_end(ctx, "write_batch", span, domid, PORT_ILLEGAL, 0);
 
-    if (!fd) {
-	igvt_printf(IGVT_ERROR, "%s::error opening %s: %s\n",
-		    __func__, filename, strerror(errno));
+    for (j = 0; j < n_writes && status == 0; j++) {
+        if (writes[j].result < 0) {
+            status = writes[j].result;
 
-        return -ENODEV;
+            igvt_printf(ctx, IGVT_ERROR, "%s::failed to write %s of vm%u %s: "
+                        "%s\n", __func__, _attr_name(writes[j].attr), domid,
+                        port_strings[writes[j].port],
+                        igvt_strerror(-status));
+        }
     }
 
-    fprintf(fd, "%s\n", "connect");
-    fclose (fd);
+    return status;
+}
+
+int igvt_ctx_vm_restore_displays(igvt_ctx *ctx, unsigned int domid,
+                                 const void *blob, size_t size)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(vm_restore_displays__entry, domid, size);
+    result = vm_restore_displays(ctx, domid, blob, size);
+    IGVT_PROBE(vm_restore_displays__return, domid, result);
+    _recorder_record(ctx, IGVT_OP_VM_RESTORE_DISPLAYS, domid, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
 
-    return (0);
+int igvt_vm_restore_displays(unsigned int domid, const void *blob,
+                             size_t size)
+{
+    return igvt_ctx_vm_restore_displays(NULL, domid, blob, size);
 }
 
 /**
  * @brief Unplug a display from a virtual port
  *
+ * @param ctx The context
  * @param domid The domain ID of the port to unplug
  * @param vgt_port The virtual port to unplug
  * @return 0 on success
  */
-int igvt_unplug_display(unsigned int domid, gt_port vgt_port)
+static int unplug_display(igvt_ctx *ctx, unsigned int domid,
+                          gt_port vgt_port)
 {
-    char path[256];
-    FILE *f;
-
-    if (!igvt_enabled_p(domid)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid domain %d\n",
+    if (!_enabled_p(ctx, domid)) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d\n",
 		    __func__, domid);
 	return -EINVAL;
     }
 
     if (!igvt_is_valid_port_p(vgt_port)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid vgt_port %s\n",
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid vgt_port %d\n",
 		    __func__, vgt_port);
 
         return -EINVAL;
     }
 
-    snprintf(path, sizeof(path),
-	     VGT_VM_ATTRIBUTE_FORMAT, domid, 
-	     port_strings[vgt_port], "connection");
+    return _write_connection(ctx, domid, vgt_port, 0);
+}
+
+int igvt_ctx_unplug_display(igvt_ctx *ctx, unsigned int domid,
+                            gt_port vgt_port)
+{
+    uint64_t start;
+    struct journal_op jop;
+    int result;
 
-    f = fopen(path, "w");
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(unplug_display__entry, domid, vgt_port);
+    result = _journal_begin(ctx, &jop, IGVT_OP_UNPLUG_DISPLAY, domid,
+                            vgt_port, PORT_ILLEGAL, NULL, NULL, 0, 1);
 
-    if (!f) {
-	igvt_printf(IGVT_ERROR, "%s::error opening %s: %s\n",
-		    __func__, path, strerror(errno));
+    if (result == 0)
+        result = unplug_display(ctx, domid, vgt_port);
 
-        return -ENODEV;
-    }
+    _journal_end(ctx, &jop);
+    IGVT_PROBE(unplug_display__return, domid, vgt_port, result);
+    _recorder_record(ctx, IGVT_OP_UNPLUG_DISPLAY, domid, vgt_port,
+                     result, start);
 
-    fprintf(f, "%s\n", "disconnect");
-    fclose (f);
+    return result;
+}
 
-    return (0);
+int igvt_unplug_display(unsigned int domid, gt_port vgt_port)
+{
+    return igvt_ctx_unplug_display(NULL, domid, vgt_port);
 }
 
 /**
  * @brief Predicate that returns whether a port is plugged in or not
  *
+ * @param ctx The context
  * @param domid The domain ID
  * @param vgt_port
  * @return 1 if plugged in
  */
-int igvt_port_plugged_p(unsigned int domid, gt_port vgt_port)
+static int port_plugged_p(igvt_ctx *ctx, unsigned int domid,
+                          gt_port vgt_port)
 {
-    char path[256];
     char c[12];
-    FILE *f;
-    struct stat st;
-    int retval = 0;
 
-    if (!igvt_enabled_p(domid)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid domain %d\n",
+    if (!_enabled_p(ctx, domid)) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d\n",
 		    __func__, domid);
 	return 0;
     }
 
     if (!igvt_is_valid_port_p(vgt_port)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid vgt_port %s\n",
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid vgt_port %d\n",
 		    __func__, vgt_port);
 
         return (0);
     }
 
-    if (domid == 0) {
-        return (0);
-    }
-
-    snprintf(path, sizeof(path), VGT_KERNEL_PATH "/vm%d", domid);
-
-    if (stat(path, &st) != 0) {
-	igvt_printf(IGVT_ERROR, "%s::error opening %s: %s\n",
-		    __func__, path, strerror(errno));
-
-        return (0);
+    if (_read_attr_word(ctx, IGVT_ATTR_CONNECTION, domid, vgt_port,
+                        c, sizeof(c)) <= 0) {
+        return 0;
     }
 
-    snprintf(path, sizeof(path),
-	     VGT_VM_ATTRIBUTE_FORMAT, domid, 
-	     port_strings[vgt_port], "connection");
-
-    f = fopen(path, "r");
-
-    if (!f) {
-	igvt_printf(IGVT_ERROR, "%s::error opening %s: %s\n",
-		    __func__, path, strerror(errno));
+    return strcmp("connected", c) == 0;
+}
 
-        return 0;
-    }
+int igvt_ctx_port_plugged_p(igvt_ctx *ctx, unsigned int domid,
+                            gt_port vgt_port)
+{
+    int result;
 
-    if (fscanf(f, "%s", c) != 1) {
-        retval = 0;
-    } else if (strcmp("connected", c) != 0) {
-        retval = 0;
-    } else {
-        retval = 1;
-    }
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(port_plugged_p__entry, domid, vgt_port);
+    result = port_plugged_p(ctx, domid, vgt_port);
+    IGVT_PROBE(port_plugged_p__return, domid, vgt_port, result);
 
-    if (f)
-        fclose(f);
+    return result;
+}
 
-    return retval;
+int igvt_port_plugged_p(unsigned int domid, gt_port vgt_port)
+{
+    return igvt_ctx_port_plugged_p(NULL, domid, vgt_port);
 }
 
 /**
  * @brief Predicate that returns whether a port is present or not
  *
- * @param domid The domain ID
+ * @param ctx The context
  * @param vgt_port
  * @return 1 if present, else 0
  */
-int igvt_port_present_p(gt_port vgt_port)
+static int port_present_p(igvt_ctx *ctx, gt_port vgt_port)
 {
-    char path[256];
     char c[12];
-    FILE *f;
-    int retval = 0;
 
     if (!igvt_is_valid_port_p(vgt_port)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid vgt_port %s\n",
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid vgt_port %d\n",
 		    __func__, vgt_port);
 
         return (0);
     }
 
-    snprintf(path, sizeof(path),
-	     "%s/control/%s/presence",
-	     VGT_KERNEL_PATH,
-	     port_strings[vgt_port]);
-
-    f = fopen(path, "r");
-
-    if (!f) {
-	igvt_printf(IGVT_ERROR, "%s::error opening %s: %s\n",
-		    __func__, path, strerror(errno));
-
+    if (_read_attr_word(ctx, IGVT_ATTR_PRESENCE, 0, vgt_port,
+                        c, sizeof(c)) <= 0) {
         return 0;
     }
 
-    if (fscanf(f, "%s", c) != 1) {
-        retval = 0;
-    } else if (strcmp("present", c) != 0) {
-        retval = 0;
-    } else {
-        retval = 1;
-    }
+    return strcmp("present", c) == 0;
+}
 
-    if (f)
-        fclose(f);
+int igvt_ctx_port_present_p(igvt_ctx *ctx, gt_port vgt_port)
+{
+    int result;
 
-    return retval;
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(port_present_p__entry, vgt_port);
+    result = port_present_p(ctx, vgt_port);
+    IGVT_PROBE(port_present_p__return, vgt_port, result);
+
+    return result;
+}
+
+int igvt_port_present_p(gt_port vgt_port)
+{
+    return igvt_ctx_port_present_p(NULL, vgt_port);
 }
 
 
 /**
  * @brief Predicate that returns whether a port is hot-pluggable
  *
+ * @param ctx The context
  * @param vmid The ID of the vm
  * @param vgt_port
  * @return 1 if plugged in
  */
-int igvt_port_hotpluggable(unsigned int vmid, gt_port vgt_port)
+static int port_hotpluggable(igvt_ctx *ctx, unsigned int vmid,
+                             gt_port vgt_port)
 {
-
-    if (!igvt_enabled_p(vmid)) {
-	igvt_printf(IGVT_ERROR, "%s::Invalid domain %d\n",
+    if (!_enabled_p(ctx, vmid)) {
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid domain %d\n",
 		    __func__, vmid);
 	return 0;
     }
@@ -708,7 +1720,7 @@ int igvt_port_hotpluggable(unsigned int vmid, gt_port vgt_port)
 
     /* Not a legal port... */
     default:
-	igvt_printf(IGVT_ERROR, "%s::Invalid vgt_port %s\n",
+	igvt_printf(ctx, IGVT_ERROR, "%s::Invalid vgt_port %d\n",
 		    __func__, vgt_port);
 
         return 0;
@@ -717,47 +1729,154 @@ int igvt_port_hotpluggable(unsigned int vmid, gt_port vgt_port)
     return 0;
 }
 
-static int (*loggers[IGVT_NUM_LOGGERS])(const char *text);
+int igvt_ctx_port_hotpluggable(igvt_ctx *ctx, unsigned int vmid,
+                               gt_port vgt_port)
+{
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(port_hotpluggable__entry, vmid, vgt_port);
+    result = port_hotpluggable(ctx, vmid, vgt_port);
+    IGVT_PROBE(port_hotpluggable__return, vmid, vgt_port, result);
+
+    return result;
+}
+
+int igvt_port_hotpluggable(unsigned int vmid, gt_port vgt_port)
+{
+    return igvt_ctx_port_hotpluggable(NULL, vmid, vgt_port);
+}
 
 /**
  * @brief Set error/warning loggers
  *
+ * @param ctx The context
  * @param logger function to be called to log errors
  * @return previous logger function
  */
-int (*igvt_set_warning_logger(int (*new_logger)(const char *text)))(const char *)
+int (*igvt_ctx_set_warning_logger(igvt_ctx *ctx,
+                                  int (*new_logger)(const char *text)))(const char *)
 {
-    int (*old_logger)(const char *text) = loggers[IGVT_WARNING];
+    int (*old_logger)(const char *text);
 
-    loggers[IGVT_WARNING] = new_logger;
+    ctx = _igvt_ctx(ctx);
+    old_logger = __atomic_exchange_n(&ctx->loggers[IGVT_WARNING], new_logger,
+                                     __ATOMIC_ACQ_REL);
 
     return old_logger;
 }
 
-int (*igvt_set_error_logger(int (*new_logger)(const char *text)))(const char *)
+int (*igvt_ctx_set_error_logger(igvt_ctx *ctx,
+                                int (*new_logger)(const char *text)))(const char *)
 {
-    int (*old_logger)(const char *text) = loggers[IGVT_ERROR];
+    int (*old_logger)(const char *text);
 
-    loggers[IGVT_WARNING] = new_logger;
+    ctx = _igvt_ctx(ctx);
+    old_logger = __atomic_exchange_n(&ctx->loggers[IGVT_ERROR], new_logger,
+                                     __ATOMIC_ACQ_REL);
 
     return old_logger;
 }
 
-static int
-igvt_printf(igvt_log_type log_type, const char *format, ...)
+int (*igvt_set_warning_logger(int (*new_logger)(const char *text)))(const char *)
+{
+    return igvt_ctx_set_warning_logger(NULL, new_logger);
+}
+
+int (*igvt_set_error_logger(int (*new_logger)(const char *text)))(const char *)
+{
+    return igvt_ctx_set_error_logger(NULL, new_logger);
+}
+
+/**
+ * @brief Set the most verbose messages to log
+ *
+ * @param ctx The context
+ * @param level
+ * @return the previous level
+ */
+igvt_log_level igvt_ctx_set_log_level(igvt_ctx *ctx, igvt_log_level level)
+{
+    int old_level;
+
+    ctx = _igvt_ctx(ctx);
+    old_level = __atomic_exchange_n(&ctx->log_level, level, __ATOMIC_RELAXED);
+
+    if (old_level == IGVT_LOG_UNSET)
+        old_level = __atomic_load_n(&_igvt_ctx(NULL)->log_level,
+                                    __ATOMIC_RELAXED);
+
+    return old_level;
+}
+
+igvt_log_level igvt_set_log_level(igvt_log_level level)
+{
+    return igvt_ctx_set_log_level(NULL, level);
+}
+
+/**
+ * @brief strerror_r behind one interface, whichever variant libc has
+ */
+const char *_igvt_strerror(int err, char *buf, size_t size)
+{
+#ifdef STRERROR_R_CHAR_P
+    return strerror_r(err, buf, size);
+#else
+    if (strerror_r(err, buf, size) != 0)
+        snprintf(buf, size, "Unknown error %d", err);
+
+    return buf;
+#endif
+}
+
+/*
+ * Called through the igvt_printf macro, once the level check has passed.
+ *
+ * Contexts without a logger of their own use the default context's, so
+ * that setting a logger once covers everything.
+ *
+ * Safe to call from any thread. Loggers may be swapped concurrently; a
+ * message goes to whichever logger was installed when it was formatted.
+ */
+int
+_igvt_printf(igvt_ctx *ctx, igvt_log_type log_type, const char *format, ...)
 {
     va_list arg;
     int done = 0;
-    int (*logger)(const char *text) = loggers[log_type];
+    int slot = log_type == IGVT_ERROR ? IGVT_ERROR : IGVT_WARNING;
+    int (*logger)(const char *text);
+
+    ctx = _igvt_ctx(ctx);
+    logger = __atomic_load_n(&ctx->loggers[slot], __ATOMIC_ACQUIRE);
+
+    if (!logger)
+        logger = __atomic_load_n(&_igvt_ctx(NULL)->loggers[slot],
+                                 __ATOMIC_ACQUIRE);
 
     if (logger) {
-        char buffer[256];
+        char buffer[256], *text = buffer;
 
         va_start (arg, format);
         done = vsnprintf (buffer, sizeof(buffer), format, arg);
         va_end (arg);
 
-	logger(buffer);
+        /* Don't cut long messages (paths, mostly) short */
+        if (done >= (int) sizeof(buffer)) {
+            text = malloc(done + 1);
+
+            if (text) {
+                va_start (arg, format);
+                vsnprintf (text, done + 1, format, arg);
+                va_end (arg);
+            } else {
+                text = buffer;
+            }
+        }
+
+	logger(text);
+
+        if (text != buffer)
+            free(text);
     } else {
         va_start (arg, format);
         done = vfprintf(stdout, format, arg);
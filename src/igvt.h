@@ -12,6 +12,9 @@
 #ifndef __IGVT_H_
 #define __IGVT_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -24,6 +27,12 @@ extern "C" {
  * @brief C bindings for the Intel Graphics Virtualization Technology
  * (Intel GVT) sysfs API.
  *
+ * All functions may be called concurrently from any number of threads,
+ * on the same or different contexts, except igvt_ctx_free, which must
+ * not race with any other use of its context. Queries such as
+ * igvt_port_plugged_p and igvt_translate_pgt_port take no locks once
+ * the attributes they read are open. Loggers may be called from any
+ * thread and must be thread-safe themselves.
  */
 
 typedef enum {
@@ -36,6 +45,16 @@ typedef enum {
     PORT_ILLEGAL = GVT_MAX_PORTS
 } gt_port;
 
+/**
+ * @brief An opaque handle on one vgt instance and the GPU behind it.
+ *
+ * Every function has an igvt_ctx_ variant that takes a context as its
+ * first argument; passing NULL selects the default context, which uses
+ * /sys/kernel/vgt and /sys/class/drm. The functions without a context
+ * argument operate on the default context.
+ */
+typedef struct igvt_ctx igvt_ctx;
+
 /**
  * @brief Set's which domain is directly displayed.
  *
@@ -48,7 +67,7 @@ int igvt_set_foreground_vm(unsigned int domid);
  * @brief Translates a port name from the i915 DRM driver to a gt_port.
  *
  * @param i915_port_name is the name of the port in the same format as
- *        found in /sys/class/drm/i915
+ *        found in /sys/class/drm, on any card
  * @return gt_port enum, or MAX_PORTS on error
  */
 gt_port igvt_translate_i915_port(const char *i915_port_name);
@@ -58,10 +77,20 @@ gt_port igvt_translate_i915_port(const char *i915_port_name);
  *
  * @param pgt_port_num The ID of the physical GT port
  * @return The name of the port to the i915 driver in the same format
- *         as found in /sys/class/drm/i915
+ *         as found in /sys/class/drm, on the card vGT drives
  */
 const char *igvt_translate_pgt_port(gt_port pgt_port_num);
 
+/**
+ * @brief Re-read the DRM connectors used for port name translation
+ *
+ * The connectors are discovered on first use; this is only needed if
+ * GPUs or connectors appear after that.
+ *
+ * @return 0 on success
+ */
+int igvt_drm_rescan(void);
+
 /**
  * @brief Creates a virtual GT instance for a domain.
  *
@@ -101,13 +130,397 @@ int igvt_enabled_p(unsigned int vmid);
  *
  * @param domid The domain ID of the port to plug
  * @param vgt_port The ID of the virtual port
- * @param edid Pointer to the EDID data for the virtual display
- * @param edid_size Size of the EDID data (Multiples of 128; max 256)
+ * @param edid Pointer to the EDID data for the virtual display. It is
+ *        filtered on the way to the kernel; the caller's copy is untouched.
+ * @param edid_size Size of the EDID data (Multiples of 128; max 256).
+ *        Extension blocks are only written when the kernel advertises
+ *        room for them; otherwise the EDID is cut down to its base block.
  * @param pgt_port The ID of the physical port to map the virtual display to
  *        when display ownership is assigned to domid
- * @return 0 on success
+ * @return 0 on success, -ETIMEDOUT if the kernel stalled on an extended
+ *         EDID (later plugs fall back to 128 bytes)
+ */
+int igvt_plug_display(unsigned int domid, gt_port vgt_port, const unsigned char *edid, size_t edid_size, gt_port pgt_port);
+
+/**
+ * @brief A display to plug in with igvt_plug_displays
+ */
+struct igvt_display {
+    unsigned int domid;
+    gt_port vgt_port;
+    gt_port pgt_port;
+    const unsigned char *edid;  /**< as for igvt_plug_display */
+    size_t edid_size;
+    int result;                 /**< set to 0 or -errno */
+};
+
+/**
+ * @brief Plug in many displays at once
+ *
+ * Does what igvt_plug_display does for each display, but the writes of
+ * all of them go to the kernel together: through a single io_uring
+ * submission where the kernel supports it, one at a time otherwise.
+ * The writes to a port still happen in order, and stop at the first
+ * that fails, so unlike igvt_plug_display a port whose EDID can't be
+ * written is left disconnected.
+ *
+ * The submission pays off when an EDID has an extension block, which
+ * igvt_plug_display writes from a thread of its own (3-4 times faster
+ * in igvt-bench plug, at any batch size). A batch of 128-byte EDIDs is
+ * written one at a time, which is quicker for those.
+ *
+ * @param displays The displays; each one's result is filled in
+ * @param n The number of displays
+ * @return 0 if every display was plugged in, otherwise the result of
+ *         the first that wasn't, or -ENOMEM
+ */
+int igvt_plug_displays(struct igvt_display *displays, size_t n);
+
+/**
+ * @brief Plug in a VM's displays in the background, ahead of a switch
+ *
+ * The displays are copied, EDIDs included, and plugged in as by
+ * igvt_plug_displays on a thread of the library's, while the call
+ * returns. Set up the VM that is likely to be switched to next this way
+ * and igvt_switch_foreground_vm only has the foreground_vm write left
+ * to do. Staging a VM again replaces its previous staging, once that
+ * has finished.
+ *
+ * @param domid The domain ID
+ * @param displays The displays, all of them on domid; their results
+ *        aren't filled in, failures are logged
+ * @param n The number of displays
+ * @return 0 if the staging was started, -errno otherwise
+ */
+int igvt_stage_displays(unsigned int domid,
+                        const struct igvt_display *displays, size_t n);
+
+/**
+ * @brief Wait for a VM's staging to finish
+ *
+ * @param domid The domain ID
+ * @return 0 if every display was plugged in, the first failure, or
+ *         -ENOENT if the VM had nothing staged
+ */
+int igvt_stage_wait(unsigned int domid);
+
+/**
+ * @brief Put a VM in the foreground, after its staging
+ *
+ * Waits for the VM's staging, if it has one, and sets the foreground
+ * VM unless the staging failed. Without a staging this is
+ * igvt_set_foreground_vm.
+ *
+ * @param domid The domain ID
+ * @return 0 on success, the staging's failure, or -errno
+ */
+int igvt_switch_foreground_vm(unsigned int domid);
+
+/**
+ * @brief Move a physical monitor from one virtual port to another
+ *
+ * Replaces an unplug of one port and a plug of the other. The new port
+ * is set up while the old one still shows the monitor, with the EDID of
+ * the monitor (or, if DRM can't see it, the old port's), so that all
+ * that is left is to disconnect the old port and connect the new one
+ * straight after. If the new port won't connect the old one is
+ * reconnected.
+ *
+ * @param from_dom The domain ID of the port that has the monitor
+ * @param from_port The virtual port that has the monitor
+ * @param to_dom The domain ID of the port to give it to
+ * @param to_port The virtual port to give it to
+ * @param pgt_port The physical port of the monitor
+ * @param gap_ns If not NULL, set to the ns between the old port's
+ *        disconnect and the new port's connect; 0 if the old port
+ *        wasn't connected
+ * @return 0 on success, -ENODEV if there is no EDID to give the new
+ *         port, or -errno
+ */
+int igvt_handoff_display(unsigned int from_dom, gt_port from_port,
+                         unsigned int to_dom, gt_port to_port,
+                         gt_port pgt_port, uint64_t *gap_ns);
+
+/* The largest blob igvt_vm_save_displays makes */
+#define IGVT_DISPLAYS_BLOB_MAX (8 + GVT_MAX_PORTS * (4 + 256))
+
+/**
+ * @brief Save the display configuration of a VM
+ *
+ * The port_override, EDID (as filtered when it was plugged in) and
+ * connection state of each of the VM's ports go into a small versioned
+ * blob, which doesn't depend on the host's byte order, for
+ * igvt_vm_restore_displays.
+ *
+ * @param domid The domain ID
+ * @param buf Where to put the blob; IGVT_DISPLAYS_BLOB_MAX bytes is
+ *        always enough
+ * @param size The size of buf; set to the size of the blob
+ * @return 0 on success, -ENOSPC if buf is too small, or -errno
+ */
+int igvt_vm_save_displays(unsigned int domid, void *buf, size_t *size);
+
+/**
+ * @brief Restore the display configuration of a VM
+ *
+ * Writes everything in the blob as one batch, as igvt_plug_displays
+ * does, e.g. to set up a VM again after it reboots. The blob is checked
+ * in full before anything is written.
+ *
+ * @param domid The domain ID, which may differ from the one saved
+ * @param blob From igvt_vm_save_displays
+ * @param size The size of the blob
+ * @return 0 on success, -EINVAL if the blob is malformed, -ENOTSUP if
+ *         it is from a newer libigvt, or the first write that failed
+ */
+int igvt_vm_restore_displays(unsigned int domid, const void *blob,
+                             size_t size);
+
+/**
+ * @brief Journal the calls that change a VM's displays or instance
+ *
+ * Plugging and unplugging displays (singly, in batches, by EDID id or
+ * staged), and creating and destroying instances, record their intent
+ * in the journal, synced, before they write anything. Opening a journal
+ * left by a process that died part way through a call replays it: plugs,
+ * unplugs and destroys are redone, creations are rolled back. Open the
+ * journal before making any of these calls.
+ *
+ * @param path The journal, created if need be, or NULL to stop
+ *        journaling
+ * @return the number of calls recovered, -EBUSY if another process has
+ *         the journal open, or -errno
+ */
+int igvt_journal_open(const char *path);
+
+/**
+ * @brief One of a VM's virtual ports, as discovery found it
+ */
+struct igvt_port_state {
+    int connected;
+    gt_port pgt_port;           /**< from port_override, PORT_ILLEGAL if
+                                     there is none */
+};
+
+/**
+ * @brief A VM, as discovery found it
+ */
+struct igvt_vm_state {
+    unsigned int domid;
+    int result;                 /**< 0, or -errno if a port couldn't be
+                                     read, as when the VM went away */
+    struct igvt_port_state ports[GVT_MAX_PORTS];  /**< indexed by vgt port;
+                                                       invalid ports are
+                                                       disconnected */
+};
+
+/**
+ * @brief The host and every VM on it, as discovery found them
+ */
+struct igvt_host_state {
+    unsigned int foreground_vm;
+    unsigned int present;       /**< bit n set if port n is present */
+    size_t n_vms;
+    struct igvt_vm_state *vms;  /**< sorted by domid */
+    unsigned int threads;       /**< that discovery read with */
+    uint64_t ready_ns;          /**< how long discovery took */
+};
+
+/**
+ * @brief Learn the state of every VM at once, at startup
+ *
+ * Lists the VMs and reads every port's connection and port_override,
+ * and the ports' presence and the foreground VM, spreading the VMs
+ * over a pool of threads. On a host with many VMs this is far quicker
+ * than asking about each port in turn. The attributes read are left
+ * open in the context, for the calls that follow.
+ *
+ * @param threads How many threads to read with, the caller's included;
+ *        0 for one per CPU, 1 to read on the caller's thread alone
+ * @param state Set to the state, which includes the time to ready, for
+ *        igvt_host_state_free
+ * @return 0 on success, -EOPNOTSUPP if the backend can't list its VMs,
+ *         or -errno
+ */
+int igvt_discover(unsigned int threads, struct igvt_host_state **state);
+
+void igvt_host_state_free(struct igvt_host_state *state);
+
+/**
+ * @brief Called from igvt_async_dispatch when an async call completes
+ *
+ * @param result What the blocking call returned
+ * @param arg As passed with the call
+ */
+typedef void (*igvt_async_cb)(int result, void *arg);
+
+/**
+ * @brief igvt_create_instance, completing through igvt_async_fd
+ *
+ * The async calls are made by a small pool of library threads, started
+ * on first use, and complete by making igvt_async_fd readable; the
+ * callbacks are only ever run by igvt_async_dispatch, on the caller's
+ * thread. Calls start in the order they are submitted but may finish in
+ * any order, so submit a call that depends on another from the other's
+ * callback. Calls still running when the context is freed are finished
+ * first; callbacks not yet dispatched by then are dropped.
+ *
+ * @return 0 if the call was submitted, -EINVAL if cb is NULL, or -errno
+ */
+int igvt_async_create_instance(unsigned int domid, unsigned int aperture_size,
+                               unsigned int gm_size, unsigned int fence_count,
+                               igvt_async_cb cb, void *arg);
+
+/**
+ * @brief igvt_plug_display, completing through igvt_async_fd
+ *
+ * The EDID is copied; the caller's needn't outlive the call.
+ *
+ * @return 0 if the call was submitted, -EINVAL if cb is NULL, or -errno
+ */
+int igvt_async_plug_display(unsigned int domid, gt_port vgt_port,
+                            const unsigned char *edid, size_t edid_size,
+                            gt_port pgt_port, igvt_async_cb cb, void *arg);
+
+/**
+ * @brief igvt_set_foreground_vm, completing through igvt_async_fd
+ *
+ * @return 0 if the call was submitted, -EINVAL if cb is NULL, or -errno
+ */
+int igvt_async_set_foreground_vm(unsigned int domid, igvt_async_cb cb,
+                                 void *arg);
+
+/**
+ * @brief An eventfd that polls readable while async calls wait for
+ * igvt_async_dispatch
+ *
+ * @return the descriptor, which belongs to the library, or -errno
+ */
+int igvt_async_fd(void);
+
+/**
+ * @brief Run the callbacks of the async calls that have completed
+ *
+ * Callbacks may submit further calls, and may dispatch again.
+ *
+ * @return the number of callbacks run
+ */
+int igvt_async_dispatch(void);
+
+/**
+ * @brief Synthesize the EDID of a virtual monitor
+ *
+ * Describes a monitor with a single CVT reduced blanking mode. The EDID
+ * has already been filtered the way igvt_plug_display filters EDIDs, so
+ * the pixel clock is capped at 160MHz and DPMS is not advertised.
+ *
+ * EDIDs are cached, and the common desktop modes at 60Hz are built on
+ * the first call, so asking for a mode again costs a lookup. The cache
+ * holds a bounded number of other modes; past that, an EDID is built
+ * afresh in a buffer of the calling thread's.
+ *
+ * @param width Horizontal resolution in pixels (rounded down to a multiple of 8)
+ * @param height Vertical resolution in lines
+ * @param refresh Refresh rate in Hz, at most 255, or 0 for 60Hz
+ * @param analog Non-zero for a display on the analog (VGA) port
+ * @return Pointer to a 128 byte EDID owned by the library, valid for the
+ *         life of the process if it was cached and otherwise until the
+ *         thread's next call, or NULL if the mode can't be described
+ */
+const unsigned char *igvt_edid_synthesize(unsigned int width, unsigned int height, unsigned int refresh, int analog);
+
+/**
+ * @brief The forms of an EDID kept in an EDID store
+ */
+typedef enum {
+    IGVT_EDID_RAW = 0,          /**< as it was added */
+    IGVT_EDID_FILTERED,         /**< as igvt_plug_display filters it for a
+                                     digital port */
+    IGVT_EDID_FILTERED_ANALOG,  /**< and for the analog (VGA) port */
+    IGVT_EDID_VARIANTS
+} igvt_edid_variant;
+
+/**
+ * @brief Open a file of EDIDs shared with other processes
+ *
+ * The store is mapped, so opening it costs nothing however many EDIDs
+ * it holds, and every process that opens the same file sees the EDIDs
+ * any of them adds. EDIDs are added once, filtered as they are added,
+ * and never removed; looking one up takes no lock. The file is created
+ * if it doesn't exist.
+ *
+ * @param path The store, or NULL to close the one that is open
+ * @param max_edids How many EDIDs the store holds, if it is created;
+ *        0 for 1024
+ * @return 0 on success, -EINVAL if the file isn't an EDID store, or
+ *         -errno
+ */
+int igvt_edid_store_open(const char *path, size_t max_edids);
+
+/**
+ * @brief Add an EDID to the EDID store
+ *
+ * @param edid
+ * @param edid_size Whole blocks, at most two of them are kept
+ * @param id Set to the EDID's id, a hash of its contents, which is the
+ *        same in every process
+ * @return 0 on success, including if the EDID was already there,
+ *         -ENOENT if no store is open, -ENOSPC if the store is full
+ */
+int igvt_edid_store_add(const unsigned char *edid, size_t edid_size,
+                        uint64_t *id);
+
+/**
+ * @brief Copy an EDID out of the EDID store
+ *
+ * The EDID is copied because the store may be closed, and unmapped,
+ * as soon as the lookup returns.
+ *
+ * @param id From igvt_edid_store_add
+ * @param variant The form of the EDID wanted
+ * @param edid Buffer to copy the EDID to
+ * @param edid_size Size of the buffer; 256 bytes always suffices
+ * @return the size of the EDID, which may be more than was copied,
+ *         -ENOENT if it isn't in the store, or -EINVAL
+ */
+int igvt_edid_store_get(uint64_t id, igvt_edid_variant variant,
+                        unsigned char *edid, size_t edid_size);
+
+/**
+ * @brief Plug in a display, with an EDID from the EDID store
+ *
+ * As igvt_plug_display, but the EDID was filtered when it was added to
+ * the store, and is written from there without being copied.
+ *
+ * @param domid The domain ID
+ * @param vgt_port The virtual port to plug the display into
+ * @param edid_id From igvt_edid_store_add
+ * @param pgt_port The physical port to map to
+ * @return 0 on success, -ENOENT if the EDID isn't in the store
+ */
+int igvt_plug_display_id(unsigned int domid, gt_port vgt_port,
+                         uint64_t edid_id, gt_port pgt_port);
+
+/**
+ * @brief Plug in a display, with an EDID that is filtered already
+ *
+ * As igvt_plug_display, but the EDID is written as it is, for EDIDs
+ * that went through the same filtering beforehand: those from
+ * igvt_edid_synthesize, or canned EDIDs filtered at compile time with
+ * igvt::filter_edid from igvt.hpp.
+ *
+ * @param domid The domain ID
+ * @param vgt_port The virtual port to plug the display into
+ * @param edid Filtered for an analog port if vgt_port is PORT_VGA, and
+ *        for a digital port otherwise
+ * @param edid_size Size of the EDID data (Multiples of 128; max 256)
+ * @param pgt_port The physical port to map to
+ * @return 0 on success, -EINVAL if the EDID is filtered for the other
+ *         kind of port
  */
-int igvt_plug_display(unsigned int domid, gt_port vgt_port, unsigned char *edid, size_t edid_size, gt_port pgt_port);
+int igvt_plug_display_filtered(unsigned int domid, gt_port vgt_port,
+                               const unsigned char *edid, size_t edid_size,
+                               gt_port pgt_port);
 
 /**
  * @brief Unplug a display from a virtual port
@@ -144,15 +557,548 @@ int igvt_port_present_p(gt_port vgt_port);
  */
 int igvt_port_hotpluggable(unsigned int vmid, gt_port vgt_port);
 
+/**
+ * @brief Mirror the monitor on a physical port into a virtual port
+ *
+ * The virtual port is mapped to the physical port and given the EDID of
+ * whatever is plugged into it. From then on the library follows the
+ * physical port: when the monitor changes, igvt_mirror_refresh or
+ * igvt_mirror_dispatch pushes the new EDID to every VM mirroring the
+ * port in one pass.
+ *
+ * @param domid The domain ID of the virtual port
+ * @param vgt_port The ID of the virtual port
+ * @param pgt_port The ID of the physical port to mirror
+ * @return 0 on success
+ */
+int igvt_mirror_add(unsigned int domid, gt_port vgt_port, gt_port pgt_port);
+
+/**
+ * @brief Stop mirroring a physical port into a virtual port
+ *
+ * The virtual port is left as it is.
+ *
+ * @param domid The domain ID of the virtual port
+ * @param vgt_port The ID of the virtual port
+ * @return 0 on success, -ENOENT if the port wasn't a mirror
+ */
+int igvt_mirror_remove(unsigned int domid, gt_port vgt_port);
+
+/**
+ * @brief Re-read the physical monitors and update the mirrors
+ *
+ * @return the number of virtual ports that were updated
+ */
+int igvt_mirror_refresh(void);
+
+/**
+ * @brief File descriptor for DRM hotplug notifications
+ *
+ * Poll it for input and call igvt_mirror_dispatch when it is readable.
+ *
+ * @return the file descriptor, or -errno
+ */
+int igvt_mirror_fd(void);
+
+/**
+ * @brief Handle pending DRM hotplug notifications
+ *
+ * @return the number of virtual ports that were updated, or -errno
+ */
+int igvt_mirror_dispatch(void);
+
+/**
+ * @brief Debounce hotplugs on mirrored ports
+ *
+ * A mirror whose physical port changes is only updated once the port
+ * has stayed unchanged for the settle window, and then straight to its
+ * final state: a monitor that flaps connected/disconnected within the
+ * window costs the guest nothing, or a single replug. Changes that are
+ * still settling are pushed by igvt_mirror_dispatch, so keep calling it
+ * when igvt_mirror_timeout expires as well as when the fd is readable.
+ *
+ * @param settle_ms The settle window; 0, the default, pushes changes
+ *        as soon as they are seen
+ * @return the previous settle window
+ */
+unsigned int igvt_mirror_set_settle(unsigned int settle_ms);
+
+/**
+ * @brief How long until a debounced mirror settles
+ *
+ * @return the time in ms to wait before calling igvt_mirror_dispatch,
+ *         or -1 if no mirror is settling; suitable as a poll timeout
+ */
+int igvt_mirror_timeout(void);
+
+/**
+ * @brief Hotplug counters for mirrors
+ *
+ * Every change is eventually either pushed or suppressed, so changes
+ * minus the other two is the number still settling.
+ */
+struct igvt_hotplug_stats {
+    uint64_t changes;     /**< physical port changes seen by mirrors */
+    uint64_t suppressed;  /**< changes a later one overtook or undid */
+    uint64_t pushed;      /**< settled states written to virtual ports */
+};
+
+/**
+ * @brief Read the hotplug counters of one mirror
+ *
+ * The counters start from zero when the mirror is first added.
+ *
+ * @param domid The domain ID of the virtual port
+ * @param vgt_port The ID of the virtual port
+ * @param stats Filled in with the counters
+ * @return 0 on success, -ENOENT if the port isn't a mirror
+ */
+int igvt_mirror_get_stats(unsigned int domid, gt_port vgt_port,
+                          struct igvt_hotplug_stats *stats);
+
+/**
+ * @brief Get the EDID of the monitor on a physical port
+ *
+ * @param pgt_port The ID of the physical port
+ * @param edid Buffer for the EDID
+ * @param edid_size Size of the buffer
+ * @return the size of the EDID (more than edid_size if it was cut
+ *         short), 0 if there is no monitor on the port
+ */
+size_t igvt_physical_edid(gt_port pgt_port, unsigned char *edid, size_t edid_size);
+
 /**
  * @brief Set error/warning loggers
  *
+ * Debug messages go to the warning logger.
+ *
  * @param logger function to be called to log errors
  * @return previous logger function
  */
 int (*igvt_set_warning_logger(int (*logger)(const char *text)))(const char *);
 int (*igvt_set_error_logger  (int (*logger)(const char *text)))(const char *);
 
+typedef enum {
+    IGVT_LOG_NONE = -1,
+    IGVT_LOG_ERROR = 0,
+    IGVT_LOG_WARNING = 1,
+    IGVT_LOG_DEBUG = 2,
+} igvt_log_level;
+
+/**
+ * @brief Set the most verbose messages to log
+ *
+ * Messages above the level are dropped before they are formatted. The
+ * default is IGVT_LOG_WARNING. Contexts that haven't been given a level
+ * follow the default context's. Messages above the level the library
+ * was configured with (--with-max-log-level) are never logged.
+ *
+ * @param level
+ * @return the previous level
+ */
+igvt_log_level igvt_set_log_level(igvt_log_level level);
+
+
+/**
+ * @brief The API calls kept in the flight recorder
+ *
+ * The translate and port predicate calls are no longer recorded; they
+ * keep their values so that the other calls keep theirs.
+ */
+typedef enum {
+    IGVT_OP_AVAILABLE_P = 1,
+    IGVT_OP_ENABLED_P,
+    IGVT_OP_SET_FOREGROUND_VM,
+    IGVT_OP_TRANSLATE_I915_PORT,
+    IGVT_OP_TRANSLATE_PGT_PORT,
+    IGVT_OP_CREATE_INSTANCE,
+    IGVT_OP_DESTROY_INSTANCE,
+    IGVT_OP_PLUG_DISPLAY,
+    IGVT_OP_UNPLUG_DISPLAY,
+    IGVT_OP_PORT_PLUGGED_P,
+    IGVT_OP_PORT_PRESENT_P,
+    IGVT_OP_PORT_HOTPLUGGABLE,
+    IGVT_OP_PLUG_DISPLAYS,
+    IGVT_OP_STAGE_DISPLAYS,
+    IGVT_OP_SWITCH_FOREGROUND_VM,
+    IGVT_OP_HANDOFF_DISPLAY,
+    IGVT_OP_VM_SAVE_DISPLAYS,
+    IGVT_OP_VM_RESTORE_DISPLAYS,
+    IGVT_OP_PLUG_DISPLAY_ID,
+    IGVT_OP_DISCOVER,
+    IGVT_OP_PLUG_DISPLAY_FILTERED,
+    IGVT_NUM_OPS
+} igvt_op;
+
+/**
+ * @brief One API call in the flight recorder
+ */
+struct igvt_event {
+    uint64_t seq;         /**< 1 + position in the ring, 0 while being written */
+    uint64_t timestamp;   /**< CLOCK_MONOTONIC ns when the call started */
+    uint32_t latency;     /**< ns the call took */
+    int32_t result;       /**< return value: 0 or -errno, a port, or a boolean */
+    uint32_t domid;
+    uint16_t op;          /**< igvt_op */
+    uint8_t port;         /**< gt_port, PORT_ILLEGAL if the call has none */
+    uint8_t stripe;       /**< whose ring it is in; seq counts per stripe */
+};
+
+#define IGVT_RECORDER_MAGIC 0x52564749 /* "IGVR" */
+#define IGVT_RECORDER_VERSION 2
+
+/**
+ * @brief The start of a flight recorder in shared memory
+ *
+ * Threads are spread over n_stripes stripes, and each stripe records
+ * into a ring of its own. The header is followed by n_stripes struct
+ * igvt_recorder_stripe, then by the rings, each of n_events struct
+ * igvt_event. Event seq of stripe s is in slot (seq - 1) % n_events of
+ * ring s; a reader copies a slot and keeps the copy if its seq was the
+ * expected value both before and after. Merging the rings by timestamp
+ * gives the calls in the order they were made.
+ */
+struct igvt_recorder_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_size;
+    uint32_t n_events;    /**< per stripe */
+    uint32_t n_stripes;
+    uint8_t reserved[44];
+};
+
+/**
+ * @brief The state of one stripe's ring, on a cache line of its own
+ */
+struct igvt_recorder_stripe {
+    uint64_t head;        /**< the number of events the stripe recorded */
+    uint8_t reserved[56];
+};
+
+/**
+ * @brief Replace the flight recorder
+ *
+ * Every context records the last 4096 API calls of each thread stripe
+ * by default. This resizes the rings, stops recording (n_events 0), or
+ * moves them into a POSIX shared memory object so a separate process
+ * can read them live. While nothing is recording, calls aren't timed
+ * either, and the stats count calls without latencies.
+ *
+ * Port name translation and the port predicates are never recorded:
+ * they change nothing, and are on every query's hot path.
+ *
+ * @param n_events Capacity of each stripe's ring, rounded up to a power
+ *        of two
+ * @param shm_name Shared memory object name, or NULL for private memory
+ * @return 0 on success, -errno on failure
+ */
+int igvt_recorder_open(size_t n_events, const char *shm_name);
+
+/**
+ * @brief Copy the most recent API calls out of the flight recorder
+ *
+ * @param events Buffer for the events, oldest first
+ * @param max_events Size of the buffer
+ * @return the number of events copied
+ */
+size_t igvt_recorder_dump(struct igvt_event *events, size_t max_events);
+
+/**
+ * @brief Name an igvt_op
+ */
+const char *igvt_op_name(igvt_op op);
+
+#define IGVT_LATENCY_BUCKETS 128
+#define IGVT_STATS_ERRNOS 256
+
+/**
+ * @brief Counters for one API call
+ */
+struct igvt_op_stats {
+    uint64_t calls;
+    uint64_t errors;          /**< calls that returned -errno */
+    uint64_t timed;           /**< calls made while the flight recorder or a
+                                   trace was running; only these are in
+                                   latency_sum and latency */
+    uint64_t latency_sum;     /**< ns */
+    uint64_t latency[IGVT_LATENCY_BUCKETS]; /**< see igvt_latency_bucket_max */
+};
+
+/**
+ * @brief Counters for a context, since it was created
+ */
+struct igvt_stats {
+    struct igvt_op_stats ops[IGVT_NUM_OPS];  /**< indexed by igvt_op */
+    uint64_t errors[IGVT_STATS_ERRNOS];     /**< failures by errno; the last
+                                                 counts any larger errno */
+    uint64_t bytes_written;                  /**< to vgt attributes */
+    struct igvt_hotplug_stats hotplug;       /**< summed over all mirrors,
+                                                 removed ones included */
+};
+
+/**
+ * @brief Read the call counts, errors and latency histograms
+ *
+ * Counting is always on and costs a few uncontended atomic adds per
+ * call.
+ *
+ * @param stats Filled in with the totals
+ * @return 0
+ */
+int igvt_get_stats(struct igvt_stats *stats);
+
+/**
+ * @brief The largest latency, in ns, counted in a histogram bucket
+ *
+ * Buckets are log-linear, four per power of two.
+ */
+uint64_t igvt_latency_bucket_max(unsigned int bucket);
+
+/**
+ * @brief Write the stats in the Prometheus text exposition format
+ *
+ * @param fd Where to write them
+ * @return 0 on success, -errno on failure
+ */
+int igvt_stats_write_prometheus(int fd);
+
+/**
+ * @brief Save the stats to a file for the node exporter textfile collector
+ *
+ * The file is replaced atomically.
+ *
+ * @param path
+ * @return 0 on success, -errno on failure
+ */
+int igvt_stats_save_prometheus(const char *path);
+
+/**
+ * @brief Start writing a timeline of API calls as a Chrome trace
+ *
+ * Each call is an event, with its phases (validation, unplug,
+ * port_override, EDID filtering and writing, connect) nested inside
+ * it. Load the file in chrome://tracing or ui.perfetto.dev. Any trace
+ * already running is finished first.
+ *
+ * @param path The JSON file to write
+ * @return 0 on success, -errno on failure
+ */
+int igvt_trace_start(const char *path);
+
+/**
+ * @brief Finish the Chrome trace and close its file
+ *
+ * @return 0 on success, -ENOENT if no trace was running, or -errno
+ */
+int igvt_trace_stop(void);
+
+/**
+ * @brief Where a context's vgt attributes live
+ */
+typedef enum {
+    IGVT_BACKEND_SYSFS = 0,   /**< the vgt root, normally sysfs (default) */
+    IGVT_BACKEND_SIMULATOR,   /**< an in-memory vgt, with no VMs to start */
+    IGVT_BACKEND_NULL,        /**< nothing: writes succeed, reads are empty */
+} igvt_backend;
+
+/**
+ * @brief Choose the I/O backend
+ *
+ * The simulator behaves like the vgt driver without needing one, for
+ * testing and benchmarking; the null backend measures the library's
+ * own overhead. Switch before other threads use the library.
+ *
+ * @param backend
+ * @return 0 on success, -errno on failure
+ */
+int igvt_set_backend(igvt_backend backend);
+
+/**
+ * @brief Get a descriptor to poll for changes to a port's connection
+ *
+ * The descriptor polls POLLPRI on sysfs, where the driver notifies, and
+ * POLLIN on the simulator. The caller closes it.
+ *
+ * @param domid The domain ID
+ * @param vgt_port
+ * @return the descriptor, or -errno
+ */
+int igvt_connection_watch_fd(unsigned int domid, gt_port vgt_port);
+
+#define IGVT_IOTRACE_MAGIC 0x4f494749   /* "IGIO" */
+#define IGVT_IOTRACE_VERSION 1
+
+/* The most data a single record carries */
+#define IGVT_IOTRACE_MAX_DATA 4096
+
+/**
+ * @brief The start of an I/O trace file
+ *
+ * Records follow it until the end of the file, each one a struct
+ * igvt_iotrace_record and then its size bytes of data. Everything is in
+ * host byte order.
+ */
+struct igvt_iotrace_header {
+    uint32_t magic;           /**< IGVT_IOTRACE_MAGIC */
+    uint32_t version;         /**< IGVT_IOTRACE_VERSION */
+    uint32_t record_size;     /**< sizeof(struct igvt_iotrace_record) */
+    uint32_t reserved;
+    uint64_t start;           /**< CLOCK_MONOTONIC ns */
+};
+
+typedef enum {
+    IGVT_IOTRACE_READ = 0,
+    IGVT_IOTRACE_WRITE,
+} igvt_iotrace_op;
+
+/**
+ * @brief One vgt attribute read or write
+ */
+struct igvt_iotrace_record {
+    uint64_t timestamp;       /**< ns from the start of the trace to the
+                                   start of the call. Records are written
+                                   as calls complete, so concurrent calls
+                                   need not be in timestamp order */
+    uint32_t latency;         /**< ns */
+    int32_t result;           /**< bytes transferred, or -errno */
+    uint32_t domid;
+    uint32_t size;            /**< bytes of data following the record: what
+                                   was written, or what a read returned */
+    uint8_t op;               /**< igvt_iotrace_op */
+    uint8_t attr;             /**< see igvt_iotrace_attr_name */
+    uint8_t port;             /**< gt_port */
+    uint8_t reserved[5];
+};
+
+/**
+ * @brief Start recording every vgt attribute read and write
+ *
+ * Any recording already running is finished first.
+ *
+ * @param path The trace file to write
+ * @return 0 on success, -errno on failure
+ */
+int igvt_iotrace_start(const char *path);
+
+/**
+ * @brief Finish recording attribute I/O and close the trace file
+ *
+ * @return 0 on success, -ENOENT if nothing was being recorded, or -errno
+ */
+int igvt_iotrace_stop(void);
+
+/**
+ * @brief Name the attribute of an I/O trace record
+ *
+ * @return the attribute's file name, e.g. "connection", or "unknown"
+ */
+const char *igvt_iotrace_attr_name(unsigned int attr);
+
+/**
+ * @brief What happened when a trace was replayed
+ */
+struct igvt_iotrace_replay_result {
+    uint64_t ops;
+    uint64_t mismatches;           /**< results or data that differed from
+                                        the recording */
+    uint64_t elapsed;              /**< ns */
+    uint64_t latency_sum;          /**< ns */
+    uint64_t recorded_elapsed;     /**< ns */
+    uint64_t recorded_latency_sum; /**< ns */
+};
+
+/**
+ * @brief Replay an I/O trace on a simulated vgt
+ *
+ * The default context must use the simulator, or a vgt root made of
+ * plain files rather than sysfs.
+ *
+ * Calls are replayed one at a time in the order they started, so the
+ * replay reproduces their sequence, results and data but not any
+ * overlap between threads in the recording.
+ *
+ * @param path The trace file
+ * @param speed How much faster than recorded to replay, or 0 for as
+ *        fast as possible
+ * @param result Filled in with what happened, if not NULL
+ * @return 0 on success, -errno on failure
+ */
+int igvt_iotrace_replay(const char *path, double speed,
+                        struct igvt_iotrace_replay_result *result);
+
+/**
+ * @brief Create a context
+ *
+ * @param vgt_root The vgt sysfs directory, or NULL for /sys/kernel/vgt
+ * @param drm_root The DRM class directory, or NULL for /sys/class/drm
+ * @return the new context, or NULL with errno set
+ */
+igvt_ctx *igvt_ctx_new(const char *vgt_root, const char *drm_root);
+
+/**
+ * @brief Free a context
+ *
+ * @param ctx The context, which must not be in use by any other thread
+ */
+void igvt_ctx_free(igvt_ctx *ctx);
+
+int igvt_ctx_set_foreground_vm(igvt_ctx *ctx, unsigned int domid);
+gt_port igvt_ctx_translate_i915_port(igvt_ctx *ctx, const char *i915_port_name);
+const char *igvt_ctx_translate_pgt_port(igvt_ctx *ctx, gt_port pgt_port_num);
+int igvt_ctx_drm_rescan(igvt_ctx *ctx);
+int igvt_ctx_create_instance(igvt_ctx *ctx, unsigned int domid, unsigned int aperture_size, unsigned int gm_size, unsigned int fence_count);
+int igvt_ctx_destroy_instance(igvt_ctx *ctx, unsigned int domid);
+int igvt_ctx_available_p(igvt_ctx *ctx);
+int igvt_ctx_enabled_p(igvt_ctx *ctx, unsigned int vmid);
+int igvt_ctx_plug_display(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port, const unsigned char *edid, size_t edid_size, gt_port pgt_port);
+int igvt_ctx_plug_displays(igvt_ctx *ctx, struct igvt_display *displays, size_t n);
+int igvt_ctx_edid_store_open(igvt_ctx *ctx, const char *path, size_t max_edids);
+int igvt_ctx_edid_store_add(igvt_ctx *ctx, const unsigned char *edid, size_t edid_size, uint64_t *id);
+int igvt_ctx_edid_store_get(igvt_ctx *ctx, uint64_t id, igvt_edid_variant variant, unsigned char *edid, size_t edid_size);
+int igvt_ctx_plug_display_id(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port, uint64_t edid_id, gt_port pgt_port);
+int igvt_ctx_plug_display_filtered(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port, const unsigned char *edid, size_t edid_size, gt_port pgt_port);
+int igvt_ctx_stage_displays(igvt_ctx *ctx, unsigned int domid, const struct igvt_display *displays, size_t n);
+int igvt_ctx_stage_wait(igvt_ctx *ctx, unsigned int domid);
+int igvt_ctx_switch_foreground_vm(igvt_ctx *ctx, unsigned int domid);
+int igvt_ctx_handoff_display(igvt_ctx *ctx, unsigned int from_dom, gt_port from_port, unsigned int to_dom, gt_port to_port, gt_port pgt_port, uint64_t *gap_ns);
+int igvt_ctx_vm_save_displays(igvt_ctx *ctx, unsigned int domid, void *buf, size_t *size);
+int igvt_ctx_vm_restore_displays(igvt_ctx *ctx, unsigned int domid, const void *blob, size_t size);
+int igvt_ctx_journal_open(igvt_ctx *ctx, const char *path);
+int igvt_ctx_discover(igvt_ctx *ctx, unsigned int threads, struct igvt_host_state **state);
+int igvt_ctx_async_create_instance(igvt_ctx *ctx, unsigned int domid, unsigned int aperture_size, unsigned int gm_size, unsigned int fence_count, igvt_async_cb cb, void *arg);
+int igvt_ctx_async_plug_display(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port, const unsigned char *edid, size_t edid_size, gt_port pgt_port, igvt_async_cb cb, void *arg);
+int igvt_ctx_async_set_foreground_vm(igvt_ctx *ctx, unsigned int domid, igvt_async_cb cb, void *arg);
+int igvt_ctx_async_fd(igvt_ctx *ctx);
+int igvt_ctx_async_dispatch(igvt_ctx *ctx);
+int igvt_ctx_unplug_display(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port);
+int igvt_ctx_port_plugged_p(igvt_ctx *ctx, unsigned int vmid, gt_port vgt_port);
+int igvt_ctx_port_present_p(igvt_ctx *ctx, gt_port vgt_port);
+int igvt_ctx_port_hotpluggable(igvt_ctx *ctx, unsigned int vmid, gt_port vgt_port);
+int igvt_ctx_mirror_add(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port, gt_port pgt_port);
+int igvt_ctx_mirror_remove(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port);
+int igvt_ctx_mirror_refresh(igvt_ctx *ctx);
+int igvt_ctx_mirror_fd(igvt_ctx *ctx);
+int igvt_ctx_mirror_dispatch(igvt_ctx *ctx);
+unsigned int igvt_ctx_mirror_set_settle(igvt_ctx *ctx, unsigned int settle_ms);
+int igvt_ctx_mirror_timeout(igvt_ctx *ctx);
+int igvt_ctx_mirror_get_stats(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port, struct igvt_hotplug_stats *stats);
+size_t igvt_ctx_physical_edid(igvt_ctx *ctx, gt_port pgt_port, unsigned char *edid, size_t edid_size);
+int (*igvt_ctx_set_warning_logger(igvt_ctx *ctx, int (*logger)(const char *text)))(const char *);
+int (*igvt_ctx_set_error_logger  (igvt_ctx *ctx, int (*logger)(const char *text)))(const char *);
+igvt_log_level igvt_ctx_set_log_level(igvt_ctx *ctx, igvt_log_level level);
+int igvt_ctx_recorder_open(igvt_ctx *ctx, size_t n_events, const char *shm_name);
+size_t igvt_ctx_recorder_dump(igvt_ctx *ctx, struct igvt_event *events, size_t max_events);
+int igvt_ctx_get_stats(igvt_ctx *ctx, struct igvt_stats *stats);
+int igvt_ctx_stats_write_prometheus(igvt_ctx *ctx, int fd);
+int igvt_ctx_stats_save_prometheus(igvt_ctx *ctx, const char *path);
+int igvt_ctx_trace_start(igvt_ctx *ctx, const char *path);
+int igvt_ctx_trace_stop(igvt_ctx *ctx);
+int igvt_ctx_set_backend(igvt_ctx *ctx, igvt_backend backend);
+int igvt_ctx_connection_watch_fd(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port);
+int igvt_ctx_iotrace_start(igvt_ctx *ctx, const char *path);
+int igvt_ctx_iotrace_stop(igvt_ctx *ctx);
+int igvt_ctx_iotrace_replay(igvt_ctx *ctx, const char *path, double speed, struct igvt_iotrace_replay_result *result);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,937 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef __IGVT_HPP_
+#define __IGVT_HPP_
+
+#if __cplusplus < 202002L
+#error "igvt.hpp needs C++20"
+#endif
+
+#include <array>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <span>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "igvt.h"
+
+/**
+ * @file igvt.hpp
+ *
+ * @brief C++20 wrappers for igvt.h, header only.
+ *
+ * Nothing here throws or allocates on the way to the C calls: a call
+ * that can fail returns an igvt::Result, which holds either its value
+ * or the errno it failed with, in the manner of std::expected. EDIDs
+ * are passed as spans of bytes and port names as string views, so the
+ * caller's buffers are used as they are.
+ *
+ * The handles are as cheap as the C calls. A Context owns an igvt_ctx
+ * (or stands for the default one), an Instance owns a vgt instance and
+ * destroys it when it goes out of scope, and a Vm is a view of one VM
+ * whose attribute descriptors the context opens on first use and keeps
+ * for as long as the VM exists. A Context must outlive the Instances
+ * and Vms made from it.
+ *
+ * The async_ calls return awaitables for C++20 coroutines, over the
+ * igvt_async_ calls. A coroutine that awaits one is resumed from
+ * Context::async_dispatch, on whatever thread the event loop calls it
+ * from when Context::async_fd polls readable, so a VM switch reads as
+ * straight-line code with no thread hops of the caller's:
+ *
+ * @code
+ * auto instance = co_await ctx.async_create_instance(domid);
+ * if (!instance)
+ *     co_return instance.error();
+ * auto vm = instance->vm();
+ * co_await vm.async_plug(PORT_B, edid, PORT_B);
+ * co_await vm.async_set_foreground();
+ * @endcode
+ */
+
+namespace igvt {
+
+/**
+ * @brief The errno a call failed with, for returning as a Result
+ */
+struct Error {
+    int code;                   /**< a positive errno */
+};
+
+/**
+ * @brief A value, or the Error that stopped the call producing it
+ *
+ * value() and operator* must only be used on a Result that has a
+ * value; error() on one that hasn't.
+ */
+template <typename T>
+class [[nodiscard]] Result {
+public:
+    Result(T value) noexcept(std::is_nothrow_move_constructible_v<T>)
+        : err_(0)
+    {
+        new (&value_) T(std::move(value));
+    }
+
+    Result(Error error) noexcept : err_(error.code) {}
+
+    Result(Result &&other) noexcept(std::is_nothrow_move_constructible_v<T>)
+        : err_(other.err_)
+    {
+        if (!err_)
+            new (&value_) T(std::move(other.value_));
+    }
+
+    Result(const Result &) = delete;
+    Result &operator=(const Result &) = delete;
+    Result &operator=(Result &&) = delete;
+
+    ~Result()
+    {
+        if (!err_)
+            value_.~T();
+    }
+
+    bool has_value() const noexcept { return !err_; }
+    explicit operator bool() const noexcept { return !err_; }
+
+    T &value() & noexcept { return value_; }
+    const T &value() const & noexcept { return value_; }
+    T &&value() && noexcept { return std::move(value_); }
+
+    T &operator*() & noexcept { return value_; }
+    const T &operator*() const & noexcept { return value_; }
+    T &&operator*() && noexcept { return std::move(value_); }
+    T *operator->() noexcept { return &value_; }
+    const T *operator->() const noexcept { return &value_; }
+
+    template <typename U>
+    T value_or(U &&other) const & noexcept
+    {
+        return err_ ? static_cast<T>(std::forward<U>(other)) : value_;
+    }
+
+    template <typename U>
+    T value_or(U &&other) && noexcept
+    {
+        return err_ ? static_cast<T>(std::forward<U>(other))
+                    : std::move(value_);
+    }
+
+    std::error_code error() const noexcept
+    {
+        return std::error_code(err_, std::generic_category());
+    }
+
+private:
+    union {
+        T value_;
+    };
+    int err_;
+};
+
+/**
+ * @brief Success, or the Error a call failed with
+ */
+template <>
+class [[nodiscard]] Result<void> {
+public:
+    Result() noexcept : err_(0) {}
+    Result(Error error) noexcept : err_(error.code) {}
+
+    bool has_value() const noexcept { return !err_; }
+    explicit operator bool() const noexcept { return !err_; }
+
+    std::error_code error() const noexcept
+    {
+        return std::error_code(err_, std::generic_category());
+    }
+
+private:
+    int err_;
+};
+
+/** @brief Turn a C call's 0 or -errno into a Result */
+inline Result<void> check(int status) noexcept
+{
+    if (status < 0)
+        return Error{-status};
+
+    return {};
+}
+
+namespace detail {
+
+inline const unsigned char *bytes(std::span<const std::byte> edid) noexcept
+{
+    return reinterpret_cast<const unsigned char *>(edid.data());
+}
+
+struct HostStateFree {
+    void operator()(igvt_host_state *state) const noexcept
+    {
+        igvt_host_state_free(state);
+    }
+};
+
+/* What the awaitables share: the callback that resumes the coroutine */
+class AsyncOp {
+public:
+    bool await_ready() const noexcept { return false; }
+
+protected:
+    static void complete(int result, void *arg) noexcept
+    {
+        AsyncOp *op = static_cast<AsyncOp *>(arg);
+
+        op->result_ = result;
+        op->handle_.resume();
+    }
+
+    std::coroutine_handle<> handle_;
+    int result_ = 0;
+};
+
+} // namespace detail
+
+/*
+ * An awaitable must not be touched once its call is submitted: the
+ * coroutine may already have been resumed, on another thread, and have
+ * moved on. Only a failure to submit is recorded, and resumes at once.
+ */
+
+/** @brief Awaits igvt_async_plug_display, giving a Result<void> */
+class [[nodiscard]] AsyncPlugDisplay : public detail::AsyncOp {
+public:
+    AsyncPlugDisplay(igvt_ctx *ctx, unsigned int domid, gt_port vgt_port,
+                     std::span<const std::byte> edid, gt_port pgt_port)
+        noexcept
+        : ctx_(ctx), domid_(domid), vgt_port_(vgt_port), edid_(edid),
+          pgt_port_(pgt_port) {}
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        int status;
+
+        handle_ = handle;
+        status = igvt_ctx_async_plug_display(ctx_, domid_, vgt_port_,
+                                             detail::bytes(edid_),
+                                             edid_.size(), pgt_port_,
+                                             complete, this);
+
+        if (status < 0) {
+            result_ = status;
+            return false;
+        }
+
+        return true;
+    }
+
+    Result<void> await_resume() const noexcept { return check(result_); }
+
+private:
+    igvt_ctx *ctx_;
+    unsigned int domid_;
+    gt_port vgt_port_;
+    std::span<const std::byte> edid_;
+    gt_port pgt_port_;
+};
+
+/** @brief Awaits igvt_async_set_foreground_vm, giving a Result<void> */
+class [[nodiscard]] AsyncSetForeground : public detail::AsyncOp {
+public:
+    AsyncSetForeground(igvt_ctx *ctx, unsigned int domid) noexcept
+        : ctx_(ctx), domid_(domid) {}
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        int status;
+
+        handle_ = handle;
+        status = igvt_ctx_async_set_foreground_vm(ctx_, domid_, complete,
+                                                  this);
+
+        if (status < 0) {
+            result_ = status;
+            return false;
+        }
+
+        return true;
+    }
+
+    Result<void> await_resume() const noexcept { return check(result_); }
+
+private:
+    igvt_ctx *ctx_;
+    unsigned int domid_;
+};
+
+/** @brief The state igvt_discover returns, freed when it is dropped */
+using HostState = std::unique_ptr<igvt_host_state, detail::HostStateFree>;
+
+/*
+ * EDIDs filtered at compile time.
+ *
+ * The filtering that igvt_plug_display does to every EDID it writes,
+ * as constexpr functions that make the same edits in the same order as
+ * _fixup_edid_extensions and _filter_edid, so an EDID compiled into the
+ * program can be filtered and checked by the compiler and plugged with
+ * Vm::plug_filtered, which writes it as it is.
+ */
+
+inline constexpr std::size_t edid_block_size = 128;
+
+/** @brief The most EDID the library writes: a base block and one more */
+inline constexpr std::size_t edid_max_size = 2 * edid_block_size;
+
+/**
+ * @brief An EDID filtered for one kind of port, from filter_edid
+ */
+template <std::size_t N>
+struct FilteredEdid {
+    std::array<unsigned char, N> bytes;
+    std::size_t size;           /**< less than N if blocks were dropped */
+    bool analog;                /**< filtered for the analog (VGA) port */
+
+    std::span<const std::byte> span() const noexcept
+    {
+        return std::as_bytes(std::span(bytes.data(), size));
+    }
+};
+
+namespace detail {
+
+/* Not constexpr, so that reaching it stops the compiler */
+void edid_is_not_valid();
+
+/* As write_edid_byte in edid.c: the base block's checksum follows */
+constexpr void edid_write_byte(unsigned char *edid, std::size_t byte,
+                               unsigned char value) noexcept
+{
+    edid[0x7f] += edid[byte];
+    edid[byte] = value;
+    edid[0x7f] -= edid[byte];
+}
+
+/* As _fixup_edid_extensions; size is whole blocks */
+constexpr std::size_t edid_fixup_extensions(unsigned char *edid,
+                                            std::size_t size) noexcept
+{
+    std::size_t blocks = size / edid_block_size;
+
+    if (blocks - 1 > edid[126])
+        blocks = edid[126] + 1;
+
+    if (edid[126] != blocks - 1)
+        edid_write_byte(edid, 126, blocks - 1);
+
+    for (std::size_t block = 1; block < blocks; block++) {
+        unsigned char *ext = &edid[block * edid_block_size];
+        unsigned char sum = 0;
+
+        for (std::size_t i = 0; i < edid_block_size - 1; i++)
+            sum += ext[i];
+
+        ext[edid_block_size - 1] = -sum;
+    }
+
+    return blocks * edid_block_size;
+}
+
+/* As _filter_edid; see there for why each edit is made */
+constexpr void edid_filter(unsigned char *edid, bool analog) noexcept
+{
+    if (analog && (edid[20] & 0x80)) {
+        edid_write_byte(edid, 20, 0x00);
+        edid_write_byte(edid, 24, (edid[24] & 0xE7) | 0x08);
+    } else if (!analog && !(edid[20] & 0x80)) {
+        edid_write_byte(edid, 20, 0x80);
+        edid_write_byte(edid, 24, edid[24] & 0xE7);
+    }
+
+    /* No DPMS */
+    edid_write_byte(edid, 24, edid[24] & 0x1F);
+
+    /* Pixel clocks capped at 160MHz */
+    for (std::size_t i = 0; i < 4; i++) {
+        std::size_t td = 54 + 18 * i;
+        unsigned int clock = edid[td] + (edid[td + 1] << 8);
+
+        if (clock > 16000) {
+            edid_write_byte(edid, td, 16000 & 0xff);
+            edid_write_byte(edid, td + 1, 16000 >> 8);
+        }
+    }
+}
+
+} // namespace detail
+
+/**
+ * @brief Whether an EDID is whole blocks with its header and checksums
+ *
+ * Blocks past those the base block announces aren't looked at.
+ */
+constexpr bool edid_valid(const unsigned char *edid, std::size_t size)
+    noexcept
+{
+    constexpr unsigned char header[8] = {
+        0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+    };
+
+    if (size < edid_block_size || size % edid_block_size)
+        return false;
+
+    for (std::size_t i = 0; i < 8; i++)
+        if (edid[i] != header[i])
+            return false;
+
+    for (std::size_t block = 0; block < size / edid_block_size &&
+         block <= edid[126]; block++) {
+        unsigned char sum = 0;
+
+        for (std::size_t i = 0; i < edid_block_size; i++)
+            sum += edid[block * edid_block_size + i];
+
+        if (sum)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Filter an EDID at compile time, as igvt_plug_display would
+ *
+ * The EDID must be valid as it is, and is valid once filtered; if not,
+ * the call doesn't compile. Extension blocks it doesn't announce are
+ * dropped and the others get fresh checksums. Unlike igvt_plug_display,
+ * an extension block is kept even if the kernel can't take it; it is
+ * cut off when the EDID is plugged into such a kernel.
+ *
+ * @code
+ * static constexpr auto monitor = igvt::filter_edid(monitor_edid, false);
+ * vm.plug_filtered(PORT_B, monitor, PORT_B);
+ * @endcode
+ *
+ * @param raw The EDID, 128 or 256 bytes
+ * @param analog true to filter for the analog (VGA) port
+ */
+template <std::size_t N>
+consteval FilteredEdid<N> filter_edid(const std::array<unsigned char, N> &raw,
+                                      bool analog)
+{
+    static_assert(N && N % edid_block_size == 0 && N <= edid_max_size,
+                  "an EDID is one or two 128 byte blocks");
+
+    FilteredEdid<N> edid{raw, N, analog};
+
+    /* Only the base block; the extensions' checksums are made anew */
+    if (!edid_valid(raw.data(), edid_block_size))
+        detail::edid_is_not_valid();
+
+    edid.size = detail::edid_fixup_extensions(edid.bytes.data(), N);
+    detail::edid_filter(edid.bytes.data(), analog);
+
+    if (!edid_valid(edid.bytes.data(), edid.size))
+        detail::edid_is_not_valid();
+
+    return edid;
+}
+
+/** @brief As filter_edid, for an EDID in a C array */
+template <std::size_t N>
+consteval FilteredEdid<N> filter_edid(const unsigned char (&raw)[N],
+                                      bool analog)
+{
+    return filter_edid(std::to_array(raw), analog);
+}
+
+namespace detail {
+
+/*
+ * The filter is checked against _filter_edid where it is compiled: the
+ * hashes below are of what the C library makes of two reference EDIDs,
+ * one digital with an extension block whose checksum is wrong, one
+ * analog with an extension block it doesn't announce, each filtered for
+ * both kinds of port. Both have DPMS bits and pixel clocks over the cap.
+ */
+consteval std::array<unsigned char, edid_max_size>
+edid_reference(bool analog)
+{
+    std::array<unsigned char, edid_max_size> edid{};
+    unsigned char sum = 0;
+
+    for (std::size_t i = 8; i < edid.size(); i++)
+        edid[i] = (i * 73 + 41) & 0xff;
+
+    edid[0] = edid[7] = 0x00;
+    for (std::size_t i = 1; i < 7; i++)
+        edid[i] = 0xff;
+
+    edid[20] = analog ? 0x68 : 0xa5;
+    edid[24] = 0xfa;
+    edid[54] = 25000 & 0xff;            /* over the cap */
+    edid[55] = 25000 >> 8;
+    edid[72] = 14850 & 0xff;            /* under it */
+    edid[73] = 14850 >> 8;
+    edid[90] = edid[91] = 0;            /* a display descriptor */
+    edid[108] = edid[109] = 0xff;
+    edid[126] = analog ? 0 : 1;
+
+    for (std::size_t i = 0; i < edid_block_size - 1; i++)
+        sum += edid[i];
+
+    edid[127] = -sum;
+
+    return edid;
+}
+
+template <std::size_t N>
+constexpr std::uint64_t edid_hash(const FilteredEdid<N> &edid)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (std::size_t i = 0; i < edid.size; i++)
+        hash = (hash ^ edid.bytes[i]) * 0x100000001b3ull;
+
+    return hash;
+}
+
+static_assert(edid_hash(filter_edid(edid_reference(false), false)) ==
+              0xc40f16ab52999ab3ull);
+static_assert(edid_hash(filter_edid(edid_reference(false), true)) ==
+              0x0839e69934486d33ull);
+static_assert(edid_hash(filter_edid(edid_reference(true), false)) ==
+              0x329db628a5b9e56dull);
+static_assert(edid_hash(filter_edid(edid_reference(true), true)) ==
+              0x91c159cedf7898cdull);
+
+} // namespace detail
+
+/**
+ * @brief One VM's virtual ports
+ *
+ * A Vm is only a domain ID and the context it is in, so it copies
+ * freely; the attribute descriptors behind it are the context's.
+ */
+class Vm {
+public:
+    Vm(igvt_ctx *ctx, unsigned int domid) noexcept
+        : ctx_(ctx), domid_(domid) {}
+
+    unsigned int domid() const noexcept { return domid_; }
+
+    /** @brief As igvt_plug_display */
+    Result<void> plug(gt_port vgt_port, std::span<const std::byte> edid,
+                      gt_port pgt_port) const noexcept
+    {
+        return check(igvt_ctx_plug_display(ctx_, domid_, vgt_port,
+                                           detail::bytes(edid), edid.size(),
+                                           pgt_port));
+    }
+
+    /** @brief As igvt_plug_display_id */
+    Result<void> plug(gt_port vgt_port, std::uint64_t edid_id,
+                      gt_port pgt_port) const noexcept
+    {
+        return check(igvt_ctx_plug_display_id(ctx_, domid_, vgt_port,
+                                              edid_id, pgt_port));
+    }
+
+    /**
+     * @brief As igvt_plug_display_filtered, with an EDID from filter_edid
+     *
+     * @return the error -EINVAL if the EDID was filtered for the other
+     *         kind of port
+     */
+    template <std::size_t N>
+    Result<void> plug_filtered(gt_port vgt_port, const FilteredEdid<N> &edid,
+                               gt_port pgt_port) const noexcept
+    {
+        return check(igvt_ctx_plug_display_filtered(ctx_, domid_, vgt_port,
+                                                    edid.bytes.data(),
+                                                    edid.size, pgt_port));
+    }
+
+    /** @brief As igvt_unplug_display */
+    Result<void> unplug(gt_port vgt_port) const noexcept
+    {
+        return check(igvt_ctx_unplug_display(ctx_, domid_, vgt_port));
+    }
+
+    /** @brief As igvt_port_plugged_p */
+    bool plugged(gt_port vgt_port) const noexcept
+    {
+        return igvt_ctx_port_plugged_p(ctx_, domid_, vgt_port);
+    }
+
+    /** @brief As igvt_set_foreground_vm */
+    Result<void> set_foreground() const noexcept
+    {
+        return check(igvt_ctx_set_foreground_vm(ctx_, domid_));
+    }
+
+    /**
+     * @brief As plug, awaited
+     *
+     * The EDID is copied when the coroutine suspends.
+     */
+    AsyncPlugDisplay async_plug(gt_port vgt_port,
+                                std::span<const std::byte> edid,
+                                gt_port pgt_port) const noexcept
+    {
+        return AsyncPlugDisplay(ctx_, domid_, vgt_port, edid, pgt_port);
+    }
+
+    /** @brief As set_foreground, awaited */
+    AsyncSetForeground async_set_foreground() const noexcept
+    {
+        return AsyncSetForeground(ctx_, domid_);
+    }
+
+    /**
+     * @brief As igvt_vm_save_displays
+     *
+     * @return the size of the blob written to the start of buf
+     */
+    Result<std::size_t> save_displays(std::span<std::byte> buf) const noexcept
+    {
+        std::size_t size = buf.size();
+        int status = igvt_ctx_vm_save_displays(ctx_, domid_, buf.data(),
+                                               &size);
+
+        if (status < 0)
+            return Error{-status};
+
+        return size;
+    }
+
+    /** @brief As igvt_vm_restore_displays */
+    Result<void> restore_displays(std::span<const std::byte> blob)
+        const noexcept
+    {
+        return check(igvt_ctx_vm_restore_displays(ctx_, domid_, blob.data(),
+                                                  blob.size()));
+    }
+
+private:
+    igvt_ctx *ctx_;
+    unsigned int domid_;
+};
+
+/**
+ * @brief A vgt instance, destroyed when its owner goes out of scope
+ */
+class Instance {
+public:
+    /** @brief The sizes igvt_create_instance takes */
+    struct Config {
+        unsigned int aperture_size = 64;    /**< MiB */
+        unsigned int gm_size = 512;         /**< MiB */
+        unsigned int fence_count = 4;
+    };
+
+    /** @brief As igvt_create_instance */
+    static Result<Instance> create(igvt_ctx *ctx, unsigned int domid,
+                                   const Config &config) noexcept
+    {
+        int status = igvt_ctx_create_instance(ctx, domid,
+                                              config.aperture_size,
+                                              config.gm_size,
+                                              config.fence_count);
+
+        if (status < 0)
+            return Error{-status};
+
+        return Instance(ctx, domid);
+    }
+
+    Instance(Instance &&other) noexcept
+        : ctx_(other.ctx_), domid_(std::exchange(other.domid_, 0)) {}
+
+    Instance &operator=(Instance &&other) noexcept
+    {
+        if (this != &other) {
+            (void) destroy();
+            ctx_ = other.ctx_;
+            domid_ = std::exchange(other.domid_, 0);
+        }
+
+        return *this;
+    }
+
+    Instance(const Instance &) = delete;
+    Instance &operator=(const Instance &) = delete;
+
+    ~Instance() { (void) destroy(); }
+
+    /** @brief The domain ID, or 0 once the instance is gone */
+    unsigned int domid() const noexcept { return domid_; }
+
+    Vm vm() const noexcept { return Vm(ctx_, domid_); }
+
+    /**
+     * @brief Destroy the instance now, rather than on scope exit
+     *
+     * The instance is given up whether or not this succeeds.
+     */
+    Result<void> destroy() noexcept
+    {
+        unsigned int domid = std::exchange(domid_, 0);
+
+        if (!domid)
+            return {};
+
+        return check(igvt_ctx_destroy_instance(ctx_, domid));
+    }
+
+    /**
+     * @brief Keep the instance after the Instance has gone
+     *
+     * @return the domain ID
+     */
+    unsigned int release() noexcept { return std::exchange(domid_, 0); }
+
+private:
+    friend class AsyncCreateInstance;
+
+    Instance(igvt_ctx *ctx, unsigned int domid) noexcept
+        : ctx_(ctx), domid_(domid) {}
+
+    igvt_ctx *ctx_;
+    unsigned int domid_;
+};
+
+/** @brief Awaits igvt_async_create_instance, giving a Result<Instance> */
+class [[nodiscard]] AsyncCreateInstance : public detail::AsyncOp {
+public:
+    AsyncCreateInstance(igvt_ctx *ctx, unsigned int domid,
+                        const Instance::Config &config) noexcept
+        : ctx_(ctx), domid_(domid), config_(config) {}
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        int status;
+
+        handle_ = handle;
+        status = igvt_ctx_async_create_instance(ctx_, domid_,
+                                                config_.aperture_size,
+                                                config_.gm_size,
+                                                config_.fence_count,
+                                                complete, this);
+
+        if (status < 0) {
+            result_ = status;
+            return false;
+        }
+
+        return true;
+    }
+
+    Result<Instance> await_resume() const noexcept
+    {
+        if (result_ < 0)
+            return Error{-result_};
+
+        return Instance(ctx_, domid_);
+    }
+
+private:
+    igvt_ctx *ctx_;
+    unsigned int domid_;
+    Instance::Config config_;
+};
+
+/**
+ * @brief A context, freed when its owner goes out of scope
+ *
+ * A default-constructed Context is the library's default context, which
+ * is never freed.
+ */
+class Context {
+public:
+    Context() noexcept : ctx_(nullptr) {}
+
+    /**
+     * @brief As igvt_ctx_new
+     *
+     * @param vgt_root The vgt sysfs directory, or nullptr
+     * @param drm_root The DRM class directory, or nullptr
+     */
+    static Result<Context> create(const char *vgt_root = nullptr,
+                                  const char *drm_root = nullptr) noexcept
+    {
+        igvt_ctx *ctx = igvt_ctx_new(vgt_root, drm_root);
+
+        if (!ctx)
+            return Error{errno};
+
+        return Context(ctx);
+    }
+
+    Context(Context &&other) noexcept
+        : ctx_(std::exchange(other.ctx_, nullptr)) {}
+
+    Context &operator=(Context &&other) noexcept
+    {
+        if (this != &other) {
+            if (ctx_)
+                igvt_ctx_free(ctx_);
+
+            ctx_ = std::exchange(other.ctx_, nullptr);
+        }
+
+        return *this;
+    }
+
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+
+    ~Context()
+    {
+        if (ctx_)
+            igvt_ctx_free(ctx_);
+    }
+
+    /** @brief The C context, for calls this header doesn't wrap */
+    igvt_ctx *get() const noexcept { return ctx_; }
+
+    /** @brief As igvt_set_backend */
+    Result<void> set_backend(igvt_backend backend) const noexcept
+    {
+        return check(igvt_ctx_set_backend(ctx_, backend));
+    }
+
+    /** @brief Create an instance, owned by the Instance returned */
+    Result<Instance> create_instance(unsigned int domid,
+                                     const Instance::Config &config = {})
+        const noexcept
+    {
+        return Instance::create(ctx_, domid, config);
+    }
+
+    /** @brief As create_instance, awaited */
+    AsyncCreateInstance async_create_instance(
+        unsigned int domid, const Instance::Config &config = {})
+        const noexcept
+    {
+        return AsyncCreateInstance(ctx_, domid, config);
+    }
+
+    /** @brief As igvt_async_fd */
+    int async_fd() const noexcept { return igvt_ctx_async_fd(ctx_); }
+
+    /**
+     * @brief As igvt_async_dispatch: resumes the coroutines whose calls
+     * have completed, on the calling thread
+     */
+    int async_dispatch() const noexcept
+    {
+        return igvt_ctx_async_dispatch(ctx_);
+    }
+
+    /**
+     * @brief A VM that has a vgt instance
+     *
+     * @return the VM, or ENOENT if domid has no instance
+     */
+    Result<Vm> vm(unsigned int domid) const noexcept
+    {
+        if (!igvt_ctx_enabled_p(ctx_, domid))
+            return Error{ENOENT};
+
+        return Vm(ctx_, domid);
+    }
+
+    /**
+     * @brief As igvt_translate_i915_port
+     *
+     * @return the port, or ENOENT if no connector has the name
+     */
+    Result<gt_port> i915_port(std::string_view name) const noexcept
+    {
+        char buf[64];
+        gt_port port;
+
+        if (name.size() >= sizeof(buf))
+            return Error{ENOENT};
+
+        std::memcpy(buf, name.data(), name.size());
+        buf[name.size()] = '\0';
+
+        port = igvt_ctx_translate_i915_port(ctx_, buf);
+
+        if (port == PORT_ILLEGAL)
+            return Error{ENOENT};
+
+        return port;
+    }
+
+    /**
+     * @brief As igvt_translate_pgt_port
+     *
+     * @return the name, or an empty view if the port has no connector
+     */
+    std::string_view pgt_port_name(gt_port pgt_port) const noexcept
+    {
+        std::string_view name = igvt_ctx_translate_pgt_port(ctx_, pgt_port);
+
+        return name == "INVALID" ? std::string_view() : name;
+    }
+
+    /**
+     * @brief As igvt_edid_store_add
+     *
+     * @return the EDID's id
+     */
+    Result<std::uint64_t> edid_store_add(std::span<const std::byte> edid)
+        const noexcept
+    {
+        std::uint64_t id;
+        int status = igvt_ctx_edid_store_add(ctx_, detail::bytes(edid),
+                                             edid.size(), &id);
+
+        if (status < 0)
+            return Error{-status};
+
+        return id;
+    }
+
+    /** @brief As igvt_discover */
+    Result<HostState> discover(unsigned int threads = 0) const noexcept
+    {
+        igvt_host_state *state;
+        int status = igvt_ctx_discover(ctx_, threads, &state);
+
+        if (status < 0)
+            return Error{-status};
+
+        return HostState(state);
+    }
+
+private:
+    explicit Context(igvt_ctx *ctx) noexcept : ctx_(ctx) {}
+
+    igvt_ctx *ctx_;
+};
+
+} // namespace igvt
+
+#endif
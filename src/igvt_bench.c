@@ -0,0 +1,522 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file igvt_bench.c
+ *
+ * @brief Time the library's public calls against what they replaced
+ *
+ *   igvt-bench translate [calls]
+ *   igvt-bench plug [rounds]
+ *   igvt-bench discover [vms]
+ *
+ * translate times igvt_translate_i915_port against the strcmp chain it
+ * used to be, for the known names in turn, the name at the end of the
+ * chain and a name it doesn't know, in ns per call.
+ *
+ * plug times igvt_ctx_plug_displays against one igvt_ctx_plug_display
+ * call per display, for batches of base and extended EDIDs, in us per
+ * batch. It builds a vgt root of plain files on /dev/shm, so what it
+ * measures is the library and the syscalls rather than a real vgt.
+ *
+ * discover creates VMs on the simulator and times igvt_ctx_discover,
+ * on one thread and on one per CPU, against asking igvt_ctx_enabled_p
+ * and igvt_ctx_port_plugged_p about each VM and port in turn, in us
+ * for the lot. Each run starts from a new context, so no attribute is
+ * open yet, as at a manager's startup.
+ *
+ * Each figure is the median of RUNS runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "igvt.h"
+
+#define RUNS 5
+
+static volatile unsigned int sink;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* The median of RUNS timings of fn, in ns per call */
+static double median(double (*fn)(const char *const *, size_t, size_t),
+                     const char *const *names, size_t n, size_t calls)
+{
+    double t[RUNS];
+    int i;
+
+    for (i = 0; i < RUNS; i++)
+        t[i] = fn(names, n, calls);
+
+    qsort(t, RUNS, sizeof(t[0]), cmp_double);
+
+    return t[RUNS / 2];
+}
+
+/* igvt_translate_i915_port as it was before the perfect hash */
+static __attribute__((noinline)) gt_port
+strcmp_chain(const char *i915_port_name)
+{
+    gt_port port = PORT_ILLEGAL;
+
+    if (strcmp(i915_port_name, "card0-eDP-1") == 0) {
+        port = PORT_EDP;
+    } else if (strcmp(i915_port_name, "card0-DP-1") == 0) {
+        port = PORT_B;
+    } else if (strcmp(i915_port_name, "card0-HDMI-A-1") == 0) {
+        port = PORT_B;
+    } else if (strcmp(i915_port_name, "card0-DP-2") == 0) {
+        port = PORT_C;
+    } else if (strcmp(i915_port_name, "card0-HDMI-A-2") == 0) {
+        port = PORT_C;
+    } else if (strcmp(i915_port_name, "card0-DP-3") == 0) {
+        port = PORT_D;
+    } else if (strcmp(i915_port_name, "card0-HDMI-A-3") == 0) {
+        port = PORT_D;
+    } else if (strcmp(i915_port_name, "card0-VGA-1") == 0) {
+        port = PORT_VGA;
+    }
+
+    return port;
+}
+
+static double time_chain(const char *const *names, size_t n, size_t calls)
+{
+    uint64_t start = now();
+    unsigned int acc = 0;
+    size_t i;
+
+    for (i = 0; i < calls; i++)
+        acc += strcmp_chain(names[i % n]);
+
+    sink = acc;
+
+    return (double) (now() - start) / calls;
+}
+
+static double time_public(const char *const *names, size_t n, size_t calls)
+{
+    uint64_t start = now();
+    unsigned int acc = 0;
+    size_t i;
+
+    for (i = 0; i < calls; i++)
+        acc += igvt_translate_i915_port(names[i % n]);
+
+    sink = acc;
+
+    return (double) (now() - start) / calls;
+}
+
+static int bench_translate(int argc, char **argv)
+{
+    static const char *const known[] = {
+        "card0-eDP-1", "card0-DP-1", "card0-HDMI-A-1", "card0-DP-2",
+        "card0-HDMI-A-2", "card0-DP-3", "card0-HDMI-A-3", "card0-VGA-1",
+    };
+    static const char *const last[] = { "card0-VGA-1" };
+    static const char *const unknown[] = { "card0-DVI-I-1" };
+    static const struct {
+        const char *what;
+        const char *const *names;
+        size_t n;
+    } cases[] = {
+        { "all 8 known names", known, sizeof(known) / sizeof(known[0]) },
+        { "last in the chain", last, 1 },
+        { "unknown name", unknown, 1 },
+    };
+    size_t calls = argc > 0 ? strtoul(argv[0], NULL, 0) : 10000000;
+    size_t i;
+
+    if (calls == 0)
+        return 2;
+
+    /* Unknown names are logged as errors */
+    igvt_set_log_level(IGVT_LOG_NONE);
+
+    printf("%-20s %10s %10s\n", "names cycled", "chain", "public");
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        printf("%-20s %7.1f ns %7.1f ns\n", cases[i].what,
+               median(time_chain, cases[i].names, cases[i].n, calls),
+               median(time_public, cases[i].names, cases[i].n, calls));
+
+    return 0;
+}
+
+#define PLUG_VMS 16
+#define PLUG_PORTS 4
+
+static const gt_port plug_ports[PLUG_PORTS] = {
+    PORT_A, PORT_B, PORT_C, PORT_D
+};
+
+static const char *const plug_port_names[PLUG_PORTS] = {
+    "PORT_A", "PORT_B", "PORT_C", "PORT_D"
+};
+
+/*
+ * The attributes of a port. The edid file is sized for an extension
+ * block, since the library sizes its EDID writes by the attribute.
+ */
+static const struct {
+    const char *name;
+    const char *contents;
+    size_t size;
+} plug_files[] = {
+    { "connection", "disconnected\n", 13 },
+    { "port_override", "", 0 },
+    { "edid", "", 256 },
+};
+
+static int plug_file(const char *dir, int i, int create)
+{
+    static const char zeros[256];
+    char path[512];
+    FILE *f;
+    size_t len;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, plug_files[i].name);
+
+    if (!create)
+        return unlink(path);
+
+    f = fopen(path, "w");
+
+    if (!f)
+        return -1;
+
+    len = strlen(plug_files[i].contents);
+    fwrite(plug_files[i].contents, 1, len, f);
+    fwrite(zeros, 1, plug_files[i].size - len, f);
+
+    return fclose(f);
+}
+
+/* Build (or, with create 0, tear down) a vgt root of plain files */
+static int plug_root(const char *root, int create)
+{
+    char dir[256];
+    int vm, p, i, result = 0;
+
+    for (vm = 1; vm <= PLUG_VMS; vm++) {
+        snprintf(dir, sizeof(dir), "%s/vm%d", root, vm);
+
+        if (create)
+            result |= mkdir(dir, 0755);
+
+        for (p = 0; p < PLUG_PORTS; p++) {
+            snprintf(dir, sizeof(dir), "%s/vm%d/%s", root, vm,
+                     plug_port_names[p]);
+
+            if (create)
+                result |= mkdir(dir, 0755);
+
+            for (i = 0; i < (int) (sizeof(plug_files) / sizeof(plug_files[0]));
+                 i++)
+                result |= plug_file(dir, i, create);
+
+            if (!create)
+                rmdir(dir);
+        }
+
+        if (!create) {
+            snprintf(dir, sizeof(dir), "%s/vm%d", root, vm);
+            rmdir(dir);
+        }
+    }
+
+    return result;
+}
+
+static igvt_ctx *plug_ctx;
+static struct igvt_display plug_displays[PLUG_VMS * PLUG_PORTS];
+static size_t plug_rounds;
+
+static double time_bulk(size_t n)
+{
+    uint64_t start = now();
+    size_t r;
+
+    for (r = 0; r < plug_rounds; r++)
+        igvt_ctx_plug_displays(plug_ctx, plug_displays, n);
+
+    return (double) (now() - start) / plug_rounds / 1000;
+}
+
+static double time_serial(size_t n)
+{
+    const struct igvt_display *d;
+    uint64_t start = now();
+    size_t r, i;
+
+    for (r = 0; r < plug_rounds; r++) {
+        for (i = 0; i < n; i++) {
+            d = &plug_displays[i];
+            igvt_ctx_plug_display(plug_ctx, d->domid, d->vgt_port, d->edid,
+                                  d->edid_size, d->pgt_port);
+        }
+    }
+
+    return (double) (now() - start) / plug_rounds / 1000;
+}
+
+static double median_plug(double (*fn)(size_t), size_t n)
+{
+    double t[RUNS];
+    int i;
+
+    for (i = 0; i < RUNS; i++)
+        t[i] = fn(n);
+
+    qsort(t, RUNS, sizeof(t[0]), cmp_double);
+
+    return t[RUNS / 2];
+}
+
+static int bench_plug(int argc, char **argv)
+{
+    static const size_t batches[] = { 1, 4, 16, 64 };
+    static const size_t sizes[] = { 128, 256 };
+    char root[] = "/dev/shm/igvt-bench.XXXXXX";
+    unsigned char edid[256];
+    size_t i, b, s;
+    int status = 0;
+
+    plug_rounds = argc > 0 ? strtoul(argv[0], NULL, 0) : 200;
+
+    if (plug_rounds == 0)
+        return 2;
+
+    if (!mkdtemp(root)) {
+        perror("igvt-bench: mkdtemp");
+        return 1;
+    }
+
+    if (plug_root(root, 1) < 0) {
+        fprintf(stderr, "igvt-bench: can't build a vgt root in %s\n", root);
+        status = 1;
+        goto out;
+    }
+
+    plug_ctx = igvt_ctx_new(root, NULL);
+
+    if (!plug_ctx) {
+        fprintf(stderr, "igvt-bench: no context on %s\n", root);
+        status = 1;
+        goto out;
+    }
+
+    memcpy(edid, igvt_edid_synthesize(1920, 1080, 60, 0), 128);
+    memcpy(edid + 128, edid, 128);
+    edid[126] = 1;
+
+    for (i = 0; i < PLUG_VMS * PLUG_PORTS; i++) {
+        plug_displays[i].domid = i / PLUG_PORTS + 1;
+        plug_displays[i].vgt_port = plug_ports[i % PLUG_PORTS];
+        plug_displays[i].pgt_port = plug_ports[(i + 1) % PLUG_PORTS];
+        plug_displays[i].edid = edid;
+    }
+
+    printf("%-8s %-6s %10s %10s\n", "displays", "edid", "bulk", "serial");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        /* Byte 126 of the base block counts the extension blocks */
+        edid[126] = sizes[s] > 128;
+
+        for (i = 0; i < PLUG_VMS * PLUG_PORTS; i++)
+            plug_displays[i].edid_size = sizes[s];
+
+        for (b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+            printf("%-8zu %-6zu %7.1f us %7.1f us\n", batches[b], sizes[s],
+                   median_plug(time_bulk, batches[b]),
+                   median_plug(time_serial, batches[b]));
+    }
+
+    igvt_ctx_free(plug_ctx);
+
+out:
+    plug_root(root, 0);
+    rmdir(root);
+
+    return status;
+}
+
+static unsigned int discover_vms;
+
+/* A new simulator context with discover_vms VMs, none of them probed */
+static igvt_ctx *discover_ctx(void)
+{
+    igvt_ctx *ctx = igvt_ctx_new(NULL, NULL);
+    unsigned int domid;
+
+    if (!ctx || igvt_ctx_set_backend(ctx, IGVT_BACKEND_SIMULATOR) < 0) {
+        igvt_ctx_free(ctx);
+        return NULL;
+    }
+
+    igvt_ctx_set_log_level(ctx, IGVT_LOG_NONE);
+
+    for (domid = 1; domid <= discover_vms; domid++) {
+        if (igvt_ctx_create_instance(ctx, domid, 64, 512, 4) < 0) {
+            igvt_ctx_free(ctx);
+            return NULL;
+        }
+    }
+
+    return ctx;
+}
+
+static double time_discover(unsigned int threads)
+{
+    struct igvt_host_state *state;
+    igvt_ctx *ctx = discover_ctx();
+    double us = -1;
+
+    if (ctx && igvt_ctx_discover(ctx, threads, &state) == 0) {
+        us = (double) state->ready_ns / 1000;
+        igvt_host_state_free(state);
+    }
+
+    igvt_ctx_free(ctx);
+
+    return us;
+}
+
+static double time_probe(unsigned int threads)
+{
+    igvt_ctx *ctx = discover_ctx();
+    unsigned int domid, acc = 0;
+    uint64_t start;
+    int port;
+
+    (void) threads;
+
+    if (!ctx)
+        return -1;
+
+    start = now();
+
+    for (domid = 1; domid <= discover_vms; domid++) {
+        acc += igvt_ctx_enabled_p(ctx, domid);
+
+        for (port = PORT_A; port <= PORT_E; port++)
+            acc += igvt_ctx_port_plugged_p(ctx, domid, port);
+    }
+
+    start = now() - start;
+    sink = acc;
+
+    igvt_ctx_free(ctx);
+
+    return (double) start / 1000;
+}
+
+static double median_discover(double (*fn)(unsigned int),
+                              unsigned int threads)
+{
+    double t[RUNS];
+    int i;
+
+    for (i = 0; i < RUNS; i++)
+        t[i] = fn(threads);
+
+    qsort(t, RUNS, sizeof(t[0]), cmp_double);
+
+    return t[RUNS / 2];
+}
+
+static int bench_discover(int argc, char **argv)
+{
+    static const struct {
+        const char *what;
+        double (*fn)(unsigned int);
+        unsigned int threads;
+    } cases[] = {
+        { "serial probing", time_probe, 1 },
+        { "discover, 1 thread", time_discover, 1 },
+        { "discover, per CPU", time_discover, 0 },
+    };
+    size_t i;
+    double us;
+
+    discover_vms = argc > 0 ? strtoul(argv[0], NULL, 0) : 256;
+
+    if (discover_vms == 0)
+        return 2;
+
+    printf("%u VMs on the simulator\n", discover_vms);
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        us = median_discover(cases[i].fn, cases[i].threads);
+
+        if (us < 0) {
+            fprintf(stderr, "igvt-bench: %s failed\n", cases[i].what);
+            return 1;
+        }
+
+        printf("%-20s %9.1f us\n", cases[i].what, us);
+    }
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+} benches[] = {
+    { "translate", bench_translate },
+    { "plug", bench_plug },
+    { "discover", bench_discover },
+};
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int status;
+
+    for (i = 0; argc > 1 && i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (strcmp(argv[1], benches[i].name) == 0) {
+            status = benches[i].run(argc - 2, argv + 2);
+
+            if (status != 2)
+                return status;
+
+            break;
+        }
+    }
+
+    fprintf(stderr, "usage: %s translate [calls]\n"
+                    "       %s plug [rounds]\n"
+                    "       %s discover [vms]\n", argv[0], argv[0], argv[0]);
+
+    return 2;
+}
@@ -0,0 +1,556 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef __IGVT_PRIVATE_H_
+#define __IGVT_PRIVATE_H_
+
+/**
+ * @file igvt_private.h
+ *
+ * @brief Declarations shared between the libigvt sources. Nothing in
+ * here is part of the public API.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "igvt.h"
+
+#define IGVT_INTERNAL __attribute__((visibility("hidden")))
+
+/*
+ * USDT probes in the libigvt provider, e.g. for bpftrace:
+ *   usdt:/usr/lib/libigvt.so:libigvt:plug_display__entry
+ * Each public call has <call>__entry and <call>__return probes, and
+ * every attribute write is bracketed by attr_write__entry and
+ * attr_write__return with the attribute name as the first argument.
+ */
+#ifdef IGVT_USDT
+#include <sys/sdt.h>
+#define IGVT_PROBE(...) STAP_PROBEV(libigvt, __VA_ARGS__)
+#else
+#define IGVT_PROBE(...) do { } while (0)
+#endif
+
+#define VGT_KERNEL_PATH "/sys/kernel/vgt"
+#define DRM_CLASS_PATH "/sys/class/drm"
+
+/* Longest root path a context can have */
+#define IGVT_ROOT_MAX 128
+
+typedef enum {
+    IGVT_ERROR = IGVT_LOG_ERROR,
+    IGVT_WARNING = IGVT_LOG_WARNING,
+    IGVT_DEBUG = IGVT_LOG_DEBUG,
+} igvt_log_type;
+
+/* Debug messages go to the warning logger */
+#define IGVT_NUM_LOGGERS 2
+
+/* A context that hasn't been given a level uses the default context's */
+#define IGVT_LOG_UNSET (IGVT_LOG_NONE - 1)
+
+/*
+ * The most verbose messages compiled in, see --with-max-log-level.
+ * Anything above it is dropped at compile time, arguments and all.
+ */
+#ifndef IGVT_LOG_MAX
+#define IGVT_LOG_MAX IGVT_DEBUG
+#endif
+
+IGVT_INTERNAL int _igvt_printf(igvt_ctx *ctx, igvt_log_type log_type,
+                               const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*
+ * Log a message. Nothing is formatted, and the arguments aren't even
+ * evaluated, unless the context's level lets the message through.
+ */
+#define igvt_printf(ctx, log_type, ...)                                 \
+    do {                                                                \
+        if ((log_type) <= IGVT_LOG_MAX && _igvt_log_p((ctx), (log_type))) \
+            _igvt_printf((ctx), (log_type), __VA_ARGS__);               \
+    } while (0)
+
+#define IGVT_STRERROR_MAX 64
+
+IGVT_INTERNAL const char *_igvt_strerror(int err, char *buf, size_t size);
+
+/* A thread-safe strerror, valid until the end of the enclosing statement */
+#define igvt_strerror(err) \
+    _igvt_strerror((err), (char[IGVT_STRERROR_MAX]) { 0 }, IGVT_STRERROR_MAX)
+
+#define IGVT_RCU_STRIPES 16
+#define IGVT_CACHE_LINE 64
+
+struct igvt_rcu {
+    pthread_mutex_t sync_lock;
+    unsigned int epoch;
+    struct {
+        unsigned long count;
+    } __attribute__((aligned(IGVT_CACHE_LINE)))
+    readers[2][IGVT_RCU_STRIPES];
+};
+
+IGVT_INTERNAL extern __thread int _rcu_stripe;
+IGVT_INTERNAL int _rcu_assign_stripe(void);
+IGVT_INTERNAL void _rcu_init(struct igvt_rcu *rcu);
+IGVT_INTERNAL void _rcu_free(struct igvt_rcu *rcu);
+IGVT_INTERNAL void _rcu_synchronize(struct igvt_rcu *rcu);
+
+/*
+ * Enter a read section. Anything loaded from an rcu-protected pointer
+ * stays valid until the matching _rcu_read_unlock. Returns a token to
+ * hand back to the unlock.
+ */
+static inline int
+_rcu_read_lock(struct igvt_rcu *rcu)
+{
+    int stripe = _rcu_stripe < 0 ? _rcu_assign_stripe() : _rcu_stripe;
+    unsigned int idx;
+
+    for (;;) {
+        idx = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_add_fetch(&rcu->readers[idx][stripe].count, 1,
+                           __ATOMIC_SEQ_CST);
+
+        /* A writer flipped the epoch under us and may not have seen us */
+        if ((__atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST) & 1) == idx)
+            return idx * IGVT_RCU_STRIPES + stripe;
+
+        __atomic_sub_fetch(&rcu->readers[idx][stripe].count, 1,
+                           __ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void
+_rcu_read_unlock(struct igvt_rcu *rcu, int token)
+{
+    __atomic_sub_fetch(&rcu->readers[token / IGVT_RCU_STRIPES]
+                                    [token % IGVT_RCU_STRIPES].count,
+                       1, __ATOMIC_RELEASE);
+}
+
+static inline int
+igvt_is_valid_port_p(gt_port port)
+{
+    switch (port) {
+        case PORT_EDP:
+        case PORT_B:
+        case PORT_C:
+        case PORT_D:
+        case PORT_VGA:
+            return 1;
+        break;
+
+        default:
+            return 0;
+        break;
+    }
+
+    return 0;
+}
+
+#define EDID_BLOCK_SIZE 128
+#define EDID_MAX_SIZE 256
+#define EDID_EXTENSION_COUNT 126
+
+typedef enum {
+    EDID_EXT_UNKNOWN = 0,
+    EDID_EXT_SUPPORTED,
+    EDID_EXT_UNSUPPORTED
+} edid_ext_state;
+
+/* The vgt sysfs attributes the library uses */
+typedef enum {
+    IGVT_ATTR_CONNECTION = 0,   /* vm<domid>/<port>/connection */
+    IGVT_ATTR_PORT_OVERRIDE,    /* vm<domid>/<port>/port_override */
+    IGVT_ATTR_EDID,             /* vm<domid>/<port>/edid */
+    IGVT_ATTR_PRESENCE,         /* control/<port>/presence */
+    IGVT_ATTR_FOREGROUND_VM,    /* control/foreground_vm */
+    IGVT_ATTR_CREATE_INSTANCE,  /* control/create_vgt_instance */
+    IGVT_NUM_ATTRS
+} igvt_attr;
+
+/* Attributes that live under vm<domid> rather than control */
+#define IGVT_ATTR_VM_P(attr) ((attr) <= IGVT_ATTR_EDID)
+
+/* Open file descriptors for the attributes of one VM, or of control */
+struct attr_fds {
+    struct attr_fds *next;
+    unsigned int domid;
+    int fds[GVT_MAX_PORTS][IGVT_NUM_ATTRS];
+};
+
+#define IGVT_VM_FD_BUCKETS 64
+
+/* The threads that make the calls submitted through async.c */
+#define IGVT_ASYNC_THREADS 4
+
+/* How long an extended EDID write may block before we give up on it */
+#define EDID_WRITE_TIMEOUT_MS 2000
+
+/* One write of a batch, see _attr_write_batch */
+struct attr_write {
+    igvt_attr attr;
+    unsigned int domid;
+    gt_port port;
+    const void *buf;
+    size_t size;
+    int link;           /* only write the next one if this one succeeds */
+    int handle;
+    ssize_t result;
+};
+
+/*
+ * An I/O backend, see io.c. Handles are what open_attr returns, cached
+ * by attr.c and passed back with the attribute they were opened for;
+ * every call returns -errno on failure.
+ */
+struct igvt_io {
+    const char *name;
+    int (*available)(igvt_ctx *ctx);
+    int (*vm_exists)(igvt_ctx *ctx, unsigned int domid);
+    int (*open_attr)(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                     gt_port port);
+    ssize_t (*read_attr)(igvt_ctx *ctx, int handle, igvt_attr attr,
+                         unsigned int domid, gt_port port,
+                         void *buf, size_t size);
+    ssize_t (*write_attr)(igvt_ctx *ctx, int handle, igvt_attr attr,
+                          unsigned int domid, gt_port port,
+                          const void *buf, size_t size);
+    /* The size the attribute reports, for probing the EDID limit */
+    ssize_t (*attr_size)(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                         gt_port port);
+    void (*close_attr)(igvt_ctx *ctx, int handle);
+    /* A new descriptor that polls ready when the attribute changes */
+    int (*watch)(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                 gt_port port);
+    /* Set a value as the kernel would report it, for replays; optional */
+    int (*seed)(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                gt_port port, const void *value, size_t size);
+    /*
+     * Issue the writes of a batch that have a handle all at once,
+     * filling in their results; a write it didn't get to has its
+     * handle set to -1. Returns -errno, having written nothing, if the
+     * batch can't be issued this way. Optional.
+     */
+    int (*write_batch)(igvt_ctx *ctx, struct attr_write *writes, size_t n);
+    /*
+     * Fill in up to max of the VMs' domain IDs, in no particular order.
+     * Returns how many VMs there are, which may be more than max, or
+     * -errno.
+     */
+    ssize_t (*list_vms)(igvt_ctx *ctx, unsigned int *domids, size_t max);
+};
+
+struct physical_port {
+    int connected;
+    size_t edid_size;
+    unsigned char edid[EDID_MAX_SIZE];
+};
+
+struct connector_table;
+struct mirror;
+struct recorder_ring;
+struct stats_shard;
+struct igvt_sim;
+struct igvt_uring;
+struct stage;
+struct edid_store;
+struct journal;
+struct async_op;
+
+#define IGVT_RECORDER_DEFAULT_EVENTS 4096
+#define IGVT_RECORDER_MAX_EVENTS (1 << 20)   /* per stripe */
+
+/* drm.c state */
+struct igvt_drm {
+    /* Serialises discovery; readers load connectors under rcu */
+    pthread_mutex_t connector_lock;
+    struct igvt_rcu rcu;
+    struct connector_table *connectors;
+
+    pthread_mutex_t mirror_lock;
+    struct physical_port physical_ports[GVT_MAX_PORTS];
+    int physical_ports_valid;
+    struct mirror *mirrors;
+    size_t n_mirrors;
+    size_t mirrors_size;
+    uint64_t settle_ns;     /* hotplug debounce window */
+    int uevent_fd;
+};
+
+struct igvt_ctx {
+    char vgt_root[IGVT_ROOT_MAX];
+    char drm_root[IGVT_ROOT_MAX];
+
+    int (*loggers[IGVT_NUM_LOGGERS])(const char *text);
+    int log_level;
+
+    edid_ext_state edid_ext;
+
+    /*
+     * attr.c. fd_lock serialises changes to the fd cache; reads of it
+     * only enter an rcu read section.
+     */
+    pthread_mutex_t fd_lock;
+    struct igvt_rcu fd_rcu;
+    int vgt_is_sysfs;
+    struct attr_fds control_fds;
+    struct attr_fds *vm_fds[IGVT_VM_FD_BUCKETS];
+
+    /*
+     * The backend the handles belong to, and the one I/O goes through:
+     * the same, unless the I/O trace tee is on top.
+     */
+    const struct igvt_io *io_base;
+    const struct igvt_io *io;
+    struct igvt_sim *sim;
+
+    /* uring.c, only used under uring_lock */
+    pthread_mutex_t uring_lock;
+    struct igvt_uring *uring;
+    int uring_state;
+
+    struct igvt_drm drm;
+
+    /* recorder.c */
+    pthread_mutex_t recorder_lock;
+    struct igvt_rcu recorder_rcu;
+    struct recorder_ring *recorder;
+
+    /* stats.c, one shard per rcu stripe */
+    struct stats_shard *stats[IGVT_RCU_STRIPES];
+
+    /* trace.c; trace is loaded without the lock to test for tracing */
+    pthread_mutex_t trace_lock;
+    FILE *trace;
+
+    /* iotrace.c */
+    pthread_mutex_t iotrace_lock;
+    FILE *iotrace;
+    uint64_t iotrace_start;
+
+    /* stage.c */
+    pthread_mutex_t stage_lock;
+    struct stage *stages;
+
+    /* edid_store.c; readers load edid_store under rcu */
+    pthread_mutex_t edid_store_lock;
+    struct igvt_rcu edid_store_rcu;
+    struct edid_store *edid_store;
+
+    /* async.c */
+    pthread_mutex_t async_lock;
+    pthread_cond_t async_cond;
+    struct async_op *async_queue, **async_queue_tail;
+    struct async_op *async_done, **async_done_tail;
+    int async_fd;
+    int async_stopping;
+    unsigned int async_n_threads;
+    pthread_t async_threads[IGVT_ASYNC_THREADS];
+
+    /* journal.c; journaled calls load journal under rcu */
+    pthread_mutex_t journal_lock;
+    struct igvt_rcu journal_rcu;
+    struct journal *journal;
+};
+
+/* igvt.c */
+IGVT_INTERNAL extern const char *const port_strings[GVT_MAX_PORTS];
+IGVT_INTERNAL igvt_ctx *_igvt_ctx(igvt_ctx *ctx);
+
+static inline int
+_igvt_log_p(igvt_ctx *ctx, igvt_log_type log_type)
+{
+    int level;
+
+    ctx = _igvt_ctx(ctx);
+    level = __atomic_load_n(&ctx->log_level, __ATOMIC_RELAXED);
+
+    if (level == IGVT_LOG_UNSET)
+        level = __atomic_load_n(&_igvt_ctx(NULL)->log_level,
+                                __ATOMIC_RELAXED);
+
+    return (int) log_type <= level;
+}
+
+IGVT_INTERNAL gt_port _translate_vgt_port(const char *name, size_t len);
+IGVT_INTERNAL int _enabled_p(igvt_ctx *ctx, unsigned int domid);
+IGVT_INTERNAL int _write_port_override(igvt_ctx *ctx, unsigned int domid,
+                                       gt_port vgt_port, gt_port pgt_port);
+IGVT_INTERNAL size_t _prepare_edid(igvt_ctx *ctx, unsigned int domid,
+                                  gt_port vgt_port, const unsigned char *edid,
+                                  size_t edid_size, unsigned char *filtered);
+IGVT_INTERNAL int _write_edid(igvt_ctx *ctx, unsigned int domid,
+                              gt_port vgt_port, const unsigned char *edid,
+                              size_t edid_size);
+IGVT_INTERNAL int _write_connection(igvt_ctx *ctx, unsigned int domid,
+                                    gt_port vgt_port, int connect);
+IGVT_INTERNAL int _plug_display(igvt_ctx *ctx, unsigned int domid,
+                                gt_port vgt_port, const unsigned char *edid,
+                                size_t edid_size, gt_port pgt_port,
+                                int filtered);
+IGVT_INTERNAL int _read_attr_word(igvt_ctx *ctx, igvt_attr attr,
+                                  unsigned int domid, gt_port port,
+                                  char *word, size_t size);
+IGVT_INTERNAL int _set_foreground_vm(igvt_ctx *ctx, unsigned int domid);
+IGVT_INTERNAL int _plug_displays(igvt_ctx *ctx, struct igvt_display *displays,
+                                 size_t n);
+
+/* attr.c */
+IGVT_INTERNAL const char *_attr_name(igvt_attr attr);
+IGVT_INTERNAL void _attr_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _attr_free(igvt_ctx *ctx);
+IGVT_INTERNAL void _attr_path(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                              gt_port port, char *path, size_t size);
+IGVT_INTERNAL ssize_t _attr_read(igvt_ctx *ctx, igvt_attr attr,
+                                 unsigned int domid, gt_port port,
+                                 void *buf, size_t size);
+IGVT_INTERNAL ssize_t _attr_write(igvt_ctx *ctx, igvt_attr attr,
+                                  unsigned int domid, gt_port port,
+                                  const void *buf, size_t size);
+IGVT_INTERNAL int _attr_open(igvt_ctx *ctx, igvt_attr attr,
+                             unsigned int domid, gt_port port);
+IGVT_INTERNAL void _attr_write_batch(igvt_ctx *ctx, struct attr_write *writes,
+                                     size_t n);
+IGVT_INTERNAL void _attr_forget_vm(igvt_ctx *ctx, unsigned int domid);
+IGVT_INTERNAL void _attr_set_io(igvt_ctx *ctx, const struct igvt_io *io);
+IGVT_INTERNAL void _attr_set_tee(igvt_ctx *ctx, int on);
+
+static inline const struct igvt_io *
+_attr_io(igvt_ctx *ctx)
+{
+    return __atomic_load_n(&ctx->io, __ATOMIC_ACQUIRE);
+}
+
+/* io.c */
+IGVT_INTERNAL extern const struct igvt_io _io_sysfs;
+IGVT_INTERNAL extern const struct igvt_io _io_null;
+
+/* uring.c */
+IGVT_INTERNAL int _uring_write_batch(igvt_ctx *ctx, struct attr_write *writes,
+                                     size_t n);
+IGVT_INTERNAL void _uring_free(igvt_ctx *ctx);
+
+/* stage.c */
+IGVT_INTERNAL void _stage_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _stage_free(igvt_ctx *ctx);
+
+/* edid_store.c */
+IGVT_INTERNAL void _edid_store_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _edid_store_free(igvt_ctx *ctx);
+
+/* async.c */
+IGVT_INTERNAL void _async_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _async_free(igvt_ctx *ctx);
+
+/* journal.c */
+
+/* A journaled call in flight */
+struct journal_op {
+    struct journal *journal;
+    uint64_t seq;
+    igvt_op op;
+    int token;
+};
+
+IGVT_INTERNAL void _journal_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _journal_free(igvt_ctx *ctx);
+IGVT_INTERNAL int _journal_begin(igvt_ctx *ctx, struct journal_op *jop,
+                                 igvt_op op, unsigned int domid,
+                                 gt_port vgt_port, gt_port pgt_port,
+                                 const uint32_t *args,
+                                 const unsigned char *edid, size_t edid_size,
+                                 int sync);
+IGVT_INTERNAL int _journal_sync(igvt_ctx *ctx, const struct journal_op *jop);
+IGVT_INTERNAL void _journal_end(igvt_ctx *ctx, struct journal_op *jop);
+
+/* sim.c */
+IGVT_INTERNAL extern const struct igvt_io _io_sim;
+IGVT_INTERNAL int _sim_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _sim_free(igvt_ctx *ctx);
+
+/* drm.c */
+IGVT_INTERNAL void _drm_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _drm_free(igvt_ctx *ctx);
+IGVT_INTERNAL gt_port _translate_i915_port(const char *i915_port_name);
+IGVT_INTERNAL const char *_translate_pgt_port(igvt_ctx *ctx, gt_port pgt_port);
+IGVT_INTERNAL size_t _physical_edid(igvt_ctx *ctx, gt_port pgt_port,
+                                    unsigned char *edid, size_t edid_size);
+
+/* recorder.c */
+IGVT_INTERNAL void _recorder_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _recorder_free(igvt_ctx *ctx);
+IGVT_INTERNAL uint64_t _recorder_now(void);
+IGVT_INTERNAL void _recorder_record(igvt_ctx *ctx, igvt_op op,
+                                    unsigned int domid, gt_port port,
+                                    int result, uint64_t start);
+
+/* stats.c */
+IGVT_INTERNAL void _stats_free(igvt_ctx *ctx);
+IGVT_INTERNAL void _stats_record(igvt_ctx *ctx, igvt_op op, int result,
+                                 uint64_t latency, int timed);
+IGVT_INTERNAL void _stats_bytes_written(igvt_ctx *ctx, size_t n);
+IGVT_INTERNAL void _stats_hotplug(igvt_ctx *ctx,
+                                  const struct igvt_hotplug_stats *delta);
+
+/* trace.c */
+IGVT_INTERNAL void _trace_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _trace_free(igvt_ctx *ctx);
+IGVT_INTERNAL void _trace_end(igvt_ctx *ctx, const char *name, uint64_t start,
+                              unsigned int domid, gt_port port, int result);
+
+/**
+ * @brief Start timing a phase for the Chrome trace
+ *
+ * @return the start time, or 0 if no trace is running
+ */
+static inline uint64_t
+_trace_begin(igvt_ctx *ctx)
+{
+    return __atomic_load_n(&ctx->trace, __ATOMIC_RELAXED) ?
+           _recorder_now() : 0;
+}
+
+/**
+ * @brief Start timing an API call for _recorder_record
+ *
+ * @return the start time, or 0 if neither the flight recorder nor a
+ *         trace is running, so the call needn't be timed
+ */
+static inline uint64_t
+_recorder_begin(igvt_ctx *ctx)
+{
+    return __atomic_load_n(&ctx->recorder, __ATOMIC_RELAXED) ||
+           __atomic_load_n(&ctx->trace, __ATOMIC_RELAXED) ?
+           _recorder_now() : 0;
+}
+
+/* iotrace.c */
+IGVT_INTERNAL extern const struct igvt_io _io_tee;
+IGVT_INTERNAL void _iotrace_init(igvt_ctx *ctx);
+IGVT_INTERNAL void _iotrace_free(igvt_ctx *ctx);
+
+/* edid.c */
+IGVT_INTERNAL void _filter_edid(unsigned char *edid, size_t edid_size,
+                                int analog_port);
+IGVT_INTERNAL size_t _fixup_edid_extensions(unsigned char *edid,
+                                            size_t edid_size);
+
+#endif
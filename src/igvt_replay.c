@@ -0,0 +1,152 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file igvt_replay.c
+ *
+ * @brief Replay an attribute I/O trace on a simulated vgt, for benchmarking
+ *
+ *   igvt-replay [-s speed] [-b simulator] trace
+ *   igvt-replay [-s speed] -b files trace root
+ *   igvt-replay -l trace
+ *
+ * The trace is replayed on the in-memory simulator by default, or with
+ * -b files on a vgt root made of plain files, created as needed. A
+ * speed of 0 replays as fast as possible; -l lists the trace instead.
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "igvt.h"
+
+static int list(const char *path)
+{
+    struct igvt_iotrace_header h;
+    struct igvt_iotrace_record r;
+    unsigned char data[IGVT_IOTRACE_MAX_DATA];
+    FILE *f;
+
+    f = fopen(path, "r");
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != IGVT_IOTRACE_MAGIC) {
+        fprintf(stderr, "%s: not an I/O trace\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.size > sizeof(data) || (r.size && fread(data, r.size, 1, f) != 1))
+            break;
+
+        printf("%12.3f us %8.3f us %-5s vm%-5u port %u %-20s %d\n",
+               r.timestamp / 1000.0, r.latency / 1000.0,
+               r.op == IGVT_IOTRACE_READ ? "read" : "write", r.domid,
+               r.port, igvt_iotrace_attr_name(r.attr), r.result);
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct igvt_iotrace_replay_result res;
+    igvt_ctx *ctx;
+    const char *root = NULL;
+    double speed = 1.0;
+    int opt, listing = 0, files = 0, status;
+
+    while ((opt = getopt(argc, argv, "b:ls:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "files") == 0)
+                files = 1;
+            else if (strcmp(optarg, "simulator") != 0)
+                goto usage;
+            break;
+        case 'l':
+            listing = 1;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (listing && optind + 1 == argc)
+        return list(argv[optind]);
+
+    if (listing || optind + 1 + files != argc)
+        goto usage;
+
+    if (files) {
+        root = argv[optind + 1];
+
+        if (mkdir(root, 0755) < 0 && errno != EEXIST) {
+            perror(root);
+            return 1;
+        }
+    }
+
+    ctx = igvt_ctx_new(root, root);
+
+    if (!ctx) {
+        perror("igvt_ctx_new");
+        return 1;
+    }
+
+    status = files ? 0 : igvt_ctx_set_backend(ctx, IGVT_BACKEND_SIMULATOR);
+
+    if (status < 0) {
+        fprintf(stderr, "simulator: %s\n", strerror(-status));
+        igvt_ctx_free(ctx);
+        return 1;
+    }
+
+    igvt_ctx_set_log_level(ctx, IGVT_LOG_NONE);
+
+    status = igvt_ctx_iotrace_replay(ctx, argv[optind], speed, &res);
+    igvt_ctx_free(ctx);
+
+    if (status < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(-status));
+        return 1;
+    }
+
+    printf("ops %llu mismatches %llu\n"
+           "elapsed %.3f ms (recorded %.3f ms)\n"
+           "time in I/O %.3f ms (recorded %.3f ms)\n",
+           (unsigned long long) res.ops, (unsigned long long) res.mismatches,
+           res.elapsed / 1e6, res.recorded_elapsed / 1e6,
+           res.latency_sum / 1e6, res.recorded_latency_sum / 1e6);
+
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-s speed] [-b simulator] trace\n"
+                    "       %s [-s speed] -b files trace root\n"
+                    "       %s -l trace\n", argv[0], argv[0], argv[0]);
+    return 2;
+}
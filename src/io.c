@@ -0,0 +1,555 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file io.c
+ *
+ * @brief The I/O backends: where a context's vgt attributes live.
+ *
+ * attr.c caches the handles a backend's open_attr returns and does all
+ * attribute I/O through the context's backend. The sysfs backend is
+ * the real thing, and also drives a vgt root made of plain files. The
+ * null backend accepts everything and does nothing, so that running
+ * the library against it measures the library alone. The simulator
+ * lives in sim.c, the tee that records I/O traces in iotrace.c, and
+ * the sysfs backend's batched writes in uring.c.
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+static int sysfs_available(igvt_ctx *ctx)
+{
+    struct stat st;
+
+    /*
+     * If the top level path to the igvt info is missing
+     * then igvt isn't supported on this machine.
+     */
+    return stat(ctx->vgt_root, &st) == 0;
+}
+
+static int sysfs_vm_exists(igvt_ctx *ctx, unsigned int domid)
+{
+    char path[256];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/vm%d", ctx->vgt_root, domid);
+
+    if (stat(path, &st) != 0) {
+	igvt_printf(ctx, IGVT_DEBUG, "%s::cannot stat %s: %s\n",
+		    __func__, path, igvt_strerror(errno));
+
+        return 0;
+    }
+
+    return 1;
+}
+
+static int sysfs_open_attr(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                           gt_port port)
+{
+    char path[256];
+    int fd;
+
+    _attr_path(ctx, attr, domid, port, path, sizeof(path));
+
+    fd = open(path, (attr == IGVT_ATTR_PRESENCE ? O_RDONLY : O_RDWR) |
+                    O_CLOEXEC);
+
+    /* Some attributes are write only */
+    if (fd < 0 && errno == EACCES && attr != IGVT_ATTR_PRESENCE)
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::error opening %s: %s\n",
+                    __func__, path, igvt_strerror(errno));
+
+        return -errno;
+    }
+
+    return fd;
+}
+
+static ssize_t sysfs_read_attr(igvt_ctx *ctx, int fd, igvt_attr attr,
+                               unsigned int domid, gt_port port,
+                               void *buf, size_t size)
+{
+    ssize_t n = pread(fd, buf, size, 0);
+
+    return n < 0 ? -errno : n;
+}
+
+struct edid_write {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    int done;
+    int result;
+    char path[256];
+    size_t size;
+    unsigned char data[EDID_MAX_SIZE];
+};
+
+static void edid_write_put(struct edid_write *w)
+{
+    int refs;
+
+    pthread_mutex_lock(&w->lock);
+    refs = --w->refs;
+    pthread_mutex_unlock(&w->lock);
+
+    if (refs == 0) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        free(w);
+    }
+}
+
+static void *edid_write_thread(void *arg)
+{
+    struct edid_write *w = arg;
+    size_t off;
+    ssize_t n;
+    int fd, result = 0;
+
+    fd = open(w->path, O_WRONLY);
+
+    if (fd < 0) {
+        result = -errno;
+    } else {
+        /* One block per write, so a kernel that stalls does so on a
+         * block boundary. */
+        for (off = 0; off < w->size; off += EDID_BLOCK_SIZE) {
+            n = pwrite(fd, w->data + off, EDID_BLOCK_SIZE, off);
+
+            if (n != EDID_BLOCK_SIZE) {
+                /* errno is only meaningful if the write failed */
+                result = n < 0 ? -errno : -EIO;
+                break;
+            }
+        }
+
+        close(fd);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->result = result;
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    edid_write_put(w);
+
+    return NULL;
+}
+
+/**
+ * @brief Write a multi-block EDID under a watchdog
+ *
+ * The blocks are written from a helper thread. If the kernel doesn't
+ * complete the write within EDID_WRITE_TIMEOUT_MS the helper is
+ * abandoned, extension writes are disabled for the rest of the context
+ * and -ETIMEDOUT is returned, so the caller can retry with 128 bytes.
+ *
+ * @return edid_size on success, -errno on failure
+ */
+static ssize_t sysfs_write_edid_chunked(igvt_ctx *ctx, const char *path,
+                                        const unsigned char *edid,
+                                        size_t edid_size)
+{
+    struct edid_write *w;
+    pthread_condattr_t attr;
+    pthread_t thread;
+    struct timespec deadline;
+    int status = 0;
+
+    w = calloc(1, sizeof(*w));
+
+    if (!w)
+        return -ENOMEM;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    memcpy(w->data, edid, edid_size);
+    w->size = edid_size;
+    w->refs = 2;
+
+    if (pthread_create(&thread, NULL, edid_write_thread, w) != 0) {
+        w->refs = 1;
+        edid_write_put(w);
+        return -EAGAIN;
+    }
+
+    pthread_detach(thread);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += EDID_WRITE_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (EDID_WRITE_TIMEOUT_MS % 1000) * 1000000L;
+
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    while (!w->done && status == 0)
+        status = pthread_cond_timedwait(&w->cond, &w->lock, &deadline);
+
+    status = w->done ? w->result : -ETIMEDOUT;
+
+    pthread_mutex_unlock(&w->lock);
+
+    edid_write_put(w);
+
+    if (status == -ETIMEDOUT) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::EDID write to %s timed out, "
+                    "falling back to %d byte EDIDs\n",
+                    __func__, path, EDID_BLOCK_SIZE);
+
+        __atomic_store_n(&ctx->edid_ext, EDID_EXT_UNSUPPORTED,
+                         __ATOMIC_RELAXED);
+    }
+
+    return status < 0 ? status : (ssize_t) edid_size;
+}
+
+static ssize_t sysfs_write_attr(igvt_ctx *ctx, int fd, igvt_attr attr,
+                                unsigned int domid, gt_port port,
+                                const void *buf, size_t size)
+{
+    char path[256];
+    ssize_t n;
+
+    if (attr == IGVT_ATTR_EDID && size > EDID_BLOCK_SIZE) {
+        _attr_path(ctx, attr, domid, port, path, sizeof(path));
+
+        return sysfs_write_edid_chunked(ctx, path, buf, size);
+    }
+
+    n = pwrite(fd, buf, size, 0);
+
+    /*
+     * Outside sysfs (e.g. a simulated vgt) the attributes are plain
+     * files, and a short value must not leave the tail of a longer one
+     * behind.
+     */
+    if (n >= 0 && !ctx->vgt_is_sysfs && attr != IGVT_ATTR_EDID &&
+        ftruncate(fd, n) < 0)
+        n = -1;
+
+    return n < 0 ? -errno : n;
+}
+
+static ssize_t sysfs_attr_size(igvt_ctx *ctx, igvt_attr attr,
+                               unsigned int domid, gt_port port)
+{
+    char path[256];
+    struct stat st;
+
+    _attr_path(ctx, attr, domid, port, path, sizeof(path));
+
+    return stat(path, &st) == 0 ? st.st_size : -errno;
+}
+
+static void sysfs_close_attr(igvt_ctx *ctx, int fd)
+{
+    close(fd);
+}
+
+/* sysfs attributes poll with POLLPRI once read, if the driver notifies */
+static int sysfs_watch(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                       gt_port port)
+{
+    char path[256], buf[16];
+    int fd;
+
+    _attr_path(ctx, attr, domid, port, path, sizeof(path));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+
+    if (fd < 0)
+        return -errno;
+
+    if (pread(fd, buf, sizeof(buf), 0) < 0) {
+        close(fd);
+        return -errno;
+    }
+
+    return fd;
+}
+
+/* mkdir -p the directory part of path */
+static int make_parents(char *path)
+{
+    char *p;
+
+    for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            *p = '/';
+            return -errno;
+        }
+
+        *p = '/';
+    }
+
+    return 0;
+}
+
+/* Only a vgt made of plain files can be seeded, never the kernel's */
+static int sysfs_seed(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                      gt_port port, const void *value, size_t size)
+{
+    char path[256];
+    int fd, status;
+
+    if (ctx->vgt_is_sysfs)
+        return -EPERM;
+
+    _attr_path(ctx, attr, domid, port, path, sizeof(path));
+
+    status = make_parents(path);
+
+    if (status < 0)
+        return status;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return -errno;
+
+    status = 0;
+
+    if (value && (ftruncate(fd, 0) < 0 || pwrite(fd, value, size, 0) < 0))
+        status = -errno;
+
+    close(fd);
+
+    return status;
+}
+
+/* The vm<domid> directories, read in one pass of getdents */
+static ssize_t sysfs_list_vms(igvt_ctx *ctx, unsigned int *domids,
+                              size_t max)
+{
+    struct dirent *de;
+    unsigned long domid;
+    ssize_t n = 0;
+    char *end;
+    DIR *dir;
+    int err;
+
+    dir = opendir(ctx->vgt_root);
+
+    if (!dir) {
+        err = errno;
+        igvt_printf(ctx, IGVT_ERROR, "%s::cannot open %s: %s\n",
+                    __func__, ctx->vgt_root, igvt_strerror(err));
+        return -err;
+    }
+
+    while ((de = readdir(dir))) {
+        if (strncmp(de->d_name, "vm", 2) != 0 ||
+            de->d_name[2] < '0' || de->d_name[2] > '9')
+            continue;
+
+        domid = strtoul(de->d_name + 2, &end, 10);
+
+        if (*end || domid == 0 || domid > UINT_MAX)
+            continue;
+
+        if ((size_t) n < max)
+            domids[n] = domid;
+
+        n++;
+    }
+
+    closedir(dir);
+
+    return n;
+}
+
+const struct igvt_io _io_sysfs = {
+    .name = "sysfs",
+    .available = sysfs_available,
+    .vm_exists = sysfs_vm_exists,
+    .open_attr = sysfs_open_attr,
+    .read_attr = sysfs_read_attr,
+    .write_attr = sysfs_write_attr,
+    .attr_size = sysfs_attr_size,
+    .close_attr = sysfs_close_attr,
+    .watch = sysfs_watch,
+    .seed = sysfs_seed,
+    .write_batch = _uring_write_batch,
+    .list_vms = sysfs_list_vms,
+};
+
+static int null_available(igvt_ctx *ctx)
+{
+    return 1;
+}
+
+static int null_vm_exists(igvt_ctx *ctx, unsigned int domid)
+{
+    return 1;
+}
+
+static int null_open_attr(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                          gt_port port)
+{
+    return 0;
+}
+
+static ssize_t null_read_attr(igvt_ctx *ctx, int handle, igvt_attr attr,
+                              unsigned int domid, gt_port port,
+                              void *buf, size_t size)
+{
+    return 0;
+}
+
+static ssize_t null_write_attr(igvt_ctx *ctx, int handle, igvt_attr attr,
+                               unsigned int domid, gt_port port,
+                               const void *buf, size_t size)
+{
+    return size;
+}
+
+static ssize_t null_attr_size(igvt_ctx *ctx, igvt_attr attr,
+                              unsigned int domid, gt_port port)
+{
+    return EDID_MAX_SIZE;
+}
+
+static void null_close_attr(igvt_ctx *ctx, int handle)
+{
+}
+
+static ssize_t null_list_vms(igvt_ctx *ctx, unsigned int *domids, size_t max)
+{
+    return 0;
+}
+
+static int null_watch(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                      gt_port port)
+{
+    return -EOPNOTSUPP;
+}
+
+const struct igvt_io _io_null = {
+    .name = "null",
+    .available = null_available,
+    .vm_exists = null_vm_exists,
+    .open_attr = null_open_attr,
+    .read_attr = null_read_attr,
+    .write_attr = null_write_attr,
+    .attr_size = null_attr_size,
+    .close_attr = null_close_attr,
+    .watch = null_watch,
+    .list_vms = null_list_vms,
+};
+
+/**
+ * @brief Choose where a context's vgt attributes live
+ *
+ * Descriptors opened through the previous backend are closed. Switch
+ * before other threads start using the context.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param backend
+ * @return 0 on success, -EINVAL for an unknown backend, or -errno if
+ *         the backend couldn't be set up
+ */
+int igvt_ctx_set_backend(igvt_ctx *ctx, igvt_backend backend)
+{
+    const struct igvt_io *io;
+    int status;
+
+    ctx = _igvt_ctx(ctx);
+
+    switch (backend) {
+    case IGVT_BACKEND_SYSFS:
+        io = &_io_sysfs;
+        break;
+
+    case IGVT_BACKEND_SIMULATOR:
+        status = _sim_init(ctx);
+
+        if (status < 0)
+            return status;
+
+        io = &_io_sim;
+        break;
+
+    case IGVT_BACKEND_NULL:
+        io = &_io_null;
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    _attr_set_io(ctx, io);
+
+    /* The new backend's EDID limit is yet to be probed */
+    __atomic_store_n(&ctx->edid_ext, EDID_EXT_UNKNOWN, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+int igvt_set_backend(igvt_backend backend)
+{
+    return igvt_ctx_set_backend(NULL, backend);
+}
+
+/**
+ * @brief Get a descriptor to poll for changes to a port's connection
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param domid The domain ID
+ * @param vgt_port
+ * @return a descriptor for the caller to close, or -errno
+ */
+int igvt_ctx_connection_watch_fd(igvt_ctx *ctx, unsigned int domid,
+                                 gt_port vgt_port)
+{
+    ctx = _igvt_ctx(ctx);
+
+    if (!igvt_is_valid_port_p(vgt_port))
+        return -EINVAL;
+
+    return _attr_io(ctx)->watch(ctx, IGVT_ATTR_CONNECTION, domid, vgt_port);
+}
+
+int igvt_connection_watch_fd(unsigned int domid, gt_port vgt_port)
+{
+    return igvt_ctx_connection_watch_fd(NULL, domid, vgt_port);
+}
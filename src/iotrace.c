@@ -0,0 +1,489 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file iotrace.c
+ *
+ * @brief Recording vgt attribute I/O, and replaying it on a simulated vgt.
+ *
+ * While a recording is running a tee backend sits on top of the
+ * context's I/O backend, and appends every attribute read and write to
+ * a binary file: a struct igvt_iotrace_record, followed by the bytes
+ * written or, for a read, the bytes the kernel returned. Records go
+ * through stdio under iotrace_lock. When nothing is being recorded the
+ * tee is out of the way entirely.
+ *
+ * Records are appended as calls complete, so calls made concurrently
+ * from several threads can land in the file out of the order they were
+ * issued in. Calls that were already running when the recording
+ * started are left out.
+ *
+ * Replay reissues the same reads and writes through the same attribute
+ * code, at the recorded times or as fast as possible, against the
+ * simulator or a vgt root made of plain files. It is serial: calls are
+ * sorted back into the order they started in and each is issued when
+ * the previous one returns, so calls that overlapped in production
+ * don't overlap in the replay. What it reproduces is the sequence of
+ * calls, their results and the data each read saw, not the contention
+ * between threads. Each read is first seeded with the value the kernel
+ * returned, so the library sees what it saw in production.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+void _iotrace_init(igvt_ctx *ctx)
+{
+    pthread_mutex_init(&ctx->iotrace_lock, NULL);
+    ctx->iotrace = NULL;
+}
+
+void _iotrace_free(igvt_ctx *ctx)
+{
+    igvt_ctx_iotrace_stop(ctx);
+    pthread_mutex_destroy(&ctx->iotrace_lock);
+}
+
+static void iotrace_record(igvt_ctx *ctx, igvt_iotrace_op op,
+                           igvt_attr attr, unsigned int domid, gt_port port,
+                           const void *data, size_t size, ssize_t result,
+                           uint64_t start)
+{
+    struct igvt_iotrace_record r;
+    uint64_t end = _recorder_now();
+
+    memset(&r, 0, sizeof(r));
+    r.latency = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+    r.result = result;
+    r.domid = domid;
+    r.op = op;
+    r.attr = attr;
+    r.port = port;
+    r.size = size;
+
+    pthread_mutex_lock(&ctx->iotrace_lock);
+
+    /*
+     * The recording may have stopped since the tee was entered, or
+     * been restarted, leaving a call that began before this trace did
+     */
+    if (ctx->iotrace && start >= ctx->iotrace_start) {
+        r.timestamp = start - ctx->iotrace_start;
+
+        fwrite(&r, sizeof(r), 1, ctx->iotrace);
+
+        if (r.size)
+            fwrite(data, r.size, 1, ctx->iotrace);
+    }
+
+    pthread_mutex_unlock(&ctx->iotrace_lock);
+}
+
+static int tee_available(igvt_ctx *ctx)
+{
+    return ctx->io_base->available(ctx);
+}
+
+static int tee_vm_exists(igvt_ctx *ctx, unsigned int domid)
+{
+    return ctx->io_base->vm_exists(ctx, domid);
+}
+
+static int tee_open_attr(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                         gt_port port)
+{
+    return ctx->io_base->open_attr(ctx, attr, domid, port);
+}
+
+static ssize_t tee_read_attr(igvt_ctx *ctx, int handle, igvt_attr attr,
+                             unsigned int domid, gt_port port,
+                             void *buf, size_t size)
+{
+    uint64_t start = _recorder_now();
+    ssize_t n;
+
+    n = ctx->io_base->read_attr(ctx, handle, attr, domid, port, buf, size);
+    iotrace_record(ctx, IGVT_IOTRACE_READ, attr, domid, port, buf,
+                   n > 0 ? n : 0, n, start);
+
+    return n;
+}
+
+static ssize_t tee_write_attr(igvt_ctx *ctx, int handle, igvt_attr attr,
+                              unsigned int domid, gt_port port,
+                              const void *buf, size_t size)
+{
+    uint64_t start = _recorder_now();
+    ssize_t n;
+
+    n = ctx->io_base->write_attr(ctx, handle, attr, domid, port, buf, size);
+    iotrace_record(ctx, IGVT_IOTRACE_WRITE, attr, domid, port, buf, size, n,
+                   start);
+
+    return n;
+}
+
+static ssize_t tee_attr_size(igvt_ctx *ctx, igvt_attr attr,
+                             unsigned int domid, gt_port port)
+{
+    return ctx->io_base->attr_size(ctx, attr, domid, port);
+}
+
+static void tee_close_attr(igvt_ctx *ctx, int handle)
+{
+    ctx->io_base->close_attr(ctx, handle);
+}
+
+static int tee_watch(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                     gt_port port)
+{
+    return ctx->io_base->watch(ctx, attr, domid, port);
+}
+
+static int tee_seed(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                    gt_port port, const void *value, size_t size)
+{
+    if (!ctx->io_base->seed)
+        return 0;
+
+    return ctx->io_base->seed(ctx, attr, domid, port, value, size);
+}
+
+static ssize_t tee_list_vms(igvt_ctx *ctx, unsigned int *domids, size_t max)
+{
+    return ctx->io_base->list_vms(ctx, domids, max);
+}
+
+const struct igvt_io _io_tee = {
+    .name = "tee",
+    .available = tee_available,
+    .vm_exists = tee_vm_exists,
+    .open_attr = tee_open_attr,
+    .read_attr = tee_read_attr,
+    .write_attr = tee_write_attr,
+    .attr_size = tee_attr_size,
+    .close_attr = tee_close_attr,
+    .watch = tee_watch,
+    .seed = tee_seed,
+    .list_vms = tee_list_vms,
+};
+
+/**
+ * @brief Start recording attribute I/O
+ *
+ * Any recording already running on the context is finished first.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param path The trace file to write
+ * @return 0 on success, -errno on failure
+ */
+int igvt_ctx_iotrace_start(igvt_ctx *ctx, const char *path)
+{
+    struct igvt_iotrace_header h;
+    FILE *f;
+
+    ctx = _igvt_ctx(ctx);
+
+    f = fopen(path, "we");
+
+    if (!f)
+        return -errno;
+
+    igvt_ctx_iotrace_stop(ctx);
+
+    memset(&h, 0, sizeof(h));
+    h.magic = IGVT_IOTRACE_MAGIC;
+    h.version = IGVT_IOTRACE_VERSION;
+    h.record_size = sizeof(struct igvt_iotrace_record);
+    h.start = _recorder_now();
+
+    if (fwrite(&h, sizeof(h), 1, f) != 1) {
+        fclose(f);
+        return -EIO;
+    }
+
+    pthread_mutex_lock(&ctx->iotrace_lock);
+    ctx->iotrace_start = h.start;
+    ctx->iotrace = f;
+    pthread_mutex_unlock(&ctx->iotrace_lock);
+
+    _attr_set_tee(ctx, 1);
+
+    return 0;
+}
+
+int igvt_iotrace_start(const char *path)
+{
+    return igvt_ctx_iotrace_start(NULL, path);
+}
+
+/**
+ * @brief Finish recording attribute I/O
+ *
+ * @param ctx The context, or NULL for the default context
+ * @return 0 on success, -ENOENT if nothing was being recorded, or
+ *         -errno if the trace couldn't be written out
+ */
+int igvt_ctx_iotrace_stop(igvt_ctx *ctx)
+{
+    FILE *f;
+    int status = 0;
+
+    ctx = _igvt_ctx(ctx);
+
+    pthread_mutex_lock(&ctx->iotrace_lock);
+    f = ctx->iotrace;
+    ctx->iotrace = NULL;
+    pthread_mutex_unlock(&ctx->iotrace_lock);
+
+    if (f)
+        _attr_set_tee(ctx, 0);
+
+    if (!f)
+        return -ENOENT;
+
+    if (ferror(f))
+        status = -EIO;
+
+    if (fclose(f) != 0 && status == 0)
+        status = -errno;
+
+    return status;
+}
+
+int igvt_iotrace_stop(void)
+{
+    return igvt_ctx_iotrace_stop(NULL);
+}
+
+/**
+ * @brief Name an attribute in an I/O trace
+ *
+ * @return the attribute's file name, or "unknown"
+ */
+const char *igvt_iotrace_attr_name(unsigned int attr)
+{
+    return attr < IGVT_NUM_ATTRS ? _attr_name(attr) : "unknown";
+}
+
+/*
+ * Make sure a replayed attribute exists, and for a read give it the
+ * value the kernel returned when it was recorded.
+ */
+static int replay_seed(igvt_ctx *ctx, const struct igvt_iotrace_record *r,
+                       const unsigned char *data)
+{
+    const struct igvt_io *io = _attr_io(ctx);
+
+    /* Leave what failed in production to fail the same way */
+    if (r->result < 0 || !io->seed)
+        return 0;
+
+    return io->seed(ctx, r->attr, r->domid, r->port,
+                    r->op == IGVT_IOTRACE_READ ? data : NULL, r->size);
+}
+
+/* Where a record is in the trace file, so it can be replayed in order */
+struct replay_entry {
+    uint64_t timestamp;
+    long offset;
+};
+
+static int replay_entry_cmp(const void *a, const void *b)
+{
+    const struct replay_entry *x = a, *y = b;
+
+    if (x->timestamp != y->timestamp)
+        return x->timestamp < y->timestamp ? -1 : 1;
+
+    /* Calls that started together stay in the order they were written */
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Index the records after the header by the time each call started.
+ * Returns the number of records, or -errno.
+ */
+static ssize_t replay_index(FILE *f, struct replay_entry **entries)
+{
+    struct replay_entry *index = NULL, *grown;
+    struct igvt_iotrace_record r;
+    unsigned char data[IGVT_IOTRACE_MAX_DATA];
+    size_t n = 0, size = 0;
+    long offset;
+
+    for (;;) {
+        offset = ftell(f);
+
+        if (fread(&r, sizeof(r), 1, f) != 1)
+            break;
+
+        if (r.size > sizeof(data) || r.attr >= IGVT_NUM_ATTRS ||
+            (r.size && fread(data, r.size, 1, f) != 1)) {
+            free(index);
+            return -EINVAL;
+        }
+
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            grown = realloc(index, size * sizeof(*index));
+
+            if (!grown) {
+                free(index);
+                return -ENOMEM;
+            }
+
+            index = grown;
+        }
+
+        index[n].timestamp = r.timestamp;
+        index[n].offset = offset;
+        n++;
+    }
+
+    if (n)
+        qsort(index, n, sizeof(*index), replay_entry_cmp);
+
+    *entries = index;
+
+    return n;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ULL,
+        .tv_nsec = deadline % 1000000000ULL,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/**
+ * @brief Replay an attribute I/O trace on a simulated vgt
+ *
+ * @param ctx The context, or NULL for the default context. It must use
+ *        the simulator, or the sysfs backend on a root that isn't sysfs;
+ *        attributes missing from it are created.
+ * @param path The trace file
+ * @param speed How much faster than recorded to replay, or 0 to issue
+ *        each operation as soon as the previous one returns
+ * @param result Filled in with what happened, if not NULL
+ * @return 0 on success, -EPERM for a real vgt, -EINVAL for a file
+ *         that isn't a trace, or -errno
+ */
+int igvt_ctx_iotrace_replay(igvt_ctx *ctx, const char *path, double speed,
+                            struct igvt_iotrace_replay_result *result)
+{
+    struct igvt_iotrace_replay_result res;
+    struct igvt_iotrace_header h;
+    struct igvt_iotrace_record r;
+    struct replay_entry *entries = NULL;
+    unsigned char data[IGVT_IOTRACE_MAX_DATA], buf[IGVT_IOTRACE_MAX_DATA];
+    uint64_t replay_start, op_start;
+    ssize_t n, count, i;
+    FILE *f;
+    int status = 0;
+
+    ctx = _igvt_ctx(ctx);
+
+    if (ctx->io_base == &_io_sysfs && ctx->vgt_is_sysfs)
+        return -EPERM;
+
+    if (speed < 0)
+        return -EINVAL;
+
+    f = fopen(path, "re");
+
+    if (!f)
+        return -errno;
+
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != IGVT_IOTRACE_MAGIC ||
+        h.version != IGVT_IOTRACE_VERSION ||
+        h.record_size != sizeof(struct igvt_iotrace_record)) {
+        fclose(f);
+        return -EINVAL;
+    }
+
+    count = replay_index(f, &entries);
+
+    if (count < 0) {
+        fclose(f);
+        return count;
+    }
+
+    memset(&res, 0, sizeof(res));
+    replay_start = _recorder_now();
+
+    for (i = 0; i < count; i++) {
+        if (fseek(f, entries[i].offset, SEEK_SET) != 0 ||
+            fread(&r, sizeof(r), 1, f) != 1 ||
+            (r.size && fread(data, r.size, 1, f) != 1)) {
+            status = -EIO;
+            break;
+        }
+
+        status = replay_seed(ctx, &r, data);
+
+        if (status < 0)
+            break;
+
+        if (speed > 0)
+            sleep_until(replay_start + (uint64_t) (r.timestamp / speed));
+
+        op_start = _recorder_now();
+
+        if (r.op == IGVT_IOTRACE_READ) {
+            n = _attr_read(ctx, r.attr, r.domid, r.port, buf, sizeof(buf));
+
+            if (n != r.result || (n > 0 && memcmp(buf, data, n) != 0))
+                res.mismatches++;
+        } else {
+            n = _attr_write(ctx, r.attr, r.domid, r.port, data, r.size);
+
+            if (n != r.result)
+                res.mismatches++;
+        }
+
+        res.latency_sum += _recorder_now() - op_start;
+        res.recorded_latency_sum += r.latency;
+        res.ops++;
+
+        /* Sorted by start, so the last to finish needn't be the last */
+        if (r.timestamp + r.latency > res.recorded_elapsed)
+            res.recorded_elapsed = r.timestamp + r.latency;
+    }
+
+    res.elapsed = _recorder_now() - replay_start;
+
+    free(entries);
+    fclose(f);
+
+    if (result)
+        *result = res;
+
+    return status;
+}
+
+int igvt_iotrace_replay(const char *path, double speed,
+                        struct igvt_iotrace_replay_result *result)
+{
+    return igvt_ctx_iotrace_replay(NULL, path, speed, result);
+}
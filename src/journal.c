@@ -0,0 +1,513 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file journal.c
+ *
+ * @brief A write-ahead journal of the multi-step calls, for recovering
+ * from a crash part way through one.
+ *
+ * Before a journaled call writes anything it appends an intent record,
+ * with everything needed to redo it, and waits for the record to be on
+ * disk; when it is done it appends an end record. Intents are synced as
+ * a group: one thread syncs everything written so far while the others
+ * wait for it, so concurrent calls share an fdatasync. End records are
+ * only synced where replaying a finished call would do harm.
+ *
+ * Opening a journal replays the calls that have an intent and no end:
+ * plugs, unplugs and destroys are redone, which is harmless if they had
+ * in fact finished, and instance creation is rolled back. The journal
+ * is emptied whenever no call is in flight and it has grown.
+ */
+
+#include <unistd.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+#define JOURNAL_MAGIC 0x4a564749 /* "IGVJ" */
+#define JOURNAL_INTENT 1
+#define JOURNAL_END 2
+
+/* Empty the journal once it is this big and idle */
+#define JOURNAL_COMPACT_SIZE (64 * 1024)
+
+struct journal_record {
+    uint32_t magic;
+    uint32_t check;
+    uint64_t seq;
+    uint8_t type;
+    uint8_t op;                 /* igvt_op */
+    uint8_t vgt_port;
+    uint8_t pgt_port;
+    uint32_t domid;
+    uint32_t args[3];
+    uint16_t edid_size;
+    uint16_t reserved;
+    unsigned char edid[EDID_MAX_SIZE];
+};
+
+struct journal {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t seq;               /* of the last record written */
+    uint64_t synced;            /* every record up to here is on disk */
+    int syncing;
+    int error;                  /* the sync that failed, latched */
+    unsigned int in_flight;
+    off_t size;
+};
+
+void _journal_init(igvt_ctx *ctx)
+{
+    pthread_mutex_init(&ctx->journal_lock, NULL);
+    _rcu_init(&ctx->journal_rcu);
+    ctx->journal = NULL;
+}
+
+static void journal_free(struct journal *j)
+{
+    if (!j)
+        return;
+
+    close(j->fd);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
+
+void _journal_free(igvt_ctx *ctx)
+{
+    journal_free(ctx->journal);
+    _rcu_free(&ctx->journal_rcu);
+    pthread_mutex_destroy(&ctx->journal_lock);
+}
+
+/* FNV-1a over the record, check excluded */
+static uint32_t record_check(const struct journal_record *r)
+{
+    const unsigned char *p = (const unsigned char *) r;
+    uint32_t hash = 0x811c9dc5;
+    size_t i;
+
+    for (i = offsetof(struct journal_record, seq); i < sizeof(*r); i++)
+        hash = (hash ^ p[i]) * 0x01000193;
+
+    return hash;
+}
+
+/* Append a record, numbering it. Called with the journal lock held. */
+static int journal_append(struct journal *j, struct journal_record *r)
+{
+    ssize_t n;
+    int status;
+
+    if (j->error)
+        return j->error;
+
+    r->magic = JOURNAL_MAGIC;
+    r->seq = j->seq + 1;
+    r->check = record_check(r);
+
+    do {
+        n = write(j->fd, r, sizeof(*r));
+    } while (n < 0 && errno == EINTR);
+
+    if (n != sizeof(*r)) {
+        status = n < 0 ? -errno : -EIO;
+
+        /* Don't leave a torn record for later ones to follow */
+        if (ftruncate(j->fd, j->size) < 0)
+            j->error = status;
+
+        return status;
+    }
+
+    j->seq = r->seq;
+    j->size += sizeof(*r);
+
+    return 0;
+}
+
+/*
+ * Wait for the records up to seq to be on disk, syncing them if no one
+ * else is. Called with the journal lock held.
+ */
+static int journal_sync(struct journal *j, uint64_t seq)
+{
+    uint64_t target;
+    int status;
+
+    while (j->synced < seq && !j->error) {
+        if (j->syncing) {
+            pthread_cond_wait(&j->cond, &j->lock);
+            continue;
+        }
+
+        /* Everything written by now goes in this sync */
+        j->syncing = 1;
+        target = j->seq;
+
+        pthread_mutex_unlock(&j->lock);
+        status = fdatasync(j->fd);
+        pthread_mutex_lock(&j->lock);
+
+        j->syncing = 0;
+
+        if (status < 0)
+            j->error = -errno;
+        else if (target > j->synced)
+            j->synced = target;
+
+        pthread_cond_broadcast(&j->cond);
+    }
+
+    return j->synced >= seq ? 0 : j->error;
+}
+
+/**
+ * @brief Record the intent to make a call, before making it
+ *
+ * Nothing is recorded unless a journal is open. Each _journal_begin
+ * must be matched by a _journal_end, whatever it returns.
+ *
+ * @param ctx The context
+ * @param jop Filled in for _journal_end
+ * @param op The call
+ * @param domid
+ * @param vgt_port
+ * @param pgt_port
+ * @param args The call's other arguments, or NULL
+ * @param edid The EDID being plugged in, or NULL
+ * @param edid_size
+ * @param sync Zero to leave the sync to a later _journal_sync
+ * @return 0, or -errno if the intent couldn't be recorded, in which
+ *         case the call mustn't be made
+ */
+int _journal_begin(igvt_ctx *ctx, struct journal_op *jop, igvt_op op,
+                   unsigned int domid, gt_port vgt_port, gt_port pgt_port,
+                   const uint32_t *args, const unsigned char *edid,
+                   size_t edid_size, int sync)
+{
+    struct journal_record r;
+    struct journal *j;
+    int status;
+
+    jop->journal = NULL;
+
+    /* The usual case costs one load */
+    if (!__atomic_load_n(&ctx->journal, __ATOMIC_RELAXED))
+        return 0;
+
+    jop->token = _rcu_read_lock(&ctx->journal_rcu);
+    j = __atomic_load_n(&ctx->journal, __ATOMIC_ACQUIRE);
+
+    if (!j) {
+        _rcu_read_unlock(&ctx->journal_rcu, jop->token);
+        return 0;
+    }
+
+    if (edid_size > EDID_MAX_SIZE)
+        edid_size = EDID_MAX_SIZE;
+
+    memset(&r, 0, sizeof(r));
+    r.type = JOURNAL_INTENT;
+    r.op = op;
+    r.domid = domid;
+    r.vgt_port = vgt_port;
+    r.pgt_port = pgt_port;
+
+    if (args)
+        memcpy(r.args, args, sizeof(r.args));
+
+    if (edid) {
+        memcpy(r.edid, edid, edid_size);
+        r.edid_size = edid_size;
+    }
+
+    pthread_mutex_lock(&j->lock);
+
+    status = journal_append(j, &r);
+
+    if (status == 0 && sync)
+        status = journal_sync(j, r.seq);
+
+    if (status == 0) {
+        j->in_flight++;
+        jop->journal = j;
+        jop->seq = r.seq;
+        jop->op = op;
+    }
+
+    pthread_mutex_unlock(&j->lock);
+
+    if (status < 0) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::cannot journal %s: %s\n",
+                    __func__, igvt_op_name(op), igvt_strerror(-status));
+        _rcu_read_unlock(&ctx->journal_rcu, jop->token);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Wait for intents recorded without syncing to be on disk
+ *
+ * @param ctx The context
+ * @param jop The last of the intents
+ * @return 0, or -errno if they couldn't be synced
+ */
+int _journal_sync(igvt_ctx *ctx, const struct journal_op *jop)
+{
+    struct journal *j = jop->journal;
+    int status;
+
+    if (!j)
+        return 0;
+
+    pthread_mutex_lock(&j->lock);
+    status = journal_sync(j, jop->seq);
+    pthread_mutex_unlock(&j->lock);
+
+    return status;
+}
+
+/**
+ * @brief Record that a call is done, whether or not it succeeded
+ *
+ * @param ctx The context
+ * @param jop From _journal_begin
+ */
+void _journal_end(igvt_ctx *ctx, struct journal_op *jop)
+{
+    struct journal *j = jop->journal;
+    struct journal_record r;
+
+    if (!j)
+        return;
+
+    memset(&r, 0, sizeof(r));
+    r.type = JOURNAL_END;
+    r.op = jop->op;
+    r.args[0] = jop->seq;
+    r.args[1] = jop->seq >> 32;
+
+    pthread_mutex_lock(&j->lock);
+
+    /* Rolling back a creation that had finished would undo it */
+    if (journal_append(j, &r) == 0 && jop->op == IGVT_OP_CREATE_INSTANCE)
+        journal_sync(j, r.seq);
+
+    if (--j->in_flight == 0 && j->size >= JOURNAL_COMPACT_SIZE &&
+        !j->error) {
+        if (ftruncate(j->fd, 0) == 0 && fdatasync(j->fd) == 0)
+            j->size = 0;
+    }
+
+    pthread_mutex_unlock(&j->lock);
+
+    _rcu_read_unlock(&ctx->journal_rcu, jop->token);
+    jop->journal = NULL;
+}
+
+/* Redo, or undo, a call that has no end record */
+static int journal_recover_one(igvt_ctx *ctx, const struct journal_record *r)
+{
+    igvt_printf(ctx, IGVT_WARNING, "%s::recovering %s of vm%u\n",
+                __func__, igvt_op_name(r->op), r->domid);
+
+    switch (r->op) {
+    case IGVT_OP_PLUG_DISPLAY:
+        return igvt_ctx_plug_display(ctx, r->domid, r->vgt_port, r->edid,
+                                     r->edid_size, r->pgt_port);
+
+    case IGVT_OP_UNPLUG_DISPLAY:
+        return igvt_ctx_unplug_display(ctx, r->domid, r->vgt_port);
+
+    case IGVT_OP_CREATE_INSTANCE:
+        if (!_enabled_p(ctx, r->domid))
+            return 0;
+
+        return igvt_ctx_destroy_instance(ctx, r->domid);
+
+    case IGVT_OP_DESTROY_INSTANCE:
+        if (!_enabled_p(ctx, r->domid))
+            return 0;
+
+        return igvt_ctx_destroy_instance(ctx, r->domid);
+
+    default:
+        return -EINVAL;
+    }
+}
+
+/*
+ * Replay the journal, up to the first record that didn't make it to
+ * disk whole. Returns the number of calls recovered.
+ */
+static int journal_recover(igvt_ctx *ctx, int fd)
+{
+    struct journal_record *records = NULL, *grown, r;
+    size_t n = 0, size = 0, i, k;
+    uint64_t seq;
+    int recovered = 0;
+
+    while (read(fd, &r, sizeof(r)) == sizeof(r)) {
+        if (r.magic != JOURNAL_MAGIC || r.check != record_check(&r))
+            break;
+
+        if (r.type == JOURNAL_END) {
+            seq = r.args[0] | (uint64_t) r.args[1] << 32;
+
+            for (k = 0; k < n; k++) {
+                if (records[k].seq == seq) {
+                    records[k] = records[--n];
+                    break;
+                }
+            }
+
+            continue;
+        }
+
+        if (n == size) {
+            size = size ? size * 2 : 16;
+            grown = realloc(records, size * sizeof(*records));
+
+            if (!grown) {
+                free(records);
+                return -ENOMEM;
+            }
+
+            records = grown;
+        }
+
+        records[n++] = r;
+    }
+
+    /* Redo them in the order they were made */
+    for (i = 0; i < n; i++) {
+        for (k = i + 1; k < n; k++) {
+            if (records[k].seq < records[i].seq) {
+                r = records[i];
+                records[i] = records[k];
+                records[k] = r;
+            }
+        }
+
+        journal_recover_one(ctx, &records[i]);
+        recovered++;
+    }
+
+    free(records);
+
+    return recovered;
+}
+
+/**
+ * @brief Open a journal, recovering whatever it records as unfinished
+ *
+ * @param ctx The context
+ * @param path The journal, or NULL to stop journaling
+ * @return the number of calls recovered, -EBUSY if another process has
+ *         the journal open, or -errno
+ */
+static int journal_open(igvt_ctx *ctx, const char *path)
+{
+    struct journal *j = NULL, *old;
+    int fd = -1, recovered = 0;
+
+    if (path) {
+        fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+
+        if (fd < 0)
+            return -errno;
+
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+            recovered = errno == EWOULDBLOCK ? -EBUSY : -errno;
+            close(fd);
+            return recovered;
+        }
+
+        j = calloc(1, sizeof(*j));
+
+        if (!j) {
+            close(fd);
+            return -ENOMEM;
+        }
+    }
+
+    /* Stop journaling into the old journal before replaying the new */
+    pthread_mutex_lock(&ctx->journal_lock);
+    old = ctx->journal;
+    __atomic_store_n(&ctx->journal, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->journal_lock);
+
+    _rcu_synchronize(&ctx->journal_rcu);
+    journal_free(old);
+
+    if (!j)
+        return 0;
+
+    recovered = journal_recover(ctx, fd);
+
+    if (recovered >= 0 && (ftruncate(fd, 0) < 0 || fdatasync(fd) < 0))
+        recovered = -errno;
+
+    if (recovered < 0) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::cannot recover %s: %s\n",
+                    __func__, path, igvt_strerror(-recovered));
+        close(fd);
+        free(j);
+        return recovered;
+    }
+
+    j->fd = fd;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+
+    /* A journal opened meanwhile loses */
+    pthread_mutex_lock(&ctx->journal_lock);
+    old = ctx->journal;
+    __atomic_store_n(&ctx->journal, j, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->journal_lock);
+
+    if (old) {
+        _rcu_synchronize(&ctx->journal_rcu);
+        journal_free(old);
+    }
+
+    return recovered;
+}
+
+int igvt_ctx_journal_open(igvt_ctx *ctx, const char *path)
+{
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    IGVT_PROBE(journal_open__entry, path);
+    result = journal_open(ctx, path);
+    IGVT_PROBE(journal_open__return, result);
+
+    return result;
+}
+
+int igvt_journal_open(const char *path)
+{
+    return igvt_ctx_journal_open(NULL, path);
+}
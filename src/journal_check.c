@@ -0,0 +1,319 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file journal_check.c
+ *
+ * @brief Journal recovery on the simulator, run by make check
+ *
+ * A journaled call is made and the records the library writes for it
+ * are read back, which holds the layout below to journal.c's. Then the
+ * journal is closed, records a crash would have left are appended to
+ * it, and it is opened again: the calls recovered, and the ports and
+ * instances left, are checked against what the records ask for.
+ *
+ * The first crash leaves intents out of order, one with an end record,
+ * an unfinished create to roll back, an unplug and a destroy to redo,
+ * and a record with a bad checksum, after which nothing is replayed.
+ * The second leaves a record torn part way through at the tail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "igvt.h"
+
+/* A record on disk, as journal.c lays it out */
+#define JOURNAL_MAGIC 0x4a564749
+#define JOURNAL_INTENT 1
+#define JOURNAL_END 2
+
+struct journal_record {
+    uint32_t magic;
+    uint32_t check;
+    uint64_t seq;
+    uint8_t type;
+    uint8_t op;
+    uint8_t vgt_port;
+    uint8_t pgt_port;
+    uint32_t domid;
+    uint32_t args[3];
+    uint16_t edid_size;
+    uint16_t reserved;
+    unsigned char edid[256];
+};
+
+static igvt_ctx *ctx;
+static char path[64];
+static unsigned char edid[128];
+static int failures;
+
+static void expect(int ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "journal_check: %s\n", what);
+        failures++;
+    }
+}
+
+static uint32_t record_check(const struct journal_record *r)
+{
+    const unsigned char *p = (const unsigned char *) r;
+    uint32_t hash = 0x811c9dc5;
+    size_t i;
+
+    for (i = offsetof(struct journal_record, seq); i < sizeof(*r); i++)
+        hash = (hash ^ p[i]) * 0x01000193;
+
+    return hash;
+}
+
+static struct journal_record intent(uint64_t seq, igvt_op op,
+                                    unsigned int domid, gt_port vgt_port,
+                                    gt_port pgt_port)
+{
+    struct journal_record r;
+
+    memset(&r, 0, sizeof(r));
+    r.magic = JOURNAL_MAGIC;
+    r.seq = seq;
+    r.type = JOURNAL_INTENT;
+    r.op = op;
+    r.domid = domid;
+    r.vgt_port = vgt_port;
+    r.pgt_port = pgt_port;
+
+    if (op == IGVT_OP_PLUG_DISPLAY) {
+        memcpy(r.edid, edid, 128);
+        r.edid_size = 128;
+    }
+
+    r.check = record_check(&r);
+
+    return r;
+}
+
+static struct journal_record end(uint64_t seq, const struct journal_record *of)
+{
+    struct journal_record r;
+
+    memset(&r, 0, sizeof(r));
+    r.magic = JOURNAL_MAGIC;
+    r.seq = seq;
+    r.type = JOURNAL_END;
+    r.op = of->op;
+    r.args[0] = of->seq;
+    r.args[1] = of->seq >> 32;
+    r.check = record_check(&r);
+
+    return r;
+}
+
+/* Append records to the closed journal, the last torn if torn is set */
+static void crash(const struct journal_record *records, size_t n, int torn)
+{
+    size_t size = n * sizeof(records[0]);
+    int fd = open(path, O_WRONLY | O_APPEND);
+
+    if (torn)
+        size -= sizeof(records[0]) / 2;
+
+    expect(fd >= 0 && write(fd, records, size) == (ssize_t) size,
+           "can't append to the journal");
+
+    if (fd >= 0)
+        close(fd);
+}
+
+static off_t journal_size(void)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void expect_port(const struct igvt_host_state *state,
+                        unsigned int domid, gt_port port, int connected,
+                        gt_port pgt_port)
+{
+    char what[64];
+    size_t i;
+
+    for (i = 0; i < state->n_vms && state->vms[i].domid != domid; i++)
+        ;
+
+    snprintf(what, sizeof(what), "vm%u port %d not as recovered", domid,
+             port);
+
+    expect(i < state->n_vms &&
+           state->vms[i].ports[port].connected == connected &&
+           (!connected || state->vms[i].ports[port].pgt_port == pgt_port),
+           what);
+}
+
+/* The records the library writes for a call are what's laid out above */
+static uint64_t check_format(void)
+{
+    struct journal_record r[3];
+    ssize_t n;
+    int fd;
+
+    expect(igvt_ctx_journal_open(ctx, path) == 0, "new journal recovered");
+    expect(igvt_ctx_plug_display(ctx, 1, PORT_B, edid, 128, PORT_B) == 0,
+           "can't plug vm1 port B");
+    igvt_ctx_journal_open(ctx, NULL);
+
+    fd = open(path, O_RDONLY);
+    n = fd >= 0 ? read(fd, r, sizeof(r)) : -1;
+
+    if (fd >= 0)
+        close(fd);
+
+    expect(n == 2 * sizeof(r[0]), "a plug isn't two records");
+
+    if (n != 2 * sizeof(r[0]))
+        return 0;
+
+    expect(r[0].magic == JOURNAL_MAGIC && r[0].check == record_check(&r[0]) &&
+           r[1].magic == JOURNAL_MAGIC && r[1].check == record_check(&r[1]),
+           "records don't check out");
+    expect(r[0].type == JOURNAL_INTENT && r[0].op == IGVT_OP_PLUG_DISPLAY &&
+           r[0].domid == 1 && r[0].vgt_port == PORT_B &&
+           r[0].edid_size == 128, "intent isn't the plug");
+    expect(r[1].type == JOURNAL_END && r[1].seq == r[0].seq + 1 &&
+           r[1].args[0] == (uint32_t) r[0].seq, "end isn't the plug's");
+
+    return r[1].seq;
+}
+
+static void check_recovery(uint64_t seq)
+{
+    struct journal_record r[9];
+    struct igvt_host_state *state;
+
+    /* Out of order: the later plug, to port B, must win */
+    r[0] = intent(seq + 2, IGVT_OP_PLUG_DISPLAY, 2, PORT_C, PORT_B);
+    r[1] = intent(seq + 1, IGVT_OP_PLUG_DISPLAY, 2, PORT_C, PORT_D);
+
+    /* Finished, so not replayed */
+    r[2] = intent(seq + 3, IGVT_OP_PLUG_DISPLAY, 2, PORT_D, PORT_D);
+    r[3] = end(seq + 4, &r[2]);
+
+    r[4] = intent(seq + 5, IGVT_OP_CREATE_INSTANCE, 7, PORT_ILLEGAL,
+                  PORT_ILLEGAL);
+    r[5] = intent(seq + 6, IGVT_OP_UNPLUG_DISPLAY, 1, PORT_B, PORT_ILLEGAL);
+    r[6] = intent(seq + 7, IGVT_OP_DESTROY_INSTANCE, 3, PORT_ILLEGAL,
+                  PORT_ILLEGAL);
+
+    /* Replay stops at a bad checksum, and what follows is dropped */
+    r[7] = intent(seq + 8, IGVT_OP_PLUG_DISPLAY, 1, PORT_C, PORT_C);
+    r[7].check ^= 1;
+    r[8] = intent(seq + 9, IGVT_OP_PLUG_DISPLAY, 1, PORT_D, PORT_D);
+
+    crash(r, 9, 0);
+
+    expect(igvt_ctx_journal_open(ctx, path) == 5,
+           "first crash: 5 calls not recovered");
+    expect(journal_size() == 0, "first crash: journal not emptied");
+
+    expect(!igvt_ctx_enabled_p(ctx, 7), "create of vm7 not rolled back");
+    expect(!igvt_ctx_enabled_p(ctx, 3), "destroy of vm3 not redone");
+    expect(igvt_ctx_enabled_p(ctx, 1) && igvt_ctx_enabled_p(ctx, 2),
+           "vm1 or vm2 gone");
+
+    if (igvt_ctx_discover(ctx, 1, &state) == 0) {
+        expect_port(state, 2, PORT_C, 1, PORT_B);
+        expect_port(state, 2, PORT_D, 0, PORT_ILLEGAL);
+        expect_port(state, 1, PORT_B, 0, PORT_ILLEGAL);
+        expect_port(state, 1, PORT_C, 0, PORT_ILLEGAL);
+        expect_port(state, 1, PORT_D, 0, PORT_ILLEGAL);
+        igvt_host_state_free(state);
+    } else {
+        expect(0, "first crash: can't discover");
+    }
+
+    igvt_ctx_journal_open(ctx, NULL);
+
+    /* A create with nothing to roll back still counts */
+    r[0] = intent(1, IGVT_OP_PLUG_DISPLAY, 1, PORT_C, PORT_C);
+    r[1] = intent(2, IGVT_OP_CREATE_INSTANCE, 8, PORT_ILLEGAL, PORT_ILLEGAL);
+    r[2] = intent(3, IGVT_OP_PLUG_DISPLAY, 1, PORT_D, PORT_D);
+
+    crash(r, 3, 1);
+
+    expect(igvt_ctx_journal_open(ctx, path) == 2,
+           "torn tail: 2 calls not recovered");
+    expect(!igvt_ctx_enabled_p(ctx, 8), "vm8 created");
+
+    if (igvt_ctx_discover(ctx, 1, &state) == 0) {
+        expect_port(state, 1, PORT_C, 1, PORT_C);
+        expect_port(state, 1, PORT_D, 0, PORT_ILLEGAL);
+        igvt_host_state_free(state);
+    } else {
+        expect(0, "torn tail: can't discover");
+    }
+
+    /* Recovered for good */
+    igvt_ctx_journal_open(ctx, NULL);
+    expect(igvt_ctx_journal_open(ctx, path) == 0, "recovered twice");
+    igvt_ctx_journal_open(ctx, NULL);
+}
+
+int main(void)
+{
+    static const unsigned int domids[] = { 1, 2, 3, 7 };
+    char dir[] = "/tmp/igvt-journal-check.XXXXXX";
+    uint64_t seq;
+    size_t i;
+
+    ctx = igvt_ctx_new(NULL, NULL);
+
+    if (!ctx || igvt_ctx_set_backend(ctx, IGVT_BACKEND_SIMULATOR) < 0 ||
+        !mkdtemp(dir)) {
+        fprintf(stderr, "journal_check: no simulator or no %s\n", dir);
+        return 1;
+    }
+
+    /* Recovery warns about every call it redoes */
+    igvt_ctx_set_log_level(ctx, IGVT_LOG_NONE);
+
+    snprintf(path, sizeof(path), "%s/journal", dir);
+    memcpy(edid, igvt_edid_synthesize(1024, 768, 60, 0), sizeof(edid));
+
+    for (i = 0; i < sizeof(domids) / sizeof(domids[0]); i++) {
+        if (igvt_ctx_create_instance(ctx, domids[i], 64, 512, 4) < 0) {
+            fprintf(stderr, "journal_check: can't create vm%u\n", domids[i]);
+            return 1;
+        }
+    }
+
+    seq = check_format();
+
+    if (seq)
+        check_recovery(seq);
+
+    igvt_ctx_free(ctx);
+    unlink(path);
+    rmdir(dir);
+
+    if (failures) {
+        fprintf(stderr, "journal_check: %d failures\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef __PORT_HASH_H_
+#define __PORT_HASH_H_
+
+/**
+ * @file port_hash.h
+ *
+ * @brief Perfect hashing of the fixed port names.
+ *
+ * The tables in port_hash_table.h are generated by gen_port_hash (make
+ * regen-port-hash), which picks a seed that sends every name to its own
+ * slot. A lookup is a check of
+ * the name length against the lengths in the table, one hash and one
+ * compare.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "igvt.h"
+
+struct port_hash_entry {
+    unsigned char len;          /* 0 for an empty slot */
+    const char *name;
+    gt_port port;
+    int rank;
+};
+
+struct port_hash_table {
+    unsigned int seed;
+    unsigned int size;
+    unsigned int lengths;       /* bit n set if some name is n long */
+    const struct port_hash_entry *entries;
+};
+
+static inline unsigned int
+port_hash(unsigned int seed, const char *s, size_t len)
+{
+    unsigned int h = seed ^ (unsigned int) len;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+
+    return h ^ (h >> 15);
+}
+
+static inline const struct port_hash_entry *
+port_hash_lookup(const struct port_hash_table *table, const char *s,
+                 size_t len)
+{
+    const struct port_hash_entry *e;
+
+    if (len >= 32 || !(table->lengths & (1u << len)))
+        return NULL;
+
+    e = &table->entries[port_hash(table->seed, s, len) % table->size];
+
+    if (e->len != len || memcmp(e->name, s, len) != 0)
+        return NULL;
+
+    return e;
+}
+
+#endif
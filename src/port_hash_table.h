@@ -0,0 +1,32 @@
+/* Generated by gen_port_hash. Do not edit. */
+
+static const struct port_hash_entry vgt_port_hash_entries[5] = {
+    { 6, "PORT_A", PORT_A, 0 },
+    { 6, "PORT_B", PORT_B, 0 },
+    { 6, "PORT_C", PORT_C, 0 },
+    { 6, "PORT_D", PORT_D, 0 },
+    { 6, "PORT_E", PORT_E, 0 },
+};
+
+static const struct port_hash_table vgt_port_hash = {
+    0x0000002bu, 5, 0x00000040u, vgt_port_hash_entries
+};
+
+static const struct port_hash_entry connector_hash_entries[11] = {
+    { 8, "HDMI-A-1", PORT_B, 0 },
+    { 4, "DP-1", PORT_B, 1 },
+    { 8, "HDMI-A-2", PORT_C, 0 },
+    { 7, "DVI-D-3", PORT_D, 2 },
+    { 7, "DVI-D-2", PORT_C, 2 },
+    { 7, "DVI-D-1", PORT_B, 2 },
+    { 5, "eDP-1", PORT_EDP, 0 },
+    { 4, "DP-2", PORT_C, 1 },
+    { 8, "HDMI-A-3", PORT_D, 0 },
+    { 4, "DP-3", PORT_D, 1 },
+    { 5, "VGA-1", PORT_VGA, 0 },
+};
+
+static const struct port_hash_table connector_hash = {
+    0x000003f3u, 11, 0x000001b0u, connector_hash_entries
+};
+
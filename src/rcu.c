@@ -0,0 +1,76 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file rcu.c
+ *
+ * @brief Grace periods for the lock-free read paths.
+ *
+ * Readers announce themselves by bumping a counter for the current
+ * epoch, and never block. A writer that has unpublished something
+ * (a cached fd, a connector table) flips the epoch and waits for the
+ * old epoch's readers to drain before closing or freeing it. The
+ * counters are striped across cache lines by thread, so that readers
+ * on different CPUs don't bounce a shared line between them.
+ */
+
+#include <sched.h>
+#include <string.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+__thread int _rcu_stripe = -1;
+
+static unsigned int next_stripe;
+
+int _rcu_assign_stripe(void)
+{
+    _rcu_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) %
+                  IGVT_RCU_STRIPES;
+
+    return _rcu_stripe;
+}
+
+void _rcu_init(struct igvt_rcu *rcu)
+{
+    memset(rcu, 0, sizeof(*rcu));
+    pthread_mutex_init(&rcu->sync_lock, NULL);
+}
+
+void _rcu_free(struct igvt_rcu *rcu)
+{
+    pthread_mutex_destroy(&rcu->sync_lock);
+}
+
+/**
+ * @brief Wait for every reader that might still see unpublished data
+ *
+ * Must not be called from inside a read section of the same rcu.
+ */
+void _rcu_synchronize(struct igvt_rcu *rcu)
+{
+    unsigned int old;
+    int i;
+
+    /* A second flip before the first has drained would skip readers */
+    pthread_mutex_lock(&rcu->sync_lock);
+
+    old = __atomic_fetch_add(&rcu->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+    for (i = 0; i < IGVT_RCU_STRIPES; i++) {
+        while (__atomic_load_n(&rcu->readers[old][i].count, __ATOMIC_SEQ_CST))
+            sched_yield();
+    }
+
+    pthread_mutex_unlock(&rcu->sync_lock);
+}
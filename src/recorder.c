@@ -0,0 +1,397 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file recorder.c
+ *
+ * @brief The flight recorder: a ring of the most recent API calls.
+ *
+ * Every public API call that changes something or does I/O ends in
+ * _recorder_record, which also feeds the counters in stats.c and, while
+ * one is running, the trace in trace.c. Port name translation and the
+ * port predicates are pure lookups on the query hot path, and aren't
+ * recorded. Calls are only timed, by _recorder_begin, while the
+ * recorder or a trace is running.
+ *
+ * The recorder is a ring per thread stripe (the stripes the rcu read
+ * counts use), so threads on different stripes never share a cache
+ * line. Any number of threads record into a stripe's ring without
+ * locking: each claims a slot by bumping the stripe's head, marks it
+ * busy by zeroing its seq, fills it in and publishes it by storing its
+ * position + 1 into seq. A reader, in this process or mapping the
+ * rings from shared memory, copies a slot and keeps the copy only if
+ * seq was the expected value both before and after, and merges the
+ * rings by timestamp. A writer that stalls for a whole lap of its ring
+ * can still tear a slot; that costs one record, never a crash.
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+struct recorder_ring {
+    struct igvt_recorder_header *header;
+    struct igvt_recorder_stripe *stripes;
+    struct igvt_event *events;  /* stripe s's ring at s * (mask + 1) */
+    size_t map_size;
+    uint64_t mask;
+};
+
+static const char *op_names[IGVT_NUM_OPS] = {
+    [IGVT_OP_AVAILABLE_P] = "available_p",
+    [IGVT_OP_ENABLED_P] = "enabled_p",
+    [IGVT_OP_SET_FOREGROUND_VM] = "set_foreground_vm",
+    [IGVT_OP_TRANSLATE_I915_PORT] = "translate_i915_port",
+    [IGVT_OP_TRANSLATE_PGT_PORT] = "translate_pgt_port",
+    [IGVT_OP_CREATE_INSTANCE] = "create_instance",
+    [IGVT_OP_DESTROY_INSTANCE] = "destroy_instance",
+    [IGVT_OP_PLUG_DISPLAY] = "plug_display",
+    [IGVT_OP_UNPLUG_DISPLAY] = "unplug_display",
+    [IGVT_OP_PORT_PLUGGED_P] = "port_plugged_p",
+    [IGVT_OP_PORT_PRESENT_P] = "port_present_p",
+    [IGVT_OP_PORT_HOTPLUGGABLE] = "port_hotpluggable",
+    [IGVT_OP_PLUG_DISPLAYS] = "plug_displays",
+    [IGVT_OP_STAGE_DISPLAYS] = "stage_displays",
+    [IGVT_OP_SWITCH_FOREGROUND_VM] = "switch_foreground_vm",
+    [IGVT_OP_HANDOFF_DISPLAY] = "handoff_display",
+    [IGVT_OP_VM_SAVE_DISPLAYS] = "vm_save_displays",
+    [IGVT_OP_VM_RESTORE_DISPLAYS] = "vm_restore_displays",
+    [IGVT_OP_PLUG_DISPLAY_ID] = "plug_display_id",
+    [IGVT_OP_DISCOVER] = "discover",
+    [IGVT_OP_PLUG_DISPLAY_FILTERED] = "plug_display_filtered",
+};
+
+static void ring_free(struct recorder_ring *ring)
+{
+    if (!ring)
+        return;
+
+    munmap(ring->header, ring->map_size);
+    free(ring);
+}
+
+static struct recorder_ring *ring_new(size_t n_events, const char *shm_name,
+                                      int *err)
+{
+    struct recorder_ring *ring;
+    size_t n = 1;
+    void *map;
+    int fd = -1;
+
+    while (n < n_events)
+        n <<= 1;
+
+    ring = calloc(1, sizeof(*ring));
+
+    if (!ring) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+
+    ring->map_size = sizeof(struct igvt_recorder_header) +
+                     IGVT_RCU_STRIPES * (sizeof(struct igvt_recorder_stripe) +
+                                         n * sizeof(struct igvt_event));
+    ring->mask = n - 1;
+
+    if (shm_name) {
+        fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+        if (fd < 0 || ftruncate(fd, ring->map_size) < 0) {
+            *err = -errno;
+
+            if (fd >= 0)
+                close(fd);
+
+            free(ring);
+            return NULL;
+        }
+
+        map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (map == MAP_FAILED) {
+        *err = -errno;
+        free(ring);
+        return NULL;
+    }
+
+    ring->header = map;
+    ring->stripes = (struct igvt_recorder_stripe *) (ring->header + 1);
+    ring->events = (struct igvt_event *) (ring->stripes + IGVT_RCU_STRIPES);
+
+    ring->header->version = IGVT_RECORDER_VERSION;
+    ring->header->event_size = sizeof(struct igvt_event);
+    ring->header->n_events = n;
+    ring->header->n_stripes = IGVT_RCU_STRIPES;
+
+    /* Readers mapping the ring check the magic last */
+    __atomic_store_n(&ring->header->magic, IGVT_RECORDER_MAGIC,
+                     __ATOMIC_RELEASE);
+
+    return ring;
+}
+
+void _recorder_init(igvt_ctx *ctx)
+{
+    int err;
+
+    pthread_mutex_init(&ctx->recorder_lock, NULL);
+    _rcu_init(&ctx->recorder_rcu);
+
+    ctx->recorder = ring_new(IGVT_RECORDER_DEFAULT_EVENTS, NULL, &err);
+}
+
+void _recorder_free(igvt_ctx *ctx)
+{
+    ring_free(ctx->recorder);
+    _rcu_free(&ctx->recorder_rcu);
+    pthread_mutex_destroy(&ctx->recorder_lock);
+}
+
+uint64_t _recorder_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void _recorder_record(igvt_ctx *ctx, igvt_op op, unsigned int domid,
+                      gt_port port, int result, uint64_t start)
+{
+    struct recorder_ring *ring;
+    struct igvt_recorder_stripe *stripe;
+    struct igvt_event *e;
+    uint64_t ticket, latency;
+    int token, s;
+
+    /* Nothing was recording when the call started */
+    if (!start) {
+        _stats_record(ctx, op, result, 0, 0);
+        return;
+    }
+
+    latency = _recorder_now() - start;
+
+    _stats_record(ctx, op, result, latency, 1);
+
+    if (__atomic_load_n(&ctx->trace, __ATOMIC_RELAXED))
+        _trace_end(ctx, igvt_op_name(op), start, domid, port, result);
+
+    token = _rcu_read_lock(&ctx->recorder_rcu);
+
+    ring = __atomic_load_n(&ctx->recorder, __ATOMIC_ACQUIRE);
+
+    if (ring) {
+        s = token % IGVT_RCU_STRIPES;
+        stripe = &ring->stripes[s];
+        ticket = __atomic_fetch_add(&stripe->head, 1, __ATOMIC_RELAXED);
+        e = &ring->events[(s * (ring->mask + 1)) + (ticket & ring->mask)];
+
+        __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        __atomic_store_n(&e->timestamp, start, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->latency, latency > UINT32_MAX ? UINT32_MAX :
+                         (uint32_t) latency, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->result, result, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->domid, domid, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->op, op, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->port, port, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&e->seq, ticket + 1, __ATOMIC_RELEASE);
+    }
+
+    _rcu_read_unlock(&ctx->recorder_rcu, token);
+}
+
+/* Returns non-zero if the slot held event seq and was copied intact */
+static int event_load(const struct igvt_event *e, uint64_t seq,
+                      struct igvt_event *copy)
+{
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq)
+        return 0;
+
+    copy->seq = seq;
+    copy->timestamp = __atomic_load_n(&e->timestamp, __ATOMIC_RELAXED);
+    copy->latency = __atomic_load_n(&e->latency, __ATOMIC_RELAXED);
+    copy->result = __atomic_load_n(&e->result, __ATOMIC_RELAXED);
+    copy->domid = __atomic_load_n(&e->domid, __ATOMIC_RELAXED);
+    copy->op = __atomic_load_n(&e->op, __ATOMIC_RELAXED);
+    copy->port = __atomic_load_n(&e->port, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/**
+ * @brief Replace a context's flight recorder
+ *
+ * The events recorded so far are discarded.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param n_events Capacity, rounded up to a power of two; 0 stops recording
+ * @param shm_name A POSIX shared memory name to map the ring from, so that
+ *        other processes can read it live, or NULL for private memory. The
+ *        object is created or truncated, and left in place for the caller
+ *        to shm_unlink.
+ * @return 0 on success, -errno on failure
+ */
+int igvt_ctx_recorder_open(igvt_ctx *ctx, size_t n_events,
+                           const char *shm_name)
+{
+    struct recorder_ring *ring = NULL, *old;
+    int err = 0;
+
+    ctx = _igvt_ctx(ctx);
+
+    if (n_events > IGVT_RECORDER_MAX_EVENTS)
+        return -EINVAL;
+
+    if (n_events) {
+        ring = ring_new(n_events, shm_name, &err);
+
+        if (!ring)
+            return err;
+    }
+
+    pthread_mutex_lock(&ctx->recorder_lock);
+    old = ctx->recorder;
+    __atomic_store_n(&ctx->recorder, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->recorder_lock);
+
+    _rcu_synchronize(&ctx->recorder_rcu);
+    ring_free(old);
+
+    return 0;
+}
+
+int igvt_recorder_open(size_t n_events, const char *shm_name)
+{
+    return igvt_ctx_recorder_open(NULL, n_events, shm_name);
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+    const struct igvt_event *x = a, *y = b;
+
+    if (x->timestamp != y->timestamp)
+        return x->timestamp < y->timestamp ? -1 : 1;
+
+    return x->stripe != y->stripe ? x->stripe - y->stripe :
+           (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/**
+ * @brief Copy the most recent events out of the flight recorder
+ *
+ * Recording carries on while this runs; events that are overwritten
+ * or still being written are left out. Each stripe's ring is copied in
+ * turn and the copies are merged by timestamp.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param events Buffer for the events, oldest first
+ * @param max_events Size of the buffer
+ * @return the number of events copied
+ */
+size_t igvt_ctx_recorder_dump(igvt_ctx *ctx, struct igvt_event *events,
+                              size_t max_events)
+{
+    struct recorder_ring *ring;
+    struct igvt_event *all = NULL;
+    uint64_t head, seq, first, size;
+    size_t n = 0;
+    int token, s;
+
+    ctx = _igvt_ctx(ctx);
+
+    if (max_events == 0)
+        return 0;
+
+    token = _rcu_read_lock(&ctx->recorder_rcu);
+
+    ring = __atomic_load_n(&ctx->recorder, __ATOMIC_ACQUIRE);
+
+    if (ring) {
+        size = ring->mask + 1;
+
+        /* Each stripe may hold the most recent max_events on its own */
+        if (size > max_events)
+            size = max_events;
+
+        all = malloc(IGVT_RCU_STRIPES * size * sizeof(*all));
+    }
+
+    for (s = 0; all && s < IGVT_RCU_STRIPES; s++) {
+        head = __atomic_load_n(&ring->stripes[s].head, __ATOMIC_ACQUIRE);
+        first = head > size ? head - size : 0;
+
+        for (seq = first + 1; seq <= head; seq++) {
+            if (event_load(&ring->events[s * (ring->mask + 1) +
+                                         ((seq - 1) & ring->mask)],
+                           seq, &all[n])) {
+                all[n].stripe = s;
+                n++;
+            }
+        }
+    }
+
+    _rcu_read_unlock(&ctx->recorder_rcu, token);
+
+    if (!all)
+        return 0;
+
+    qsort(all, n, sizeof(*all), event_cmp);
+
+    /* The most recent max_events of them */
+    first = n > max_events ? n - max_events : 0;
+    n -= first;
+
+    memcpy(events, all + first, n * sizeof(*all));
+    free(all);
+
+    return n;
+}
+
+size_t igvt_recorder_dump(struct igvt_event *events, size_t max_events)
+{
+    return igvt_ctx_recorder_dump(NULL, events, max_events);
+}
+
+/**
+ * @brief Name an operation in the flight recorder
+ *
+ * @return the name of the API call, or "unknown"
+ */
+const char *igvt_op_name(igvt_op op)
+{
+    if (op <= 0 || op >= IGVT_NUM_OPS || !op_names[op])
+        return "unknown";
+
+    return op_names[op];
+}
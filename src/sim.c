@@ -0,0 +1,630 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file sim.c
+ *
+ * @brief The simulator backend: an in-memory vgt.
+ *
+ * The simulator behaves like the vgt driver as far as the library can
+ * tell. Writing "<domid>,..." to create_vgt_instance creates a VM with
+ * disconnected ports, and "-<domid>" destroys it, after which its
+ * attributes fail with ENODEV. connection takes "connect" and
+ * "disconnect" and reads back "connected" or "disconnected";
+ * foreground_vm only takes dom0 or a VM that exists. Every port is
+ * present, and edid takes extension blocks.
+ *
+ * Attributes are kept in a table of slots, found through a hash of
+ * (attr, domid, port). Destroying a VM frees its slots for reuse and
+ * bumps their generation. A handle carries the slot and the generation
+ * it was opened at, so a stale handle fails with ENODEV the way a stale
+ * sysfs descriptor does, even after its slot has been reused.
+ */
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+/* A handle is a slot number with the slot's generation above it */
+#define SIM_SLOT_BITS 20
+#define SIM_SLOT_MASK ((1U << SIM_SLOT_BITS) - 1)
+#define SIM_GEN_MASK ((1U << (31 - SIM_SLOT_BITS)) - 1)
+
+struct sim_attr {
+    igvt_attr attr;
+    unsigned int domid;
+    gt_port port;
+    int used;
+    unsigned int gen;
+    int next;                   /* in the hash chain, or the free list */
+    int watch_fd;
+    size_t size;
+    unsigned char value[EDID_MAX_SIZE];
+};
+
+struct igvt_sim {
+    pthread_mutex_t lock;
+    struct sim_attr *attrs;
+    size_t n_attrs;             /* slots ever used */
+    size_t attrs_size;
+    size_t n_used;
+    int free_slot;
+    int *buckets;               /* the first slot of each chain, or -1 */
+    size_t n_buckets;           /* a power of two */
+    unsigned int *vms;
+    size_t n_vms;
+    size_t vms_size;
+};
+
+static size_t sim_hash(const struct igvt_sim *sim, igvt_attr attr,
+                       unsigned int domid, gt_port port)
+{
+    uint32_t h = (domid * 0x9e3779b1U) ^ (attr << 8 | port);
+
+    return (h ^ h >> 16) & (sim->n_buckets - 1);
+}
+
+/*
+ * Rehash into twice as many buckets once the chains average more than
+ * two slots. Called with the sim lock held; returns 1 if every slot in
+ * use was chained afresh, 0 if nothing changed, or -ENOMEM.
+ */
+static int sim_grow_buckets(struct igvt_sim *sim)
+{
+    size_t n = sim->n_buckets ? sim->n_buckets * 2 : 64, i, b;
+    int *buckets;
+
+    if (sim->n_buckets && sim->n_used <= sim->n_buckets * 2)
+        return 0;
+
+    buckets = malloc(n * sizeof(*buckets));
+
+    if (!buckets)
+        return -ENOMEM;
+
+    free(sim->buckets);
+    sim->buckets = buckets;
+    sim->n_buckets = n;
+
+    for (b = 0; b < n; b++)
+        buckets[b] = -1;
+
+    for (i = 0; i < sim->n_attrs; i++) {
+        if (!sim->attrs[i].used)
+            continue;
+
+        b = sim_hash(sim, sim->attrs[i].attr, sim->attrs[i].domid,
+                     sim->attrs[i].port);
+        sim->attrs[i].next = buckets[b];
+        buckets[b] = i;
+    }
+
+    return 1;
+}
+
+/* Called with the sim lock held */
+static struct sim_attr *sim_find(struct igvt_sim *sim, igvt_attr attr,
+                                 unsigned int domid, gt_port port)
+{
+    struct sim_attr *a;
+    int i;
+
+    if (!IGVT_ATTR_VM_P(attr))
+        domid = 0;
+
+    if (attr != IGVT_ATTR_PRESENCE && !IGVT_ATTR_VM_P(attr))
+        port = 0;
+
+    if (!sim->n_buckets)
+        return NULL;
+
+    for (i = sim->buckets[sim_hash(sim, attr, domid, port)]; i >= 0;
+         i = a->next) {
+        a = &sim->attrs[i];
+
+        if (a->attr == attr && a->domid == domid && a->port == port)
+            return a;
+    }
+
+    return NULL;
+}
+
+/* The attribute a handle was opened on, or NULL if it has gone since */
+static struct sim_attr *sim_handle(struct igvt_sim *sim, int handle)
+{
+    unsigned int slot = handle & SIM_SLOT_MASK;
+    struct sim_attr *a;
+
+    if (handle < 0 || slot >= sim->n_attrs)
+        return NULL;
+
+    a = &sim->attrs[slot];
+
+    return a->used && a->gen == ((unsigned int) handle >> SIM_SLOT_BITS) ?
+           a : NULL;
+}
+
+static int sim_handle_of(const struct igvt_sim *sim, const struct sim_attr *a)
+{
+    return (int) (a->gen << SIM_SLOT_BITS | (a - sim->attrs));
+}
+
+/* Called with the sim lock held */
+static struct sim_attr *sim_add(struct igvt_sim *sim, igvt_attr attr,
+                                unsigned int domid, gt_port port,
+                                const char *value)
+{
+    struct sim_attr *a;
+    size_t size, b;
+    int slot, grown;
+
+    if (sim->free_slot >= 0) {
+        slot = sim->free_slot;
+        sim->free_slot = sim->attrs[slot].next;
+    } else {
+        if (sim->n_attrs > SIM_SLOT_MASK)
+            return NULL;
+
+        if (sim->n_attrs == sim->attrs_size) {
+            size = sim->attrs_size ? sim->attrs_size * 2 : 64;
+            a = realloc(sim->attrs, size * sizeof(*a));
+
+            if (!a)
+                return NULL;
+
+            sim->attrs = a;
+            sim->attrs_size = size;
+        }
+
+        slot = sim->n_attrs++;
+        sim->attrs[slot].gen = 0;
+    }
+
+    a = &sim->attrs[slot];
+    a->attr = attr;
+    a->domid = domid;
+    a->port = port;
+    a->used = 1;
+    a->watch_fd = -1;
+    a->size = strlen(value);
+    memcpy(a->value, value, a->size);
+    sim->n_used++;
+
+    grown = sim_grow_buckets(sim);
+
+    if (grown < 0) {
+        a->used = 0;
+        a->next = sim->free_slot;
+        sim->free_slot = slot;
+        sim->n_used--;
+        return NULL;
+    }
+
+    if (!grown) {
+        b = sim_hash(sim, attr, domid, port);
+        a->next = sim->buckets[b];
+        sim->buckets[b] = slot;
+    }
+
+    return a;
+}
+
+/*
+ * Take an attribute out of the table. Its slot goes on the free list
+ * with a new generation, so handles to it fail from now on. Called with
+ * the sim lock held.
+ */
+static void sim_remove(struct igvt_sim *sim, struct sim_attr *a)
+{
+    int slot = a - sim->attrs;
+    int *link = &sim->buckets[sim_hash(sim, a->attr, a->domid, a->port)];
+
+    while (*link != slot)
+        link = &sim->attrs[*link].next;
+
+    *link = a->next;
+
+    if (a->watch_fd >= 0)
+        close(a->watch_fd);
+
+    a->used = 0;
+    a->gen = (a->gen + 1) & SIM_GEN_MASK;
+    a->next = sim->free_slot;
+    sim->free_slot = slot;
+    sim->n_used--;
+}
+
+/* Called with the sim lock held */
+static ssize_t sim_vm_index(struct igvt_sim *sim, unsigned int domid)
+{
+    size_t i;
+
+    for (i = 0; i < sim->n_vms; i++) {
+        if (sim->vms[i] == domid)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Called with the sim lock held */
+static int sim_vm_create(struct igvt_sim *sim, unsigned int domid)
+{
+    unsigned int *vms;
+    size_t size;
+    int port;
+
+    if (domid == 0)
+        return -EINVAL;
+
+    if (sim_vm_index(sim, domid) >= 0)
+        return -EEXIST;
+
+    if (sim->n_vms == sim->vms_size) {
+        size = sim->vms_size ? sim->vms_size * 2 : 16;
+        vms = realloc(sim->vms, size * sizeof(*vms));
+
+        if (!vms)
+            return -ENOMEM;
+
+        sim->vms = vms;
+        sim->vms_size = size;
+    }
+
+    for (port = 0; port < GVT_MAX_PORTS; port++) {
+        if (!sim_add(sim, IGVT_ATTR_CONNECTION, domid, port,
+                     "disconnected\n") ||
+            !sim_add(sim, IGVT_ATTR_PORT_OVERRIDE, domid, port, "") ||
+            !sim_add(sim, IGVT_ATTR_EDID, domid, port, ""))
+            return -ENOMEM;
+    }
+
+    sim->vms[sim->n_vms++] = domid;
+
+    return 0;
+}
+
+/* Called with the sim lock held */
+static int sim_vm_destroy(struct igvt_sim *sim, unsigned int domid)
+{
+    ssize_t vm = sim_vm_index(sim, domid);
+    size_t i;
+
+    if (vm < 0)
+        return -ENOENT;
+
+    sim->vms[vm] = sim->vms[--sim->n_vms];
+
+    for (i = 0; i < sim->n_attrs; i++) {
+        if (sim->attrs[i].used && IGVT_ATTR_VM_P(sim->attrs[i].attr) &&
+            sim->attrs[i].domid == domid)
+            sim_remove(sim, &sim->attrs[i]);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Give a context a simulated vgt, if it doesn't have one already
+ *
+ * The simulated vgt starts with no VMs and dom0 in the foreground.
+ *
+ * @return 0 on success, -ENOMEM
+ */
+int _sim_init(igvt_ctx *ctx)
+{
+    struct igvt_sim *sim;
+    int port;
+
+    if (ctx->sim)
+        return 0;
+
+    sim = calloc(1, sizeof(*sim));
+
+    if (!sim)
+        return -ENOMEM;
+
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->free_slot = -1;
+
+    if (!sim_add(sim, IGVT_ATTR_FOREGROUND_VM, 0, 0, "0\n") ||
+        !sim_add(sim, IGVT_ATTR_CREATE_INSTANCE, 0, 0, "")) {
+        ctx->sim = sim;
+        _sim_free(ctx);
+        return -ENOMEM;
+    }
+
+    for (port = 0; port < GVT_MAX_PORTS; port++) {
+        if (igvt_is_valid_port_p(port) &&
+            !sim_add(sim, IGVT_ATTR_PRESENCE, 0, port, "present\n")) {
+            ctx->sim = sim;
+            _sim_free(ctx);
+            return -ENOMEM;
+        }
+    }
+
+    ctx->sim = sim;
+
+    return 0;
+}
+
+void _sim_free(igvt_ctx *ctx)
+{
+    struct igvt_sim *sim = ctx->sim;
+    size_t i;
+
+    if (!sim)
+        return;
+
+    for (i = 0; i < sim->n_attrs; i++) {
+        if (sim->attrs[i].used && sim->attrs[i].watch_fd >= 0)
+            close(sim->attrs[i].watch_fd);
+    }
+
+    pthread_mutex_destroy(&sim->lock);
+    free(sim->buckets);
+    free(sim->attrs);
+    free(sim->vms);
+    free(sim);
+    ctx->sim = NULL;
+}
+
+static int sim_available(igvt_ctx *ctx)
+{
+    return 1;
+}
+
+static int sim_vm_exists(igvt_ctx *ctx, unsigned int domid)
+{
+    int exists;
+
+    pthread_mutex_lock(&ctx->sim->lock);
+    exists = sim_vm_index(ctx->sim, domid) >= 0;
+    pthread_mutex_unlock(&ctx->sim->lock);
+
+    return exists;
+}
+
+static int sim_open_attr(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                         gt_port port)
+{
+    struct sim_attr *a;
+    int handle;
+
+    pthread_mutex_lock(&ctx->sim->lock);
+    a = sim_find(ctx->sim, attr, domid, port);
+    handle = a ? sim_handle_of(ctx->sim, a) : -ENOENT;
+    pthread_mutex_unlock(&ctx->sim->lock);
+
+    return handle;
+}
+
+static ssize_t sim_read_attr(igvt_ctx *ctx, int handle, igvt_attr attr,
+                             unsigned int domid, gt_port port,
+                             void *buf, size_t size)
+{
+    struct sim_attr *a;
+    ssize_t n = -ENODEV;
+
+    pthread_mutex_lock(&ctx->sim->lock);
+
+    a = sim_handle(ctx->sim, handle);
+
+    if (a) {
+        n = a->size < size ? a->size : size;
+        memcpy(buf, a->value, n);
+    }
+
+    pthread_mutex_unlock(&ctx->sim->lock);
+
+    return n;
+}
+
+/* Called with the sim lock held; returns 0 or -errno */
+static int sim_store(struct igvt_sim *sim, struct sim_attr *a,
+                     const char *buf, size_t size)
+{
+    char text[32];
+    int domid;
+
+    /* Text attributes are parsed like the driver's sscanf would */
+    snprintf(text, sizeof(text), "%.*s", (int) size, buf);
+
+    switch (a->attr) {
+    case IGVT_ATTR_CONNECTION:
+        if (strncmp(text, "connect", 7) == 0)
+            strcpy((char *) a->value, "connected\n");
+        else if (strncmp(text, "disconnect", 10) == 0)
+            strcpy((char *) a->value, "disconnected\n");
+        else
+            return -EINVAL;
+
+        a->size = strlen((char *) a->value);
+        return 0;
+
+    case IGVT_ATTR_FOREGROUND_VM:
+        if (sscanf(text, "%d", &domid) != 1 ||
+            (domid != 0 && sim_vm_index(sim, domid) < 0))
+            return -EINVAL;
+
+        a->size = snprintf((char *) a->value, sizeof(a->value), "%d\n", domid);
+        return 0;
+
+    case IGVT_ATTR_CREATE_INSTANCE:
+        if (sscanf(text, "%d", &domid) != 1)
+            return -EINVAL;
+
+        return domid < 0 ? sim_vm_destroy(sim, -domid) :
+                           sim_vm_create(sim, domid);
+
+    case IGVT_ATTR_PRESENCE:
+        return -EACCES;
+
+    default:
+        if (size > sizeof(a->value))
+            return -EINVAL;
+
+        memcpy(a->value, buf, size);
+        a->size = size;
+        return 0;
+    }
+}
+
+static ssize_t sim_write_attr(igvt_ctx *ctx, int handle, igvt_attr attr,
+                              unsigned int domid, gt_port port,
+                              const void *buf, size_t size)
+{
+    struct sim_attr *a;
+    ssize_t n = -ENODEV;
+    int status;
+
+    pthread_mutex_lock(&ctx->sim->lock);
+
+    a = sim_handle(ctx->sim, handle);
+
+    if (a) {
+        status = sim_store(ctx->sim, a, buf, size);
+        n = status < 0 ? status : (ssize_t) size;
+
+        /* Creating a VM may have moved the table */
+        a = sim_handle(ctx->sim, handle);
+
+        if (status == 0 && a->watch_fd >= 0)
+            eventfd_write(a->watch_fd, 1);
+    }
+
+    pthread_mutex_unlock(&ctx->sim->lock);
+
+    return n;
+}
+
+static ssize_t sim_attr_size(igvt_ctx *ctx, igvt_attr attr,
+                             unsigned int domid, gt_port port)
+{
+    struct sim_attr *a;
+    ssize_t size = -ENOENT;
+
+    pthread_mutex_lock(&ctx->sim->lock);
+
+    a = sim_find(ctx->sim, attr, domid, port);
+
+    /* The simulated edid is a binary attribute that takes extensions */
+    if (a)
+        size = attr == IGVT_ATTR_EDID ? EDID_MAX_SIZE : (ssize_t) a->size;
+
+    pthread_mutex_unlock(&ctx->sim->lock);
+
+    return size;
+}
+
+static void sim_close_attr(igvt_ctx *ctx, int handle)
+{
+}
+
+/* An eventfd that is bumped on every successful write */
+static int sim_watch(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                     gt_port port)
+{
+    struct sim_attr *a;
+    int fd = -ENOENT;
+
+    pthread_mutex_lock(&ctx->sim->lock);
+
+    a = sim_find(ctx->sim, attr, domid, port);
+
+    if (a) {
+        if (a->watch_fd < 0)
+            a->watch_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if (a->watch_fd >= 0)
+            fd = dup(a->watch_fd);
+
+        if (fd < 0)
+            fd = -errno;
+    }
+
+    pthread_mutex_unlock(&ctx->sim->lock);
+
+    return fd;
+}
+
+static int sim_seed(igvt_ctx *ctx, igvt_attr attr, unsigned int domid,
+                    gt_port port, const void *value, size_t size)
+{
+    struct igvt_sim *sim = ctx->sim;
+    struct sim_attr *a;
+    int status = 0;
+
+    if (size > sizeof(a->value))
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim->lock);
+
+    if (IGVT_ATTR_VM_P(attr) && sim_vm_index(sim, domid) < 0)
+        status = sim_vm_create(sim, domid);
+
+    a = status < 0 ? NULL : sim_find(sim, attr, domid, port);
+
+    if (!a && status == 0) {
+        a = sim_add(sim, attr, IGVT_ATTR_VM_P(attr) ? domid : 0,
+                    attr == IGVT_ATTR_PRESENCE || IGVT_ATTR_VM_P(attr) ?
+                    port : 0, "");
+
+        if (!a)
+            status = -ENOMEM;
+    }
+
+    if (a && value) {
+        memcpy(a->value, value, size);
+        a->size = size;
+    }
+
+    pthread_mutex_unlock(&sim->lock);
+
+    return status;
+}
+
+static ssize_t sim_list_vms(igvt_ctx *ctx, unsigned int *domids, size_t max)
+{
+    ssize_t n;
+
+    pthread_mutex_lock(&ctx->sim->lock);
+
+    n = ctx->sim->n_vms;
+    memcpy(domids, ctx->sim->vms,
+           (n < (ssize_t) max ? (size_t) n : max) * sizeof(*domids));
+
+    pthread_mutex_unlock(&ctx->sim->lock);
+
+    return n;
+}
+
+const struct igvt_io _io_sim = {
+    .name = "simulator",
+    .available = sim_available,
+    .vm_exists = sim_vm_exists,
+    .open_attr = sim_open_attr,
+    .read_attr = sim_read_attr,
+    .write_attr = sim_write_attr,
+    .attr_size = sim_attr_size,
+    .close_attr = sim_close_attr,
+    .watch = sim_watch,
+    .seed = sim_seed,
+    .list_vms = sim_list_vms,
+};
@@ -0,0 +1,272 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file stage.c
+ *
+ * @brief Displays plugged in ahead of a foreground switch.
+ *
+ * A VM's virtual ports can be set up while another VM owns the screen.
+ * Staging copies the displays and plugs them in on a thread of their
+ * own; switching to the VM waits for that thread, which has normally
+ * long finished, and then only has the foreground_vm write left to do.
+ *
+ * There is at most one staging per VM. Its thread is joined, and the
+ * staging dropped, by whoever collects its result: a switch, a wait, a
+ * newer staging of the same VM, or freeing the context.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+struct stage {
+    struct stage *next;
+    igvt_ctx *ctx;
+    unsigned int domid;
+    pthread_t thread;
+    int result;
+    size_t n;
+    struct igvt_display displays[];
+    /* followed by the EDIDs */
+};
+
+void _stage_init(igvt_ctx *ctx)
+{
+    pthread_mutex_init(&ctx->stage_lock, NULL);
+    ctx->stages = NULL;
+}
+
+/* Unlink a VM's staging. Called with stage_lock held. */
+static struct stage *stage_take(igvt_ctx *ctx, unsigned int domid)
+{
+    struct stage **p, *s;
+
+    for (p = &ctx->stages; (s = *p); p = &s->next) {
+        if (s->domid == domid) {
+            *p = s->next;
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+/* Wait for an unlinked staging to finish, and free it */
+static int stage_finish(struct stage *s)
+{
+    int result;
+
+    pthread_join(s->thread, NULL);
+    result = s->result;
+    free(s);
+
+    return result;
+}
+
+void _stage_free(igvt_ctx *ctx)
+{
+    struct stage *s;
+
+    while ((s = ctx->stages)) {
+        ctx->stages = s->next;
+        stage_finish(s);
+    }
+
+    pthread_mutex_destroy(&ctx->stage_lock);
+}
+
+static void *stage_thread(void *arg)
+{
+    struct stage *s = arg;
+    uint64_t span = _trace_begin(s->ctx);
+
+    s->result = _plug_displays(s->ctx, s->displays, s->n);
+    _trace_end(s->ctx, "stage", span, s->domid, PORT_ILLEGAL, s->result);
+
+    return NULL;
+}
+
+/**
+ * @brief Start plugging in a VM's displays in the background
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @param displays The displays, all of them on domid
+ * @param n The number of displays
+ * @return 0 if the staging was started, -errno otherwise
+ */
+static int stage_displays(igvt_ctx *ctx, unsigned int domid,
+                          const struct igvt_display *displays, size_t n)
+{
+    struct stage *s, *old;
+    unsigned char *edid;
+    size_t i, size;
+    int status;
+
+    size = sizeof(*s) + n * sizeof(s->displays[0]);
+
+    for (i = 0; i < n; i++) {
+        if (displays[i].domid != domid) {
+            igvt_printf(ctx, IGVT_ERROR, "%s::display %zu is on domain %u, "
+                        "not %u\n", __func__, i, displays[i].domid, domid);
+            return -EINVAL;
+        }
+
+        size += displays[i].edid_size;
+    }
+
+    s = malloc(size);
+
+    if (!s)
+        return -ENOMEM;
+
+    s->ctx = ctx;
+    s->domid = domid;
+    s->result = 0;
+    s->n = n;
+
+    /* The caller's EDIDs needn't outlive the call */
+    edid = (unsigned char *) &s->displays[n];
+
+    for (i = 0; i < n; i++) {
+        s->displays[i] = displays[i];
+        memcpy(edid, displays[i].edid, displays[i].edid_size);
+        s->displays[i].edid = edid;
+        edid += displays[i].edid_size;
+    }
+
+    pthread_mutex_lock(&ctx->stage_lock);
+
+    /* A newer staging replaces the old one, once that is done writing */
+    while ((old = stage_take(ctx, domid))) {
+        pthread_mutex_unlock(&ctx->stage_lock);
+        stage_finish(old);
+        pthread_mutex_lock(&ctx->stage_lock);
+    }
+
+    status = pthread_create(&s->thread, NULL, stage_thread, s);
+
+    if (status == 0) {
+        s->next = ctx->stages;
+        ctx->stages = s;
+    }
+
+    pthread_mutex_unlock(&ctx->stage_lock);
+
+    if (status != 0) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::cannot start staging thread: %s\n",
+                    __func__, igvt_strerror(status));
+        free(s);
+        return -status;
+    }
+
+    return 0;
+}
+
+int igvt_ctx_stage_displays(igvt_ctx *ctx, unsigned int domid,
+                            const struct igvt_display *displays, size_t n)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(stage_displays__entry, domid, n);
+    result = stage_displays(ctx, domid, displays, n);
+    IGVT_PROBE(stage_displays__return, domid, result);
+    _recorder_record(ctx, IGVT_OP_STAGE_DISPLAYS, domid, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
+
+int igvt_stage_displays(unsigned int domid,
+                        const struct igvt_display *displays, size_t n)
+{
+    return igvt_ctx_stage_displays(NULL, domid, displays, n);
+}
+
+/**
+ * @brief Wait for a VM's staging to finish, and drop it
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param domid The domain ID
+ * @return the result of the staging, or -ENOENT if the VM had none
+ */
+int igvt_ctx_stage_wait(igvt_ctx *ctx, unsigned int domid)
+{
+    struct stage *s;
+
+    ctx = _igvt_ctx(ctx);
+
+    pthread_mutex_lock(&ctx->stage_lock);
+    s = stage_take(ctx, domid);
+    pthread_mutex_unlock(&ctx->stage_lock);
+
+    return s ? stage_finish(s) : -ENOENT;
+}
+
+int igvt_stage_wait(unsigned int domid)
+{
+    return igvt_ctx_stage_wait(NULL, domid);
+}
+
+/**
+ * @brief Bring a VM to the foreground, once its staging is done
+ *
+ * @param ctx The context
+ * @param domid The domain ID
+ * @return 0 on success, the staging's failure, or -errno
+ */
+static int switch_foreground_vm(igvt_ctx *ctx, unsigned int domid)
+{
+    uint64_t span = _trace_begin(ctx);
+    int status;
+
+    status = igvt_ctx_stage_wait(ctx, domid);
+
+    _trace_end(ctx, "stage_wait", span, domid, PORT_ILLEGAL, status);
+
+    if (status < 0 && status != -ENOENT) {
+        igvt_printf(ctx, IGVT_ERROR, "%s::staging vm%u failed: %s\n",
+                    __func__, domid, igvt_strerror(-status));
+        return status;
+    }
+
+    return _set_foreground_vm(ctx, domid);
+}
+
+int igvt_ctx_switch_foreground_vm(igvt_ctx *ctx, unsigned int domid)
+{
+    uint64_t start;
+    int result;
+
+    ctx = _igvt_ctx(ctx);
+    start = _recorder_begin(ctx);
+    IGVT_PROBE(switch_foreground_vm__entry, domid);
+    result = switch_foreground_vm(ctx, domid);
+    IGVT_PROBE(switch_foreground_vm__return, domid, result);
+    _recorder_record(ctx, IGVT_OP_SWITCH_FOREGROUND_VM, domid, PORT_ILLEGAL,
+                     result, start);
+
+    return result;
+}
+
+int igvt_switch_foreground_vm(unsigned int domid)
+{
+    return igvt_ctx_switch_foreground_vm(NULL, domid);
+}
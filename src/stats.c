@@ -0,0 +1,419 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file stats.c
+ *
+ * @brief Call counts, errors, bytes written, hotplug counts and latency
+ * histograms.
+ *
+ * Counters live in shards, one per thread stripe (the same stripes the
+ * rcu read counts use), so that threads don't share cache lines when
+ * they count. A shard is allocated the first time its stripe counts
+ * something. Reading the stats sums the shards.
+ *
+ * Latencies go into log-linear buckets in the style of HdrHistogram:
+ * four buckets per power of two, so a bucket is within 25% of any
+ * latency in it, from nanoseconds up to about eight seconds. Calls are
+ * only timed while the flight recorder or a trace is running; the rest
+ * are counted without a latency.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+struct stats_shard {
+    struct igvt_op_stats ops[IGVT_NUM_OPS];
+    uint64_t errors[IGVT_STATS_ERRNOS];
+    uint64_t bytes_written;
+    struct igvt_hotplug_stats hotplug;
+} __attribute__((aligned(IGVT_CACHE_LINE)));
+
+/* The lowest latency bound exported to Prometheus, as a power of two ns */
+#define PROMETHEUS_MIN_OCTAVE 10
+
+static unsigned int latency_bucket(uint64_t ns)
+{
+    unsigned int msb, bucket;
+
+    if (ns < 4)
+        return ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    bucket = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+
+    return bucket < IGVT_LATENCY_BUCKETS ? bucket : IGVT_LATENCY_BUCKETS - 1;
+}
+
+/**
+ * @brief The largest latency counted in a histogram bucket
+ *
+ * @param bucket
+ * @return the bound in ns; the last bucket also counts everything above it
+ */
+uint64_t igvt_latency_bucket_max(unsigned int bucket)
+{
+    unsigned int msb;
+
+    if (bucket < 4)
+        return bucket;
+
+    if (bucket >= IGVT_LATENCY_BUCKETS)
+        bucket = IGVT_LATENCY_BUCKETS - 1;
+
+    msb = bucket / 4 + 1;
+
+    return ((uint64_t) (5 + bucket % 4) << (msb - 2)) - 1;
+}
+
+static struct stats_shard *stats_shard(igvt_ctx *ctx)
+{
+    struct stats_shard *shard, *expected = NULL;
+    int stripe = _rcu_stripe < 0 ? _rcu_assign_stripe() : _rcu_stripe;
+
+    shard = __atomic_load_n(&ctx->stats[stripe], __ATOMIC_ACQUIRE);
+
+    if (shard)
+        return shard;
+
+    if (posix_memalign((void **) &shard, IGVT_CACHE_LINE, sizeof(*shard)))
+        return NULL;
+
+    memset(shard, 0, sizeof(*shard));
+
+    if (!__atomic_compare_exchange_n(&ctx->stats[stripe], &expected, shard, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(shard);
+        shard = expected;
+    }
+
+    return shard;
+}
+
+void _stats_free(igvt_ctx *ctx)
+{
+    int i;
+
+    for (i = 0; i < IGVT_RCU_STRIPES; i++) {
+        free(ctx->stats[i]);
+        ctx->stats[i] = NULL;
+    }
+}
+
+static void count(uint64_t *counter, uint64_t n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+void _stats_record(igvt_ctx *ctx, igvt_op op, int result, uint64_t latency,
+                   int timed)
+{
+    struct stats_shard *shard = stats_shard(ctx);
+    struct igvt_op_stats *s;
+
+    if (!shard || op <= 0 || op >= IGVT_NUM_OPS)
+        return;
+
+    s = &shard->ops[op];
+
+    count(&s->calls, 1);
+
+    if (timed) {
+        count(&s->timed, 1);
+        count(&s->latency_sum, latency);
+        count(&s->latency[latency_bucket(latency)], 1);
+    }
+
+    if (result < 0) {
+        count(&s->errors, 1);
+        count(&shard->errors[-result < IGVT_STATS_ERRNOS ?
+                             -result : IGVT_STATS_ERRNOS - 1], 1);
+    }
+}
+
+void _stats_bytes_written(igvt_ctx *ctx, size_t n)
+{
+    struct stats_shard *shard = stats_shard(ctx);
+
+    if (shard)
+        count(&shard->bytes_written, n);
+}
+
+void _stats_hotplug(igvt_ctx *ctx, const struct igvt_hotplug_stats *delta)
+{
+    struct stats_shard *shard = stats_shard(ctx);
+
+    if (!shard)
+        return;
+
+    if (delta->changes)
+        count(&shard->hotplug.changes, delta->changes);
+
+    if (delta->suppressed)
+        count(&shard->hotplug.suppressed, delta->suppressed);
+
+    if (delta->pushed)
+        count(&shard->hotplug.pushed, delta->pushed);
+}
+
+static void sum(uint64_t *total, const uint64_t *counter)
+{
+    *total += __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Read a context's statistics
+ *
+ * The counters keep moving while they are read, so the totals are only
+ * consistent with each other to within the calls that were in flight.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param stats Filled in with the totals since the context was created
+ * @return 0
+ */
+int igvt_ctx_get_stats(igvt_ctx *ctx, struct igvt_stats *stats)
+{
+    const struct stats_shard *shard;
+    int i, op, b;
+
+    ctx = _igvt_ctx(ctx);
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (i = 0; i < IGVT_RCU_STRIPES; i++) {
+        shard = __atomic_load_n(&ctx->stats[i], __ATOMIC_ACQUIRE);
+
+        if (!shard)
+            continue;
+
+        for (op = 0; op < IGVT_NUM_OPS; op++) {
+            sum(&stats->ops[op].calls, &shard->ops[op].calls);
+            sum(&stats->ops[op].errors, &shard->ops[op].errors);
+            sum(&stats->ops[op].timed, &shard->ops[op].timed);
+            sum(&stats->ops[op].latency_sum, &shard->ops[op].latency_sum);
+
+            for (b = 0; b < IGVT_LATENCY_BUCKETS; b++)
+                sum(&stats->ops[op].latency[b], &shard->ops[op].latency[b]);
+        }
+
+        for (b = 0; b < IGVT_STATS_ERRNOS; b++)
+            sum(&stats->errors[b], &shard->errors[b]);
+
+        sum(&stats->bytes_written, &shard->bytes_written);
+        sum(&stats->hotplug.changes, &shard->hotplug.changes);
+        sum(&stats->hotplug.suppressed, &shard->hotplug.suppressed);
+        sum(&stats->hotplug.pushed, &shard->hotplug.pushed);
+    }
+
+    return 0;
+}
+
+int igvt_get_stats(struct igvt_stats *stats)
+{
+    return igvt_ctx_get_stats(NULL, stats);
+}
+
+static void prometheus_format(FILE *f, const struct igvt_stats *stats)
+{
+    const struct igvt_op_stats *s;
+    uint64_t cumulative;
+    int op, b, octave;
+
+    fprintf(f, "# HELP igvt_calls_total libigvt API calls.\n"
+               "# TYPE igvt_calls_total counter\n");
+
+    for (op = 1; op < IGVT_NUM_OPS; op++)
+        fprintf(f, "igvt_calls_total{op=\"%s\"} %llu\n", igvt_op_name(op),
+                (unsigned long long) stats->ops[op].calls);
+
+    fprintf(f, "# HELP igvt_call_errors_total libigvt API calls that failed.\n"
+               "# TYPE igvt_call_errors_total counter\n");
+
+    for (op = 1; op < IGVT_NUM_OPS; op++)
+        fprintf(f, "igvt_call_errors_total{op=\"%s\"} %llu\n",
+                igvt_op_name(op), (unsigned long long) stats->ops[op].errors);
+
+    fprintf(f, "# HELP igvt_errors_total libigvt API failures by errno.\n"
+               "# TYPE igvt_errors_total counter\n");
+
+    for (b = 1; b < IGVT_STATS_ERRNOS; b++) {
+        if (stats->errors[b])
+            fprintf(f, "igvt_errors_total{errno=\"%d\"} %llu\n", b,
+                    (unsigned long long) stats->errors[b]);
+    }
+
+    fprintf(f, "# HELP igvt_sysfs_bytes_written_total Bytes written to vgt "
+               "attributes.\n"
+               "# TYPE igvt_sysfs_bytes_written_total counter\n"
+               "igvt_sysfs_bytes_written_total %llu\n",
+            (unsigned long long) stats->bytes_written);
+
+    fprintf(f, "# HELP igvt_hotplug_changes_total Physical port changes seen "
+               "by mirrors.\n"
+               "# TYPE igvt_hotplug_changes_total counter\n"
+               "igvt_hotplug_changes_total %llu\n"
+               "# HELP igvt_hotplug_suppressed_total Physical port changes "
+               "debounced away before reaching a mirror.\n"
+               "# TYPE igvt_hotplug_suppressed_total counter\n"
+               "igvt_hotplug_suppressed_total %llu\n"
+               "# HELP igvt_hotplug_pushed_total Settled physical port states "
+               "pushed to mirrors.\n"
+               "# TYPE igvt_hotplug_pushed_total counter\n"
+               "igvt_hotplug_pushed_total %llu\n",
+            (unsigned long long) stats->hotplug.changes,
+            (unsigned long long) stats->hotplug.suppressed,
+            (unsigned long long) stats->hotplug.pushed);
+
+    fprintf(f, "# HELP igvt_call_duration_seconds libigvt API call latency.\n"
+               "# TYPE igvt_call_duration_seconds histogram\n");
+
+    for (op = 1; op < IGVT_NUM_OPS; op++) {
+        s = &stats->ops[op];
+        cumulative = 0;
+        b = 0;
+
+        /* Export one bucket per power of two, summing the four of each
+         * octave */
+        for (octave = PROMETHEUS_MIN_OCTAVE;
+             (octave - 1) * 4 < IGVT_LATENCY_BUCKETS; octave++) {
+            for (; b < (octave - 1) * 4; b++)
+                cumulative += s->latency[b];
+
+            fprintf(f, "igvt_call_duration_seconds_bucket{op=\"%s\","
+                       "le=\"%.9g\"} %llu\n", igvt_op_name(op),
+                    (double) igvt_latency_bucket_max(b - 1) / 1e9,
+                    (unsigned long long) cumulative);
+        }
+
+        fprintf(f, "igvt_call_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} "
+                   "%llu\n"
+                   "igvt_call_duration_seconds_sum{op=\"%s\"} %.9g\n"
+                   "igvt_call_duration_seconds_count{op=\"%s\"} %llu\n",
+                igvt_op_name(op), (unsigned long long) s->timed,
+                igvt_op_name(op), (double) s->latency_sum / 1e9,
+                igvt_op_name(op), (unsigned long long) s->timed);
+    }
+}
+
+/**
+ * @brief Write a context's statistics in the Prometheus text format
+ *
+ * The text is formatted first and written in one go.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param fd Where to write it
+ * @return 0 on success, -errno on failure
+ */
+int igvt_ctx_stats_write_prometheus(igvt_ctx *ctx, int fd)
+{
+    struct igvt_stats *stats;
+    char *text = NULL;
+    size_t size = 0, off;
+    ssize_t n;
+    FILE *f;
+    int status = 0;
+
+    stats = malloc(sizeof(*stats));
+
+    if (!stats)
+        return -ENOMEM;
+
+    igvt_ctx_get_stats(ctx, stats);
+
+    f = open_memstream(&text, &size);
+
+    if (!f) {
+        free(stats);
+        return -errno;
+    }
+
+    prometheus_format(f, stats);
+    free(stats);
+
+    if (fclose(f) != 0) {
+        free(text);
+        return -ENOMEM;
+    }
+
+    for (off = 0; off < size; off += n) {
+        n = write(fd, text + off, size - off);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+
+            status = -errno;
+            break;
+        }
+    }
+
+    free(text);
+
+    return status;
+}
+
+int igvt_stats_write_prometheus(int fd)
+{
+    return igvt_ctx_stats_write_prometheus(NULL, fd);
+}
+
+/**
+ * @brief Save a context's statistics to a Prometheus text file
+ *
+ * The file is written under a temporary name and renamed into place,
+ * as the node exporter's textfile collector requires.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param path The file to write, e.g. /var/lib/node_exporter/igvt.prom
+ * @return 0 on success, -errno on failure
+ */
+int igvt_ctx_stats_save_prometheus(igvt_ctx *ctx, const char *path)
+{
+    char tmp[256];
+    int fd, status;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid()) >=
+        (int) sizeof(tmp))
+        return -ENAMETOOLONG;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return -errno;
+
+    status = igvt_ctx_stats_write_prometheus(ctx, fd);
+
+    if (close(fd) < 0 && status == 0)
+        status = -errno;
+
+    if (status == 0 && rename(tmp, path) < 0)
+        status = -errno;
+
+    if (status < 0)
+        unlink(tmp);
+
+    return status;
+}
+
+int igvt_stats_save_prometheus(const char *path)
+{
+    return igvt_ctx_stats_save_prometheus(NULL, path);
+}
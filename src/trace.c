@@ -0,0 +1,159 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file trace.c
+ *
+ * @brief Timelines of API calls and their phases as Chrome trace JSON.
+ *
+ * While a trace is running every public call, and the phases inside it
+ * (validation, unplug, the port_override, EDID and connection writes,
+ * EDID filtering, a bulk plug's preparation and batch write, and a
+ * handoff's disconnect-to-connect gap), is
+ * written out as a complete ("X") event. Phases run
+ * on the caller's thread inside the call, so chrome://tracing and
+ * Perfetto draw them nested under it; the exceptions are a staging,
+ * whose "stage" event is on the thread that plugged the displays in,
+ * and discovery's "discover_worker" events, one per thread of its pool.
+ * When no trace is running a phase costs one relaxed load.
+ */
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+static __thread long trace_tid;
+
+void _trace_init(igvt_ctx *ctx)
+{
+    pthread_mutex_init(&ctx->trace_lock, NULL);
+    ctx->trace = NULL;
+}
+
+void _trace_free(igvt_ctx *ctx)
+{
+    igvt_ctx_trace_stop(ctx);
+    pthread_mutex_destroy(&ctx->trace_lock);
+}
+
+void _trace_end(igvt_ctx *ctx, const char *name, uint64_t start,
+                unsigned int domid, gt_port port, int result)
+{
+    uint64_t end;
+
+    if (!start)
+        return;
+
+    end = _recorder_now();
+
+    if (!trace_tid)
+        trace_tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&ctx->trace_lock);
+
+    /* The trace may have stopped since the phase began */
+    if (ctx->trace) {
+        fprintf(ctx->trace,
+                ",\n{\"name\":\"%s\",\"cat\":\"igvt\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,"
+                "\"args\":{\"domid\":%u,\"port\":\"%s\",\"result\":%d}}",
+                name, start / 1000.0, (end - start) / 1000.0,
+                (int) getpid(), trace_tid, domid,
+                igvt_is_valid_port_p(port) ? port_strings[port] : "none",
+                result);
+    }
+
+    pthread_mutex_unlock(&ctx->trace_lock);
+}
+
+/**
+ * @brief Start writing a Chrome trace
+ *
+ * Any trace already running on the context is finished first.
+ *
+ * @param ctx The context, or NULL for the default context
+ * @param path The JSON file to write; load it in chrome://tracing or
+ *        ui.perfetto.dev
+ * @return 0 on success, -errno on failure
+ */
+int igvt_ctx_trace_start(igvt_ctx *ctx, const char *path)
+{
+    FILE *f;
+
+    ctx = _igvt_ctx(ctx);
+
+    f = fopen(path, "we");
+
+    if (!f)
+        return -errno;
+
+    igvt_ctx_trace_stop(ctx);
+
+    /* Every event is written with a leading comma, so start with one
+     * that names the process */
+    fprintf(f, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+               "\"args\":{\"name\":\"libigvt\"}}", (int) getpid());
+
+    pthread_mutex_lock(&ctx->trace_lock);
+    __atomic_store_n(&ctx->trace, f, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ctx->trace_lock);
+
+    return 0;
+}
+
+int igvt_trace_start(const char *path)
+{
+    return igvt_ctx_trace_start(NULL, path);
+}
+
+/**
+ * @brief Finish the Chrome trace
+ *
+ * @param ctx The context, or NULL for the default context
+ * @return 0 on success, -ENOENT if no trace was running, or -errno if
+ *         the trace couldn't be written out
+ */
+int igvt_ctx_trace_stop(igvt_ctx *ctx)
+{
+    FILE *f;
+    int status = 0;
+
+    ctx = _igvt_ctx(ctx);
+
+    pthread_mutex_lock(&ctx->trace_lock);
+    f = ctx->trace;
+    __atomic_store_n(&ctx->trace, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ctx->trace_lock);
+
+    if (!f)
+        return -ENOENT;
+
+    fprintf(f, "\n]\n");
+
+    if (ferror(f))
+        status = -EIO;
+
+    if (fclose(f) != 0 && status == 0)
+        status = -errno;
+
+    return status;
+}
+
+int igvt_trace_stop(void)
+{
+    return igvt_ctx_trace_stop(NULL);
+}
@@ -0,0 +1,576 @@
+/* Copyright (C) Citrix Systems
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/**
+ * @file uring.c
+ *
+ * @brief Batched attribute writes for the sysfs backend, through io_uring.
+ *
+ * A batch of writes (see _attr_write_batch) goes to the kernel in one
+ * io_uring_enter: one SQE per write, or per block of an extended EDID,
+ * with IOSQE_IO_LINK between the writes of a chain so that they happen
+ * in order and stop at the first failure. Chains are independent, so
+ * the kernel is free to write many ports at once.
+ *
+ * Each context sets up its ring the first time it writes a batch. If
+ * io_uring isn't there (an old kernel, a seccomp filter, the
+ * io_uring_disabled sysctl) the context stops trying, and its batches
+ * are written one at a time. The ring is only used under uring_lock, so
+ * batches to the ring are submitted one after another.
+ *
+ * The ring pays off by replacing the watchdog thread io.c starts for
+ * each extended EDID: igvt-bench plug has a batch of them written 3-4
+ * times faster than one at a time, even a batch of one. Writes of a
+ * block or less gain nothing, as the kernel hands every linked write to
+ * an io-wq worker, and come out 10-50% slower. So a batch without an
+ * extended EDID is written one at a time.
+ *
+ * Like the EDID watchdog in io.c, a batch is only waited for for
+ * EDID_WRITE_TIMEOUT_MS. If the kernel stalls the ring is abandoned,
+ * writes that hadn't finished fail with -ETIMEDOUT, and a stall on an
+ * extended EDID disables extension writes for the context.
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "igvt.h"
+#include "igvt_private.h"
+
+#ifdef IGVT_IO_URING
+
+#include <linux/io_uring.h>
+
+/* SQEs per submission; a chain never takes more than a handful */
+#define URING_ENTRIES 64
+
+enum {
+    URING_UNTRIED = 0,
+    URING_READY,
+    URING_UNAVAILABLE,
+};
+
+struct igvt_uring {
+    int fd;
+    unsigned int entries;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* What the SQEs write; the kernel may read it until they complete */
+    unsigned char (*data)[EDID_BLOCK_SIZE];
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+                       unsigned int min_complete, unsigned int flags,
+                       const void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+static void uring_unmap(struct igvt_uring *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+        ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+static int uring_map(struct igvt_uring *ring, struct io_uring_params *p)
+{
+    ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p->cq_off.cqes +
+                         p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED)
+        return -errno;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+
+    if (ring->cq_ring == MAP_FAILED)
+        return -errno;
+
+    ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED)
+        return -errno;
+
+    ring->sq_tail = (void *) ((char *) ring->sq_ring + p->sq_off.tail);
+    ring->sq_mask = (void *) ((char *) ring->sq_ring + p->sq_off.ring_mask);
+    ring->sq_array = (void *) ((char *) ring->sq_ring + p->sq_off.array);
+    ring->cq_head = (void *) ((char *) ring->cq_ring + p->cq_off.head);
+    ring->cq_tail = (void *) ((char *) ring->cq_ring + p->cq_off.tail);
+    ring->cq_mask = (void *) ((char *) ring->cq_ring + p->cq_off.ring_mask);
+    ring->cqes = (void *) ((char *) ring->cq_ring + p->cq_off.cqes);
+
+    return 0;
+}
+
+static int uring_create(struct igvt_uring **ringp)
+{
+    struct io_uring_params p;
+    struct igvt_uring *ring;
+    int status;
+
+    ring = calloc(1, sizeof(*ring));
+
+    if (!ring)
+        return -ENOMEM;
+
+    /*
+     * SUBMIT_ALL keeps one bad SQE from leaving the rest of the batch
+     * in the ring, and EXT_ARG lets the wait time out.
+     */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL;
+
+    ring->fd = uring_setup(URING_ENTRIES, &p);
+
+    if (ring->fd < 0) {
+        status = -errno;
+        free(ring);
+        return status;
+    }
+
+    ring->entries = p.sq_entries;
+    ring->data = calloc(ring->entries, sizeof(*ring->data));
+
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP))
+        status = -EOPNOTSUPP;
+    else if (!ring->data)
+        status = -ENOMEM;
+    else
+        status = uring_map(ring, &p);
+
+    if (status < 0) {
+        uring_unmap(ring);
+        free(ring->data);
+        free(ring);
+        return status;
+    }
+
+    *ringp = ring;
+
+    return 0;
+}
+
+/* The context's ring, set up on first use; NULL if there can't be one */
+static struct igvt_uring *uring_get(igvt_ctx *ctx)
+{
+    int status;
+
+    if (ctx->uring_state == URING_UNTRIED) {
+        status = uring_create(&ctx->uring);
+
+        if (status < 0) {
+            igvt_printf(ctx, IGVT_DEBUG, "%s::io_uring unavailable (%s), "
+                        "writing batches one at a time\n",
+                        __func__, igvt_strerror(-status));
+        }
+
+        ctx->uring_state = status < 0 ? URING_UNAVAILABLE : URING_READY;
+    }
+
+    return ctx->uring;
+}
+
+/*
+ * Give up on a ring the kernel may still be using. Its data stays
+ * allocated for as long as the process lives, since writes still in
+ * flight may not have read it yet.
+ */
+static void uring_abandon(igvt_ctx *ctx)
+{
+    struct igvt_uring *ring = ctx->uring;
+
+    uring_unmap(ring);
+    free(ring);
+
+    ctx->uring = NULL;
+    ctx->uring_state = URING_UNAVAILABLE;
+}
+
+void _uring_free(igvt_ctx *ctx)
+{
+    struct igvt_uring *ring = ctx->uring;
+
+    if (!ring)
+        return;
+
+    uring_unmap(ring);
+    free(ring->data);
+    free(ring);
+
+    ctx->uring = NULL;
+}
+
+/* How many SQEs a write takes: one, or one per block of an EDID */
+static unsigned int uring_sqes(const struct attr_write *w)
+{
+    if (w->handle < 0)
+        return 0;
+
+    if (w->attr == IGVT_ATTR_EDID && w->size > EDID_BLOCK_SIZE)
+        return (w->size + EDID_BLOCK_SIZE - 1) / EDID_BLOCK_SIZE;
+
+    return 1;
+}
+
+/* Whether the kernel should only start the next write once this one's done */
+static int uring_link_p(const struct attr_write *writes, size_t n, size_t i)
+{
+    return writes[i].handle >= 0 && writes[i].link && i + 1 < n &&
+           writes[i + 1].handle >= 0;
+}
+
+/* The number of SQEs taken by the chain starting at writes[i] */
+static unsigned int uring_chain_sqes(const struct attr_write *writes,
+                                     size_t n, size_t i, size_t *end)
+{
+    unsigned int sqes = uring_sqes(&writes[i]);
+
+    while (uring_link_p(writes, n, i))
+        sqes += uring_sqes(&writes[++i]);
+
+    *end = i + 1;
+
+    return sqes;
+}
+
+static void uring_queue(struct igvt_uring *ring, unsigned int *tail,
+                        const struct attr_write *writes, size_t n, size_t i)
+{
+    const struct attr_write *w = &writes[i];
+    struct io_uring_sqe *sqe;
+    unsigned int block, blocks = uring_sqes(w), idx;
+    size_t off, len;
+
+    for (block = 0; block < blocks; block++) {
+        idx = *tail & *ring->sq_mask;
+        off = block * EDID_BLOCK_SIZE;
+        len = w->size - off < EDID_BLOCK_SIZE ? w->size - off :
+                                                EDID_BLOCK_SIZE;
+
+        memcpy(ring->data[idx], (const unsigned char *) w->buf + off, len);
+
+        sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = w->handle;
+        sqe->off = off;
+        sqe->addr = (uintptr_t) ring->data[idx];
+        sqe->len = len;
+        sqe->user_data = i;
+
+        if (block + 1 < blocks || uring_link_p(writes, n, i))
+            sqe->flags = IOSQE_IO_LINK;
+
+        ring->sq_array[idx] = idx;
+        (*tail)++;
+    }
+}
+
+/* Collect finished writes; returns the number of CQEs seen */
+static unsigned int uring_reap(struct igvt_uring *ring,
+                               struct attr_write *writes,
+                               unsigned char *pending)
+{
+    struct io_uring_cqe *cqe;
+    struct attr_write *w;
+    unsigned int head, tail, seen = 0;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++, seen++) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        w = &writes[cqe->user_data];
+
+        pending[cqe->user_data]--;
+
+        /* The block that failed, not the ones it cancelled */
+        if (cqe->res < 0) {
+            if (w->result >= 0 || w->result == -ECANCELED)
+                w->result = cqe->res;
+        } else if (w->result >= 0) {
+            w->result += cqe->res;
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return seen;
+}
+
+/*
+ * Submit writes[start..end) and wait for them. Returns 0, or -errno if
+ * the ring had to be given up, with what didn't finish failed.
+ */
+static int uring_run(igvt_ctx *ctx, struct attr_write *writes, size_t n,
+                     size_t start, size_t end, unsigned char *pending)
+{
+    struct igvt_uring *ring = ctx->uring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    uint64_t deadline, now;
+    unsigned int tail, sqes, done = 0;
+    size_t i;
+    int ret, status = 0;
+
+    tail = *ring->sq_tail;
+
+    for (i = start; i < end; i++) {
+        writes[i].result = 0;
+        pending[i] = uring_sqes(&writes[i]);
+        uring_queue(ring, &tail, writes, n, i);
+    }
+
+    sqes = tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    do {
+        ret = uring_enter(ring->fd, sqes, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != (int) sqes) {
+        status = ret < 0 ? -errno : -EIO;
+
+        igvt_printf(ctx, IGVT_ERROR, "%s::io_uring submitted %d of %u "
+                    "writes: %s\n", __func__, ret, sqes,
+                    igvt_strerror(-status));
+
+        /* If nothing went in, it can all be written one at a time */
+        for (i = start; ret <= 0 && i < end; i++)
+            writes[i].handle = -1;
+
+        for (i = start; ret > 0 && i < end; i++)
+            writes[i].result = status;
+
+        uring_abandon(ctx);
+
+        return status;
+    }
+
+    deadline = _recorder_now() + EDID_WRITE_TIMEOUT_MS * 1000000ULL;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t) &ts;
+
+    for (;;) {
+        done += uring_reap(ring, writes, pending);
+
+        if (done == sqes)
+            break;
+
+        now = _recorder_now();
+
+        if (now >= deadline) {
+            status = -ETIMEDOUT;
+            break;
+        }
+
+        ts.tv_sec = (deadline - now) / 1000000000ULL;
+        ts.tv_nsec = (deadline - now) % 1000000000ULL;
+
+        ret = uring_enter(ring->fd, 0, sqes - done,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof(arg));
+
+        if (ret < 0 && errno != EINTR && errno != ETIME) {
+            status = -errno;
+            break;
+        }
+    }
+
+    if (status < 0) {
+        for (i = start; i < end; i++) {
+            if (!pending[i])
+                continue;
+
+            writes[i].result = status;
+
+            if (status == -ETIMEDOUT && writes[i].attr == IGVT_ATTR_EDID &&
+                writes[i].size > EDID_BLOCK_SIZE) {
+                igvt_printf(ctx, IGVT_ERROR, "%s::EDID write to vm%u %s "
+                            "timed out, falling back to %d byte EDIDs\n",
+                            __func__, writes[i].domid,
+                            port_strings[writes[i].port], EDID_BLOCK_SIZE);
+
+                __atomic_store_n(&ctx->edid_ext, EDID_EXT_UNSUPPORTED,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+
+        igvt_printf(ctx, IGVT_ERROR, "%s::giving up on io_uring: %s\n",
+                    __func__, igvt_strerror(-status));
+
+        uring_abandon(ctx);
+
+        return status;
+    }
+
+    /* Plain files must be cut down the way sysfs_write_attr does it */
+    for (i = start; !ctx->vgt_is_sysfs && i < end; i++) {
+        if (writes[i].handle >= 0 && writes[i].attr != IGVT_ATTR_EDID &&
+            writes[i].result >= 0 &&
+            ftruncate(writes[i].handle, writes[i].result) < 0)
+            writes[i].result = -errno;
+    }
+
+    return 0;
+}
+
+/* Called with uring_lock held */
+static int uring_write_batch(igvt_ctx *ctx, struct attr_write *writes,
+                             size_t n)
+{
+    unsigned char *pending;
+    size_t i, start, end;
+    unsigned int sqes, used;
+    int status = 0, extended = 0;
+
+    for (i = 0; i < n; i++) {
+        /* Only EDIDs are longer than a block */
+        if (writes[i].size > (writes[i].attr == IGVT_ATTR_EDID ?
+                              EDID_MAX_SIZE : EDID_BLOCK_SIZE))
+            return -EOPNOTSUPP;
+
+        if (uring_chain_sqes(writes, n, i, &end) > URING_ENTRIES)
+            return -EOPNOTSUPP;
+
+        extended |= writes[i].size > EDID_BLOCK_SIZE;
+    }
+
+    /* Without an extended EDID the ring only adds the io-wq round trip */
+    if (!extended)
+        return -EOPNOTSUPP;
+
+    if (!uring_get(ctx))
+        return -EOPNOTSUPP;
+
+    pending = calloc(n, 1);
+
+    if (!pending)
+        return -ENOMEM;
+
+    for (i = 0; i < n && status == 0; ) {
+        start = i;
+        used = 0;
+
+        while (i < n) {
+            sqes = uring_chain_sqes(writes, n, i, &end);
+
+            if (used + sqes > ctx->uring->entries)
+                break;
+
+            used += sqes;
+            i = end;
+        }
+
+        if (used)
+            status = uring_run(ctx, writes, n, start, i, pending);
+    }
+
+    /* What's left is written one at a time */
+    for (; i < n; i++)
+        writes[i].handle = -1;
+
+    free(pending);
+
+    return 0;
+}
+
+/**
+ * @brief Write a batch through the context's io_uring
+ *
+ * The sysfs backend's write_batch: as many whole chains as fit in the
+ * ring go in each submission. Batches without an extended EDID are
+ * turned down, as they are quicker written one at a time.
+ *
+ * @return 0, or -errno if the batch must be written one at a time
+ */
+int _uring_write_batch(igvt_ctx *ctx, struct attr_write *writes, size_t n)
+{
+    int status;
+
+    pthread_mutex_lock(&ctx->uring_lock);
+    status = uring_write_batch(ctx, writes, n);
+    pthread_mutex_unlock(&ctx->uring_lock);
+
+    return status;
+}
+
+#else
+
+int _uring_write_batch(igvt_ctx *ctx, struct attr_write *writes, size_t n)
+{
+    return -EOPNOTSUPP;
+}
+
+void _uring_free(igvt_ctx *ctx)
+{
+}
+
+#endif